@@ -0,0 +1,775 @@
+/**
+ * @file bench.cpp
+ * @brief Нагрузочный тест сервера: множество одновременных клиентов.
+ *
+ * Потоки теста держат по циклу epoll и вместе поддерживают concurrency
+ * подключений в течение duration секунд. Каждое подключение представляется
+ * случайным идентификатором клиента и загружает files_per_connection файлов,
+ * выбранных по весам из смеси размеров mix. Часть передач начинается с
+ * случайной позиции как догрузка (resume_ratio), часть обрывается на
+ * случайной позиции разрывом подключения (disconnect_ratio). Данные не
+ * сохраняются, а только подсчитываются.
+ *
+ * По окончании тест выводит суммарную скорость, подключения в секунду,
+ * перцентили времени до первого байта (от FRAME_SEND_DATA до первого кадра
+ * FRAME_DATA) и процессорное время сервера на гигабайт, если известен его
+ * pid, и дописывает результаты строкой JSON в файл results, чтобы прогоны
+ * разных моделей сервера можно было сравнивать.
+ */
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+
+/**
+ * @struct BenchConfig
+ * @brief Структура для хранения конфигурации теста.
+ *
+ * @var BenchConfig::label Метка прогона в результатах, например модель
+ * сервера.
+ * @var BenchConfig::concurrency Количество одновременных подключений.
+ * @var BenchConfig::duration Длительность теста в секундах.
+ * @var BenchConfig::workers Количество потоков теста.
+ * @var BenchConfig::id_base Первый идентификатор клиентов теста.
+ * @var BenchConfig::client_ids Количество разных идентификаторов клиентов.
+ * @var BenchConfig::mix Смесь размеров файлов: пары "<размер>:<вес>".
+ * Запрашиваются файлы bench_<размер>.
+ * @var BenchConfig::prepare Директория файлов сервера, в которой тест
+ * создаёт недостающие файлы смеси (пусто - не создавать).
+ * @var BenchConfig::files_per_connection Сколько файлов загружается по
+ * одному подключению.
+ * @var BenchConfig::resume_ratio Доля передач, начинающихся со случайной
+ * позиции.
+ * @var BenchConfig::disconnect_ratio Доля передач, обрываемых разрывом
+ * подключения.
+ * @var BenchConfig::server_pid Процесс сервера для учёта процессорного
+ * времени (0 - не учитывать).
+ * @var BenchConfig::results Файл, в который дописываются результаты.
+ */
+struct BenchConfig {
+  std::string server_address = "127.0.0.1";
+  int port = 0;
+  std::string label = "";
+  int concurrency = 100;
+  double duration = 10;
+  int workers = 0;
+  int id_base = 900000;
+  int client_ids = 64;
+  std::vector<std::pair<uint64_t, uint32_t>> mix;
+  std::string prepare = "";
+  int files_per_connection = 1;
+  double resume_ratio = 0;
+  double disconnect_ratio = 0;
+  int server_pid = 0;
+  std::string results = "bench_results.jsonl";
+};
+
+/**
+ * @struct BenchStats
+ * @brief Счётчики одного потока теста.
+ */
+struct BenchStats {
+  uint64_t connections = 0;     ///< Установленные подключения.
+  uint64_t connect_errors = 0;  ///< Неудачные попытки подключения.
+  uint64_t transfers = 0;       ///< Передачи, завершённые FRAME_END_OF_DATA.
+  uint64_t resumed = 0;         ///< Из них начатые с середины файла.
+  uint64_t disconnects = 0;     ///< Передачи, оборванные тестом.
+  uint64_t failures = 0;        ///< Разрывы и ошибки со стороны сервера.
+  uint64_t bytes = 0;           ///< Принятые байты данных файлов.
+  std::vector<uint32_t> first_byte_us;
+};
+
+/**
+ * @enum SessionState
+ * @brief Состояние подключения теста.
+ */
+enum class SessionState {
+  Connecting,  ///< Ожидание завершения connect.
+  Status,      ///< Ожидание FRAME_FILE_STATUS.
+  Receiving    ///< Приём данных файла.
+};
+
+/**
+ * @struct Session
+ * @brief Одно подключение теста.
+ */
+struct Session {
+  int fd = -1;
+  SessionState state = SessionState::Connecting;
+  std::string out;     ///< Кадры, ожидающие отправки.
+  std::string in;      ///< Принятый неразобранный управляющий кадр.
+  uint64_t skip = 0;   ///< Остаток нагрузки текущего FRAME_DATA.
+  int transfers = 0;   ///< Сколько файлов ещё загрузить.
+  uint64_t position = 0;  ///< Позиция, до которой данные приняты.
+  uint64_t cut = UINT64_MAX;  ///< Позиция, на которой оборвать передачу.
+  bool resumed = false;
+  bool first_byte = false;
+  int64_t request_us = 0;  ///< Время отправки FRAME_SEND_DATA.
+};
+
+/**
+ * @brief Монотонное время в микросекундах.
+ */
+
+static int64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Имя файла смеси на сервере.
+ */
+
+static std::string benchFileName(uint64_t size) {
+  return "bench_" + std::to_string(size);
+}
+
+/**
+ * @class BenchWorker
+ * @brief Поток теста с собственным циклом epoll.
+ */
+class BenchWorker {
+ public:
+  BenchWorker(const BenchConfig& config, int sessions, uint64_t seed,
+              std::atomic<bool>& stopping)
+      : config_(config),
+        sessions_(sessions),
+        random_(seed),
+        stopping_(stopping),
+        buffer_(1 << 20) {}
+
+  void run();
+  const BenchStats& stats() const { return stats_; }
+
+ private:
+  bool startSession();
+  void requestFile(Session& session);
+  void handleEvent(Session& session, uint32_t events);
+  bool consume(Session& session, const char* data, size_t length);
+  bool handleFrame(Session& session, const FrameHeader& header,
+                   const std::string& payload);
+  bool flush(Session& session);
+  void updateEvents(Session& session);
+  void closeSession(Session& session);
+  double uniform() {
+    return std::uniform_real_distribution<double>(0, 1)(random_);
+  }
+
+  const BenchConfig& config_;
+  int sessions_;  ///< Сколько подключений поддерживать.
+  std::mt19937_64 random_;
+  std::atomic<bool>& stopping_;
+  int epoll_fd_ = -1;
+  struct sockaddr_in address_ = {};
+  std::map<int, std::unique_ptr<Session>> active_;
+  std::vector<char> buffer_;
+  uint64_t total_weight_ = 0;
+  BenchStats stats_;
+};
+
+/**
+ * @brief Цикл потока: поддерживает заданное число подключений, пока тест
+ * не остановлен.
+ */
+
+void BenchWorker::run() {
+  address_.sin_family = AF_INET;
+  address_.sin_port = htons(config_.port);
+  inet_pton(AF_INET, config_.server_address.c_str(), &address_.sin_addr);
+  for (const auto& entry : config_.mix) total_weight_ += entry.second;
+  epoll_fd_ = epoll_create1(0);
+  if (epoll_fd_ < 0) {
+    perror("epoll_create1 failed");
+    return;
+  }
+
+  const int max_events = 256;
+  struct epoll_event events[max_events];
+  while (!stopping_.load(std::memory_order_relaxed)) {
+    // Подключения, которые не удалось открыть, повторяются через 10 мс
+    bool full = true;
+    while ((int)active_.size() < sessions_) {
+      if (!startSession()) {
+        full = false;
+        break;
+      }
+    }
+    int n = epoll_wait(epoll_fd_, events, max_events, full ? 100 : 10);
+    for (int i = 0; i < n; i++) {
+      auto it = active_.find(events[i].data.fd);
+      if (it != active_.end()) handleEvent(*it->second, events[i].events);
+    }
+  }
+  // Незавершённые передачи не учитываются
+  while (!active_.empty()) closeSession(*active_.begin()->second);
+  close(epoll_fd_);
+}
+
+/**
+ * @brief Открывает новое подключение.
+ *
+ * @return false, если подключение не удалось открыть.
+ */
+
+bool BenchWorker::startSession() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    stats_.connect_errors++;
+    return false;
+  }
+  // Подключения закрываются сбросом, чтобы порты не копились в TIME_WAIT
+  struct linger linger = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  if (connect(fd, (struct sockaddr*)&address_, sizeof(address_)) < 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    stats_.connect_errors++;
+    return false;
+  }
+  auto session = std::make_unique<Session>();
+  session->fd = fd;
+  session->transfers = std::max(1, config_.files_per_connection);
+  int id = config_.id_base + random_() % std::max(1, config_.client_ids);
+  session->out = encodeFrame(FRAME_HELLO, 0, 0, std::to_string(id));
+  struct epoll_event ev = {};
+  ev.events = EPOLLOUT;
+  ev.data.fd = fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  Session& ref = *session;
+  active_[fd] = std::move(session);
+  requestFile(ref);
+  return true;
+}
+
+/**
+ * @brief Запрашивает следующий файл смеси.
+ *
+ * @param session Подключение.
+ */
+
+void BenchWorker::requestFile(Session& session) {
+  uint64_t pick = random_() % std::max<uint64_t>(1, total_weight_);
+  uint64_t size = config_.mix.empty() ? 0 : config_.mix.back().first;
+  for (const auto& entry : config_.mix) {
+    if (pick < entry.second) {
+      size = entry.first;
+      break;
+    }
+    pick -= entry.second;
+  }
+  session.out += encodeFrame(FRAME_FILE_REQUEST, 0, 0, benchFileName(size));
+}
+
+/**
+ * @brief Обрабатывает событие готовности сокета.
+ *
+ * @param session Подключение.
+ * @param events Маска событий epoll.
+ */
+
+void BenchWorker::handleEvent(Session& session, uint32_t events) {
+  if (session.state == SessionState::Connecting) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(session.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+      stats_.connect_errors++;
+      closeSession(session);
+      return;
+    }
+    stats_.connections++;
+    session.state = SessionState::Status;
+  }
+  if (events & EPOLLIN) {
+    ssize_t n = read(session.fd, buffer_.data(), buffer_.size());
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      stats_.failures++;
+      closeSession(session);
+      return;
+    }
+    if (n > 0 && !consume(session, buffer_.data(), n)) {
+      closeSession(session);
+      return;
+    }
+  }
+  if (!flush(session)) {
+    stats_.failures++;
+    closeSession(session);
+    return;
+  }
+  updateEvents(session);
+}
+
+/**
+ * @brief Разбирает принятые байты: нагрузка FRAME_DATA пропускается,
+ * управляющие кадры накапливаются целиком.
+ *
+ * @param session Подключение.
+ * @param data Принятые байты.
+ * @param length Их количество.
+ * @return false, если подключение нужно закрыть.
+ */
+
+bool BenchWorker::consume(Session& session, const char* data, size_t length) {
+  while (length > 0) {
+    if (session.skip > 0) {
+      size_t n = std::min<uint64_t>(length, session.skip);
+      session.skip -= n;
+      session.position += n;
+      stats_.bytes += n;
+      data += n;
+      length -= n;
+      if (session.position >= session.cut) {
+        stats_.disconnects++;
+        return false;
+      }
+      continue;
+    }
+    size_t need = FRAME_HEADER_SIZE;
+    FrameHeader header;
+    if (session.in.size() >= FRAME_HEADER_SIZE) {
+      decodeFrameHeader(
+          reinterpret_cast<const unsigned char*>(session.in.data()), header);
+      need += header.type == FRAME_DATA ? 0 : header.length;
+    }
+    size_t n = std::min(length, need - session.in.size());
+    session.in.append(data, n);
+    data += n;
+    length -= n;
+    if (session.in.size() < need) continue;
+    if (need == FRAME_HEADER_SIZE) {
+      if (!decodeFrameHeader(
+              reinterpret_cast<const unsigned char*>(session.in.data()),
+              header) ||
+          (header.type != FRAME_DATA && header.length > MAX_CONTROL_PAYLOAD)) {
+        stats_.failures++;
+        return false;
+      }
+      if (header.type != FRAME_DATA && header.length > 0) continue;
+    }
+    std::string payload = session.in.substr(FRAME_HEADER_SIZE);
+    session.in.clear();
+    if (!handleFrame(session, header, payload)) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Обрабатывает кадр сервера.
+ *
+ * @param session Подключение.
+ * @param header Заголовок кадра.
+ * @param payload Нагрузка управляющего кадра.
+ * @return false, если подключение нужно закрыть.
+ */
+
+bool BenchWorker::handleFrame(Session& session, const FrameHeader& header,
+                              const std::string& payload) {
+  if (header.type == FRAME_FILE_STATUS &&
+      session.state == SessionState::Status) {
+    if (!(header.flags & FLAG_FOUND)) {
+      stats_.failures++;
+      return false;
+    }
+    uint64_t size = decodeU64(payload);
+    session.position = 0;
+    session.cut = UINT64_MAX;
+    session.resumed = size > 0 && uniform() < config_.resume_ratio;
+    if (session.resumed) session.position = random_() % size;
+    if (size > session.position && uniform() < config_.disconnect_ratio)
+      session.cut = session.position + random_() % (size - session.position);
+    session.out += encodeFrame(FRAME_SEND_DATA,
+                               session.resumed ? FLAG_RESUME : 0,
+                               session.position);
+    session.first_byte = false;
+    session.request_us = nowUs();
+    session.state = SessionState::Receiving;
+    return true;
+  }
+  if (header.type == FRAME_DATA && session.state == SessionState::Receiving) {
+    if (!session.first_byte) {
+      session.first_byte = true;
+      stats_.first_byte_us.push_back(
+          std::min<int64_t>(nowUs() - session.request_us, UINT32_MAX));
+    }
+    session.skip = header.length;
+    session.position = header.offset;
+    if (session.position >= session.cut) {
+      stats_.disconnects++;
+      return false;
+    }
+    return true;
+  }
+  if (header.type == FRAME_END_OF_DATA &&
+      session.state == SessionState::Receiving) {
+    stats_.transfers++;
+    if (session.resumed) stats_.resumed++;
+    if (--session.transfers == 0) return false;
+    session.state = SessionState::Status;
+    requestFile(session);
+    return true;
+  }
+  stats_.failures++;
+  return false;
+}
+
+/**
+ * @brief Отправляет накопленные кадры.
+ *
+ * @return false при ошибке сокета.
+ */
+
+bool BenchWorker::flush(Session& session) {
+  if (session.state == SessionState::Connecting) return true;
+  while (!session.out.empty()) {
+    ssize_t n = send(session.fd, session.out.data(), session.out.size(),
+                     MSG_NOSIGNAL);
+    if (n < 0) return errno == EAGAIN || errno == EINTR;
+    session.out.erase(0, n);
+  }
+  return true;
+}
+
+/**
+ * @brief Обновляет набор отслеживаемых событий.
+ */
+
+void BenchWorker::updateEvents(Session& session) {
+  uint32_t events = EPOLLIN;
+  if (!session.out.empty()) events |= EPOLLOUT;
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = session.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, session.fd, &ev);
+}
+
+/**
+ * @brief Закрывает подключение; его место займёт новое.
+ */
+
+void BenchWorker::closeSession(Session& session) {
+  int fd = session.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  active_.erase(fd);
+}
+
+/**
+ * @brief Читает конфигурацию теста из файла.
+ *
+ * @param filename Путь к файлу конфигурации.
+ * @return Конфигурация.
+ */
+
+BenchConfig readBenchConfig(const std::string& filename) {
+  BenchConfig config;
+  std::ifstream file(filename);
+  std::string line;
+  if (!file.is_open()) {
+    std::cerr << "Unable to open file: " << filename << std::endl;
+    return config;
+  }
+  while (getline(file, line)) {
+    std::istringstream iss(line);
+    std::string key;
+    if (getline(iss, key, ':')) {
+      std::string value;
+      getline(iss, value);
+      if (key == "server_address")
+        config.server_address = value.substr(1);
+      else if (key == "port")
+        config.port = std::stoi(value.substr(1));
+      else if (key == "label")
+        config.label = value.substr(1);
+      else if (key == "concurrency")
+        config.concurrency = std::stoi(value.substr(1));
+      else if (key == "duration")
+        config.duration = std::stod(value.substr(1));
+      else if (key == "workers")
+        config.workers = std::stoi(value.substr(1));
+      else if (key == "id_base")
+        config.id_base = std::stoi(value.substr(1));
+      else if (key == "client_ids")
+        config.client_ids = std::stoi(value.substr(1));
+      else if (key == "prepare")
+        config.prepare = value.substr(1);
+      else if (key == "files_per_connection")
+        config.files_per_connection = std::stoi(value.substr(1));
+      else if (key == "resume_ratio")
+        config.resume_ratio = std::stod(value.substr(1));
+      else if (key == "disconnect_ratio")
+        config.disconnect_ratio = std::stod(value.substr(1));
+      else if (key == "server_pid")
+        config.server_pid = std::stoi(value.substr(1));
+      else if (key == "results")
+        config.results = value.substr(1);
+      else if (key == "mix") {
+        // Пары "<размер>:<вес>" через пробел
+        std::istringstream pairs(value);
+        std::string pair;
+        while (pairs >> pair) {
+          size_t colon = pair.find(':');
+          uint32_t weight = colon == std::string::npos
+                                ? 1
+                                : std::stoul(pair.substr(colon + 1));
+          config.mix.emplace_back(std::stoull(pair.substr(0, colon)), weight);
+        }
+      }
+    }
+  }
+  file.close();
+  return config;
+}
+
+/**
+ * @brief Создаёт недостающие файлы смеси из псевдослучайных данных, чтобы
+ * сжатие не искажало результаты.
+ *
+ * @param config Конфигурация теста.
+ * @return false, если файл не удалось создать.
+ */
+
+bool prepareFiles(const BenchConfig& config) {
+  std::vector<uint64_t> block(1 << 17);
+  for (const auto& entry : config.mix) {
+    std::string path = config.prepare + "/" + benchFileName(entry.first);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == entry.first)
+      continue;
+    std::cout << "Creating " << path << std::endl;
+    std::mt19937_64 random(entry.first);
+    std::ofstream file(path + ".tmp", std::ios::binary | std::ios::trunc);
+    for (uint64_t done = 0; done < entry.first && file;) {
+      for (auto& word : block) word = random();
+      size_t n = std::min<uint64_t>(entry.first - done, block.size() * 8);
+      file.write(reinterpret_cast<const char*>(block.data()), n);
+      done += n;
+    }
+    file.close();
+    if (!file || rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+      perror(("Failed to create " + path).c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Суммарное процессорное время процесса и всех его потомков, в том
+ * числе завершившихся, но не собранных (процессы модели "fork").
+ *
+ * @param root Процесс сервера.
+ * @return Время в секундах.
+ */
+
+double processTreeCpu(int root) {
+  std::map<int, int> parents;
+  std::map<int, uint64_t> ticks;
+  DIR* proc = opendir("/proc");
+  if (proc == nullptr) return 0;
+  while (struct dirent* entry = readdir(proc)) {
+    int pid = atoi(entry->d_name);
+    if (pid <= 0) continue;
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!getline(stat, line)) continue;
+    // Имя процесса в скобках может содержать пробелы
+    size_t end = line.rfind(')');
+    if (end == std::string::npos) continue;
+    std::istringstream fields(line.substr(end + 2));
+    std::string state;
+    int ppid = 0;
+    uint64_t value = 0, utime = 0, stime = 0, cutime = 0, cstime = 0;
+    fields >> state >> ppid;
+    for (int i = 5; i < 14; i++) fields >> value;
+    fields >> utime >> stime >> cutime >> cstime;
+    parents[pid] = ppid;
+    ticks[pid] = utime + stime + (pid == root ? cutime + cstime : 0);
+  }
+  closedir(proc);
+
+  uint64_t total = 0;
+  for (const auto& entry : ticks) {
+    int pid = entry.first;
+    for (int depth = 0; pid > 1 && pid != root && depth < 64; depth++)
+      pid = parents.count(pid) ? parents[pid] : 0;
+    if (pid == root) total += entry.second;
+  }
+  return (double)total / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @brief Перцентиль отсортированной выборки.
+ */
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[index];
+}
+
+/**
+ * @brief Экранирует строку для JSON.
+ */
+
+static std::string jsonString(const std::string& value) {
+  std::string out = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') out += '\\';
+    if ((unsigned char)c >= 0x20) out += c;
+  }
+  return out + "\"";
+}
+
+/**
+ * @brief Главная функция теста.
+ *
+ * @param argc Количество аргументов командной строки.
+ * @param argv Конфигурация теста и, необязательно, pid сервера.
+ * @return Код завершения программы.
+ */
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <config_file> [server_pid]"
+              << std::endl;
+    return -1;
+  }
+  BenchConfig config = readBenchConfig(argv[1]);
+  if (argc > 2) config.server_pid = atoi(argv[2]);
+  if (config.mix.empty() || config.concurrency <= 0) {
+    std::cerr << "mix and concurrency must be set" << std::endl;
+    return -1;
+  }
+  if (!config.prepare.empty() && !prepareFiles(config)) return -1;
+  int workers = config.workers;
+  if (workers <= 0) workers = std::thread::hardware_concurrency();
+  workers = std::max(1, std::min(workers, config.concurrency));
+
+  double cpu_start =
+      config.server_pid > 0 ? processTreeCpu(config.server_pid) : 0;
+  std::atomic<bool> stopping{false};
+  std::vector<std::unique_ptr<BenchWorker>> benches;
+  std::vector<std::thread> threads;
+  int64_t start_us = nowUs();
+  for (int i = 0; i < workers; i++) {
+    int sessions = config.concurrency / workers +
+                   (i < config.concurrency % workers ? 1 : 0);
+    benches.push_back(std::make_unique<BenchWorker>(config, sessions,
+                                                    start_us + i, stopping));
+    BenchWorker* bench = benches.back().get();
+    threads.emplace_back([bench]() { bench->run(); });
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(config.duration));
+  stopping.store(true);
+  for (auto& thread : threads) thread.join();
+  double elapsed = (nowUs() - start_us) / 1e6;
+  double cpu =
+      config.server_pid > 0 ? processTreeCpu(config.server_pid) - cpu_start
+                            : 0;
+
+  BenchStats total;
+  for (const auto& bench : benches) {
+    const BenchStats& stats = bench->stats();
+    total.connections += stats.connections;
+    total.connect_errors += stats.connect_errors;
+    total.transfers += stats.transfers;
+    total.resumed += stats.resumed;
+    total.disconnects += stats.disconnects;
+    total.failures += stats.failures;
+    total.bytes += stats.bytes;
+    total.first_byte_us.insert(total.first_byte_us.end(),
+                               stats.first_byte_us.begin(),
+                               stats.first_byte_us.end());
+  }
+  std::sort(total.first_byte_us.begin(), total.first_byte_us.end());
+  double gigabytes = total.bytes / 1e9;
+
+  std::ostringstream mix;
+  for (const auto& entry : config.mix)
+    mix << (mix.tellp() > 0 ? " " : "") << entry.first << ":" << entry.second;
+  std::ostringstream json;
+  json << std::fixed << std::setprecision(3) << "{\"label\":"
+       << jsonString(config.label) << ",\"time\":" << time(nullptr)
+       << ",\"concurrency\":" << config.concurrency
+       << ",\"workers\":" << workers << ",\"mix\":" << jsonString(mix.str())
+       << ",\"files_per_connection\":" << config.files_per_connection
+       << ",\"resume_ratio\":" << config.resume_ratio
+       << ",\"disconnect_ratio\":" << config.disconnect_ratio
+       << ",\"duration_s\":" << elapsed
+       << ",\"connections\":" << total.connections
+       << ",\"connections_per_s\":" << total.connections / elapsed
+       << ",\"connect_errors\":" << total.connect_errors
+       << ",\"transfers\":" << total.transfers
+       << ",\"resumed\":" << total.resumed
+       << ",\"disconnects\":" << total.disconnects
+       << ",\"failures\":" << total.failures << ",\"bytes\":" << total.bytes
+       << ",\"throughput_mb_s\":" << total.bytes / elapsed / 1e6
+       << ",\"first_byte_us\":{\"p50\":"
+       << percentile(total.first_byte_us, 0.5)
+       << ",\"p90\":" << percentile(total.first_byte_us, 0.9)
+       << ",\"p99\":" << percentile(total.first_byte_us, 0.99)
+       << ",\"p999\":" << percentile(total.first_byte_us, 0.999)
+       << ",\"max\":" << percentile(total.first_byte_us, 1) << "}";
+  if (config.server_pid > 0) {
+    json << ",\"server_cpu_s\":" << cpu << ",\"server_cpu_s_per_gb\":"
+         << (gigabytes > 0 ? cpu / gigabytes : 0);
+  }
+  json << "}";
+
+  std::cout << std::fixed << std::setprecision(1)
+            << "Duration: " << elapsed << " s\n"
+            << "Connections: " << total.connections << " ("
+            << total.connections / elapsed << "/s, " << total.connect_errors
+            << " errors)\n"
+            << "Transfers: " << total.transfers << " (" << total.resumed
+            << " resumed), " << total.disconnects << " disconnects, "
+            << total.failures << " failures\n"
+            << "Throughput: " << total.bytes / elapsed / 1e6 << " MB/s\n"
+            << "Time to first byte, us: p50 "
+            << percentile(total.first_byte_us, 0.5) << ", p90 "
+            << percentile(total.first_byte_us, 0.9) << ", p99 "
+            << percentile(total.first_byte_us, 0.99) << ", p99.9 "
+            << percentile(total.first_byte_us, 0.999) << std::endl;
+  if (config.server_pid > 0) {
+    std::cout << std::setprecision(3) << "Server CPU: " << cpu << " s ("
+              << (gigabytes > 0 ? cpu / gigabytes : 0) << " s/GB)"
+              << std::endl;
+  }
+
+  std::ofstream results(config.results, std::ios::app);
+  results << json.str() << "\n";
+  if (!results) {
+    perror(("Failed to write " + config.results).c_str());
+    return -1;
+  }
+  std::cout << "Results appended to " << config.results << std::endl;
+  return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * @file bundle.h
+ * @brief Архив мелких файлов: формат, общий для клиента и сервера.
+ *
+ * Вместо того чтобы запрашивать тысячи мелких файлов по одному, клиент
+ * запрашивает кадром FRAME_FILE_REQUEST с флагом FLAG_BUNDLE шаблон имён
+ * (как в shell, без '/'). Сервер собирает подходящие файлы в архив и отдаёт
+ * его как один файл: с одной записью прогресса, догрузкой и сжатием. В ответе
+ * FRAME_FILE_STATUS за размером архива идёт его идентификатор (8 байт),
+ * который меняется при изменении любого из файлов.
+ *
+ * Архив начинается с заголовка BUNDLE_HEADER_SIZE байт: магическое число,
+ * идентификатор (по 8 байт), количество файлов и длина таблицы (по 4 байта).
+ * Таблица содержит для каждого файла размер (8 байт), длину имени (2 байта)
+ * и имя. За таблицей подряд идут данные файлов в порядке таблицы. Все числа
+ * передаются в сетевом порядке байт.
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const uint64_t BUNDLE_MAGIC = 0x314c444e42535052;  // "RPSBNDL1"
+const size_t BUNDLE_HEADER_SIZE = 24;
+/// Длина записи таблицы без имени.
+const size_t BUNDLE_ENTRY_SIZE = 10;
+/// Файлы крупнее в архив не входят: их выгоднее загружать отдельно.
+const uint64_t BUNDLE_MAX_FILE_SIZE = 1 << 20;
+/// Максимальный размер данных архива.
+const uint64_t BUNDLE_MAX_SIZE = 256 << 20;
+/// Максимальное количество файлов в архиве.
+const uint32_t BUNDLE_MAX_FILES = 1 << 16;
+
+/**
+ * @struct BundleEntry
+ * @brief Файл в архиве.
+ */
+struct BundleEntry {
+  std::string name;
+  uint64_t offset;  ///< Позиция данных файла в архиве.
+  uint64_t size;
+};
+
+/**
+ * @brief Проверяет, что имя из таблицы архива - имя файла в директории.
+ */
+
+inline bool validBundleName(const std::string& name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos &&
+         name.find('\0') == std::string::npos;
+}
+
+/**
+ * @brief Кодирует заголовок и таблицу архива.
+ *
+ * @param id Идентификатор архива.
+ * @param entries Файлы архива; позиции их данных заполняются.
+ * @return Начало архива до данных первого файла.
+ */
+
+inline std::string encodeBundleTable(uint64_t id,
+                                     std::vector<BundleEntry>& entries) {
+  std::string table;
+  for (const auto& entry : entries) {
+    uint64_t size = htobe64(entry.size);
+    uint16_t length = htobe16(entry.name.size());
+    table.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    table.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    table += entry.name;
+  }
+  uint64_t header[2] = {htobe64(BUNDLE_MAGIC), htobe64(id)};
+  uint32_t counts[2] = {htobe32(entries.size()), htobe32(table.size())};
+  std::string out(reinterpret_cast<const char*>(header), sizeof(header));
+  out.append(reinterpret_cast<const char*>(counts), sizeof(counts));
+  out += table;
+  uint64_t offset = out.size();
+  for (auto& entry : entries) {
+    entry.offset = offset;
+    offset += entry.size;
+  }
+  return out;
+}
+
+/**
+ * @brief Узнаёт по заголовку архива длину его начала до данных файлов.
+ *
+ * @param data Заголовок длиной BUNDLE_HEADER_SIZE.
+ * @return Длина заголовка с таблицей или 0, если это не архив.
+ */
+
+inline uint64_t bundleTableEnd(const char* data) {
+  uint64_t magic;
+  uint32_t length;
+  memcpy(&magic, data, sizeof(magic));
+  memcpy(&length, data + 20, sizeof(length));
+  if (be64toh(magic) != BUNDLE_MAGIC) return 0;
+  return BUNDLE_HEADER_SIZE + be32toh(length);
+}
+
+/**
+ * @brief Разбирает заголовок и таблицу архива.
+ *
+ * @param data Начало архива длиной не меньше bundleTableEnd().
+ * @param id Идентификатор архива.
+ * @param entries Файлы архива в порядке данных.
+ * @return false, если таблица повреждена.
+ */
+
+inline bool decodeBundleTable(const std::string& data, uint64_t& id,
+                              std::vector<BundleEntry>& entries) {
+  if (data.size() < BUNDLE_HEADER_SIZE) return false;
+  uint64_t end = bundleTableEnd(data.data());
+  if (end == 0 || data.size() < end) return false;
+  uint32_t count;
+  memcpy(&id, data.data() + 8, sizeof(id));
+  memcpy(&count, data.data() + 16, sizeof(count));
+  id = be64toh(id);
+  count = be32toh(count);
+  if (count > BUNDLE_MAX_FILES) return false;
+  entries.clear();
+  uint64_t pos = BUNDLE_HEADER_SIZE;
+  uint64_t offset = end;
+  for (uint32_t i = 0; i < count; i++) {
+    if (end - pos < BUNDLE_ENTRY_SIZE) return false;
+    uint64_t size;
+    uint16_t length;
+    memcpy(&size, data.data() + pos, sizeof(size));
+    memcpy(&length, data.data() + pos + 8, sizeof(length));
+    size = be64toh(size);
+    length = be16toh(length);
+    pos += BUNDLE_ENTRY_SIZE;
+    if (end - pos < length || size > BUNDLE_MAX_FILE_SIZE) return false;
+    BundleEntry entry = {data.substr(pos, length), offset, size};
+    if (!validBundleName(entry.name)) return false;
+    entries.push_back(entry);
+    pos += length;
+    offset += size;
+  }
+  return pos == end;
+}
+
+#endif  // BUNDLE_H
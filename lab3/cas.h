@@ -0,0 +1,208 @@
+/**
+ * @file cas.h
+ * @brief Деление файлов на куски по содержимому: определения, общие для
+ * клиента и сервера.
+ *
+ * Границы кусков выбираются по содержимому (FastCDC): по байтам файла
+ * считается gear-хэш, и кусок заканчивается там, где старшие биты хэша
+ * нулевые. Граница зависит только от последних 64 байт, поэтому вставка или
+ * удаление данных сдвигает лишь соседние границы, а одинаковые участки разных
+ * файлов и версий делятся на одинаковые куски. До средней длины куска
+ * условие границы строже, после - мягче, поэтому длины кусков собираются
+ * около CAS_AVG_CHUNK.
+ *
+ * Кусок опознаётся по 128-битному хэшу содержимого. Хэш не
+ * криптографический: сервер при совпадении хэша сравнивает сами данные, а
+ * клиент проверяет собранный файл по манифесту.
+ *
+ * Список кусков файла передаётся кадрами FRAME_CHUNKS: offset - номер
+ * первого куска кадра, нагрузка - по CAS_ENTRY_SIZE байт на кусок (хэш -
+ * два слова по 8 байт и длина - 4 байта, в сетевом порядке), последний кадр
+ * отмечен FLAG_LAST.
+ */
+
+#ifndef CAS_H
+#define CAS_H
+
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// Границы и средняя длина куска.
+const uint64_t CAS_MIN_CHUNK = 16 << 10;
+const uint64_t CAS_AVG_CHUNK = 64 << 10;
+const uint64_t CAS_MAX_CHUNK = 256 << 10;
+/// Условия границы до и после средней длины: нулевые старшие 18 и 14 бит.
+const uint64_t CAS_MASK_STRICT = ~0ull << (64 - 18);
+const uint64_t CAS_MASK_LOOSE = ~0ull << (64 - 14);
+/// Длина записи о куске в кадре FRAME_CHUNKS.
+const size_t CAS_ENTRY_SIZE = 20;
+/// Сколько байт файла читается за раз при делении на куски.
+const size_t CAS_READ_SIZE = 8 << 20;
+
+/**
+ * @struct CasGearTable
+ * @brief Случайные слова gear-хэша для каждого значения байта.
+ *
+ * Таблица получается из фиксированного начального значения (splitmix64) и
+ * одинакова у клиента и сервера.
+ */
+struct CasGearTable {
+  uint64_t values[256];
+
+  CasGearTable() {
+    uint64_t state = 0x5eed0f7a8b3c2d1e;
+    for (int i = 0; i < 256; i++) {
+      uint64_t value = (state += 0x9e3779b97f4a7c15);
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+      values[i] = value ^ (value >> 31);
+    }
+  }
+};
+
+/**
+ * @struct CasHash
+ * @brief Хэш содержимого куска.
+ */
+struct CasHash {
+  uint64_t low = 0;
+  uint64_t high = 0;
+
+  bool operator==(const CasHash& other) const {
+    return low == other.low && high == other.high;
+  }
+  bool operator<(const CasHash& other) const {
+    return high != other.high ? high < other.high : low < other.low;
+  }
+};
+
+/**
+ * @struct CasChunk
+ * @brief Кусок файла.
+ */
+struct CasChunk {
+  CasHash hash;
+  uint32_t length = 0;
+};
+
+/**
+ * @brief Находит конец первого куска данных.
+ *
+ * @param data Данные с начала куска.
+ * @param size Длина данных; если это не конец файла, не меньше
+ * CAS_MAX_CHUNK.
+ * @return Длина куска.
+ */
+
+inline size_t casCutPoint(const unsigned char* data, size_t size) {
+  static const CasGearTable gear;
+  if (size <= CAS_MIN_CHUNK) return size;
+  size_t normal = size < CAS_AVG_CHUNK ? size : CAS_AVG_CHUNK;
+  size_t end = size < CAS_MAX_CHUNK ? size : CAS_MAX_CHUNK;
+  uint64_t hash = 0;
+  size_t i = CAS_MIN_CHUNK;
+  for (; i < normal; i++) {
+    hash = (hash << 1) + gear.values[data[i]];
+    if (!(hash & CAS_MASK_STRICT)) return i + 1;
+  }
+  for (; i < end; i++) {
+    hash = (hash << 1) + gear.values[data[i]];
+    if (!(hash & CAS_MASK_LOOSE)) return i + 1;
+  }
+  return end;
+}
+
+/**
+ * @brief Циклический сдвиг слова влево.
+ */
+
+inline uint64_t casRotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+/**
+ * @brief Перемешивает биты слова (финализатор splitmix64).
+ */
+
+inline uint64_t casMix(uint64_t value) {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+  return value ^ (value >> 31);
+}
+
+/**
+ * @brief Считает хэш куска: две полосы по 8 байт за шаг с умножением и
+ * циклическим сдвигом, в конце - перемешивание с длиной.
+ *
+ * @param data Данные.
+ * @param size Размер данных.
+ * @return Хэш.
+ */
+
+inline CasHash casHash(const void* data, size_t size) {
+  const uint64_t k1 = 0x9e3779b97f4a7c15, k2 = 0xc2b2ae3d27d4eb4f;
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t a = k1 ^ size, b = k2;
+  unsigned char tail[16] = {};
+  for (size_t pos = 0; pos < size; pos += 16) {
+    const unsigned char* block = bytes + pos;
+    if (size - pos < 16) {
+      memcpy(tail, block, size - pos);
+      block = tail;
+    }
+    uint64_t w0, w1;
+    memcpy(&w0, block, sizeof(w0));
+    memcpy(&w1, block + 8, sizeof(w1));
+    a = casRotate(a ^ (w0 * k2), 31) * k1;
+    b = casRotate(b ^ (w1 * k1), 29) * k2;
+    a += b;
+  }
+  CasHash hash;
+  hash.low = casMix(a ^ (b >> 17));
+  hash.high = casMix(b + hash.low);
+  return hash;
+}
+
+/**
+ * @brief Делит файл на куски.
+ *
+ * @param fd Дескриптор файла.
+ * @param size Размер файла.
+ * @param on_chunk Вызывается для каждого куска по порядку с его данными и
+ * длиной; возвращает false, чтобы прервать деление.
+ * @return false при ошибке чтения или если деление прервано.
+ */
+
+template <class OnChunk>
+bool casSplitFile(int fd, uint64_t size, OnChunk on_chunk) {
+  std::vector<unsigned char> buffer(CAS_READ_SIZE);
+  uint64_t read_pos = 0;
+  size_t filled = 0;
+  while (read_pos < size || filled > 0) {
+    while (filled < buffer.size() && read_pos < size) {
+      size_t want = buffer.size() - filled;
+      if (want > size - read_pos) want = size - read_pos;
+      ssize_t n = pread(fd, buffer.data() + filled, want, read_pos);
+      if (n <= 0) return false;
+      filled += n;
+      read_pos += n;
+    }
+    // Последний кусок буфера может продолжаться за ним
+    size_t start = 0;
+    while (filled - start >= CAS_MAX_CHUNK ||
+           (read_pos == size && start < filled)) {
+      size_t length = casCutPoint(buffer.data() + start, filled - start);
+      if (!on_chunk(buffer.data() + start, length)) return false;
+      start += length;
+    }
+    memmove(buffer.data(), buffer.data() + start, filled - start);
+    filled -= start;
+  }
+  return true;
+}
+
+#endif  // CAS_H
@@ -0,0 +1,101 @@
+/**
+ * @file checksum.h
+ * @brief Контрольные суммы CRC32C блоков файла, общие для клиента и сервера.
+ *
+ * На процессорах с SSE4.2 CRC32C считается инструкцией crc32 по 8 байт за
+ * раз; на остальных - табличным алгоритмом. Выбор делается один раз при
+ * первом вызове.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CHECKSUM_HAVE_SSE42 1
+#endif
+
+/// Размер блока, для которого считается одна контрольная сумма.
+const uint64_t HASH_BLOCK_SIZE = 1 << 20;
+
+/**
+ * @struct Crc32cTable
+ * @brief Таблица остатков CRC32C (полином Кастаньоли) для побайтового счёта.
+ */
+struct Crc32cTable {
+  uint32_t values[256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; bit++)
+        value = (value >> 1) ^ (0x82f63b78 & (0 - (value & 1)));
+      values[i] = value;
+    }
+  }
+};
+
+/**
+ * @brief Табличный CRC32C.
+ */
+
+inline uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data,
+                               size_t size) {
+  static const Crc32cTable table;
+  while (size-- > 0) crc = table.values[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CHECKSUM_HAVE_SSE42
+/**
+ * @brief CRC32C на инструкциях SSE4.2.
+ */
+
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(
+    uint32_t crc, const unsigned char* data, size_t size) {
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+  while (size-- > 0) crc = _mm_crc32_u8(crc, *data++);
+  return crc;
+}
+#endif
+
+/**
+ * @brief Считает CRC32C буфера.
+ *
+ * @param data Данные.
+ * @param size Размер данных.
+ * @return Контрольная сумма.
+ */
+
+inline uint32_t crc32c(const void* data, size_t size) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#ifdef CHECKSUM_HAVE_SSE42
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) return ~crc32cHardware(~0u, bytes, size);
+#endif
+  return ~crc32cSoftware(~0u, bytes, size);
+}
+
+/**
+ * @brief Количество блоков HASH_BLOCK_SIZE в файле заданного размера.
+ */
+
+inline uint64_t hashBlockCount(uint64_t file_size) {
+  return (file_size + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+}
+
+#endif  // CHECKSUM_H
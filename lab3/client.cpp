@@ -3,39 +3,25 @@
  * @brief Клиентская часть для работы с файловым сервером.
  */
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <vector>
-#define BUFFER_SIZE 4096
 
-/**
- * @struct ClientConfig
- * @brief Структура для хранения конфигурации клиента.
- *
- * @var ClientConfig::id Идентификатор клиента.
- * @var ClientConfig::server_address IP-адрес сервера.
- * @var ClientConfig::port Порт сервера.
- * @var ClientConfig::files Список файлов для передачи.
- */
-
-struct ClientConfig {
-  int id = 0;
-  std::string server_address = "";
-  int port = 0;
-  std::vector<std::string> files;
-};
-
-ClientConfig readClientConfig(const std::string& filename);
-void getAndProcessFileSize(int sock, ClientConfig& config);
-void receiveFileData(int sock, const std::string& filePath);
+#include "checksum.h"
+#include "client.h"
+#include "codec.h"
+#include "delta.h"
+#include "protocol.h"
 
 /**
  * @brief Главная функция клиента для передачи файлов.
@@ -46,84 +32,155 @@ void receiveFileData(int sock, const std::string& filePath);
  */
 
 int main(int argc, char** argv) {
-  int sock = 0, valread;
-  struct sockaddr_in serv_addr;
-  char buffer[BUFFER_SIZE] = {0};
-
   if (argc < 2) {
     std::cerr << "Usage: ./client <config_file>" << std::endl;
     return -1;
   }
 
   ClientConfig config = readClientConfig(argv[1]);
-
-  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    std::cerr << "Socket creation error" << std::endl;
-    return -1;
+  ProgressReporter progress(config.progress);
+  if (config.streams > 1) {
+    return downloadParallel(config, progress) ? 0 : -1;
   }
 
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(config.port);
-
-  if (inet_pton(AF_INET, config.server_address.c_str(), &serv_addr.sin_addr) <=
-      0) {
-    std::cerr << "Invalid address/ Address not supported" << std::endl;
-    return -1;
+  ClientSession session;
+  loadSession(config, session);
+  bool complete = false;
+  for (int attempt = 0; attempt <= MAX_RECONNECTS; attempt++) {
+    // Переподключение ждёт сервер, удваивая паузу с каждой попыткой
+    if (attempt > 0) usleep((RECONNECT_DELAY_MS << (attempt - 1)) * 1000);
+    int sock = connectToServer(config);
+    if (sock < 0) continue;
+    complete = downloadFiles(sock, config, session, progress);
+    close(sock);
+    if (complete) break;
+    // Сервер не ответил на продолжение сессии: следующая попытка заводит
+    // новую
+    if (session.pending) session.token = 0;
+    if (attempt < MAX_RECONNECTS)
+      std::cout << "Connection lost, reconnecting" << std::endl;
   }
+  return complete ? 0 : -1;
+}
 
-  if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-    std::cerr << "Connection Failed" << std::endl;
-    return -1;
-  }
-  getAndProcessFileSize(sock, config);
-  for (const auto& file : config.files) {
-    send(sock, file.c_str(), file.length(), 0);
+/**
+ * @brief Загружает файлы и архивы из конфигурации по одному подключению.
+ *
+ * Файлы и архивы, загруженные до разрыва соединения, пропускаются, а файлы,
+ * загрузка которых прервалась, догружаются конвейером с длины локальной
+ * копии.
+ *
+ * @param sock Дескриптор сокета.
+ * @param config Конфигурация клиента.
+ * @param session Сессия.
+ * @param progress Отображение прогресса.
+ * @return false при разрыве соединения или нарушении протокола.
+ */
+
+bool downloadFiles(int sock, ClientConfig& config, ClientSession& session,
+                   ProgressReporter& progress) {
+  if (!getAndProcessFileSize(sock, config, session)) return false;
+  // Файлы, которых ещё нет локально, запрашиваются конвейером; остальные
+  // требуют проверки локальной копии и загружаются по одному
+  std::vector<std::string> existing;
+  if (!downloadPipelined(sock, config, session, progress, existing))
+    return false;
+  ChunkIndex index;
+  bool indexed = false;
+  for (const auto& file : existing) {
+    if (!sendFrame(sock, FRAME_FILE_REQUEST, 0, 0, file)) return false;
     std::cout << "File " << file << " sent" << std::endl;
-    memset(buffer, 0, BUFFER_SIZE);
-    valread = read(sock, buffer, BUFFER_SIZE);
-
-    std::string response(buffer, valread);
-    std::istringstream iss(response);
-    std::string existsStr;
-    double serverFileSize;
-    if (iss >> existsStr >> serverFileSize) {
-      bool exists = existsStr == "true";
-      std::cout << "File exists on server: " << std::boolalpha << exists
-                << ", Server file size: " << serverFileSize << " bytes"
-                << std::endl;
 
-      std::ifstream localFile(file, std::ifstream::ate | std::ifstream::binary);
-      if (!localFile && exists) {
-        // Если файл не открыт, но существует на сервере, создаём его
-        std::ofstream newFile(file, std::ios::binary);
-        newFile.close();
-        localFile.open(file, std::ifstream::ate | std::ifstream::binary);
-      }
-      std::cout << "localFile " << file << std::endl;
-      if (localFile) {
-        double localFileSize = localFile.tellg();
-        std::cout << "Local file size: " << localFileSize << " bytes"
-                  << std::endl;
-
-        if (localFileSize == serverFileSize) {
-          std::string readyMessage = "SENDING DATA";
-          std::cout << readyMessage << std::endl;
-          send(sock, readyMessage.c_str(), readyMessage.length(), 0);
-          receiveFileData(sock, file);
-        } else {
-          std::ostringstream resumeMsg;
-          resumeMsg << "RESUME DOWNLOAD " << file << " " << localFileSize;
-          std::cout << localFileSize << std::endl;
-          std::cout << "Requesting file resume from byte: " << localFileSize
-                    << std::endl;
-          send(sock, resumeMsg.str().c_str(), resumeMsg.str().length(), 0);
-          receiveFileData(sock, file);
-        }
+    FrameHeader header;
+    std::string payload;
+    if (!recvFrame(sock, header, payload) || header.type != FRAME_FILE_STATUS)
+      return false;
+    bool exists = header.flags & FLAG_FOUND;
+    uint64_t serverFileSize = decodeU64(payload);
+    std::cout << "File exists on server: " << std::boolalpha << exists
+              << ", Server file size: " << serverFileSize << " bytes"
+              << ", Recorded progress: " << header.offset << " bytes"
+              << std::endl;
+    if (!exists) {
+      session.done.insert(file);
+      continue;
+    }
+
+    uint64_t localFileSize = 0;
+    struct stat st;
+    bool present = stat(file.c_str(), &st) == 0;
+    if (present) localFileSize = st.st_size;
+    std::cout << "Local file size: " << localFileSize << " bytes" << std::endl;
+
+    // Файла нет локально: куски, которые уже есть у клиента, берутся из
+    // его файлов
+    if (config.dedup && !present) {
+      if (!indexed) indexLocalFiles(config, session, index);
+      indexed = true;
+      if (!downloadChunked(sock, file, serverFileSize, index)) return false;
+      session.done.insert(file);
+      continue;
+    }
+    uint64_t originalSize = localFileSize;
+    bool longer = localFileSize > serverFileSize;
+    if (longer) {
+      // Локальная копия длиннее файла на сервере - загружаем файл заново
+      localFileSize = 0;
+    }
+    bool delta = config.delta && originalSize >= DELTA_MIN_BLOCK;
+
+    // Полные блоки локальной копии проверяем по манифесту сервера; неполный
+    // последний блок проверить нельзя, поэтому он загружается заново
+    uint64_t resumePos = localFileSize;
+    std::vector<std::pair<uint64_t, uint64_t>> damaged;
+    std::vector<uint32_t> manifest;
+    uint64_t verifiedEnd = localFileSize / HASH_BLOCK_SIZE * HASH_BLOCK_SIZE;
+    if (localFileSize == serverFileSize) verifiedEnd = localFileSize;
+    if (verifiedEnd > 0 || delta) {
+      if (!fetchManifest(sock, serverFileSize, manifest)) return false;
+      if (!manifest.empty() && verifiedEnd > 0) {
+        resumePos = verifiedEnd;
+        damaged = findDamagedRanges(file, manifest, serverFileSize,
+                                    {{0, verifiedEnd}});
       }
     }
+
+    // Копия не совпадает с началом файла или её нельзя проверить по
+    // манифесту: сверяем её с файлом по дельте
+    if (delta && (verifiedEnd == 0 || !damaged.empty())) {
+      if (!downloadDelta(sock, file, originalSize, serverFileSize, manifest))
+        return false;
+      session.done.insert(file);
+      continue;
+    }
+
+    bool direct = config.write_mode == "direct" &&
+                  serverFileSize >= DIRECT_IO_MIN_SIZE;
+    // Для O_DIRECT кадры должны приходить с выровненных смещений
+    if (direct) resumePos -= resumePos % DIRECT_IO_ALIGNMENT;
+
+    if (resumePos == 0) {
+      std::cout << "SENDING DATA" << std::endl;
+      if (!sendFrame(sock, FRAME_SEND_DATA, 0, 0)) return false;
+    } else {
+      std::cout << "Requesting file resume from byte: " << resumePos
+                << std::endl;
+      if (!sendFrame(sock, FRAME_SEND_DATA, FLAG_RESUME, resumePos))
+        return false;
+    }
+    if (!receiveFileData(sock, file, resumePos, serverFileSize, progress,
+                         direct))
+      return false;
+    if (!repairRanges(sock, file, damaged)) return false;
+    session.done.insert(file);
   }
-  close(sock);
-  return 0;
+  // Мелкие файлы загружаются архивами, по одному на шаблон
+  for (const auto& pattern : config.bundles) {
+    if (session.done.count(pattern)) continue;
+    if (!downloadBundle(sock, pattern, progress)) return false;
+    session.done.insert(pattern);
+  }
+  return true;
 }
 
 /**
@@ -153,6 +210,26 @@ ClientConfig readClientConfig(const std::string& filename) {
         config.server_address = value.substr(1);
       } else if (key == "port") {
         config.port = std::stoi(value.substr(1));
+      } else if (key == "streams") {
+        config.streams = std::stoi(value.substr(1));
+      } else if (key == "write_mode") {
+        config.write_mode = value.substr(1);
+      } else if (key == "progress") {
+        config.progress = value.substr(1);
+      } else if (key == "compression") {
+        config.compression = value.substr(1);
+      } else if (key == "delta") {
+        config.delta = std::stoi(value.substr(1)) != 0;
+      } else if (key == "session") {
+        config.session = std::stoi(value.substr(1)) != 0;
+      } else if (key == "dedup") {
+        config.dedup = std::stoi(value.substr(1)) != 0;
+      } else if (key == "bundles") {
+        std::istringstream patterns(value);
+        std::string pattern;
+        while (patterns >> pattern) {
+          config.bundles.push_back(pattern);
+        }
       } else if (key == "files") {
         std::istringstream filestream(value);
         std::string file;
@@ -167,77 +244,174 @@ ClientConfig readClientConfig(const std::string& filename) {
 }
 
 /**
- * @brief Инициирует запрос на получение размера файла.
+ * @brief Устанавливает соединение с сервером.
+ *
+ * @param config Конфигурация клиента.
+ * @return Дескриптор сокета или -1 при ошибке.
+ */
+
+int connectToServer(const ClientConfig& config) {
+  int sock = 0;
+  struct sockaddr_in serv_addr;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    std::cerr << "Socket creation error" << std::endl;
+    return -1;
+  }
+
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(config.port);
+
+  if (inet_pton(AF_INET, config.server_address.c_str(), &serv_addr.sin_addr) <=
+      0) {
+    std::cerr << "Invalid address/ Address not supported" << std::endl;
+    close(sock);
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+    std::cerr << "Connection Failed" << std::endl;
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/**
+ * @brief Загружает файлы, которых нет локально, конвейером запросов.
+ *
+ * Запросы FRAME_FILE_REQUEST с флагом FLAG_STREAM отправляются, не дожидаясь
+ * ответов, но не больше PIPELINE_DEPTH сразу: так запросы всегда помещаются
+ * в буфер сокета, пока сервер отправляет данные. Сервер отвечает на них по
+ * порядку: FRAME_FILE_STATUS с именем файла и, если файл есть, его данными.
+ * Файлы, загрузка которых прервалась разрывом соединения, запрашиваются так
+ * же, но с длины локальной копии, поэтому после переподключения все они
+ * продолжаются за один обмен.
  *
  * @param sock Дескриптор сокета.
  * @param config Конфигурация клиента.
+ * @param session Сессия.
+ * @param progress Отображение прогресса.
+ * @param existing Файлы с локальной копией и, если включена сборка из
+ * кусков, файлы без неё - они загружаются отдельно.
+ * @return false при разрыве соединения или нарушении протокола.
  */
 
-void getAndProcessFileSize(int sock, ClientConfig& config) {
-  send(sock, std::to_string(config.id).c_str(),
-       sizeof(std::to_string(config.id)).length(), 0);
+bool downloadPipelined(int sock, ClientConfig& config,
+                       ClientSession& session, ProgressReporter& progress,
+                       std::vector<std::string>& existing) {
+  // Имя файла и позиция, с которой он запрашивается
+  std::vector<std::pair<std::string, uint64_t>> files;
+  for (const auto& file : config.files) {
+    if (session.done.count(file)) continue;
+    struct stat st;
+    bool present = stat(file.c_str(), &st) == 0;
+    if (!present && config.dedup)
+      existing.push_back(file);  // Собирается из кусков
+    else if (!present)
+      files.push_back({file, 0});
+    else if (session.partial.count(file))
+      // Позиция выровнена для записи с O_DIRECT
+      files.push_back({file, st.st_size - st.st_size % DIRECT_IO_ALIGNMENT});
+    else
+      existing.push_back(file);
+  }
+
+  size_t next = 0;
+  // Запросы без ответа, по порядку
+  std::deque<std::pair<std::string, uint64_t>> pending;
+  while (next < files.size() || !pending.empty()) {
+    while (next < files.size() && pending.size() < PIPELINE_DEPTH) {
+      if (!sendFrame(sock, FRAME_FILE_REQUEST, FLAG_STREAM, files[next].second,
+                     files[next].first))
+        return false;
+      pending.push_back(files[next++]);
+    }
+    // Ответ на FRAME_HELLO приходит раньше ответов на запросы
+    if (!receiveSession(sock, config, session)) return false;
+    std::string file = pending.front().first;
+    uint64_t startPos = pending.front().second;
+    pending.pop_front();
 
-  sleep(1);
+    FrameHeader header;
+    std::string payload;
+    if (!recvFrame(sock, header, payload) ||
+        header.type != FRAME_FILE_STATUS || payload.size() < sizeof(uint64_t) ||
+        payload.compare(sizeof(uint64_t), std::string::npos, file) != 0)
+      return false;
+    if (!(header.flags & FLAG_FOUND)) {
+      std::cout << "File not found on server: " << file << std::endl;
+      session.done.insert(file);
+      continue;
+    }
+    uint64_t fileSize = decodeU64(payload);
+    bool direct =
+        config.write_mode == "direct" && fileSize >= DIRECT_IO_MIN_SIZE;
+    session.partial.insert(file);
+    if (!receiveFileData(sock, file, startPos, fileSize, progress, direct))
+      return false;
+    session.partial.erase(file);
+    session.done.insert(file);
+  }
+  return receiveSession(sock, config, session);
 }
 
 /**
  * @brief Получает данные файла от сервера и записывает их в файл.
  *
+ * Данные приходят кадрами FRAME_DATA; передача завершается кадром
+ * FRAME_END_OF_DATA. Каждый кадр записывается по смещению, указанному в его
+ * заголовке, поэтому при догрузке дописывается только недостающий хвост.
+ * Запись на диск выполняет отдельный поток (DiskWriter), так что приём из
+ * сети не ждёт диска. Сжатые кадры распаковываются перед записью.
+ *
  * @param sock Дескриптор сокета.
  * @param filePath Путь к файлу для сохранения данных.
+ * @param startPos Позиция, с которой запрошена передача.
+ * @param fileSize Размер файла на сервере.
+ * @param progress Отображение прогресса.
+ * @param direct Писать файл с O_DIRECT.
+ * @return false при разрыве соединения, нарушении протокола или ошибке
+ * записи.
  */
 
-void receiveFileData(int sock, const std::string& filePath) {
+bool receiveFileData(int sock, const std::string& filePath, uint64_t startPos,
+                     uint64_t fileSize, ProgressReporter& progress,
+                     bool direct) {
   std::cout << "Starting file download: " << filePath << std::endl;
-  std::ofstream file(filePath, std::ios::binary | std::ios::app);
-  if (!file.is_open()) {
-    std::cerr << "Failed to open file: " << filePath << std::endl;
-    return;
-  }
+  DiskWriter writer;
+  if (!writer.open(filePath, startPos, fileSize, direct)) return false;
 
-  char buffer[BUFFER_SIZE];
-  int bytesReceived;
   bool endOfDataReceived = false;
-  size_t totalReceived = 0;
-  const int numBlocks = 50;
-
-  // Чтение размера файла
-  bytesReceived = recv(sock, buffer, BUFFER_SIZE, 0);
-  std::string sizeStr(buffer, bytesReceived);
-  size_t fileSize = std::stoul(sizeStr.substr(0, sizeStr.find('\n')));
   std::cout << "Expected file size: " << fileSize << " bytes" << std::endl;
+  // Прогресс рисует отдельный поток, здесь только обновляется счётчик
+  std::atomic<uint64_t>* received =
+      progress.addFile(filePath, fileSize, startPos);
 
-  while ((bytesReceived = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
-    usleep(10);
-
-    file.write(buffer, bytesReceived);
-    totalReceived += bytesReceived;
-    if (strstr(buffer, "END_OF_DATA") ||
-        totalReceived >= fileSize) {  // Проверка на наличие маркера завершения
+  FrameHeader header;
+  std::vector<char> plain, scratch;  // Для сжатых кадров
+  while (recvFrameHeader(sock, header)) {
+    if (header.type == FRAME_END_OF_DATA) {
       endOfDataReceived = true;
-      std::cout << std::endl;
       break;
     }
-
-    // Обновление прогресс-бара
-    int progress = ceil(((double)totalReceived / (double)fileSize) * numBlocks);
-    std::cout << "\r[";
-    for (int i = 0; i < numBlocks; ++i) {
-      std::cout << (i < progress ? "=" : " ");
+    if (header.type != FRAME_DATA || header.length > MAX_DATA_PAYLOAD) break;
+    int64_t length = header.length;
+    if (header.flags & FLAG_COMPRESSED) {
+      plain.resize(MAX_DATA_PAYLOAD);
+      length = recvDataPayload(sock, header, plain.data(), scratch);
+      if (length < 0 || !writer.append(plain.data(), header.offset, length))
+        break;
+    } else if (!writer.append(sock, header.offset, header.length)) {
+      break;
     }
-    std::cout << "] " << (int)(((double)totalReceived / (double)fileSize) * 100)
-              << "%" << std::flush;
+    received->fetch_add(length, std::memory_order_relaxed);
   }
 
-  // Обеспечиваем, что прогресс-бар достигает 100%
+  if (!writer.finish()) endOfDataReceived = false;
+  progress.clear();
   if (endOfDataReceived) {
-    std::cout << "\r[";
-    for (int i = 0; i < numBlocks; ++i) {
-      std::cout << "=";
-    }
-    std::cout << "] 100%" << std::endl;
     std::cout << "All data received for this file." << std::endl;
   }
-
-  file.close();
+  return endOfDataReceived;
 }
@@ -0,0 +1,260 @@
+/**
+ * @file client.h
+ * @brief Общие объявления клиентской части приложения.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bundle.h"
+#include "cas.h"
+
+/**
+ * @struct ClientConfig
+ * @brief Структура для хранения конфигурации клиента.
+ *
+ * @var ClientConfig::id Идентификатор клиента.
+ * @var ClientConfig::server_address IP-адрес сервера.
+ * @var ClientConfig::port Порт сервера.
+ * @var ClientConfig::files Список файлов для передачи.
+ * @var ClientConfig::streams Количество параллельных подключений. При
+ * значении больше 1 файлы делятся на диапазоны, которые загружаются
+ * одновременно.
+ * @var ClientConfig::write_mode Способ записи файлов: "buffered" (через page
+ * cache) или "direct" (O_DIRECT и заранее выделенное место для файлов от
+ * DIRECT_IO_MIN_SIZE байт).
+ * @var ClientConfig::progress Отображение прогресса: "bar", "json", "none"
+ * или "auto" ("bar" в терминале, иначе "json").
+ * @var ClientConfig::compression Кодеки, которые клиент предлагает серверу:
+ * "auto" (все поддерживаемые), "deflate", "zstd" или "none".
+ * @var ClientConfig::delta Если локальная копия файла - его прежняя версия,
+ * загружать только отличия (см. client_delta.cpp). Используется при одном
+ * подключении.
+ * @var ClientConfig::bundles Шаблоны имён мелких файлов, каждый из которых
+ * загружается одним архивом (см. client_bundle.cpp). Используется при одном
+ * подключении.
+ * @var ClientConfig::session Продолжать сессию на сервере при
+ * переподключении и следующем запуске (см. client_session.cpp). Используется
+ * при одном подключении.
+ * @var ClientConfig::dedup Файлы, которых нет локально, собирать из кусков
+ * уже имеющихся файлов и загружать только недостающие куски (см.
+ * client_chunks.cpp). Такие файлы запрашиваются по одному, без конвейера.
+ * Используется при одном подключении.
+ */
+
+struct ClientConfig {
+  int id = 0;
+  std::string server_address = "";
+  int port = 0;
+  std::vector<std::string> files;
+  int streams = 1;
+  std::string write_mode = "buffered";
+  std::string progress = "auto";
+  std::string compression = "auto";
+  bool delta = true;
+  std::vector<std::string> bundles;
+  bool session = true;
+  bool dedup = false;
+};
+
+/**
+ * @struct ClientSession
+ * @brief Сессия клиента на сервере и состояние загрузки между
+ * переподключениями.
+ */
+struct ClientSession {
+  uint64_t token = 0;      ///< Маркер сессии; 0 - сессии нет.
+  bool pending = false;    ///< Ответ FRAME_SESSION ещё не прочитан.
+  bool resuming = false;   ///< FRAME_HELLO продолжает сессию.
+  std::set<std::string> done;  ///< Загруженные файлы и шаблоны архивов.
+  /// Файлы, загрузка которых с нуля прервалась: их локальная копия - начало
+  /// файла, и она догружается без проверки по манифесту.
+  std::set<std::string> partial;
+};
+
+/**
+ * @struct ChunkSource
+ * @brief Место куска в локальном файле.
+ */
+struct ChunkSource {
+  std::string path;
+  uint64_t offset = 0;
+};
+
+/// Куски локальных файлов по хэшу содержимого (см. cas.h).
+typedef std::map<CasHash, ChunkSource> ChunkIndex;
+
+/// Сколько раз клиент переподключается к серверу после разрыва соединения.
+const int MAX_RECONNECTS = 3;
+/// Пауза перед первым переподключением, мс; перед каждым следующим - вдвое
+/// дольше.
+const int RECONNECT_DELAY_MS = 200;
+/// Сколько запросов файлов отправляется серверу, не дожидаясь ответов.
+const size_t PIPELINE_DEPTH = 32;
+/// Выравнивание смещений и буферов для записи с O_DIRECT.
+const uint64_t DIRECT_IO_ALIGNMENT = 4096;
+/// Минимальный размер файла, для которого используется O_DIRECT.
+const uint64_t DIRECT_IO_MIN_SIZE = 64 << 20;
+
+/**
+ * @class DiskWriter
+ * @brief Запись принятых данных в файл отдельным потоком через кольцо
+ * буферов (см. client_writer.cpp).
+ */
+class DiskWriter {
+ public:
+  DiskWriter() = default;
+  DiskWriter(const DiskWriter&) = delete;
+  DiskWriter& operator=(const DiskWriter&) = delete;
+  ~DiskWriter();
+
+  bool open(const std::string& path, uint64_t startPos, uint64_t fileSize,
+            bool direct);
+  bool append(int sock, uint64_t offset, uint32_t length);
+  bool append(const char* data, uint64_t offset, size_t length);
+  bool finish();
+
+ private:
+  struct Buffer {
+    char* data = nullptr;
+    uint64_t offset = 0;
+    size_t used = 0;
+  };
+
+  void run();
+  char* reserve(uint64_t offset, size_t& length);
+  void submit();
+  bool write(const Buffer& buffer);
+
+  std::string path_;
+  int fd_ = -1;
+  int direct_fd_ = -1;
+  std::vector<Buffer> buffers_;
+  int current_ = -1;      ///< Заполняемый буфер или -1.
+  std::deque<int> free_;  ///< Буферы, которые можно заполнять.
+  std::deque<int> full_;  ///< Буферы, ожидающие записи.
+  std::mutex mutex_;
+  std::condition_variable free_cv_;
+  std::condition_variable full_cv_;
+  bool stopping_ = false;
+  bool failed_ = false;
+  std::thread thread_;
+};
+
+/**
+ * @class ProgressReporter
+ * @brief Отображение прогресса загрузки в отдельном потоке по таймеру (см.
+ * client_progress.cpp).
+ */
+class ProgressReporter {
+ public:
+  explicit ProgressReporter(const std::string& mode);
+  ProgressReporter(const ProgressReporter&) = delete;
+  ProgressReporter& operator=(const ProgressReporter&) = delete;
+  ~ProgressReporter();
+
+  std::atomic<uint64_t>* addFile(const std::string& name, uint64_t size,
+                                 uint64_t done);
+  void clear();
+
+ private:
+  struct FileProgress {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t start = 0;  ///< Сколько байт было до начала загрузки.
+    std::atomic<uint64_t> done{0};
+  };
+
+  void run();
+
+  std::string mode_;
+  std::deque<FileProgress> files_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  bool drawn_ = false;  ///< Строка прогресса выведена и не стёрта.
+  std::thread thread_;
+};
+
+/**
+ * @class BundleExtractor
+ * @brief Раскладывает принимаемый архив мелких файлов по файлам (см.
+ * client_bundle.cpp).
+ */
+class BundleExtractor {
+ public:
+  BundleExtractor() = default;
+  BundleExtractor(const BundleExtractor&) = delete;
+  BundleExtractor& operator=(const BundleExtractor&) = delete;
+  ~BundleExtractor();
+
+  uint64_t open(const std::string& pattern, uint64_t id, uint64_t size);
+  bool write(uint64_t offset, const char* data, size_t length);
+  bool finish();
+
+ private:
+  bool validSize() const;
+  bool parseTable();
+  bool writeEntry(size_t index, uint64_t offset, const char* data,
+                  size_t length);
+
+  std::string state_path_;  ///< Сохранённая таблица архива.
+  uint64_t id_ = 0;
+  uint64_t size_ = 0;
+  std::string table_;       ///< Принятое начало архива.
+  uint64_t table_end_ = 0;  ///< Длина начала архива или 0, пока неизвестна.
+  bool parsed_ = false;
+  std::vector<BundleEntry> entries_;
+  size_t current_ = SIZE_MAX;  ///< Файл, открытый для записи.
+  int fd_ = -1;
+};
+
+ClientConfig readClientConfig(const std::string& filename);
+int connectToServer(const ClientConfig& config);
+bool getAndProcessFileSize(int sock, ClientConfig& config,
+                           ClientSession& session);
+void loadSession(const ClientConfig& config, ClientSession& session);
+bool receiveSession(int sock, const ClientConfig& config,
+                    ClientSession& session);
+bool downloadFiles(int sock, ClientConfig& config, ClientSession& session,
+                   ProgressReporter& progress);
+bool receiveFileData(int sock, const std::string& filePath, uint64_t startPos,
+                     uint64_t fileSize, ProgressReporter& progress,
+                     bool direct = false);
+bool downloadPipelined(int sock, ClientConfig& config,
+                       ClientSession& session, ProgressReporter& progress,
+                       std::vector<std::string>& existing);
+bool downloadParallel(ClientConfig& config, ProgressReporter& progress);
+
+bool fetchManifest(int sock, uint64_t fileSize,
+                   std::vector<uint32_t>& manifest);
+std::vector<std::pair<uint64_t, uint64_t>> findDamagedRanges(
+    const std::string& filePath, const std::vector<uint32_t>& manifest,
+    uint64_t fileSize, const std::vector<std::pair<uint64_t, uint64_t>>& done);
+bool repairRanges(int sock, const std::string& filePath,
+                  const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                  const std::string& localPath = "");
+bool downloadDelta(int sock, const std::string& filePath, uint64_t localSize,
+                   uint64_t fileSize, const std::vector<uint32_t>& manifest);
+bool copyRange(int from, int to, uint64_t source, uint64_t target,
+               uint64_t length);
+void indexLocalFiles(const ClientConfig& config, const ClientSession& session,
+                     ChunkIndex& index);
+bool downloadChunked(int sock, const std::string& filePath, uint64_t fileSize,
+                     ChunkIndex& index);
+bool downloadBundle(int sock, const std::string& pattern,
+                    ProgressReporter& progress);
+
+#endif  // CLIENT_H
@@ -0,0 +1,271 @@
+/**
+ * @file client_bundle.cpp
+ * @brief Загрузка архива мелких файлов (см. bundle.h).
+ *
+ * Архив не сохраняется целиком: по мере приёма данные раскладываются по
+ * файлам по позициям из таблицы архива. Принятая таблица сохраняется в
+ * служебный файл ".bundle-<CRC32C шаблона>", поэтому прерванную загрузку
+ * можно продолжить. Продолжение начинается с первого файла, который
+ * отсутствует, короче своего размера в таблице или не записывался после
+ * сохранения таблицы; если архив на сервере изменился (другой
+ * идентификатор), он загружается заново.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+#include "checksum.h"
+#include "client.h"
+#include "codec.h"
+#include "protocol.h"
+
+BundleExtractor::~BundleExtractor() {
+  if (fd_ >= 0) close(fd_);
+}
+
+/**
+ * @brief Начинает загрузку архива.
+ *
+ * @param pattern Шаблон имён файлов.
+ * @param id Идентификатор архива на сервере.
+ * @param size Размер архива на сервере.
+ * @return Позиция архива, с которой нужно продолжить загрузку.
+ */
+
+uint64_t BundleExtractor::open(const std::string& pattern, uint64_t id,
+                               uint64_t size) {
+  std::ostringstream path;
+  path << ".bundle-" << std::hex << crc32c(pattern.data(), pattern.size());
+  state_path_ = path.str();
+  id_ = id;
+  size_ = size;
+
+  std::ifstream state(state_path_, std::ios::binary);
+  struct stat state_st;
+  if (!state.is_open() || stat(state_path_.c_str(), &state_st) != 0) return 0;
+  table_.assign(std::istreambuf_iterator<char>(state),
+                std::istreambuf_iterator<char>());
+  uint64_t saved_id = 0;
+  if (!decodeBundleTable(table_, saved_id, entries_) || saved_id != id_ ||
+      !validSize()) {
+    std::cout << "Bundle " << pattern << " changed on server" << std::endl;
+    table_.clear();
+    entries_.clear();
+    unlink(state_path_.c_str());
+    return 0;
+  }
+  table_end_ = table_.size();
+  parsed_ = true;
+
+  for (const auto& entry : entries_) {
+    struct stat st;
+    if (stat(entry.name.c_str(), &st) != 0) return entry.offset;
+    // Файл с тем же именем мог остаться от прежней загрузки
+    bool fresh = st.st_mtim.tv_sec > state_st.st_mtim.tv_sec ||
+                 (st.st_mtim.tv_sec == state_st.st_mtim.tv_sec &&
+                  st.st_mtim.tv_nsec >= state_st.st_mtim.tv_nsec);
+    if (!fresh || (uint64_t)st.st_size > entry.size) return entry.offset;
+    if ((uint64_t)st.st_size < entry.size) return entry.offset + st.st_size;
+  }
+  return size_;
+}
+
+/**
+ * @brief Проверяет, что таблица описывает архив размера с сервера.
+ */
+
+bool BundleExtractor::validSize() const {
+  if (entries_.empty()) return false;
+  return entries_.back().offset + entries_.back().size == size_;
+}
+
+/**
+ * @brief Записывает принятые данные архива.
+ *
+ * Начало архива до данных файлов накапливается, пока таблица не будет
+ * принята целиком; остальное записывается в файлы по таблице.
+ *
+ * @param offset Позиция данных в архиве.
+ * @param data Данные.
+ * @param length Длина данных.
+ * @return false при нарушении формата или ошибке записи.
+ */
+
+bool BundleExtractor::write(uint64_t offset, const char* data,
+                            size_t length) {
+  while (length > 0) {
+    size_t n = 0;
+    if (!parsed_) {
+      // Таблица приходит подряд с начала архива
+      if (offset != table_.size()) return false;
+      uint64_t end = table_end_ != 0 ? table_end_ : BUNDLE_HEADER_SIZE;
+      n = std::min<uint64_t>(length, end - table_.size());
+      table_.append(data, n);
+      if (table_end_ == 0 && table_.size() == BUNDLE_HEADER_SIZE) {
+        table_end_ = bundleTableEnd(table_.data());
+        if (table_end_ == 0 || table_end_ > size_) return false;
+      }
+      if (table_.size() == table_end_ && !parseTable()) return false;
+    } else {
+      auto it = std::upper_bound(entries_.begin(), entries_.end(), offset,
+                                 [](uint64_t value, const BundleEntry& entry) {
+                                   return value < entry.offset;
+                                 });
+      if (it == entries_.begin()) return false;
+      --it;
+      if (offset >= it->offset + it->size) return false;
+      n = std::min<uint64_t>(length, it->offset + it->size - offset);
+      if (!writeEntry(it - entries_.begin(), offset, data, n)) return false;
+    }
+    offset += n;
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Разбирает принятую таблицу и сохраняет её для продолжения загрузки.
+ */
+
+bool BundleExtractor::parseTable() {
+  uint64_t id = 0;
+  if (!decodeBundleTable(table_, id, entries_) || id != id_ || !validSize()) {
+    std::cerr << "Invalid bundle table" << std::endl;
+    return false;
+  }
+  parsed_ = true;
+  std::ofstream state(state_path_, std::ios::binary | std::ios::trunc);
+  state.write(table_.data(), table_.size());
+  if (!state) std::cerr << "Failed to save " << state_path_ << std::endl;
+  return true;
+}
+
+/**
+ * @brief Записывает часть данных одного файла архива.
+ *
+ * @param index Номер файла в таблице.
+ * @param offset Позиция данных в архиве.
+ * @param data Данные.
+ * @param length Длина данных, не выходящих за конец файла.
+ * @return false при ошибке записи.
+ */
+
+bool BundleExtractor::writeEntry(size_t index, uint64_t offset,
+                                 const char* data, size_t length) {
+  const BundleEntry& entry = entries_[index];
+  if (index != current_) {
+    if (fd_ >= 0) close(fd_);
+    // С начала файл пишется заново, при продолжении - дописывается
+    int flags = O_WRONLY | O_CREAT | (offset == entry.offset ? O_TRUNC : 0);
+    fd_ = ::open(entry.name.c_str(), flags, 0644);
+    current_ = index;
+    if (fd_ < 0) {
+      perror(("Failed to open " + entry.name).c_str());
+      return false;
+    }
+  }
+  while (length > 0) {
+    ssize_t n = pwrite(fd_, data, length, offset - entry.offset);
+    if (n <= 0) {
+      perror(("Failed to write " + entry.name).c_str());
+      return false;
+    }
+    data += n;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Завершает загрузку: создаёт пустые файлы архива и удаляет
+ * сохранённую таблицу.
+ *
+ * @return false, если таблица так и не была принята или файл не создан.
+ */
+
+bool BundleExtractor::finish() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+  if (!parsed_) return false;
+  for (const auto& entry : entries_) {
+    if (entry.size != 0) continue;
+    int fd = ::open(entry.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(("Failed to create " + entry.name).c_str());
+      return false;
+    }
+    close(fd);
+  }
+  unlink(state_path_.c_str());
+  std::cout << "Extracted " << entries_.size() << " files" << std::endl;
+  return true;
+}
+
+/**
+ * @brief Загружает архив файлов, подходящих под шаблон.
+ *
+ * @param sock Сокет.
+ * @param pattern Шаблон имён файлов (без '/').
+ * @param progress Отображение прогресса.
+ * @return false при разрыве соединения, нарушении протокола или ошибке
+ * записи.
+ */
+
+bool downloadBundle(int sock, const std::string& pattern,
+                    ProgressReporter& progress) {
+  FrameHeader header;
+  std::string payload;
+  if (!sendFrame(sock, FRAME_FILE_REQUEST, FLAG_BUNDLE, 0, pattern) ||
+      !recvFrame(sock, header, payload) ||
+      header.type != FRAME_FILE_STATUS ||
+      payload.size() < 2 * sizeof(uint64_t))
+    return false;
+  if (!(header.flags & FLAG_FOUND)) {
+    std::cout << "No files match " << pattern << " on server" << std::endl;
+    return true;
+  }
+  uint64_t size = decodeU64(payload);
+  uint64_t id = decodeU64(payload.substr(sizeof(uint64_t)));
+
+  BundleExtractor extractor;
+  uint64_t resumePos = extractor.open(pattern, id, size);
+  if (resumePos == 0) {
+    std::cout << "Downloading bundle " << pattern << ": " << size << " bytes"
+              << std::endl;
+    if (!sendFrame(sock, FRAME_SEND_DATA, 0, 0)) return false;
+  } else {
+    std::cout << "Resuming bundle " << pattern << " from byte: " << resumePos
+              << std::endl;
+    if (!sendFrame(sock, FRAME_SEND_DATA, FLAG_RESUME, resumePos))
+      return false;
+  }
+
+  std::atomic<uint64_t>* received = progress.addFile(pattern, size, resumePos);
+  std::vector<char> buffer(MAX_DATA_PAYLOAD), scratch;
+  bool endOfDataReceived = false;
+  while (recvFrameHeader(sock, header)) {
+    if (header.type == FRAME_END_OF_DATA) {
+      endOfDataReceived = true;
+      break;
+    }
+    if (header.type != FRAME_DATA) break;
+    int64_t length = recvDataPayload(sock, header, buffer.data(), scratch);
+    if (length < 0 || !extractor.write(header.offset, buffer.data(), length))
+      break;
+    received->fetch_add(length, std::memory_order_relaxed);
+  }
+  progress.clear();
+  return endOfDataReceived && extractor.finish();
+}
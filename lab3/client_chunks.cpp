@@ -0,0 +1,235 @@
+/**
+ * @file client_chunks.cpp
+ * @brief Загрузка файла из кусков, которые уже есть у клиента (см. cas.h).
+ *
+ * Клиент делит на куски свои файлы из конфигурации и запоминает, где лежит
+ * каждый кусок. Для файла, которого нет локально, сервер присылает список
+ * его кусков; новая версия собирается во временном файле "<имя>.chunks":
+ * известные куски копируются из локальных файлов средствами ядра
+ * (copy_file_range), куски, повторяющиеся внутри файла, загружаются один раз,
+ * остальное загружается запросами диапазонов. Собранный файл проверяется по
+ * манифесту сервера, и его куски тоже попадают в индекс, поэтому следующий
+ * файл может взять их из только что загруженного.
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cas.h"
+#include "client.h"
+#include "delta.h"
+#include "protocol.h"
+
+/**
+ * @brief Добавляет в индекс куски локального файла.
+ *
+ * @param path Путь к файлу.
+ * @param index Индекс кусков.
+ */
+
+static void indexFile(const std::string& path, ChunkIndex& index) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0) return;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    uint64_t offset = 0;
+    casSplitFile(fd, st.st_size,
+                 [&](const unsigned char* data, size_t length) {
+                   ChunkSource source;
+                   source.path = path;
+                   source.offset = offset;
+                   index.insert({casHash(data, length), source});
+                   offset += length;
+                   return true;
+                 });
+  }
+  close(fd);
+}
+
+/**
+ * @brief Заполняет индекс кусками локальных копий файлов из конфигурации.
+ *
+ * Файлы, загрузка которых прервалась, не индексируются: их содержимое ещё
+ * может измениться.
+ *
+ * @param config Конфигурация клиента.
+ * @param session Сессия.
+ * @param index Индекс кусков.
+ */
+
+void indexLocalFiles(const ClientConfig& config, const ClientSession& session,
+                     ChunkIndex& index) {
+  for (const auto& file : config.files) {
+    if (!session.partial.count(file)) indexFile(file, index);
+  }
+  std::cout << "Indexed " << index.size() << " local chunks" << std::endl;
+}
+
+/**
+ * @brief Принимает кадры FRAME_CHUNKS.
+ *
+ * @param sock Сокет.
+ * @param fileSize Размер файла на сервере.
+ * @param chunks Куски файла по порядку.
+ * @return false при разрыве соединения или нарушении протокола.
+ */
+
+static bool receiveChunkList(int sock, uint64_t fileSize,
+                             std::vector<CasChunk>& chunks) {
+  std::vector<char> buffer(MAX_DATA_PAYLOAD);
+  FrameHeader header;
+  uint64_t total = 0;
+  do {
+    if (!recvFrameHeader(sock, header) || header.type != FRAME_CHUNKS ||
+        header.length > MAX_DATA_PAYLOAD ||
+        header.length % CAS_ENTRY_SIZE != 0 ||
+        header.offset != chunks.size() ||
+        !readFull(sock, buffer.data(), header.length))
+      return false;
+    for (size_t pos = 0; pos < header.length; pos += CAS_ENTRY_SIZE) {
+      uint64_t hash[2];
+      uint32_t length;
+      memcpy(hash, buffer.data() + pos, sizeof(hash));
+      memcpy(&length, buffer.data() + pos + sizeof(hash), sizeof(length));
+      CasChunk chunk;
+      chunk.hash.low = be64toh(hash[0]);
+      chunk.hash.high = be64toh(hash[1]);
+      chunk.length = be32toh(length);
+      if (chunk.length == 0 || chunk.length > CAS_MAX_CHUNK ||
+          chunk.length > fileSize - total)
+        return false;
+      total += chunk.length;
+      chunks.push_back(chunk);
+    }
+  } while (!(header.flags & FLAG_LAST));
+  // Сервер не смог разделить файл - загружается весь файл
+  if (total != fileSize) chunks.clear();
+  return true;
+}
+
+/**
+ * @brief Дописывает участок к списку диапазонов, объединяя соседние.
+ */
+
+static void addRange(std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                     uint64_t pos, uint64_t length) {
+  if (!ranges.empty() && ranges.back().first + ranges.back().second == pos)
+    ranges.back().second += length;
+  else
+    ranges.push_back({pos, length});
+}
+
+/**
+ * @brief Загружает файл, которого нет локально, беря известные куски из
+ * локальных файлов.
+ *
+ * Вызывается после FRAME_FILE_STATUS, вместо FRAME_SEND_DATA.
+ *
+ * @param sock Сокет.
+ * @param filePath Путь к файлу (совпадает с именем на сервере).
+ * @param fileSize Размер файла на сервере.
+ * @param index Индекс кусков локальных файлов; дополняется кусками
+ * загруженного файла.
+ * @return false при разрыве соединения или ошибке записи.
+ */
+
+bool downloadChunked(int sock, const std::string& filePath, uint64_t fileSize,
+                     ChunkIndex& index) {
+  std::vector<uint32_t> manifest;
+  std::vector<CasChunk> chunks;
+  if (!fetchManifest(sock, fileSize, manifest) ||
+      !sendFrame(sock, FRAME_CHUNKS_REQUEST, 0, 0) ||
+      !receiveChunkList(sock, fileSize, chunks))
+    return false;
+
+  std::string tempPath = filePath + ".chunks";
+  int to = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (to < 0 || ftruncate(to, fileSize) != 0) {
+    perror(("Failed to create " + tempPath).c_str());
+    if (to >= 0) close(to);
+    return false;
+  }
+  std::map<std::string, int> sources;  // Открытые локальные файлы
+  std::map<CasHash, uint64_t> first;   // Первое место куска в этом файле
+  std::vector<DeltaCopy> repeats;      // Копируются после загрузки
+  std::vector<std::pair<uint64_t, uint64_t>> missing;
+  uint64_t pos = 0, reused = 0;
+  for (const auto& chunk : chunks) {
+    auto it = index.find(chunk.hash);
+    bool copied = false;
+    if (it != index.end()) {
+      auto source = sources.find(it->second.path);
+      if (source == sources.end())
+        source = sources
+                     .insert({it->second.path,
+                              open(it->second.path.c_str(), O_RDONLY)})
+                     .first;
+      // Файл мог измениться после индексации - тогда кусок загружается
+      copied = source->second >= 0 &&
+               copyRange(source->second, to, it->second.offset, pos,
+                         chunk.length);
+    }
+    auto earlier = first.find(chunk.hash);
+    if (copied) {
+      reused += chunk.length;
+    } else if (earlier != first.end()) {
+      repeats.push_back({pos, earlier->second, chunk.length});
+      reused += chunk.length;
+    } else {
+      addRange(missing, pos, chunk.length);
+    }
+    first.insert({chunk.hash, pos});
+    pos += chunk.length;
+  }
+  if (chunks.empty() && fileSize > 0) missing.push_back({0, fileSize});
+  for (const auto& source : sources) {
+    if (source.second >= 0) close(source.second);
+  }
+  close(to);
+  std::cout << "Chunks: " << chunks.size() << " chunks, " << reused
+            << " bytes found locally, " << fileSize - reused
+            << " bytes to download" << std::endl;
+
+  if (!repairRanges(sock, filePath, missing, tempPath)) return false;
+  if (!repeats.empty()) {
+    int fd = open(tempPath.c_str(), O_RDWR);
+    bool ok = fd >= 0;
+    for (size_t i = 0; ok && i < repeats.size(); i++)
+      ok = copyRange(fd, fd, repeats[i].source, repeats[i].target,
+                     repeats[i].length);
+    if (fd >= 0) close(fd);
+    if (!ok) {
+      perror(("Failed to build " + tempPath).c_str());
+      return false;
+    }
+  }
+  // Совпадение хэшей - не гарантия совпадения данных
+  if (!manifest.empty()) {
+    std::vector<std::pair<uint64_t, uint64_t>> damaged =
+        findDamagedRanges(tempPath, manifest, fileSize, {{0, fileSize}});
+    if (!repairRanges(sock, filePath, damaged, tempPath)) return false;
+  }
+  if (rename(tempPath.c_str(), filePath.c_str()) != 0) {
+    perror("rename failed");
+    return false;
+  }
+  pos = 0;
+  for (const auto& chunk : chunks) {
+    ChunkSource source;
+    source.path = filePath;
+    source.offset = pos;
+    index.insert({chunk.hash, source});
+    pos += chunk.length;
+  }
+  std::cout << "All data received for this file." << std::endl;
+  return true;
+}
@@ -0,0 +1,224 @@
+/**
+ * @file client_delta.cpp
+ * @brief Обновление прежней версии файла по дельте (см. delta.h).
+ *
+ * Клиент отправляет подписи блоков своей копии и получает от сервера
+ * участки новой версии, которые в копии уже есть. Новая версия собирается
+ * во временном файле "<имя>.delta": найденные участки копируются из
+ * прежней версии средствами ядра (copy_file_range), остальное загружается
+ * запросами диапазонов. Собранный файл проверяется по манифесту сервера и
+ * заменяет прежнюю версию.
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "checksum.h"
+#include "client.h"
+#include "delta.h"
+#include "protocol.h"
+
+/// Сколько байт локальной копии читается за раз при подсчёте подписей.
+const size_t DELTA_READ_SIZE = 8 << 20;
+
+/**
+ * @brief Считает подписи блоков локальной копии и отправляет их серверу.
+ *
+ * @param sock Сокет.
+ * @param fd Локальная копия.
+ * @param block Длина блока.
+ * @param blocks Количество блоков.
+ * @return false при ошибке чтения или разрыве соединения.
+ */
+
+static bool sendSignatures(int sock, int fd, uint64_t block,
+                           uint64_t blocks) {
+  const size_t per_frame = MAX_CONTROL_PAYLOAD / DELTA_SIGNATURE_SIZE;
+  std::vector<char> buffer(DELTA_READ_SIZE / block * block);
+  std::string payload;
+  uint64_t index = 0;
+  while (index < blocks) {
+    size_t count = std::min<uint64_t>(buffer.size() / block, blocks - index);
+    size_t length = count * block;
+    size_t done = 0;
+    while (done < length) {
+      ssize_t n = pread(fd, buffer.data() + done, length - done,
+                        index * block + done);
+      if (n <= 0) return false;
+      done += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      const char* data = buffer.data() + i * block;
+      uint32_t a = 0, b = 0;
+      rollingSums(data, block, a, b);
+      uint32_t be[2] = {htobe32(rollingDigest(a, b)),
+                        htobe32(crc32c(data, block))};
+      payload.append(reinterpret_cast<const char*>(be), sizeof(be));
+      index++;
+      if (payload.size() / DELTA_SIGNATURE_SIZE == per_frame &&
+          index < blocks) {
+        if (!sendFrame(sock, FRAME_DELTA_REQUEST, 0, block, payload))
+          return false;
+        payload.clear();
+      }
+    }
+  }
+  return sendFrame(sock, FRAME_DELTA_REQUEST, FLAG_LAST, block, payload);
+}
+
+/**
+ * @brief Принимает кадры FRAME_DELTA.
+ *
+ * @param sock Сокет.
+ * @param localSize Размер локальной копии.
+ * @param fileSize Размер файла на сервере.
+ * @param copies Участки новой версии в порядке позиций.
+ * @return false при разрыве соединения или нарушении протокола.
+ */
+
+static bool receiveDelta(int sock, uint64_t localSize, uint64_t fileSize,
+                         std::vector<DeltaCopy>& copies) {
+  std::vector<char> buffer(MAX_DATA_PAYLOAD);
+  FrameHeader header;
+  uint64_t end = 0;  // Участки идут по возрастанию и не пересекаются
+  do {
+    if (!recvFrameHeader(sock, header) || header.type != FRAME_DELTA ||
+        header.length > MAX_DATA_PAYLOAD ||
+        header.length % DELTA_COPY_SIZE != 0 ||
+        !readFull(sock, buffer.data(), header.length))
+      return false;
+    for (size_t pos = 0; pos < header.length; pos += DELTA_COPY_SIZE) {
+      uint64_t be[3];
+      memcpy(be, buffer.data() + pos, sizeof(be));
+      DeltaCopy copy = {be64toh(be[0]), be64toh(be[1]), be64toh(be[2])};
+      if (copy.target < end || copy.length > fileSize - copy.target ||
+          copy.source > localSize || copy.length > localSize - copy.source)
+        return false;
+      end = copy.target + copy.length;
+      copies.push_back(copy);
+    }
+  } while (!(header.flags & FLAG_LAST));
+  return true;
+}
+
+/**
+ * @brief Копирует участок между файлами, по возможности без копирования в
+ * пространство пользователя.
+ */
+
+bool copyRange(int from, int to, uint64_t source, uint64_t target,
+               uint64_t length) {
+  loff_t in = source, out = target;
+  while (length > 0) {
+    ssize_t n = copy_file_range(from, &in, to, &out, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    length -= n;
+  }
+  // Ядро не умеет копировать между этими файлами - копируем через буфер
+  std::vector<char> buffer(std::min<uint64_t>(length, MAX_DATA_PAYLOAD));
+  while (length > 0) {
+    ssize_t n = pread(from, buffer.data(),
+                      std::min<uint64_t>(length, buffer.size()), in);
+    if (n <= 0 || pwrite(to, buffer.data(), n, out) != n) return false;
+    in += n;
+    out += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Собирает новую версию файла из участков прежней.
+ *
+ * @param filePath Прежняя версия.
+ * @param tempPath Новая версия.
+ * @param fileSize Размер новой версии.
+ * @param copies Участки прежней версии.
+ * @return false при ошибке ввода-вывода.
+ */
+
+static bool buildFromCopies(const std::string& filePath,
+                            const std::string& tempPath, uint64_t fileSize,
+                            const std::vector<DeltaCopy>& copies) {
+  int from = open(filePath.c_str(), O_RDONLY);
+  int to = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = from >= 0 && to >= 0 && ftruncate(to, fileSize) == 0;
+  for (size_t i = 0; ok && i < copies.size(); i++) {
+    ok = copyRange(from, to, copies[i].source, copies[i].target,
+                   copies[i].length);
+  }
+  if (!ok) perror(("Failed to build " + tempPath).c_str());
+  if (from >= 0) close(from);
+  if (to >= 0) close(to);
+  return ok;
+}
+
+/**
+ * @brief Обновляет прежнюю версию файла, загружая только отличия.
+ *
+ * Вызывается после FRAME_FILE_STATUS (и, возможно, манифеста), вместо
+ * FRAME_SEND_DATA.
+ *
+ * @param sock Сокет.
+ * @param filePath Путь к локальной копии (совпадает с именем на сервере).
+ * @param localSize Размер локальной копии.
+ * @param fileSize Размер файла на сервере.
+ * @param manifest Манифест файла на сервере или пустой вектор.
+ * @return false при разрыве соединения или ошибке записи.
+ */
+
+bool downloadDelta(int sock, const std::string& filePath, uint64_t localSize,
+                   uint64_t fileSize, const std::vector<uint32_t>& manifest) {
+  uint64_t block = deltaBlockSize(localSize);
+  uint64_t blocks = std::min(localSize / block, DELTA_MAX_BLOCKS);
+  int fd = open(filePath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open file: " << filePath << std::endl;
+    return false;
+  }
+  std::cout << "Sending " << blocks << " signatures of " << block
+            << "-byte blocks for " << filePath << std::endl;
+  bool sent = sendSignatures(sock, fd, block, blocks);
+  close(fd);
+  std::vector<DeltaCopy> copies;
+  if (!sent || !receiveDelta(sock, localSize, fileSize, copies)) return false;
+
+  // Всё, что не нашлось в прежней версии, загружается диапазонами
+  std::vector<std::pair<uint64_t, uint64_t>> missing;
+  uint64_t pos = 0, reused = 0;
+  for (const auto& copy : copies) {
+    if (copy.target > pos) missing.push_back({pos, copy.target - pos});
+    pos = copy.target + copy.length;
+    reused += copy.length;
+  }
+  if (pos < fileSize) missing.push_back({pos, fileSize - pos});
+  std::cout << "Delta: " << reused << " bytes reused, "
+            << fileSize - reused << " bytes to download" << std::endl;
+
+  std::string tempPath = filePath + ".delta";
+  if (!buildFromCopies(filePath, tempPath, fileSize, copies) ||
+      !repairRanges(sock, filePath, missing, tempPath))
+    return false;
+  // Совпадение подписей - не гарантия совпадения данных
+  if (!manifest.empty()) {
+    std::vector<std::pair<uint64_t, uint64_t>> damaged =
+        findDamagedRanges(tempPath, manifest, fileSize, {{0, fileSize}});
+    if (!repairRanges(sock, filePath, damaged, tempPath)) return false;
+  }
+  if (rename(tempPath.c_str(), filePath.c_str()) != 0) {
+    perror("rename failed");
+    return false;
+  }
+  std::cout << "All data received for this file." << std::endl;
+  return true;
+}
@@ -0,0 +1,397 @@
+/**
+ * @file client_parallel.cpp
+ * @brief Параллельная загрузка файлов диапазонами по нескольким подключениям.
+ *
+ * Каждый поток держит своё подключение к серверу и берёт задания из общей
+ * очереди. Первое задание для файла узнаёт его размер, выделяет место под
+ * выходной файл и делит недостающую часть на диапазоны; остальные потоки
+ * запрашивают диапазоны кадром FRAME_SEND_DATA с флагом FLAG_RANGE и
+ * записывают их в файл через pwrite. Завершённые диапазоны записываются в
+ * файл "<имя>.part", чтобы прерванную загрузку можно было продолжить. При
+ * продолжении загруженные диапазоны проверяются по манифесту сервера, и
+ * повреждённые блоки загружаются заново.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+#include "codec.h"
+#include "protocol.h"
+
+/// Минимальный размер диапазона, на который делится файл.
+const uint64_t MIN_SEGMENT_SIZE = 4 << 20;
+
+/**
+ * @struct Range
+ * @brief Диапазон байт файла, загружаемый одним запросом.
+ */
+struct Range {
+  std::string file;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+/**
+ * @struct ParallelFile
+ * @brief Состояние загружаемого файла.
+ */
+struct ParallelFile {
+  int fd = -1;
+  uint64_t size = 0;
+  int pending = 0;  ///< Количество ещё не загруженных диапазонов.
+  std::ofstream part;
+  std::atomic<uint64_t>* received = nullptr;  ///< Счётчик для прогресса.
+};
+
+/**
+ * @class ParallelDownload
+ * @brief Очередь заданий и пул потоков параллельной загрузки.
+ */
+class ParallelDownload {
+ public:
+  ParallelDownload(ClientConfig& config, ProgressReporter& progress)
+      : config_(config), progress_(progress) {
+    files_.assign(config.files.begin(), config.files.end());
+  }
+
+  bool run();
+
+ private:
+  void worker();
+  bool planFile(int sock, const std::string& name, Range& first);
+  bool fetchRange(int sock, Range& range, std::vector<char>& buffer,
+                  bool requested);
+  void completeRange(const Range& range);
+
+  ClientConfig& config_;
+  ProgressReporter& progress_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> files_;  ///< Файлы, для которых не составлен план.
+  std::deque<Range> ranges_;       ///< Диапазоны, ожидающие загрузки.
+  std::map<std::string, ParallelFile> state_;
+  int planning_ = 0;  ///< Сколько файлов сейчас делится на диапазоны.
+};
+
+/**
+ * @brief Загружает файлы из конфигурации по нескольким подключениям.
+ *
+ * @param config Конфигурация клиента.
+ * @param progress Отображение прогресса.
+ * @return true, если все найденные на сервере файлы загружены полностью.
+ */
+
+bool downloadParallel(ClientConfig& config, ProgressReporter& progress) {
+  ParallelDownload download(config, progress);
+  return download.run();
+}
+
+/**
+ * @brief Запускает потоки загрузки и ждёт их завершения.
+ */
+
+bool ParallelDownload::run() {
+  std::cout << "Parallel download with " << config_.streams << " streams"
+            << std::endl;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < config_.streams; i++) {
+    threads.emplace_back(&ParallelDownload::worker, this);
+  }
+  for (auto& thread : threads) thread.join();
+
+  bool complete = ranges_.empty() && files_.empty();
+  for (auto& entry : state_) {
+    if (entry.second.pending > 0) complete = false;
+    if (entry.second.fd >= 0) close(entry.second.fd);
+  }
+  return complete;
+}
+
+/**
+ * @brief Цикл потока: берёт задания из очереди, пока они не закончатся.
+ */
+
+void ParallelDownload::worker() {
+  std::vector<char> buffer(MAX_DATA_PAYLOAD);
+  int sock = -1;
+  int reconnects = 0;
+
+  while (1) {
+    std::string file;
+    Range range;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() {
+        return !ranges_.empty() || !files_.empty() || planning_ == 0;
+      });
+      if (!ranges_.empty()) {
+        range = ranges_.front();
+        ranges_.pop_front();
+      } else if (!files_.empty()) {
+        file = files_.front();
+        files_.pop_front();
+        planning_++;
+      } else {
+        break;
+      }
+    }
+
+    if (sock < 0) {
+      sock = connectToServer(config_);
+      if (sock >= 0 &&
+          !sendFrame(sock, FRAME_HELLO, 0, parseCodecs(config_.compression),
+                     std::to_string(config_.id))) {
+        close(sock);
+        sock = -1;
+      }
+    }
+
+    bool ok = sock >= 0;
+    if (!file.empty()) {
+      ok = ok && planFile(sock, file, range);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!ok) files_.push_back(file);  // Составим план заново
+      planning_--;
+      cv_.notify_all();
+    }
+    if (ok && !range.file.empty()) {
+      Range requested = range;
+      // После составления плана сервер уже ждёт FRAME_SEND_DATA
+      ok = fetchRange(sock, range, buffer, !file.empty());
+      if (ok) {
+        completeRange(requested);
+      } else {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ranges_.push_back(range);  // Недополученный остаток диапазона
+        cv_.notify_all();
+      }
+    }
+
+    if (!ok) {
+      if (sock >= 0) close(sock);
+      sock = -1;
+      if (++reconnects > MAX_RECONNECTS) break;
+    }
+  }
+  if (sock >= 0) close(sock);
+}
+
+/**
+ * @brief Узнаёт размер файла и делит недостающую часть на диапазоны.
+ *
+ * Первый диапазон возвращается вызывающему потоку, остальные ставятся в
+ * очередь. Если файл уже загружен полностью, запрашивается пустой диапазон,
+ * чтобы завершить обмен по текущему запросу.
+ *
+ * @param sock Сокет.
+ * @param name Имя файла.
+ * @param first Диапазон, который загрузит вызывающий поток.
+ * @return false при разрыве соединения.
+ */
+
+bool ParallelDownload::planFile(int sock, const std::string& name,
+                                Range& first) {
+  FrameHeader header;
+  std::string payload;
+  if (!sendFrame(sock, FRAME_FILE_REQUEST, 0, 0, name) ||
+      !recvFrame(sock, header, payload) || header.type != FRAME_FILE_STATUS)
+    return false;
+  if (!(header.flags & FLAG_FOUND)) {
+    std::cout << "File " << name << " not found on server" << std::endl;
+    return true;
+  }
+  uint64_t size = decodeU64(payload);
+
+  // Уже загруженные диапазоны: из файла .part либо непрерывный префикс
+  std::string part_path = name + ".part";
+  std::vector<std::pair<uint64_t, uint64_t>> done;
+  std::ifstream part_in(part_path);
+  if (part_in) {
+    uint64_t offset, length;
+    while (part_in >> offset >> length) done.push_back({offset, length});
+  } else {
+    struct stat st;
+    if (stat(name.c_str(), &st) == 0 && (uint64_t)st.st_size <= size)
+      done.push_back({0, (uint64_t)st.st_size});
+  }
+  part_in.close();
+  std::sort(done.begin(), done.end());
+
+  if (!done.empty()) {
+    std::vector<uint32_t> manifest;
+    if (!fetchManifest(sock, size, manifest)) return false;
+    std::vector<std::pair<uint64_t, uint64_t>> damaged;
+    if (!manifest.empty())
+      damaged = findDamagedRanges(name, manifest, size, done);
+    // Повреждённые блоки исключаем из загруженных диапазонов
+    std::vector<std::pair<uint64_t, uint64_t>> valid;
+    for (const auto& range : done) {
+      uint64_t pos = range.first;
+      uint64_t end = range.first + range.second;
+      for (const auto& bad : damaged) {
+        if (bad.first + bad.second <= pos || bad.first >= end) continue;
+        if (bad.first > pos) valid.push_back({pos, bad.first - pos});
+        pos = std::max(pos, bad.first + bad.second);
+      }
+      if (pos < end) valid.push_back({pos, end - pos});
+    }
+    done.swap(valid);
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> gaps;
+  uint64_t pos = 0;
+  for (const auto& range : done) {
+    if (range.first > pos) gaps.push_back({pos, range.first - pos});
+    pos = std::max(pos, range.first + range.second);
+  }
+  if (pos < size) gaps.push_back({pos, size - pos});
+
+  uint64_t missing = 0;
+  for (const auto& gap : gaps) missing += gap.second;
+  progress_.clear();
+  std::cout << "File " << name << ": " << size << " bytes, " << missing
+            << " bytes missing" << std::endl;
+
+  first = Range();
+  if (missing == 0) {
+    remove(part_path.c_str());
+    // Пустой диапазон: сервер сразу ответит FRAME_END_OF_DATA
+    return sendFrame(sock, FRAME_SEND_DATA, FLAG_RANGE, size, encodeU64(0)) &&
+           recvFrameHeader(sock, header) && header.type == FRAME_END_OF_DATA;
+  }
+
+  int fd = open(name.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to open file: " << name << std::endl;
+    return sendFrame(sock, FRAME_SEND_DATA, FLAG_RANGE, size, encodeU64(0)) &&
+           recvFrameHeader(sock, header) && header.type == FRAME_END_OF_DATA;
+  }
+
+  std::vector<Range> segments;
+  uint64_t segment =
+      std::max(MIN_SEGMENT_SIZE,
+               (missing + config_.streams - 1) / config_.streams);
+  for (const auto& gap : gaps) {
+    for (uint64_t offset = gap.first; offset < gap.first + gap.second;
+         offset += segment) {
+      Range range;
+      range.file = name;
+      range.offset = offset;
+      range.length = std::min(segment, gap.first + gap.second - offset);
+      segments.push_back(range);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ParallelFile& file = state_[name];
+    file.fd = fd;
+    file.size = size;
+    file.pending = segments.size();
+    file.received = progress_.addFile(name, size, size - missing);
+    file.part.open(part_path, std::ios::app);
+    for (const auto& range : done) {
+      file.part << range.first << " " << range.second << std::endl;
+    }
+    // Выделяем место под весь файл заранее
+    if (ftruncate(fd, size) < 0 || posix_fallocate(fd, 0, size) != 0) {
+      std::cerr << "Failed to preallocate file: " << name << std::endl;
+    }
+    ranges_.insert(ranges_.end(), segments.begin() + 1, segments.end());
+  }
+  first = segments.front();
+  return true;
+}
+
+/**
+ * @brief Загружает диапазон по текущему подключению.
+ *
+ * При разрыве соединения range сокращается до недополученного остатка.
+ *
+ * @param sock Сокет.
+ * @param range Диапазон.
+ * @param buffer Буфер для полезной нагрузки кадров.
+ * @param requested Файл уже запрошен по этому подключению и получен его
+ * статус.
+ * @return false при разрыве соединения.
+ */
+
+bool ParallelDownload::fetchRange(int sock, Range& range,
+                                  std::vector<char>& buffer, bool requested) {
+  int fd;
+  std::atomic<uint64_t>* received;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fd = state_[range.file].fd;
+    received = state_[range.file].received;
+  }
+
+  FrameHeader header;
+  std::string payload;
+  // Запрос на каждый диапазон проходит обычный обмен: имя файла -> статус
+  if (!requested &&
+      (!sendFrame(sock, FRAME_FILE_REQUEST, 0, 0, range.file) ||
+       !recvFrame(sock, header, payload) || header.type != FRAME_FILE_STATUS ||
+       !(header.flags & FLAG_FOUND)))
+    return false;
+  if (!sendFrame(sock, FRAME_SEND_DATA, FLAG_RANGE, range.offset,
+                 encodeU64(range.length)))
+    return false;
+
+  uint64_t end = range.offset + range.length;
+  std::vector<char> scratch;
+  while (recvFrameHeader(sock, header)) {
+    if (header.type == FRAME_END_OF_DATA) return range.length == 0;
+    if (header.type != FRAME_DATA || header.offset != range.offset)
+      return false;
+    int64_t length = recvDataPayload(sock, header, buffer.data(), scratch);
+    if (length < 0 || header.offset + length > end) return false;
+    if (pwrite(fd, buffer.data(), length, header.offset) != length) {
+      std::cerr << "Failed to write file: " << range.file << std::endl;
+      return false;
+    }
+    range.offset += length;
+    range.length -= length;
+    received->fetch_add(length, std::memory_order_relaxed);
+  }
+  return false;
+}
+
+/**
+ * @brief Отмечает диапазон загруженным и закрывает файл после последнего.
+ *
+ * @param range Загруженный диапазон.
+ */
+
+void ParallelDownload::completeRange(const Range& range) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ParallelFile& file = state_[range.file];
+  file.part << range.offset << " " << range.length << std::endl;
+  file.pending--;
+  progress_.clear();
+  if (file.pending > 0) {
+    std::cout << "File " << range.file << ": " << file.pending
+              << " ranges left" << std::endl;
+    return;
+  }
+  fsync(file.fd);
+  close(file.fd);
+  file.fd = -1;
+  file.part.close();
+  remove((range.file + ".part").c_str());
+  std::cout << "All data received for " << range.file << std::endl;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file client_session.cpp
+ * @brief Сессия клиента на сервере.
+ *
+ * Маркер сессии, выданный сервером, сохраняется в файл ".session-<id>" и
+ * используется при переподключении после разрыва и при следующем запуске:
+ * FRAME_HELLO с маркером и запросы файлов уходят одной пачкой, а ответ
+ * FRAME_SESSION читается перед ответом на первый запрос. Если сервер не знает
+ * маркер (сессия устарела или сервер перезапущен), подключение повторяется с
+ * идентификатором клиента.
+ */
+
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "client.h"
+#include "codec.h"
+#include "protocol.h"
+
+/**
+ * @brief Путь к файлу с маркером сессии.
+ */
+
+static std::string sessionPath(const ClientConfig& config) {
+  return ".session-" + std::to_string(config.id);
+}
+
+/**
+ * @brief Читает маркер сессии, сохранённый прошлым запуском.
+ *
+ * @param config Конфигурация клиента.
+ * @param session Сессия.
+ */
+
+void loadSession(const ClientConfig& config, ClientSession& session) {
+  if (!config.session) return;
+  std::ifstream file(sessionPath(config));
+  if (!(file >> session.token)) session.token = 0;
+}
+
+/**
+ * @brief Представляется серверу кадром FRAME_HELLO.
+ *
+ * Ответ на FRAME_HELLO не ждётся: сервер разбирает кадры по порядку, поэтому
+ * запросы файлов можно отправлять сразу за ним, а ответ FRAME_SESSION
+ * прочитать перед первым ответом на запрос (receiveSession()).
+ *
+ * @param sock Дескриптор сокета.
+ * @param config Конфигурация клиента.
+ * @param session Сессия: с маркером продолжается, без него заводится новая.
+ * @return false при разрыве соединения.
+ */
+
+bool getAndProcessFileSize(int sock, ClientConfig& config,
+                           ClientSession& session) {
+  uint16_t codecs = parseCodecs(config.compression);
+  session.pending = config.session;
+  session.resuming = config.session && session.token != 0;
+  if (!config.session)
+    return sendFrame(sock, FRAME_HELLO, 0, codecs, std::to_string(config.id));
+  if (session.resuming)
+    return sendFrame(sock, FRAME_HELLO, FLAG_SESSION | FLAG_RESUME, codecs,
+                     encodeU64(session.token));
+  return sendFrame(sock, FRAME_HELLO, FLAG_SESSION, codecs,
+                   std::to_string(config.id));
+}
+
+/**
+ * @brief Читает ответ FRAME_SESSION, если он ещё не прочитан, и сохраняет
+ * маркер сессии.
+ *
+ * @param sock Дескриптор сокета.
+ * @param config Конфигурация клиента.
+ * @param session Сессия.
+ * @return false при разрыве соединения или если сервер не продолжил сессию.
+ */
+
+bool receiveSession(int sock, const ClientConfig& config,
+                    ClientSession& session) {
+  if (!session.pending) return true;
+  FrameHeader header;
+  std::string payload;
+  if (!recvFrame(sock, header, payload) || header.type != FRAME_SESSION)
+    return false;
+  session.pending = false;
+  if (session.resuming && !(header.flags & FLAG_RESUME)) {
+    std::cout << "Session expired on server" << std::endl;
+    session.token = 0;
+    unlink(sessionPath(config).c_str());
+    return false;
+  }
+  if (session.resuming) {
+    std::cout << "Session resumed" << std::endl;
+    return true;
+  }
+  session.token = header.offset;
+  if (session.token == 0) return true;  // Сервер не выдаёт сессии
+  std::ofstream file(sessionPath(config), std::ios::trunc);
+  file << session.token << std::endl;
+  if (!file) std::cerr << "Failed to save " << sessionPath(config) << std::endl;
+  return true;
+}
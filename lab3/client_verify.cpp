@@ -0,0 +1,166 @@
+/**
+ * @file client_verify.cpp
+ * @brief Проверка частично загруженного файла по манифесту сервера.
+ *
+ * Перед догрузкой клиент запрашивает у сервера CRC32C блоков файла
+ * (FRAME_MANIFEST_REQUEST), считает те же суммы для уже загруженных блоков
+ * локальной копии и загружает заново только блоки, суммы которых не совпали.
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "checksum.h"
+#include "client.h"
+#include "codec.h"
+#include "protocol.h"
+
+/**
+ * @brief Запрашивает манифест файла и принимает его.
+ *
+ * Вызывается после FRAME_FILE_STATUS, до FRAME_SEND_DATA.
+ *
+ * @param sock Сокет.
+ * @param fileSize Размер файла на сервере.
+ * @param manifest Контрольные суммы блоков; пуст, если сервер не смог
+ * посчитать манифест.
+ * @return false при разрыве соединения или нарушении протокола.
+ */
+
+bool fetchManifest(int sock, uint64_t fileSize,
+                   std::vector<uint32_t>& manifest) {
+  manifest.clear();
+  if (!sendFrame(sock, FRAME_MANIFEST_REQUEST, 0, 0)) return false;
+
+  uint64_t blocks = hashBlockCount(fileSize);
+  std::vector<uint32_t> received(blocks);
+  uint64_t count = 0;
+  std::vector<uint32_t> buffer(MAX_DATA_PAYLOAD / sizeof(uint32_t));
+  FrameHeader header;
+  do {
+    if (!recvFrameHeader(sock, header) || header.type != FRAME_MANIFEST ||
+        header.length > MAX_DATA_PAYLOAD ||
+        header.length % sizeof(uint32_t) != 0 ||
+        !readFull(sock, buffer.data(), header.length))
+      return false;
+    uint64_t entries = header.length / sizeof(uint32_t);
+    if (header.offset + entries > blocks) return false;
+    for (uint64_t i = 0; i < entries; i++)
+      received[header.offset + i] = be32toh(buffer[i]);
+    count += entries;
+  } while (!(header.flags & FLAG_LAST));
+
+  if (count == blocks) manifest.swap(received);
+  return true;
+}
+
+/**
+ * @brief Находит повреждённые блоки локальной копии файла.
+ *
+ * Проверяются только блоки, целиком лежащие внутри уже загруженных
+ * диапазонов; соседние повреждённые блоки объединяются в один диапазон.
+ *
+ * @param filePath Путь к локальной копии.
+ * @param manifest Контрольные суммы блоков файла на сервере.
+ * @param fileSize Размер файла на сервере.
+ * @param done Загруженные диапазоны (смещение, длина).
+ * @return Диапазоны (смещение, длина), которые нужно загрузить заново.
+ */
+
+std::vector<std::pair<uint64_t, uint64_t>> findDamagedRanges(
+    const std::string& filePath, const std::vector<uint32_t>& manifest,
+    uint64_t fileSize,
+    const std::vector<std::pair<uint64_t, uint64_t>>& done) {
+  std::vector<std::pair<uint64_t, uint64_t>> damaged;
+  int fd = open(filePath.c_str(), O_RDONLY);
+  if (fd < 0) return damaged;
+
+  std::vector<char> buffer(HASH_BLOCK_SIZE);
+  uint64_t checked = 0;
+  for (const auto& range : done) {
+    uint64_t end = std::min(range.first + range.second, fileSize);
+    uint64_t first = (range.first + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE;
+    for (uint64_t i = first; i < manifest.size(); i++) {
+      uint64_t offset = i * HASH_BLOCK_SIZE;
+      uint64_t length = std::min(HASH_BLOCK_SIZE, fileSize - offset);
+      if (offset + length > end) break;
+      checked++;
+      bool valid =
+          pread(fd, buffer.data(), length, offset) == (ssize_t)length &&
+          crc32c(buffer.data(), length) == manifest[i];
+      if (valid) continue;
+      if (!damaged.empty() &&
+          damaged.back().first + damaged.back().second == offset)
+        damaged.back().second += length;
+      else
+        damaged.push_back({offset, length});
+    }
+  }
+  close(fd);
+
+  uint64_t bad = 0;
+  for (const auto& range : damaged) bad += range.second;
+  std::cout << "Verified " << checked << " blocks of " << filePath << ", "
+            << bad << " bytes damaged" << std::endl;
+  return damaged;
+}
+
+/**
+ * @brief Загружает заново диапазоны файла.
+ *
+ * Для каждого диапазона выполняется обычный обмен: FRAME_FILE_REQUEST ->
+ * FRAME_FILE_STATUS -> FRAME_SEND_DATA с флагом FLAG_RANGE. Данные
+ * записываются поверх локальной копии, её длина не меняется.
+ *
+ * @param sock Сокет.
+ * @param filePath Путь к локальной копии (совпадает с именем на сервере).
+ * @param ranges Диапазоны (смещение, длина).
+ * @param localPath Файл, в который записываются данные, если это не
+ * filePath.
+ * @return false при разрыве соединения или ошибке записи.
+ */
+
+bool repairRanges(int sock, const std::string& filePath,
+                  const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                  const std::string& localPath) {
+  if (ranges.empty()) return true;
+  const std::string& path = localPath.empty() ? filePath : localPath;
+  int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open file: " << path << std::endl;
+    return false;
+  }
+
+  std::vector<char> buffer(MAX_DATA_PAYLOAD), scratch;
+  bool ok = true;
+  for (const auto& range : ranges) {
+    std::cout << "Repairing " << filePath << ": " << range.second
+              << " bytes at " << range.first << std::endl;
+    FrameHeader header;
+    std::string payload;
+    ok = sendFrame(sock, FRAME_FILE_REQUEST, 0, 0, filePath) &&
+         recvFrame(sock, header, payload) &&
+         header.type == FRAME_FILE_STATUS && (header.flags & FLAG_FOUND) &&
+         sendFrame(sock, FRAME_SEND_DATA, FLAG_RANGE, range.first,
+                   encodeU64(range.second));
+    uint64_t end = range.first + range.second;
+    while (ok && (ok = recvFrameHeader(sock, header))) {
+      if (header.type == FRAME_END_OF_DATA) break;
+      int64_t length = -1;
+      if (header.type == FRAME_DATA && header.offset >= range.first)
+        length = recvDataPayload(sock, header, buffer.data(), scratch);
+      ok = length >= 0 && header.offset + length <= end &&
+           pwrite(fd, buffer.data(), length, header.offset) == length;
+    }
+    if (!ok) break;
+  }
+  close(fd);
+  return ok;
+}
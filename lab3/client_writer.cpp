@@ -0,0 +1,254 @@
+/**
+ * @file client_writer.cpp
+ * @brief Конвейерная запись принятых данных на диск.
+ *
+ * Поток приёма читает полезную нагрузку кадров прямо в буферы кольца
+ * (WRITE_RING_BUFFERS буферов по WRITE_BUFFER_SIZE байт, выровненных по
+ * странице), а отдельный поток записи сбрасывает заполненные буферы в файл.
+ * Подряд идущие кадры собираются в один буфер, поэтому размер записи не
+ * зависит от размера кадра. В режиме O_DIRECT выровненная часть буфера
+ * пишется мимо page cache, а неполный хвост - обычной записью.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "client.h"
+#include "protocol.h"
+
+/// Размер одного буфера кольца.
+const size_t WRITE_BUFFER_SIZE = 1 << 20;
+/// Количество буферов в кольце.
+const int WRITE_RING_BUFFERS = 8;
+
+/**
+ * @brief Записывает буфер в файл целиком.
+ *
+ * @return false при ошибке записи.
+ */
+
+static bool pwriteFull(int fd, const char* data, size_t size,
+                       uint64_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+DiskWriter::~DiskWriter() {
+  finish();
+  for (auto& buffer : buffers_) free(buffer.data);
+}
+
+/**
+ * @brief Открывает файл и запускает поток записи.
+ *
+ * @param path Путь к файлу.
+ * @param startPos Позиция, с которой начнётся запись.
+ * @param fileSize Ожидаемый размер файла.
+ * @param direct Писать выровненные блоки с O_DIRECT и заранее выделить
+ * место под файл.
+ * @return false, если файл не удалось открыть.
+ */
+
+bool DiskWriter::open(const std::string& path, uint64_t startPos,
+                      uint64_t fileSize, bool direct) {
+  path_ = path;
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd_ < 0) {
+    std::cerr << "Failed to open file: " << path << std::endl;
+    return false;
+  }
+  // Отбрасываем всё, что лежит за позицией догрузки
+  if (ftruncate(fd_, startPos) < 0) {
+    std::cerr << "Failed to truncate file: " << path << std::endl;
+    return false;
+  }
+  if (direct) {
+    // Место выделяется без изменения длины файла, чтобы прерванная
+    // загрузка не выглядела завершённой
+    if (fileSize > startPos &&
+        fallocate(fd_, FALLOC_FL_KEEP_SIZE, startPos, fileSize - startPos) < 0)
+      perror("fallocate failed");
+    direct_fd_ = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+    if (direct_fd_ < 0) perror("O_DIRECT is not supported, using page cache");
+  }
+
+  for (int i = 0; i < WRITE_RING_BUFFERS; i++) {
+    Buffer buffer;
+    if (posix_memalign(reinterpret_cast<void**>(&buffer.data),
+                       DIRECT_IO_ALIGNMENT, WRITE_BUFFER_SIZE) != 0)
+      return false;
+    buffers_.push_back(buffer);
+    free_.push_back(i);
+  }
+  thread_ = std::thread(&DiskWriter::run, this);
+  return true;
+}
+
+/**
+ * @brief Возвращает место в кольце для данных с указанного смещения.
+ *
+ * Ждёт свободный буфер, если поток записи отстаёт от сети.
+ *
+ * @param offset Смещение данных в файле.
+ * @param length Сколько байт нужно записать; уменьшается до размера места,
+ * оставшегося в буфере.
+ * @return Указатель на место в буфере или nullptr после ошибки записи.
+ */
+
+char* DiskWriter::reserve(uint64_t offset, size_t& length) {
+  if (current_ >= 0) {
+    Buffer& buffer = buffers_[current_];
+    if (buffer.offset + buffer.used != offset) submit();
+  }
+  if (current_ < 0) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_cv_.wait(lock, [this]() { return !free_.empty() || failed_; });
+    if (failed_) return nullptr;
+    current_ = free_.front();
+    free_.pop_front();
+    buffers_[current_].offset = offset;
+    buffers_[current_].used = 0;
+  }
+  Buffer& buffer = buffers_[current_];
+  length = std::min(length, WRITE_BUFFER_SIZE - buffer.used);
+  return buffer.data + buffer.used;
+}
+
+/**
+ * @brief Читает полезную нагрузку кадра FRAME_DATA из сокета в кольцо.
+ *
+ * @param sock Сокет.
+ * @param offset Смещение данных в файле.
+ * @param length Длина полезной нагрузки.
+ * @return false при разрыве соединения или ошибке записи.
+ */
+
+bool DiskWriter::append(int sock, uint64_t offset, uint32_t length) {
+  while (length > 0) {
+    size_t n = length;
+    char* space = reserve(offset, n);
+    if (space == nullptr || !readFull(sock, space, n)) return false;
+    buffers_[current_].used += n;
+    if (buffers_[current_].used == WRITE_BUFFER_SIZE) submit();
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Копирует в кольцо данные, уже находящиеся в памяти (например,
+ * распакованный кадр).
+ *
+ * @param data Данные.
+ * @param offset Смещение данных в файле.
+ * @param length Длина данных.
+ * @return false после ошибки записи.
+ */
+
+bool DiskWriter::append(const char* data, uint64_t offset, size_t length) {
+  while (length > 0) {
+    size_t n = length;
+    char* space = reserve(offset, n);
+    if (space == nullptr) return false;
+    memcpy(space, data, n);
+    buffers_[current_].used += n;
+    if (buffers_[current_].used == WRITE_BUFFER_SIZE) submit();
+    data += n;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Передаёт текущий буфер потоку записи.
+ */
+
+void DiskWriter::submit() {
+  if (current_ < 0) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  full_.push_back(current_);
+  current_ = -1;
+  full_cv_.notify_one();
+}
+
+/**
+ * @brief Дописывает оставшиеся буферы, останавливает поток записи и
+ * закрывает файл.
+ *
+ * @return false, если какую-либо запись выполнить не удалось.
+ */
+
+bool DiskWriter::finish() {
+  if (thread_.joinable()) {
+    submit();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      full_cv_.notify_one();
+    }
+    thread_.join();
+  }
+  if (direct_fd_ >= 0) close(direct_fd_);
+  if (fd_ >= 0) close(fd_);
+  direct_fd_ = -1;
+  fd_ = -1;
+  return !failed_;
+}
+
+/**
+ * @brief Цикл потока записи.
+ */
+
+void DiskWriter::run() {
+  while (1) {
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      full_cv_.wait(lock, [this]() { return !full_.empty() || stopping_; });
+      if (full_.empty()) return;
+      index = full_.front();
+      full_.pop_front();
+    }
+    bool ok = failed_ || write(buffers_[index]);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok && !failed_) {
+      std::cerr << "Failed to write file: " << path_ << std::endl;
+      failed_ = true;
+    }
+    free_.push_back(index);
+    free_cv_.notify_one();
+  }
+}
+
+/**
+ * @brief Записывает буфер в файл.
+ *
+ * @param buffer Заполненный буфер.
+ * @return false при ошибке записи.
+ */
+
+bool DiskWriter::write(const Buffer& buffer) {
+  size_t aligned = 0;
+  if (direct_fd_ >= 0 && buffer.offset % DIRECT_IO_ALIGNMENT == 0)
+    aligned = buffer.used - buffer.used % DIRECT_IO_ALIGNMENT;
+  if (aligned > 0 &&
+      !pwriteFull(direct_fd_, buffer.data, aligned, buffer.offset))
+    return false;
+  return pwriteFull(fd_, buffer.data + aligned, buffer.used - aligned,
+                    buffer.offset + aligned);
+}
@@ -0,0 +1,182 @@
+/**
+ * @file codec.h
+ * @brief Сжатие полезной нагрузки кадров FRAME_DATA, общее для клиента и
+ * сервера.
+ *
+ * Клиент сообщает маску кодеков, которые умеет распаковывать, в поле offset
+ * кадра FRAME_HELLO. Сервер сжимает кусок файла, только если это заметно
+ * уменьшает его, и помечает такой кадр флагом кодека. Нагрузка сжатого
+ * кадра - исходная длина куска (4 байта в сетевом порядке) и сжатые данные.
+ * Поле offset, как и у обычного кадра, - позиция куска в исходном файле,
+ * поэтому догрузка и диапазоны работают с несжатыми смещениями.
+ *
+ * zlib доступен всегда; zstd - если при сборке найден его заголовок
+ * (Makefile тогда же добавляет -lzstd).
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <endian.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define CODEC_HAVE_ZSTD 1
+#endif
+
+#include "protocol.h"
+
+/// Длина заголовка сжатой нагрузки (исходная длина куска).
+const size_t CODEC_PREFIX_SIZE = 4;
+
+/**
+ * @brief Маска кодеков, поддерживаемых этой сборкой.
+ */
+
+inline uint16_t supportedCodecs() {
+  uint16_t codecs = FLAG_DEFLATE;
+#ifdef CODEC_HAVE_ZSTD
+  codecs |= FLAG_ZSTD;
+#endif
+  return codecs;
+}
+
+/**
+ * @brief Разбирает параметр конфигурации "compression".
+ *
+ * @param value "auto" (все поддерживаемые кодеки), "none", "deflate" или
+ * "zstd".
+ * @return Маска кодеков.
+ */
+
+inline uint16_t parseCodecs(const std::string& value) {
+  if (value == "auto") return supportedCodecs();
+  if (value == "deflate") return FLAG_DEFLATE;
+  if (value == "zstd") return supportedCodecs() & FLAG_ZSTD;
+  return 0;
+}
+
+/**
+ * @brief Выбирает кодек: zstd быстрее zlib, поэтому предпочтительнее.
+ *
+ * @param codecs Маска кодеков, доступных обеим сторонам.
+ * @return Флаг кодека или 0.
+ */
+
+inline uint16_t chooseCodec(uint16_t codecs) {
+  if (codecs & FLAG_ZSTD) return FLAG_ZSTD;
+  if (codecs & FLAG_DEFLATE) return FLAG_DEFLATE;
+  return 0;
+}
+
+inline const char* codecName(uint16_t codec) {
+  if (codec == FLAG_ZSTD) return "zstd";
+  return codec == FLAG_DEFLATE ? "deflate" : "none";
+}
+
+/**
+ * @brief Сжимает кусок файла в нагрузку кадра FRAME_DATA.
+ *
+ * @param codec Флаг кодека.
+ * @param data Данные куска.
+ * @param size Длина куска.
+ * @param out Нагрузка: исходная длина и сжатые данные.
+ * @return false при ошибке кодека.
+ */
+
+inline bool compressPayload(uint16_t codec, const char* data, size_t size,
+                            std::string& out) {
+  uint32_t raw = htobe32(size);
+  size_t bound = size + size / 8 + 128;
+#ifdef CODEC_HAVE_ZSTD
+  if (codec == FLAG_ZSTD) bound = ZSTD_compressBound(size);
+#endif
+  if (codec == FLAG_DEFLATE) bound = compressBound(size);
+  out.resize(CODEC_PREFIX_SIZE + bound);
+  memcpy(&out[0], &raw, sizeof(raw));
+  char* dst = &out[CODEC_PREFIX_SIZE];
+  size_t written = 0;
+#ifdef CODEC_HAVE_ZSTD
+  if (codec == FLAG_ZSTD) {
+    written = ZSTD_compress(dst, bound, data, size, 1);
+    if (ZSTD_isError(written)) return false;
+  }
+#endif
+  if (codec == FLAG_DEFLATE) {
+    uLongf length = bound;
+    if (compress2(reinterpret_cast<Bytef*>(dst), &length,
+                  reinterpret_cast<const Bytef*>(data), size,
+                  Z_BEST_SPEED) != Z_OK)
+      return false;
+    written = length;
+  }
+  if (written == 0 && size > 0) return false;
+  out.resize(CODEC_PREFIX_SIZE + written);
+  return true;
+}
+
+/**
+ * @brief Распаковывает нагрузку сжатого кадра FRAME_DATA.
+ *
+ * @param codec Флаг кодека.
+ * @param data Нагрузка кадра.
+ * @param size Длина нагрузки.
+ * @param out Буфер не меньше MAX_DATA_PAYLOAD байт.
+ * @return Длина куска или -1 при повреждённых данных.
+ */
+
+inline int64_t decompressPayload(uint16_t codec, const char* data, size_t size,
+                                 char* out) {
+  uint32_t raw;
+  if (size < CODEC_PREFIX_SIZE) return -1;
+  memcpy(&raw, data, sizeof(raw));
+  raw = be32toh(raw);
+  if (raw > MAX_DATA_PAYLOAD) return -1;
+  data += CODEC_PREFIX_SIZE;
+  size -= CODEC_PREFIX_SIZE;
+#ifdef CODEC_HAVE_ZSTD
+  if (codec == FLAG_ZSTD) {
+    size_t length = ZSTD_decompress(out, raw, data, size);
+    return ZSTD_isError(length) || length != raw ? -1 : (int64_t)raw;
+  }
+#endif
+  if (codec == FLAG_DEFLATE) {
+    uLongf length = raw;
+    if (uncompress(reinterpret_cast<Bytef*>(out), &length,
+                   reinterpret_cast<const Bytef*>(data), size) != Z_OK ||
+        length != raw)
+      return -1;
+    return raw;
+  }
+  return -1;
+}
+
+/**
+ * @brief Читает нагрузку кадра FRAME_DATA, распаковывая сжатую.
+ *
+ * @param sock Сокет.
+ * @param header Заголовок кадра.
+ * @param out Буфер не меньше MAX_DATA_PAYLOAD байт.
+ * @param scratch Буфер для сжатой нагрузки.
+ * @return Длина данных куска или -1 при разрыве соединения или повреждённых
+ * данных.
+ */
+
+inline int64_t recvDataPayload(int sock, const FrameHeader& header, char* out,
+                               std::vector<char>& scratch) {
+  if (header.length > MAX_DATA_PAYLOAD) return -1;
+  uint16_t codec = header.flags & FLAG_COMPRESSED;
+  if (codec == 0)
+    return readFull(sock, out, header.length) ? (int64_t)header.length : -1;
+  scratch.resize(header.length);
+  if (!readFull(sock, scratch.data(), header.length)) return -1;
+  return decompressPayload(codec, scratch.data(), header.length, out);
+}
+
+#endif  // CODEC_H
@@ -0,0 +1,168 @@
+/**
+ * @file delta.h
+ * @brief Дельта-передача изменившихся файлов: определения, общие для клиента
+ * и сервера.
+ *
+ * Если у клиента есть прежняя версия файла, он делит её на блоки и отправляет
+ * серверу подписи блоков: слабую скользящую сумму (как в rsync) и CRC32C.
+ * Сервер проходит новую версию окном длины блока, сдвигая слабую сумму на
+ * байт за O(1), и для окон, у которых совпали обе суммы, сообщает, из какого
+ * места локальной копии клиент может взять эти данные. Остальное клиент
+ * загружает обычными запросами диапазонов, а собранный файл проверяет по
+ * манифесту.
+ *
+ * Подписи передаются кадрами FRAME_DELTA_REQUEST: offset - длина блока,
+ * нагрузка - по DELTA_SIGNATURE_SIZE байт на блок (слабая сумма и CRC32C по
+ * 4 байта в сетевом порядке), последний кадр отмечен FLAG_LAST. Ответ -
+ * кадры FRAME_DELTA с записями по DELTA_COPY_SIZE байт (позиция в новой
+ * версии, позиция в локальной копии, длина - по 8 байт в сетевом порядке),
+ * последний кадр тоже отмечен FLAG_LAST.
+ *
+ * Подписи блоков считаются векторно (SSSE3), если процессор это позволяет.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define DELTA_HAVE_SSSE3 1
+#endif
+
+/// Границы длины блока подписи.
+const uint64_t DELTA_MIN_BLOCK = 2 << 10;
+const uint64_t DELTA_MAX_BLOCK = 128 << 10;
+/// Длина подписи одного блока.
+const size_t DELTA_SIGNATURE_SIZE = 8;
+/// Длина записи о совпавшем участке в кадре FRAME_DELTA.
+const size_t DELTA_COPY_SIZE = 24;
+/// Максимальное количество подписей в одном запросе.
+const uint64_t DELTA_MAX_BLOCKS = 1 << 22;
+
+/**
+ * @struct DeltaCopy
+ * @brief Участок новой версии файла, который есть в локальной копии клиента.
+ */
+struct DeltaCopy {
+  uint64_t target;  ///< Позиция в новой версии.
+  uint64_t source;  ///< Позиция в локальной копии.
+  uint64_t length;
+};
+
+/**
+ * @brief Выбирает длину блока подписи: порядка квадратного корня из размера
+ * файла, как в rsync, с округлением до килобайта.
+ *
+ * @param file_size Размер локальной копии.
+ */
+
+inline uint64_t deltaBlockSize(uint64_t file_size) {
+  uint64_t block = (uint64_t)std::sqrt((double)file_size);
+  block = (block + 1023) / 1024 * 1024;
+  if (block < DELTA_MIN_BLOCK) return DELTA_MIN_BLOCK;
+  return block > DELTA_MAX_BLOCK ? DELTA_MAX_BLOCK : block;
+}
+
+/**
+ * @brief Слабая сумма блока из её составляющих.
+ *
+ * a - сумма байт блока, b - сумма байт с весами от длины блока до 1; обе
+ * считаются по модулю 2^32, в сумму входят младшие 16 бит каждой.
+ */
+
+inline uint32_t rollingDigest(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * @brief Сдвигает окно на один байт.
+ *
+ * @param a, b Составляющие слабой суммы окна.
+ * @param length Длина окна.
+ * @param out Байт, покидающий окно.
+ * @param in Байт, входящий в окно.
+ */
+
+inline void rollingShift(uint32_t& a, uint32_t& b, uint32_t length,
+                         unsigned char out, unsigned char in) {
+  a += in - out;
+  b += a - length * out;
+}
+
+/**
+ * @brief Составляющие слабой суммы блока, побайтовый счёт.
+ */
+
+inline void rollingSumsSoftware(const unsigned char* data, size_t size,
+                                uint32_t& a, uint32_t& b) {
+  for (size_t i = 0; i < size; i++) {
+    a += data[i];
+    b += a;
+  }
+}
+
+#ifdef DELTA_HAVE_SSSE3
+/**
+ * @brief Составляющие слабой суммы блока на инструкциях SSSE3.
+ *
+ * За шаг обрабатываются 16 байт: psadbw даёт их сумму, pmaddubsw и pmaddwd -
+ * сумму с весами 16..1. Вклад предыдущих байт в b (16 * a на каждом шаге)
+ * накапливается отдельно и учитывается в конце.
+ */
+
+__attribute__((target("ssse3"))) inline void rollingSumsSsse3(
+    const unsigned char* data, size_t size, uint32_t& a, uint32_t& b) {
+  const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+                                        6, 5, 4, 3, 2, 1);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = _mm_setzero_si128();       // a
+  __m128i prefix = _mm_setzero_si128();    // Сумма a перед каждым шагом
+  __m128i weighted = _mm_setzero_si128();  // Взвешенные суммы шагов
+  size_t blocks = size / 16;
+  for (size_t i = 0; i < blocks; i++) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 16));
+    prefix = _mm_add_epi32(prefix, sum);
+    sum = _mm_add_epi32(sum, _mm_sad_epu8(bytes, zero));
+    weighted = _mm_add_epi32(
+        weighted, _mm_madd_epi16(_mm_maddubs_epi16(bytes, weights), ones));
+  }
+  uint32_t lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+  uint32_t block_a = lanes[0] + lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), prefix);
+  uint32_t block_b = (lanes[0] + lanes[2]) * 16;
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), weighted);
+  block_b += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  // Блок дописывается к уже посчитанным a и b
+  b += a * (uint32_t)(blocks * 16) + block_b;
+  a += block_a;
+  rollingSumsSoftware(data + blocks * 16, size - blocks * 16, a, b);
+}
+#endif
+
+/**
+ * @brief Считает составляющие слабой суммы блока.
+ *
+ * @param data Данные.
+ * @param size Размер данных.
+ * @param a, b Составляющие суммы, к которым дописывается блок (для нового
+ * блока - нули).
+ */
+
+inline void rollingSums(const void* data, size_t size, uint32_t& a,
+                        uint32_t& b) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#ifdef DELTA_HAVE_SSSE3
+  static const bool vector = __builtin_cpu_supports("ssse3");
+  if (vector) return rollingSumsSsse3(bytes, size, a, b);
+#endif
+  rollingSumsSoftware(bytes, size, a, b);
+}
+
+#endif  // DELTA_H
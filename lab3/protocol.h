@@ -0,0 +1,310 @@
+/**
+ * @file protocol.h
+ * @brief Двоичный формат кадров прикладного протокола, общий для клиента и
+ * сервера.
+ *
+ * Каждое сообщение состоит из заголовка фиксированной длины и полезной
+ * нагрузки длиной FrameHeader::length байт. Все поля заголовка передаются в
+ * сетевом порядке байт:
+ *
+ * | Поле    | Размер | Описание                                   |
+ * |---------|--------|--------------------------------------------|
+ * | version | 1      | Версия протокола (PROTOCOL_VERSION)        |
+ * | type    | 1      | Тип кадра (FrameType)                      |
+ * | flags   | 2      | Флаги (FrameFlags)                         |
+ * | length  | 4      | Длина полезной нагрузки                    |
+ * | offset  | 8      | Смещение в файле или числовой аргумент     |
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+const uint8_t PROTOCOL_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 16;
+/// Максимальная длина полезной нагрузки управляющего кадра.
+const uint32_t MAX_CONTROL_PAYLOAD = 4096;
+/// Максимальная длина полезной нагрузки кадра с данными файла.
+const uint32_t MAX_DATA_PAYLOAD = 1 << 20;
+
+/**
+ * @enum FrameType
+ * @brief Типы кадров.
+ */
+enum FrameType : uint8_t {
+  FRAME_HELLO = 1,             ///< Клиент -> сервер: идентификатор клиента
+                               ///< или маркер сессии (FLAG_RESUME), offset -
+                               ///< маска поддерживаемых кодеков
+                               ///< (FLAG_DEFLATE | FLAG_ZSTD).
+  FRAME_FILE_REQUEST = 2,      ///< Клиент -> сервер: имя файла.
+  FRAME_FILE_STATUS = 3,       ///< Сервер -> клиент: наличие файла, offset -
+                               ///< сохранённый прогресс, нагрузка - размер,
+                               ///< идентификатор архива в ответ на
+                               ///< FLAG_BUNDLE (см. bundle.h) и имя файла в
+                               ///< ответ на FLAG_STREAM.
+  FRAME_SEND_DATA = 4,         ///< Клиент -> сервер: начать передачу с offset.
+  FRAME_DATA = 5,              ///< Сервер -> клиент: данные с позиции offset.
+  FRAME_END_OF_DATA = 6,       ///< Сервер -> клиент: передача завершена.
+  FRAME_MANIFEST_REQUEST = 7,  ///< Клиент -> сервер: запрос контрольных сумм
+                               ///< блоков файла (перед FRAME_SEND_DATA).
+  FRAME_MANIFEST = 8,          ///< Сервер -> клиент: CRC32C блоков, начиная с
+                               ///< блока offset, по 4 байта в сетевом порядке.
+  FRAME_DELTA_REQUEST = 9,     ///< Клиент -> сервер: подписи блоков длиной
+                               ///< offset локальной копии (см. delta.h).
+  FRAME_DELTA = 10,            ///< Сервер -> клиент: участки локальной копии,
+                               ///< из которых собирается новая версия файла.
+  FRAME_SESSION = 11,          ///< Сервер -> клиент: ответ на FRAME_HELLO с
+                               ///< FLAG_SESSION, offset - маркер сессии
+                               ///< (0 - сессии нет или она устарела).
+  FRAME_CHUNKS_REQUEST = 12,   ///< Клиент -> сервер: запрос списка кусков
+                               ///< файла (перед FRAME_SEND_DATA).
+  FRAME_CHUNKS = 13            ///< Сервер -> клиент: хэши и длины кусков
+                               ///< файла, начиная с куска offset (см. cas.h).
+};
+
+/**
+ * @enum FrameFlags
+ * @brief Флаги кадров.
+ */
+enum FrameFlags : uint16_t {
+  FLAG_FOUND = 1 << 0,    ///< FRAME_FILE_STATUS: файл есть на сервере.
+  FLAG_RESUME = 1 << 1,   ///< FRAME_SEND_DATA: догрузка с позиции offset.
+                          ///< FRAME_HELLO: продолжение сессии, маркер -
+                          ///< в нагрузке (8 байт). FRAME_SESSION: сессия
+                          ///< продолжена.
+  FLAG_RANGE = 1 << 2,    ///< FRAME_SEND_DATA: передать диапазон с позиции
+                          ///< offset, длина диапазона - в нагрузке (8 байт).
+  FLAG_LAST = 1 << 3,     ///< FRAME_MANIFEST, FRAME_DELTA_REQUEST,
+                          ///< FRAME_DELTA, FRAME_CHUNKS: последний кадр
+                          ///< последовательности.
+  FLAG_DEFLATE = 1 << 4,  ///< FRAME_DATA: нагрузка сжата zlib (codec.h).
+  FLAG_ZSTD = 1 << 5,     ///< FRAME_DATA: нагрузка сжата zstd (codec.h).
+  FLAG_STREAM = 1 << 6,   ///< FRAME_FILE_REQUEST: передать файл с позиции
+                          ///< offset сразу за FRAME_FILE_STATUS, не
+                          ///< дожидаясь FRAME_SEND_DATA.
+  FLAG_BUNDLE = 1 << 7,   ///< FRAME_FILE_REQUEST: нагрузка - шаблон имён,
+                          ///< файлы передаются одним архивом (bundle.h).
+  FLAG_SESSION = 1 << 8   ///< FRAME_HELLO: клиенту нужен маркер сессии,
+                          ///< сервер отвечает FRAME_SESSION первым кадром.
+};
+
+/// Флаги FRAME_DATA, означающие сжатую нагрузку.
+const uint16_t FLAG_COMPRESSED = FLAG_DEFLATE | FLAG_ZSTD;
+
+/**
+ * @struct FrameHeader
+ * @brief Заголовок кадра.
+ */
+struct FrameHeader {
+  uint8_t version = PROTOCOL_VERSION;
+  uint8_t type = 0;
+  uint16_t flags = 0;
+  uint32_t length = 0;
+  uint64_t offset = 0;
+};
+
+/**
+ * @brief Кодирует заголовок кадра в сетевой порядок байт.
+ *
+ * @param header Заголовок.
+ * @param out Буфер длиной FRAME_HEADER_SIZE.
+ */
+
+inline void encodeFrameHeader(const FrameHeader& header, unsigned char* out) {
+  uint16_t flags = htobe16(header.flags);
+  uint32_t length = htobe32(header.length);
+  uint64_t offset = htobe64(header.offset);
+  out[0] = header.version;
+  out[1] = header.type;
+  memcpy(out + 2, &flags, sizeof(flags));
+  memcpy(out + 4, &length, sizeof(length));
+  memcpy(out + 8, &offset, sizeof(offset));
+}
+
+/**
+ * @brief Декодирует заголовок кадра.
+ *
+ * @param in Буфер длиной FRAME_HEADER_SIZE.
+ * @param header Заголовок.
+ * @return false, если версия протокола не поддерживается.
+ */
+
+inline bool decodeFrameHeader(const unsigned char* in, FrameHeader& header) {
+  uint16_t flags;
+  uint32_t length;
+  uint64_t offset;
+  memcpy(&flags, in + 2, sizeof(flags));
+  memcpy(&length, in + 4, sizeof(length));
+  memcpy(&offset, in + 8, sizeof(offset));
+  header.version = in[0];
+  header.type = in[1];
+  header.flags = be16toh(flags);
+  header.length = be32toh(length);
+  header.offset = be64toh(offset);
+  return header.version == PROTOCOL_VERSION;
+}
+
+/**
+ * @brief Читает из сокета ровно size байт.
+ *
+ * @return false при разрыве соединения или ошибке.
+ */
+
+inline bool readFull(int sock, void* buffer, size_t size) {
+  char* data = static_cast<char*>(buffer);
+  while (size > 0) {
+    ssize_t n = recv(sock, data, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Записывает в сокет ровно size байт.
+ *
+ * @return false при разрыве соединения или ошибке.
+ */
+
+inline bool writeFull(int sock, const void* buffer, size_t size) {
+  const char* data = static_cast<const char*>(buffer);
+  while (size > 0) {
+    ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Отправляет кадр (заголовок и полезную нагрузку одним вызовом).
+ *
+ * @return false при разрыве соединения или ошибке.
+ */
+
+inline bool sendFrame(int sock, uint8_t type, uint16_t flags, uint64_t offset,
+                      const void* payload = nullptr, uint32_t length = 0) {
+  FrameHeader header;
+  header.type = type;
+  header.flags = flags;
+  header.length = length;
+  header.offset = offset;
+  unsigned char raw[FRAME_HEADER_SIZE];
+  encodeFrameHeader(header, raw);
+
+  struct iovec iov[2];
+  iov[0].iov_base = raw;
+  iov[0].iov_len = FRAME_HEADER_SIZE;
+  iov[1].iov_base = const_cast<void*>(payload);
+  iov[1].iov_len = length;
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = length > 0 ? 2 : 1;
+  ssize_t n;
+  do {
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) return false;
+  // Короткая запись: досылаем остаток
+  size_t total = FRAME_HEADER_SIZE + length;
+  if ((size_t)n < FRAME_HEADER_SIZE) {
+    if (!writeFull(sock, raw + n, FRAME_HEADER_SIZE - n)) return false;
+    n = FRAME_HEADER_SIZE;
+  }
+  if ((size_t)n < total) {
+    const char* data = static_cast<const char*>(payload);
+    return writeFull(sock, data + (n - FRAME_HEADER_SIZE), total - n);
+  }
+  return true;
+}
+
+/**
+ * @brief Формирует кадр в памяти для последующей отправки.
+ *
+ * @return Заголовок и полезная нагрузка одной строкой.
+ */
+
+inline std::string encodeFrame(uint8_t type, uint16_t flags, uint64_t offset,
+                               const std::string& payload = "",
+                               uint32_t length = 0) {
+  FrameHeader header;
+  header.type = type;
+  header.flags = flags;
+  header.length = payload.empty() ? length : payload.size();
+  header.offset = offset;
+  std::string frame(FRAME_HEADER_SIZE, '\0');
+  encodeFrameHeader(header, reinterpret_cast<unsigned char*>(&frame[0]));
+  return frame + payload;
+}
+
+/**
+ * @brief Отправляет управляющий кадр со строковой полезной нагрузкой.
+ */
+
+inline bool sendFrame(int sock, uint8_t type, uint16_t flags, uint64_t offset,
+                      const std::string& payload) {
+  return sendFrame(sock, type, flags, offset, payload.data(), payload.size());
+}
+
+/**
+ * @brief Читает заголовок кадра.
+ *
+ * @return false при разрыве соединения или неподдерживаемой версии.
+ */
+
+inline bool recvFrameHeader(int sock, FrameHeader& header) {
+  unsigned char raw[FRAME_HEADER_SIZE];
+  if (!readFull(sock, raw, FRAME_HEADER_SIZE)) return false;
+  return decodeFrameHeader(raw, header);
+}
+
+/**
+ * @brief Читает управляющий кадр целиком.
+ *
+ * @param sock Сокет.
+ * @param header Заголовок полученного кадра.
+ * @param payload Полезная нагрузка полученного кадра.
+ * @return false при разрыве соединения, неподдерживаемой версии или слишком
+ * длинной полезной нагрузке.
+ */
+
+inline bool recvFrame(int sock, FrameHeader& header, std::string& payload) {
+  if (!recvFrameHeader(sock, header)) return false;
+  if (header.length > MAX_CONTROL_PAYLOAD) return false;
+  payload.resize(header.length);
+  return header.length == 0 || readFull(sock, &payload[0], header.length);
+}
+
+/**
+ * @brief Кодирует 64-битное число для передачи в полезной нагрузке.
+ */
+
+inline std::string encodeU64(uint64_t value) {
+  uint64_t be = htobe64(value);
+  return std::string(reinterpret_cast<const char*>(&be), sizeof(be));
+}
+
+/**
+ * @brief Декодирует 64-битное число из полезной нагрузки.
+ */
+
+inline uint64_t decodeU64(const std::string& payload) {
+  uint64_t be = 0;
+  if (payload.size() >= sizeof(be)) memcpy(&be, payload.data(), sizeof(be));
+  return be64toh(be);
+}
+
+#endif  // PROTOCOL_H
@@ -4,47 +4,28 @@
  */
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <map>
 #include <sstream>
 #include <string>
 #include <vector>
 
-/**
- * @struct ServerConfig
- * @brief Структура для хранения конфигурации сервера.
- *
- * @var ServerConfig::server_address IP-адрес сервера.
- * @var ServerConfig::port Порт сервера.
- * @var ServerConfig::directory Директория для файлов клиента.
- */
-struct ServerConfig {
-  std::string server_address = "";
-  int port = 0;
-  int buffer_size = 0;
-  std::string directory = "";
-};
-
-ServerConfig readServerConfig(const std::string& filename);
-void checkDirectory(ServerConfig& config);
-std::fstream checkFileExistance(ServerConfig& config, int client_id,
-                                int new_socket);
-std::string checkFileStatus(std::fstream& progress_file, int new_socket,
-                            int client_id, ServerConfig& config);
-float readClientFile(std::fstream& file, const std::string& fileName);
-void sendFileData(ServerConfig& config, int client_id, int new_socket,
-                  const std::string& file_name, size_t startPos);
-void updateProgressFile(const std::string& progressFilePath,
-                        const std::string& fileName, size_t sentBytes);
+#include "protocol.h"
+#include "server.h"
 
 /**
  * @brief Главная функция сервера.
@@ -58,94 +39,109 @@ void updateProgressFile(const std::string& progressFilePath,
  */
 
 int main(int argc, char** argv) {
-  int server_fd, new_socket, valread;
+  int server_fd, new_socket;
   struct sockaddr_in address;
   int opt = 1;
   int addrlen = sizeof(address);
 
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <config_file>" << std::endl;
+  if (argc < 2 || (argc > 2 && std::string(argv[2]) != "--import")) {
+    std::cerr << "Usage: " << argv[0] << " <config_file> [--import]"
+              << std::endl;
     return -1;
   }
 
   ServerConfig config = readServerConfig(argv[1]);
-
-  std::cout << "Server Address: " << config.server_address << std::endl;
-  std::cout << "Port: " << config.port << std::endl;
-  std::cout << "Buffer: " << config.buffer_size << std::endl;
-  std::cout << "Directory: " << config.directory << std::endl;
+  setLogLevel(config.log_level);
+
+  logInfo() << "Server Address: " << config.server_address;
+  logInfo() << "Port: " << config.port;
+  logInfo() << "Buffer: " << config.buffer_size;
+  logInfo() << "Directory: " << config.directory;
+  logInfo() << "Transfer mode: " << config.transfer_mode;
+  logInfo() << "Engine: " << config.engine;
+  logInfo() << "Storage: " << config.storage;
+
+  // Перенос файлов в хранилище удаляет их из директории - только по запросу
+  if (argc > 2) {
+    if (config.storage != "cas") {
+      logError() << "--import requires storage: cas";
+      return -1;
+    }
+    if (!contentStore().open("server_files")) return -1;
+    contentStore().importFiles();
+    return 0;
+  }
 
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
     perror("socket failed");
     exit(EXIT_FAILURE);
   }
 
+  // Рабочие процессы модели "prefork" открывают свои сокеты на том же порту
+  if (config.engine == "prefork")
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = inet_addr(config.server_address.c_str());
   address.sin_port = htons(config.port);
 
   if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-    std::cerr << argv[0] << ": bind failed" << std::endl;
+    logError() << argv[0] << ": bind failed";
     return -1;
   }
 
-  if (listen(server_fd, 3) < 0) {
-    std::cerr << argv[0] << ": listen failed" << std::endl;
+  if (listen(server_fd, config.backlog) < 0) {
+    logError() << argv[0] << ": listen failed";
     return -1;
   }
 
+  // sendfile в сокет, разорванный клиентом, не принимает MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+  // Хранилище открывается до fork и до первого обращения к кэшу файлов
+  if (config.storage == "cas" && !contentStore().open("server_files"))
+    logWarn() << "Content store unavailable, serving plain files";
+  fileCache().open("server_files");
+  ioStats();  // Счётчики и корзины должны быть созданы до fork
+  fileActivityTable();
+  shapingState();
+  metricsState();
+  sessionTable();
+  startMetricsServer(config);
+  if (config.engine == "io_uring" && runUringServer(config, server_fd))
+    return 0;
+  if (config.engine == "epoll" || config.engine == "io_uring") {
+    runEpollServer(config, server_fd);
+    return 0;
+  }
+
+  // Дочерние процессы наследуют уже открытые файлы
+  fileCache().preload();
+  if (config.engine == "prefork") {
+    runPreforkServer(config, server_fd);
+    return -1;
+  }
   while (1) {
     if ((new_socket = accept(server_fd, (struct sockaddr*)&address,
                              (socklen_t*)&addrlen)) < 0) {
-      std::cerr << argv[0] << ": accept failed" << std::endl;
+      logError() << argv[0] << ": accept failed";
       return -1;
     }
+    int64_t accepted_us = monotonicUs();
+    metricAdd(METRIC_CONNECTIONS);
+    metricAdd(METRIC_ACTIVE_CONNECTIONS);
+    fileCache().processEvents();
 
     int pid = fork();
     if (pid < 0) {
-      std::cerr << argv[0] << ": fork failed" << std::endl;
+      logError() << argv[0] << ": fork failed";
       return -1;
     }
 
     // Дочерний процесс
     if (pid == 0) {
       close(server_fd);
-      char id_buffer[config.buffer_size];
-      memset(id_buffer, 0, config.buffer_size);
-      valread = read(new_socket, id_buffer, config.buffer_size);
-      std::string client_id_str(id_buffer, valread);
-      int client_id = std::stoi(client_id_str);
-      std::cout << "Client id: " << client_id << std::endl;
-      checkDirectory(config);
-      std::fstream file = checkFileExistance(config, client_id, new_socket);
-
-      while (1) {
-        std::string recieved_file =
-            checkFileStatus(file, new_socket, client_id, config);
-        if (!recieved_file.empty()) {
-          char readyBuffer[config.buffer_size] = {0};
-          int messageLength = read(new_socket, readyBuffer, config.buffer_size);
-          std::string clientMessage(readyBuffer, messageLength);
-          std::cout << clientMessage << std::endl;
-          if (clientMessage == "SENDING DATA") {
-            std::string clientMessage(readyBuffer, messageLength);
-            std::cout << "Client message: " << clientMessage << std::endl;
-            sendFileData(config, client_id, new_socket, recieved_file, 0);
-          } else if (clientMessage.substr(0, 15) == "RESUME DOWNLOAD") {
-            std::istringstream ss(clientMessage.substr(
-                16));  // Извлекаем оставшуюся часть сообщения
-            std::string filename;
-            size_t position;
-            ss >> filename >> position;
-            std::cout << "Resuming file transfer from: " << position
-                      << " for file: " << filename << std::endl;
-            //     sendFileData(config, client_id, new_socket, filename,
-            //                  position);  // Функция отправки данных с учетом
-            //                  позиции
-          }
-        }
-      }
-      close(new_socket);
+      fileCache().rewatch();
+      serveClient(config, new_socket, accepted_us);
       exit(0);
     } else {
       close(new_socket);
@@ -155,6 +151,93 @@ int main(int argc, char** argv) {
   return 0;
 }
 
+/**
+ * @brief Обслуживает подключение клиента в блокирующем режиме до разрыва
+ * соединения.
+ *
+ * @param config Конфигурация сервера.
+ * @param new_socket Сокет клиента; закрывается по окончании.
+ * @param accepted_us Время приёма подключения (monotonicUs()).
+ */
+
+void serveClient(ServerConfig& config, int new_socket, int64_t accepted_us) {
+  FrameHeader header;
+  std::string payload;
+  int client_id = 0;
+  uint16_t codecs = 0;  // Кодеки, которые знает клиент
+  std::shared_ptr<ProgressStore> progress;
+  if (recvFrame(new_socket, header, payload) && header.type == FRAME_HELLO) {
+    metricRecord(HISTOGRAM_HANDSHAKE, monotonicUs() - accepted_us);
+    std::string reply;
+    bool opened = openSession(config, header, payload, client_id, reply);
+    codecs = header.offset;
+    writeFull(new_socket, reply.data(), reply.size());
+    if (opened) {
+      logInfo() << "Client id: " << client_id;
+      // Директория создана ещё при открытии сессии
+      if (!(header.flags & FLAG_RESUME)) checkDirectory(config);
+      progress = checkFileExistance(config, client_id);
+    }
+  }
+
+  while (progress) {
+    bool connected = true;
+    FrameHeader request;
+    std::string recieved_file =
+        checkFileStatus(*progress, new_socket, connected, request);
+    if (!connected) break;
+    // Запросы с FLAG_STREAM клиент отправляет конвейером, не дожидаясь
+    // ответов, поэтому файл передаётся сразу
+    if (!recieved_file.empty() && (request.flags & FLAG_STREAM)) {
+      if (!sendFileData(config, *progress, new_socket, recieved_file,
+                        request.offset, SIZE_MAX, codecs, client_id))
+        break;
+      continue;
+    }
+    if (!recieved_file.empty()) {
+      if (!recvFrame(new_socket, header, payload)) break;
+      // Перед передачей клиент может запросить манифест для проверки
+      if (header.type == FRAME_MANIFEST_REQUEST) {
+        if (!sendManifest(new_socket, recieved_file) ||
+            !recvFrame(new_socket, header, payload))
+          break;
+      }
+      // Прежнюю версию файла клиент обновляет по дельте, а недостающие
+      // участки запрашивает диапазонами
+      if (header.type == FRAME_DELTA_REQUEST) {
+        if (!sendDelta(new_socket, recieved_file, header, payload)) break;
+        continue;
+      }
+      // Так же после списка кусков: клиент берёт известные ему куски из
+      // своих файлов
+      if (header.type == FRAME_CHUNKS_REQUEST) {
+        if (!sendChunkList(new_socket, recieved_file)) break;
+        continue;
+      }
+      if (header.type != FRAME_SEND_DATA) break;
+      size_t position = 0;
+      size_t length = SIZE_MAX;
+      if (header.flags & FLAG_RANGE) {
+        position = header.offset;
+        length = decodeU64(payload);
+        logDebug() << "Sending range " << position << "+" << length
+                   << " of file: " << recieved_file;
+      } else if (header.flags & FLAG_RESUME) {
+        position = header.offset;
+        logDebug() << "Resuming file transfer from: " << position
+                   << " for file: " << recieved_file;
+      } else {
+        logDebug() << "Client message: SENDING DATA";
+      }
+      if (!sendFileData(config, *progress, new_socket, recieved_file,
+                        position, length, codecs, client_id))
+        break;
+    }
+  }
+  close(new_socket);
+  metricAdd(METRIC_ACTIVE_CONNECTIONS, -1);
+}
+
 /**
  * @brief Проверяет и создает директорию, если она не существует.
  *
@@ -164,124 +247,114 @@ int main(int argc, char** argv) {
 void checkDirectory(ServerConfig& config) {
   struct stat st = {0};
   if (stat(config.directory.c_str(), &st) == -1) {
-    std::cout << "Directory does not exist. Creating: " << config.directory
-              << std::endl;
+    logInfo() << "Directory does not exist. Creating: " << config.directory;
     mkdir(config.directory.c_str(), 0700);
   }
 }
 
 /**
- * @brief Проверяет наличие файла клиента и создает его, если не существует.
+ * @brief Проверяет наличие файла прогресса клиента и создает его, если не
+ * существует.
  *
  * @param config Конфигурация сервера.
  * @param client_id Идентификатор клиента.
- * @param new_socket Дескриптор сокета нового клиента.
- * @return Открытый файловый поток.
+ * @return Открытое хранилище прогресса или nullptr при ошибке.
  */
 
-std::fstream checkFileExistance(ServerConfig& config, int client_id,
-                                int new_socket) {
-  std::string file_path =
-      config.directory + "/client_" + std::to_string(client_id) + ".txt";
-
-  std::cout << "file_path: " << file_path << std::endl;
-  std::fstream file(
-      file_path, std::fstream::in | std::fstream::out |
-                     std::fstream::app);  // Открытие файла для чтения и записи
-  if (file.good()) {
-    std::cout << "File " << file_path << " exists." << std::endl;
-  } else {
-    std::cout << "File " << file_path << " does not exist. Creating file..."
-              << std::endl;
-    file.open(file_path, std::fstream::out);
-    file << "Client ID: " << client_id << std::endl;
-    file.close();
-    file.open(file_path, std::fstream::in | std::fstream::out |
-                             std::fstream::app);  // Повторное открытие файла
-    if (file.good()) {
-      std::cout << "File created successfully." << std::endl;
-    } else {
-      std::cerr << "Failed to create file." << std::endl;
-    }
+std::shared_ptr<ProgressStore> checkFileExistance(ServerConfig& config,
+                                                  int client_id) {
+  std::string file_path = progressFilePath(config, client_id);
+  logDebug() << "file_path: " << file_path;
+  std::shared_ptr<ProgressStore> progress =
+      openProgressStore(config, client_id);
+  if (!progress) {
+    logError() << "Failed to open progress file: " << file_path;
   }
-  return file;
+  return progress;
 }
 
 /**
- * @brief Читает значение размера файла из файла прогресса.
+ * @brief Читает сохранённый прогресс передачи файла.
  *
- * @param file Открытый файловый поток для файла прогресса.
+ * @param progress Хранилище прогресса клиента.
  * @param fileName Имя файла, для которого необходимо прочитать прогресс.
- * @return Размер файла в байтах, если найден; -1, если запись отсутствует.
+ * @return Смещение в байтах, если найдено; -1, если запись отсутствует.
  */
 
-float readClientFile(std::fstream& file, const std::string& fileName) {
-  file.clear();  // Очистка флагов состояния
-  file.seekg(0, std::ios::beg);  // Перемещение указателя в начало файла
-  std::string line;
-  while (std::getline(file, line)) {
-    std::istringstream iss(line);
-    std::string key;
-    float value;
-    std::cout << fileName << std::endl;
-    std::getline(iss, key, ':');
-    std::cout << "key: " << key << " fileName: " << fileName << std::endl;
-    if (key == fileName) {
-      iss >> value;
-      std::cout << "key: " << key << " value: " << value << std::endl;
-      return value;  // Возвращаем значение, если нашли правильную строку
-    }
-  }
-  return -1;  // Возвращаем -1, если файл не найден
+int64_t readClientFile(ProgressStore& progress, const std::string& fileName) {
+  return progress.get(fileName);
 }
 
 /**
  * @brief Проверяет статус файла на сервере и обновляет файл прогресса клиента.
  *
- * @param file Открытый файловый поток для файла прогресса.
+ * @param progress Хранилище прогресса клиента.
  * @param new_socket Сокет для общения с клиентом.
- * @param client_id Идентификатор клиента.
- * @param config Конфигурация сервера.
+ * @param connected Сбрасывается в false при разрыве соединения.
+ * @param header Заголовок запроса FRAME_FILE_REQUEST.
  * @return Имя файла, полученное от клиента.
  */
 
-std::string checkFileStatus(std::fstream& file, int new_socket, int client_id,
-                            ServerConfig& config) {
-  char buffer[config.buffer_size] = {0};
-  memset(buffer, 0, config.buffer_size);
-  int valread = read(new_socket, buffer, config.buffer_size);
-  if (valread > 0) {
-    buffer[valread] = '\0';
-    std::string clientFileName(buffer);
-    std::cout << "Received file name: " << clientFileName << std::endl;
-
-    std::string serverFilePath = "server_files/" + clientFileName;
-    std::ifstream serverFile(serverFilePath);
-    bool fileExistsOnServer = serverFile.good();
-    serverFile.close();
-
-    if (!fileExistsOnServer) {
-      std::cerr << "File " << clientFileName << " not found on server."
-                << std::endl;
-      std::string response = "File not found";
-      send(new_socket, response.c_str(), response.length(), 0);
-      return "";  // Пропускаем текущий файл, возвращаем пустую строку
-    }
+std::string checkFileStatus(ProgressStore& progress, int new_socket,
+                            bool& connected, FrameHeader& header) {
+  std::string clientFileName;
+  if (!recvFrame(new_socket, header, clientFileName) ||
+      header.type != FRAME_FILE_REQUEST) {
+    connected = false;
+    return "";
+  }
+  logDebug() << "Received file name: " << clientFileName;
+
+  int64_t recorded = 0;
+  std::string status;
+  bool fileExistsOnServer =
+      prepareFileStatus(progress, header, clientFileName, recorded, status);
+  connected = sendFrame(new_socket, FRAME_FILE_STATUS,
+                        fileExistsOnServer ? FLAG_FOUND : 0, recorded, status);
+  if (!fileExistsOnServer) {
+    return "";  // Пропускаем текущий файл, возвращаем пустую строку
+  }
+  return clientFileName;
+}
 
-    float file_size = readClientFile(file, clientFileName);
-    if (file_size < 0) {  // Если файла нет в файле прогресса
-      std::cout << "Adding new entry for: " << clientFileName << std::endl;
-      file.clear();
-      file.seekp(0, std::ios::end);
-      file << clientFileName << ": " << 0 << std::endl;
-      file_size = 0;
-    }
+/**
+ * @brief Проверяет наличие файла на сервере, при необходимости добавляет
+ * запись о нём в файл прогресса и формирует нагрузку FRAME_FILE_STATUS.
+ *
+ * @param progress Хранилище прогресса клиента.
+ * @param request Заголовок запроса FRAME_FILE_REQUEST.
+ * @param clientFileName Имя файла, запрошенного клиентом; для запроса с
+ * FLAG_BUNDLE заменяется именем архива в кэше файлов.
+ * @param recorded Сохранённый прогресс передачи файла.
+ * @param status Нагрузка FRAME_FILE_STATUS.
+ * @return true, если файл есть на сервере.
+ */
 
-    std::string response = "true " + std::to_string(file_size);
-    send(new_socket, response.c_str(), response.length(), 0);
-    return clientFileName;
+bool prepareFileStatus(ProgressStore& progress, const FrameHeader& request,
+                       std::string& clientFileName, int64_t& recorded,
+                       std::string& status) {
+  std::string requested = clientFileName;
+  if (request.flags & FLAG_BUNDLE) clientFileName = bundleName(requested);
+  std::shared_ptr<CachedFile> file;
+  if (requested.find('/') == std::string::npos)
+    file = fileCache().lookup(clientFileName);
+  status = encodeU64(file ? file->size : 0);
+  if (request.flags & FLAG_BUNDLE)
+    status += encodeU64(file ? file->bundle_id : 0);
+  if (request.flags & FLAG_STREAM) status += requested;
+  if (!file) {
+    metricAdd(METRIC_NOT_FOUND);
+    logWarn() << "File " << requested << " not found on server.";
+    return false;
   }
-  return "";
+
+  recorded = readClientFile(progress, clientFileName);
+  if (recorded < 0) {  // Если файла нет в файле прогресса
+    logDebug() << "Adding new entry for: " << clientFileName;
+    progress.set(clientFileName, 0);
+    recorded = 0;
+  }
+  return true;
 }
 
 /**
@@ -296,7 +369,7 @@ ServerConfig readServerConfig(const std::string& filename) {
   std::ifstream file(filename);
   std::string line;
   if (!file.is_open()) {
-    std::cerr << "Unable to open file: " << filename << std::endl;
+    logError() << "Unable to open file: " << filename;
     return config;
   }
   while (getline(file, line)) {
@@ -313,6 +386,69 @@ ServerConfig readServerConfig(const std::string& filename) {
         config.buffer_size = std::stoi(value.substr(1));
       else if (key == "directory")
         config.directory = value.substr(1);
+      else if (key == "transfer_mode")
+        config.transfer_mode = value.substr(1);
+      else if (key == "engine")
+        config.engine = value.substr(1);
+      else if (key == "workers")
+        config.workers = std::stoi(value.substr(1));
+      else if (key == "hash_threads")
+        config.hash_threads = std::stoi(value.substr(1));
+      else if (key == "backlog")
+        config.backlog = std::stoi(value.substr(1));
+      else if (key == "max_requests")
+        config.max_requests = std::stoi(value.substr(1));
+      else if (key == "checkpoint_bytes")
+        config.checkpoint_bytes = std::stoull(value.substr(1));
+      else if (key == "checkpoint_interval_ms")
+        config.checkpoint_interval_ms = std::stoi(value.substr(1));
+      else if (key == "io_policy")
+        config.io_policy = value.substr(1);
+      else if (key == "readahead_ms")
+        config.readahead_ms = std::stoi(value.substr(1));
+      else if (key == "readahead_max")
+        config.readahead_max = std::stoull(value.substr(1));
+      else if (key == "mmap_window")
+        config.mmap_window = std::stoull(value.substr(1));
+      else if (key == "mmap_populate")
+        config.mmap_populate = std::stoi(value.substr(1)) != 0;
+      else if (key == "mmap_hugepages")
+        config.mmap_hugepages = std::stoi(value.substr(1)) != 0;
+      else if (key == "compression")
+        config.compression = value.substr(1);
+      else if (key == "compression_cache")
+        config.compression_cache = std::stoull(value.substr(1));
+      else if (key == "rate_limit")
+        config.rate_limit = std::stoull(value.substr(1));
+      else if (key == "client_rate_limit")
+        config.client_rate_limit = std::stoull(value.substr(1));
+      else if (key == "file_rate_limit")
+        config.file_rate_limit = std::stoull(value.substr(1));
+      else if (key == "metrics_port")
+        config.metrics_port = std::stoi(value.substr(1));
+      else if (key == "log_level")
+        config.log_level = value.substr(1);
+      else if (key == "session_ttl")
+        config.session_ttl = std::stoi(value.substr(1));
+      else if (key == "tcp_tuning")
+        config.tcp_tuning = std::stoi(value.substr(1)) != 0;
+      else if (key == "tcp_sndbuf_max")
+        config.tcp_sndbuf_max = std::stoull(value.substr(1));
+      else if (key == "tcp_notsent_lowat")
+        config.tcp_notsent_lowat = std::stoull(value.substr(1));
+      else if (key == "storage")
+        config.storage = value.substr(1);
+      else if (key == "client_weights") {
+        // Пары "<id>:<вес>" через пробел
+        std::istringstream pairs(value);
+        std::string pair;
+        while (pairs >> pair) {
+          size_t colon = pair.find(':');
+          if (colon == std::string::npos) continue;
+          config.client_weights[std::stoi(pair.substr(0, colon))] =
+              std::stoul(pair.substr(colon + 1));
+        }
+      }
     }
   }
   file.close();
@@ -322,87 +458,228 @@ ServerConfig readServerConfig(const std::string& filename) {
 /**
  * @brief Отправляет данные файла клиенту, начиная с указанной позиции.
  *
+ * Данные передаются кадрами FRAME_DATA, после которых следует кадр
+ * FRAME_END_OF_DATA. В режиме "sendfile" полезная нагрузка кадров
+ * передаётся из page cache в сокет средствами ядра, минуя пространство
+ * пользователя. В режиме "mmap" нагрузка отправляется из отображения файла
+ * в память (см. server_mmap.cpp). Если ядро не поддерживает sendfile для
+ * данного файла, файл не удалось отобразить, либо задан режим "copy",
+ * используется цикл чтения в буфер и отправки. Куски, которые заметно
+ * уменьшаются при сжатии кодеком, общим с клиентом, отправляются сжатыми
+ * (см. server_compress.cpp). Если задано ограничение скорости, перед
+ * каждым кадром передача ждёт, пока его разрешат корзины маркеров (см.
+ * server_shaping.cpp). Размер кадров подбирается под соединение (см.
+ * server_tcp.cpp).
+ *
  * @param config Конфигурация сервера.
- * @param client_id Идентификатор клиента.
+ * @param progress Хранилище прогресса клиента.
  * @param new_socket Сокет для отправки данных.
  * @param file_name Имя файла, данные которого отправляются.
  * @param startPos Позиция в файле, с которой начинается отправка данных.
+ * @param length Количество байт для отправки; SIZE_MAX - до конца файла.
+ * Прогресс в файле прогресса сохраняется только при отправке до конца файла.
+ * @param codecs Маска кодеков клиента из FRAME_HELLO.
+ * @param client_id Идентификатор клиента.
+ * @return false при разрыве соединения.
  */
 
-void sendFileData(ServerConfig& config, int client_id, int new_socket,
-                  const std::string& file_name, size_t startPos) {
+bool sendFileData(ServerConfig& config, ProgressStore& progress, int new_socket,
+                  const std::string& file_name, size_t startPos, size_t length,
+                  uint16_t codecs, int client_id) {
   std::string file_path = "server_files/" + file_name;
-  std::cout << "Sending file data: " << file_path << std::endl;
+  logDebug() << "Sending file data: " << file_path;
 
-  std::ifstream file(file_path, std::ios::binary | std::ios::ate);
-  if (!file.is_open()) {
-    std::cerr << "Failed to open file: " << file_path << std::endl;
-    return;
+  std::shared_ptr<CachedFile> file = fileCache().lookup(file_name);
+  if (!file) {
+    logError() << "Failed to open file: " << file_path;
+    return sendFrame(new_socket, FRAME_END_OF_DATA, 0, startPos);
   }
-  // file.seekg(startPos, std::ios::beg);
-  size_t file_size = file.tellg();  // Получаем размер файла
-  file.seekg(startPos,
-             std::ios::beg);  // Возвращаемся к началу файла для чтения
-
-  // Отправка размера файла клиенту
-  std::string sizeMsg = std::to_string(file_size) + "\n";
-  send(new_socket, sizeMsg.c_str(), sizeMsg.length(), 0);
-
-  char buffer[config.buffer_size];
+  int file_fd = file->fd;
+  size_t file_size = file->size;
+  if (startPos > file_size) startPos = file_size;
+  size_t end = length < file_size - startPos ? startPos + length : file_size;
+
+  bool zero_copy = config.transfer_mode == "sendfile";
+  // Файл из хранилища кусков не лежит в fd подряд и не отображается
+  bool mapped = config.transfer_mode == "mmap" && file->extents.empty();
+  MappedSender mapping;
+  if (mapped)
+    mapped = mapping.start(config, new_socket, file_fd, file_size, startPos);
+  size_t chunk_size =
+      zero_copy || mapped ? MAX_DATA_PAYLOAD : config.buffer_size;
+  TcpTuner tcp;
+  tcp.start(config, new_socket);
   size_t sent_bytes = startPos;
-  while (!file.eof()) {
-    file.read(buffer, sizeof(buffer));
-    int bytes_to_send = file.gcount();
-    send(new_socket, buffer, bytes_to_send, 0);
-    sent_bytes += bytes_to_send;
-    std::cout << "Total bytes sent for " << file_name << ": " << sent_bytes
-              << std::endl;
+  bool connected = true;
+  bool whole_tail = end == file_size && length == SIZE_MAX;
+  ProgressCheckpoint checkpoint;
+  checkpoint.start(config, whole_tail ? &progress : nullptr, file_name,
+                   startPos);
+  IoPolicy io;
+  io.start(config, file, startPos, end);
+  ChunkCompressor compressor;
+  compressor.start(config, codecs, file);
+  TrafficShaper shaper;
+  shaper.start(config, client_id, file_name);
+  TransferMetrics metrics;
+  metrics.start(startPos);
+  while (connected && sent_bytes < end) {
+    size_t length =
+        std::min(tcp.chunkSize(sent_bytes, chunk_size), end - sent_bytes);
+    if (compressor.active())
+      length = compressor.chunkLength(sent_bytes, end);
+    io.advance(sent_bytes, length);
+    std::string compressed;
+    bool encoded = compressor.encode(sent_bytes, length, nullptr, compressed);
+    // Кадр файла из хранилища не выходит за участок, лежащий в fd подряд
+    uint64_t run = length;
+    uint64_t offset = file->locate(sent_bytes, run);
+    if (!encoded) length = run;
+    int64_t wait = shaper.reserve(encoded ? compressed.size()
+                                          : FRAME_HEADER_SIZE + length);
+    if (wait > 0) usleep(wait);
+    if (encoded) {
+      connected = writeFull(new_socket, compressed.data(), compressed.size());
+      if (!connected) break;
+      metrics.sent(compressed.size());
+      sent_bytes += length;
+      checkpoint.update(sent_bytes);
+      continue;
+    }
+    // Заголовок уходит вместе с началом полезной нагрузки
+    FrameHeader header;
+    header.type = FRAME_DATA;
+    header.length = length;
+    header.offset = sent_bytes;
+    unsigned char raw[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, raw);
+    if (send(new_socket, raw, FRAME_HEADER_SIZE, MSG_MORE | MSG_NOSIGNAL) !=
+        (ssize_t)FRAME_HEADER_SIZE) {
+      connected = false;
+      break;
+    }
+    metrics.sent(FRAME_HEADER_SIZE);
+
+    size_t done = 0;
+    if (mapped) {
+      connected = sendFileMapped(mapping, sent_bytes, length);
+      if (!connected) break;
+      done = length;
+    } else if (zero_copy) {
+      ssize_t sent = sendFileZeroCopy(file_fd, new_socket, offset, length);
+      if (sent < 0) {
+        connected = false;
+        break;
+      }
+      done = sent;
+      if (done < length) zero_copy = false;  // sendfile не поддерживается
+    }
+    if (done < length) {
+      connected = sendFileCopy(config, file_fd, new_socket, offset + done,
+                               length - done);
+    }
+    if (!connected) break;
+    metrics.sent(length);
+    sent_bytes += length;
+    checkpoint.update(sent_bytes);
+  }
+  metrics.finish(sent_bytes);
+  io.finish(sent_bytes);
+  mapping.finish();
+  compressor.finish();
+  if (!connected) {
+    // Сохраняем позицию последнего полностью отправленного кадра
+    checkpoint.finish(sent_bytes);
+    tcp.finish();
+    return false;
   }
 
-  file.close();
-  updateProgressFile(
-      config.directory + "/client_" + std::to_string(client_id) + ".txt",
-      file_name, sent_bytes);
-  const char* endOfData = "END_OF_DATA";
-  send(new_socket, endOfData, strlen(endOfData), 0);
-
-  std::cout << "Total bytes sent for " << file_name << ": " << sent_bytes
-            << std::endl;
+  if (whole_tail) updateProgressFile(progress, file_name, sent_bytes);
+  logInfo() << "Total bytes sent for " << file_name << ": " << sent_bytes;
+  connected = sendFrame(new_socket, FRAME_END_OF_DATA, 0, sent_bytes);
+  tcp.finish();
+  return connected;
 }
 
 /**
- * @brief Обновляет файл прогресса, записывая текущее состояние передачи файлов.
+ * @brief Передаёт участок файла в сокет без копирования в пространство
+ * пользователя.
  *
- * @param progressFilePath Путь к файлу прогресса.
- * @param fileName Имя файла.
- * @param sentBytes Количество отправленных байт.
+ * @param file_fd Дескриптор открытого файла.
+ * @param new_socket Сокет для отправки данных.
+ * @param offset Позиция в файле, с которой начинается отправка.
+ * @param length Количество байт для отправки.
+ * @return Количество отправленных байт (меньше length, если sendfile не
+ * поддерживается для файла), либо -1 при разрыве соединения.
  */
 
-void updateProgressFile(const std::string& progressFilePath,
-                        const std::string& fileName, size_t sentBytes) {
-  std::map<std::string, size_t> progressData;
-  std::ifstream inFile(progressFilePath);
-  std::string line;
-
-  // Читаем текущие данные прогресса
-  while (getline(inFile, line)) {
-    std::istringstream iss(line);
-    std::string filename;
-    size_t size;
-    if (getline(iss, filename, ':')) {
-      iss >> size;
-      progressData[filename] = size;
+ssize_t sendFileZeroCopy(int file_fd, int new_socket, size_t offset,
+                         size_t length) {
+  off_t pos = offset;
+  size_t end = offset + length;
+  while ((size_t)pos < end) {
+    ssize_t sent = sendfile(new_socket, file_fd, &pos, end - pos);
+    if (sent < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      // EINVAL/ENOSYS: файловая система не поддерживает sendfile
+      if (errno == EINVAL || errno == ENOSYS) break;
+      return -1;
     }
+    if (sent == 0) return -1;  // Файл укоротился во время передачи
   }
-  inFile.close();
+  return pos - offset;
+}
 
-  // Обновляем данные для текущего файла
-  progressData[fileName] = sentBytes;
+/**
+ * @brief Передаёт участок файла через буфер пользовательского пространства.
+ *
+ * @param config Конфигурация сервера.
+ * @param file_fd Дескриптор открытого файла.
+ * @param new_socket Сокет для отправки данных.
+ * @param offset Позиция в файле, с которой начинается отправка.
+ * @param length Количество байт для отправки.
+ * @return false при разрыве соединения или ошибке чтения.
+ */
 
-  // Перезаписываем файл с обновленной информацией
-  std::ofstream outFile(progressFilePath);
-  for (const auto& entry : progressData) {
-    outFile << entry.first << ": " << entry.second << std::endl;
+bool sendFileCopy(ServerConfig& config, int file_fd, int new_socket,
+                  size_t offset, size_t length) {
+  char buffer[config.buffer_size];
+  while (length > 0) {
+    ssize_t bytes_read =
+        pread(file_fd, buffer, std::min(sizeof(buffer), length), offset);
+    if (bytes_read <= 0) return false;
+    if (!writeFull(new_socket, buffer, bytes_read)) return false;
+    offset += bytes_read;
+    length -= bytes_read;
   }
-  outFile.close();
-}
\ No newline at end of file
+  return true;
+}
+
+/**
+ * @brief Возвращает путь к файлу прогресса клиента.
+ *
+ * @param config Конфигурация сервера.
+ * @param client_id Идентификатор клиента.
+ * @return Путь к файлу прогресса.
+ */
+
+std::string progressFilePath(const ServerConfig& config, int client_id) {
+  return config.directory + "/client_" + std::to_string(client_id) +
+         ".progress";
+}
+
+/**
+ * @brief Обновляет файл прогресса, записывая текущее состояние передачи файлов.
+ *
+ * Смещение обновляется на месте, после чего страница с записью сбрасывается
+ * на диск.
+ *
+ * @param progress Хранилище прогресса клиента.
+ * @param fileName Имя файла.
+ * @param sentBytes Количество отправленных байт.
+ */
+
+void updateProgressFile(ProgressStore& progress, const std::string& fileName,
+                        size_t sentBytes) {
+  if (progress.set(fileName, sentBytes)) progress.sync(fileName, true);
+}
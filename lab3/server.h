@@ -0,0 +1,796 @@
+/**
+ * @file server.h
+ * @brief Общие объявления серверной части приложения.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cas.h"
+#include "protocol.h"
+
+/**
+ * @struct ServerConfig
+ * @brief Структура для хранения конфигурации сервера.
+ *
+ * @var ServerConfig::server_address IP-адрес сервера.
+ * @var ServerConfig::port Порт сервера.
+ * @var ServerConfig::directory Директория для файлов клиента.
+ * @var ServerConfig::transfer_mode Способ передачи данных: "sendfile"
+ * (передача средствами ядра без копирования), "mmap" (отправка из
+ * отображения файла в память) или "copy" (чтение в буфер и send).
+ * @var ServerConfig::engine Модель обработки подключений: "fork" (процесс на
+ * каждого клиента), "prefork" (заранее созданные процессы), "epoll" (пул
+ * потоков с циклами epoll) или "io_uring".
+ * @var ServerConfig::workers Количество потоков в режимах "epoll" и
+ * "io_uring" или процессов в режиме "prefork".
+ * @var ServerConfig::hash_threads Количество потоков, считающих манифесты,
+ * дельты и списки кусков в режимах "epoll" и "io_uring" (0 - по числу
+ * ядер).
+ * @var ServerConfig::backlog Длина очереди ожидающих подключений.
+ * @var ServerConfig::max_requests Сколько подключений обслуживает процесс
+ * модели "prefork" перед заменой новым (0 - без ограничения).
+ * @var ServerConfig::checkpoint_bytes Сохранять прогресс во время передачи
+ * каждые checkpoint_bytes байт (0 - не сохранять по объёму).
+ * @var ServerConfig::checkpoint_interval_ms Сохранять прогресс во время
+ * передачи не реже одного раза за указанное число миллисекунд (0 - не
+ * сохранять по времени).
+ * @var ServerConfig::io_policy Подсказки ядру при чтении файлов: "default"
+ * (без подсказок), "sequential" (последовательное чтение с упреждением) или
+ * "oneshot" (как "sequential", но прочитанные страницы вытесняются из page
+ * cache вслед за передачей).
+ * @var ServerConfig::readahead_ms Окно упреждающего чтения - столько
+ * миллисекунд передачи на текущей скорости клиента.
+ * @var ServerConfig::readahead_max Максимальный размер окна упреждающего
+ * чтения в байтах.
+ * @var ServerConfig::mmap_window Размер окна отображения файла в режиме
+ * "mmap".
+ * @var ServerConfig::mmap_populate Читать окно отображения целиком сразу при
+ * отображении (MAP_POPULATE).
+ * @var ServerConfig::mmap_hugepages Предлагать ядру отображать окна huge
+ * pages (MADV_HUGEPAGE).
+ * @var ServerConfig::compression Кодеки, которыми сервер сжимает данные:
+ * "auto" (любой, который поддерживает клиент), "deflate", "zstd" или "none".
+ * @var ServerConfig::compression_cache Сколько байт сжатых кусков повторно
+ * запрашиваемых файлов хранится в кэше файлов.
+ * @var ServerConfig::rate_limit Ограничение скорости отдачи всего сервера в
+ * байтах в секунду (0 - без ограничения). Полоса делится между активными
+ * клиентами пропорционально их весам.
+ * @var ServerConfig::client_rate_limit Ограничение скорости для одного
+ * идентификатора клиента.
+ * @var ServerConfig::file_rate_limit Ограничение скорости отдачи одного
+ * файла всем клиентам.
+ * @var ServerConfig::client_weights Веса клиентов по идентификаторам при
+ * делении rate_limit (по умолчанию 1).
+ * @var ServerConfig::metrics_port Порт на 127.0.0.1, на котором сервер
+ * отдаёт метрики в формате Prometheus (0 - не отдавать).
+ * @var ServerConfig::log_level Уровень журнала: "error", "warn", "info",
+ * "debug" или "off".
+ * @var ServerConfig::session_ttl Сколько секунд сессия клиента действует
+ * после последнего подключения (0 - не выдавать сессии).
+ * @var ServerConfig::tcp_tuning Подбирать размер кадров данных и буфер
+ * отправки по TCP_INFO и склеивать сегменты через TCP_CORK.
+ * @var ServerConfig::tcp_sndbuf_max Наибольший буфер отправки, до которого
+ * его увеличивает tcp_tuning.
+ * @var ServerConfig::tcp_notsent_lowat Порог неотправленных в сеть данных
+ * сокета (TCP_NOTSENT_LOWAT, 0 - по умолчанию ядра).
+ * @var ServerConfig::storage Хранение файлов: "files" (обычные файлы) или
+ * "cas" (куски без повторов в server_files/.store, см. server_store.cpp).
+ */
+struct ServerConfig {
+  std::string server_address = "";
+  int port = 0;
+  int buffer_size = 0;
+  std::string directory = "";
+  std::string transfer_mode = "sendfile";
+  std::string engine = "fork";
+  int workers = 0;
+  int hash_threads = 0;
+  int backlog = 128;
+  int max_requests = 0;
+  uint64_t checkpoint_bytes = 16 << 20;
+  int checkpoint_interval_ms = 1000;
+  std::string io_policy = "sequential";
+  int readahead_ms = 1000;
+  uint64_t readahead_max = 32 << 20;
+  uint64_t mmap_window = 64 << 20;
+  bool mmap_populate = false;
+  bool mmap_hugepages = false;
+  std::string compression = "auto";
+  uint64_t compression_cache = 64 << 20;
+  uint64_t rate_limit = 0;
+  uint64_t client_rate_limit = 0;
+  uint64_t file_rate_limit = 0;
+  std::map<int, uint32_t> client_weights;
+  int metrics_port = 0;
+  std::string log_level = "info";
+  int session_ttl = 600;
+  bool tcp_tuning = true;
+  uint64_t tcp_sndbuf_max = 16 << 20;
+  uint64_t tcp_notsent_lowat = 0;
+  std::string storage = "files";
+};
+
+/**
+ * @enum ConnState
+ * @brief Состояние протокола для одного подключения в событийных моделях
+ * ("epoll", "io_uring").
+ */
+enum class ConnState {
+  ReadId,        ///< Ожидание идентификатора клиента.
+  ReadFileName,  ///< Ожидание имени файла.
+  ReadCommand,   ///< Ожидание FRAME_SEND_DATA, FRAME_MANIFEST_REQUEST,
+                 ///< FRAME_DELTA_REQUEST или FRAME_CHUNKS_REQUEST.
+  Hashing,       ///< Манифест, дельта или список кусков файла считается в
+                 ///< пуле потоков.
+  Sending        ///< Передача данных файла.
+};
+
+struct ProtocolConnection;
+
+/**
+ * @struct ManifestResult
+ * @brief Манифест, дельта или ответ на запрос архива, подготовленные для
+ * подключения событийной модели в пуле потоков.
+ */
+struct ManifestResult {
+  int fd;
+  uint64_t serial;
+  std::string frames;
+  ConnState next;  ///< Состояние подключения после отправки кадров.
+  /// Продолжение в потоке модели после смены состояния; может быть пустым.
+  std::function<void(ProtocolConnection&)> then;
+};
+
+/**
+ * @struct DeltaRequest
+ * @brief Подписи блоков копии файла у клиента (см. delta.h).
+ */
+struct DeltaRequest {
+  uint64_t block_size = 0;
+  std::string signatures;
+};
+
+/// Максимальная длина имени файла в хранилище прогресса.
+const size_t PROGRESS_NAME_MAX = 233;
+
+/**
+ * @class ProgressStore
+ * @brief Хранилище прогресса передачи файлов одного клиента.
+ *
+ * Отображаемая в память таблица записей фиксированной длины с поиском за
+ * O(1) и обновлением смещений на месте (см. server_progress.cpp).
+ */
+class ProgressStore {
+ public:
+  ProgressStore() = default;
+  ProgressStore(const ProgressStore&) = delete;
+  ProgressStore& operator=(const ProgressStore&) = delete;
+  ~ProgressStore();
+
+  bool open(const std::string& path);
+  int64_t get(const std::string& fileName);
+  bool set(const std::string& fileName, uint64_t value);
+  void sync(const std::string& fileName, bool wait);
+  void import(const std::string& path);
+
+ private:
+  uint64_t* find(const std::string& fileName, bool create);
+
+  int fd_ = -1;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  std::mutex insert_mutex_;
+};
+
+/**
+ * @class ProgressCheckpoint
+ * @brief Периодическое сохранение прогресса во время передачи файла.
+ *
+ * Контрольная точка - это атомарная запись смещения в отображаемую запись
+ * хранилища и асинхронный msync, поэтому она не задерживает передачу.
+ */
+class ProgressCheckpoint {
+ public:
+  void start(const ServerConfig& config, ProgressStore* progress,
+             const std::string& fileName, uint64_t position);
+  void update(uint64_t position);
+  void finish(uint64_t position);
+
+ private:
+  void save(uint64_t position);
+
+  ProgressStore* progress_ = nullptr;
+  std::string file_name_;
+  uint64_t bytes_ = 0;
+  int64_t interval_ms_ = 0;
+  uint64_t last_position_ = 0;
+  int64_t last_time_ms_ = 0;
+};
+
+/**
+ * @struct IoStats
+ * @brief Счётчики попаданий чтения в page cache.
+ *
+ * Размещаются в разделяемой памяти, поэтому в модели "fork" их обновляют
+ * все дочерние процессы.
+ */
+struct IoStats {
+  uint64_t resident_pages;  ///< Страницы, уже бывшие в page cache.
+  uint64_t missing_pages;   ///< Страницы, которые пришлось читать с диска.
+};
+
+IoStats* ioStats();
+
+/**
+ * @struct FileActivity
+ * @brief Передачи файла и сведения о его сжатии во всех процессах сервера.
+ *
+ * Записи лежат в разделяемой памяти, поэтому в моделях "fork" и "prefork"
+ * их видят все процессы (см. server_io.cpp и server_compress.cpp).
+ */
+struct FileActivity {
+  std::atomic<uint64_t> key;  ///< Устройство и inode файла; 0 - свободна.
+  std::atomic<int32_t> active_transfers;  ///< Сколько передач идёт сейчас.
+  std::atomic<uint64_t> version;  ///< Версия файла для полей ниже.
+  std::atomic<int32_t> transfers;  ///< Сколько передач версии начато.
+  std::atomic<bool> incompressible;
+};
+
+FileActivity* fileActivityTable();
+FileActivity* fileActivity(dev_t device, ino_t inode);
+int64_t monotonicMs();
+int64_t monotonicUs();
+
+struct CachedFile;
+
+/**
+ * @class IoPolicy
+ * @brief Подсказки ядру и учёт попаданий в page cache для одной передачи
+ * (см. server_io.cpp).
+ */
+class IoPolicy {
+ public:
+  IoPolicy() = default;
+  IoPolicy(const IoPolicy&) = delete;
+  IoPolicy& operator=(const IoPolicy&) = delete;
+  ~IoPolicy();
+
+  void start(const ServerConfig& config, std::shared_ptr<CachedFile> file,
+             uint64_t position, uint64_t end);
+  void advance(uint64_t position, uint64_t length);
+  void finish(uint64_t position);
+
+ private:
+  void countResident(const unsigned char* map, uint64_t offset,
+                     uint64_t length);
+  void advise(uint64_t position, uint64_t length, int advice);
+
+  std::shared_ptr<CachedFile> file_;
+  int fd_ = -1;
+  bool hints_ = false;
+  bool drop_behind_ = false;
+  int window_ms_ = 0;
+  uint64_t window_max_ = 0;
+  uint64_t start_ = 0;
+  uint64_t end_ = 0;
+  uint64_t ahead_ = 0;    ///< Позиция, до которой запрошено упреждение.
+  uint64_t dropped_ = 0;  ///< Позиция, до которой страницы вытеснены.
+  int64_t start_ms_ = 0;
+  std::vector<unsigned char> residency_;  ///< Буфер для mincore.
+  uint64_t resident_ = 0;
+  uint64_t missing_ = 0;
+};
+
+/**
+ * @class TcpTuner
+ * @brief Настройка TCP для одной передачи: размер кадров и буфер отправки
+ * по TCP_INFO, TCP_CORK и TCP_NOTSENT_LOWAT (см. server_tcp.cpp).
+ */
+class TcpTuner {
+ public:
+  void start(const ServerConfig& config, int sock);
+  size_t chunkSize(uint64_t position, size_t fallback);
+  void finish();
+
+ private:
+  void tune();
+
+  int sock_ = -1;
+  bool active_ = false;
+  bool measured_ = false;
+  uint64_t tuned_at_ = 0;  ///< Позиция последнего пересчёта.
+  size_t chunk_ = 0;
+  uint64_t sndbuf_max_ = 0;
+};
+
+/**
+ * @class MappedSender
+ * @brief Отправка файла из его отображения в память скользящими окнами,
+ * при поддержке ядром - с MSG_ZEROCOPY (см. server_mmap.cpp).
+ *
+ * Объект привязан к сокету и может использоваться для нескольких передач
+ * подряд.
+ */
+class MappedSender {
+ public:
+  MappedSender() = default;
+  MappedSender(const MappedSender&) = delete;
+  MappedSender& operator=(const MappedSender&) = delete;
+  ~MappedSender();
+
+  bool start(const ServerConfig& config, int socket, int fd,
+             uint64_t file_size, uint64_t position);
+  ssize_t send(uint64_t position, size_t length, int flags);
+  bool reap();
+  void finish();
+
+ private:
+  bool map(uint64_t position);
+  void unmap();
+
+  int socket_ = -1;
+  int fd_ = -1;
+  uint64_t file_size_ = 0;
+  uint64_t window_size_ = 0;
+  bool populate_ = false;
+  bool hugepages_ = false;
+  bool zero_copy_ = false;  ///< Отправлять с MSG_ZEROCOPY.
+  uint32_t pending_ = 0;    ///< Отправки, о которых ещё нет уведомления.
+  char* map_ = nullptr;     ///< Текущее окно отображения.
+  uint64_t map_offset_ = 0;
+  size_t map_size_ = 0;
+};
+
+/**
+ * @struct FileExtent
+ * @brief Участок файла из хранилища кусков, лежащий в файле кусков подряд.
+ */
+struct FileExtent {
+  uint64_t position = 0;  ///< Позиция в файле.
+  uint64_t offset = 0;    ///< Позиция в файле кусков.
+  uint64_t length = 0;
+};
+
+/**
+ * @struct CachedFile
+ * @brief Открытый файл сервера и его метаданные.
+ *
+ * Запись неизменяема, кроме лениво загружаемого манифеста и сведений о
+ * сжатии (см. server_compress.cpp). Запись архива мелких файлов ссылается на
+ * анонимный файл в памяти (см. server_bundle.cpp). У файла из хранилища
+ * кусков fd - файл кусков, а extents отображает позиции файла на позиции в
+ * нём (см. server_store.cpp); данные такого файла читаются только через
+ * locate() и readAt(). Дескриптор закрывается, когда запись вытеснена из
+ * кэша и последняя передача, использующая её, завершена.
+ */
+struct CachedFile {
+  int fd = -1;
+  uint64_t size = 0;
+  std::vector<FileExtent> extents;  ///< Пусто, если fd - сам файл.
+  struct timespec mtime = {};
+  std::mutex manifest_mutex;
+  bool manifest_ready = false;
+  std::vector<uint32_t> manifest;  ///< CRC32C блоков (см. checksum.h).
+  bool chunk_list_ready = false;   ///< Под manifest_mutex, как и манифест.
+  std::vector<CasChunk> chunk_list;  ///< Куски файла (см. cas.h).
+  FileActivity* activity = nullptr;  ///< Общая для процессов запись или нет.
+  std::atomic<int> transfers{0};  ///< Если activity == nullptr.
+  std::once_flag residency_once;
+  void* residency_map = nullptr;  ///< Отображение для mincore.
+  size_t residency_size = 0;
+  std::atomic<bool> incompressible{false};  ///< Если activity == nullptr.
+  std::mutex chunks_mutex;
+  std::map<uint64_t, std::string> chunks;  ///< Сжатые куски: позиция | кодек.
+  uint64_t chunks_bytes = 0;
+  uint64_t bundle_id = 0;  ///< Идентификатор архива (см. bundle.h).
+
+  CachedFile() = default;
+  CachedFile(const CachedFile&) = delete;
+  CachedFile& operator=(const CachedFile&) = delete;
+  ~CachedFile();
+
+  uint64_t locate(uint64_t position, uint64_t& length) const;
+  ssize_t readAt(void* buffer, size_t length, uint64_t position) const;
+};
+
+/**
+ * @class FileCache
+ * @brief Кэш открытых файлов директории server_files с инвалидацией по
+ * inotify (см. server_filecache.cpp).
+ */
+class FileCache {
+ public:
+  FileCache() = default;
+  FileCache(const FileCache&) = delete;
+  FileCache& operator=(const FileCache&) = delete;
+  ~FileCache();
+
+  void open(const std::string& directory);
+  void preload();
+  void rewatch();
+  void processEvents();
+  std::shared_ptr<CachedFile> lookup(const std::string& name);
+
+ private:
+  void watch();
+  void processEventsLocked();
+  std::shared_ptr<CachedFile> lookupAssembled(const std::string& name);
+  void insertLocked(const std::string& name, std::shared_ptr<CachedFile> file);
+
+  /// Запись кэша и время её последнего использования.
+  struct CacheEntry {
+    std::shared_ptr<CachedFile> file;
+    uint64_t last_used = 0;
+  };
+
+  std::string directory_;
+  int notify_fd_ = -1;
+  bool watching_ = false;  ///< Без слежения записи не кэшируются.
+  uint64_t generation_ = 0;  ///< Счётчик изменений в директории.
+  std::map<std::string, CacheEntry> files_;
+  uint64_t use_clock_ = 0;  ///< Счётчик обращений к кэшу.
+  std::mutex mutex_;
+};
+
+FileCache& fileCache();
+
+/**
+ * @class ContentStore
+ * @brief Хранилище файлов кусками без повторов (см. server_store.cpp).
+ */
+class ContentStore {
+ public:
+  ContentStore() = default;
+  ContentStore(const ContentStore&) = delete;
+  ContentStore& operator=(const ContentStore&) = delete;
+  ~ContentStore();
+
+  bool open(const std::string& directory);
+  size_t importFiles();
+  bool enabled() const { return pack_fd_ >= 0; }
+  std::vector<std::string> names(uint64_t max_size);
+  std::shared_ptr<CachedFile> load(const std::string& name);
+
+ private:
+  /// Кусок в файле кусков.
+  struct Extent {
+    CasHash hash;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+  };
+
+  bool readRecipe(const std::string& path, uint64_t& size,
+                  std::vector<Extent>& extents);
+  void loadIndex();
+  bool import(const std::string& name);
+  bool storeChunk(const unsigned char* data, size_t length, Extent& extent);
+
+  std::string directory_;
+  std::string store_;
+  int pack_fd_ = -1;
+  uint64_t pack_size_ = 0;  ///< Размер файла кусков во время импорта.
+  std::map<CasHash, Extent> index_;  ///< Только на время импорта.
+};
+
+ContentStore& contentStore();
+
+std::string bundleName(const std::string& pattern);
+bool isBundleName(const std::string& name);
+std::shared_ptr<CachedFile> buildBundle(const std::string& directory,
+                                        const std::string& pattern);
+
+/**
+ * @class ChunkCompressor
+ * @brief Сжатие кусков файла для одной передачи с оценкой сжимаемости и
+ * кэшем сжатых кусков (см. server_compress.cpp).
+ *
+ * Пока сжатие активно, передача должна нарезать файл на куски длиной
+ * chunkLength().
+ */
+class ChunkCompressor {
+ public:
+  void start(const ServerConfig& config, uint16_t codecs,
+             const std::shared_ptr<CachedFile>& file);
+  bool active() const { return codec_ != 0; }
+  size_t chunkLength(uint64_t position, uint64_t end) const;
+  bool encode(uint64_t position, size_t length, const char* data,
+              std::string& frame);
+  void finish();
+
+ private:
+  void reject();
+
+  std::shared_ptr<CachedFile> file_;
+  FileActivity* shared_ = nullptr;  ///< Общая запись файла или nullptr.
+  uint16_t codec_ = 0;
+  uint64_t cache_limit_ = 0;
+  bool hot_ = false;  ///< Файл запрашивался раньше, куски кэшируются.
+  int skip_ = 0;      ///< Сколько кусков ещё отправить без попытки сжатия.
+  int backoff_ = 0;   ///< Пауза после последней неудачной попытки.
+  int failures_ = 0;  ///< Неудачные попытки подряд.
+  std::vector<char> buffer_;
+  uint64_t raw_bytes_ = 0;  ///< Исходный объём отправленных сжатыми кусков.
+  uint64_t compressed_bytes_ = 0;
+};
+
+void releaseCompressedChunks(uint64_t bytes);
+
+struct ShapingState;
+struct ShapingSlot;
+ShapingState* shapingState();
+
+/**
+ * @class TrafficShaper
+ * @brief Ограничение скорости одной передачи корзинами маркеров сервера,
+ * клиента и файла (см. server_shaping.cpp).
+ *
+ * Перед отправкой каждого куска передача резервирует его объём и ждёт
+ * столько, сколько вернул reserve().
+ */
+class TrafficShaper {
+ public:
+  void start(const ServerConfig& config, int client_id,
+             const std::string& file_name);
+  bool active() const { return active_; }
+  int64_t reserve(uint64_t bytes);
+
+ private:
+  uint64_t clientRate(int64_t now);
+
+  bool active_ = false;
+  uint64_t rate_limit_ = 0;
+  uint64_t client_rate_limit_ = 0;
+  uint64_t file_rate_limit_ = 0;
+  uint32_t weight_ = 1;
+  ShapingSlot* client_ = nullptr;
+  ShapingSlot* file_ = nullptr;
+  uint64_t share_weight_ = 0;  ///< Сумма весов активных клиентов.
+  int64_t share_time_ = 0;     ///< Когда сумма посчитана.
+};
+
+/**
+ * @enum LogLevel
+ * @brief Уровень сообщения журнала сервера (см. server_log.cpp).
+ */
+enum class LogLevel { Off, Error, Warn, Info, Debug };
+
+void setLogLevel(const std::string& level);
+bool logEnabled(LogLevel level);
+void logMessage(LogLevel level, std::string message);
+
+/**
+ * @class LogLine
+ * @brief Сообщение журнала, собираемое оператором <<.
+ *
+ * Сообщение ставится в очередь журнала при уничтожении объекта, то есть в
+ * конце выражения. Если уровень отключён, аргументы не форматируются.
+ */
+class LogLine {
+ public:
+  explicit LogLine(LogLevel level) : level_(level) {
+    if (logEnabled(level)) stream_.emplace();
+  }
+  LogLine(const LogLine&) = delete;
+  LogLine& operator=(const LogLine&) = delete;
+  ~LogLine() {
+    if (stream_) logMessage(level_, stream_->str());
+  }
+
+  template <typename T>
+  LogLine& operator<<(const T& value) {
+    if (stream_) *stream_ << value;
+    return *this;
+  }
+
+ private:
+  LogLevel level_;
+  std::optional<std::ostringstream> stream_;
+};
+
+inline LogLine logError() { return LogLine(LogLevel::Error); }
+inline LogLine logWarn() { return LogLine(LogLevel::Warn); }
+inline LogLine logInfo() { return LogLine(LogLevel::Info); }
+inline LogLine logDebug() { return LogLine(LogLevel::Debug); }
+
+/**
+ * @enum Metric
+ * @brief Счётчики сервера (см. server_metrics.cpp).
+ */
+enum Metric {
+  METRIC_CONNECTIONS,         ///< Принятые подключения.
+  METRIC_ACTIVE_CONNECTIONS,  ///< Открытые подключения.
+  METRIC_TRANSFERS,           ///< Завершённые и прерванные передачи.
+  METRIC_BYTES_SENT,          ///< Байты кадров данных, отданные ядру.
+  METRIC_NOT_FOUND,           ///< Запросы отсутствующих файлов.
+  METRIC_LOG_DROPPED,         ///< Отброшенные сообщения журнала.
+  METRIC_SESSIONS_RESUMED,    ///< Подключения, продолжившие сессию.
+  METRIC_COUNT
+};
+
+/**
+ * @enum MetricHistogram
+ * @brief Гистограммы сервера.
+ */
+enum MetricHistogram {
+  HISTOGRAM_HANDSHAKE,   ///< От подключения до FRAME_HELLO, мкс.
+  HISTOGRAM_FIRST_BYTE,  ///< От начала передачи до первых данных, мкс.
+  HISTOGRAM_THROUGHPUT,  ///< Скорость одной передачи, байт в секунду.
+  HISTOGRAM_COUNT
+};
+
+struct MetricsState;
+MetricsState* metricsState();
+void metricAdd(Metric metric, int64_t value = 1);
+void metricRecord(MetricHistogram histogram, uint64_t value);
+std::string formatMetrics();
+bool startMetricsServer(const ServerConfig& config);
+
+/**
+ * @class TransferMetrics
+ * @brief Метрики одной передачи файла: время до первого байта, объём и
+ * скорость.
+ */
+class TransferMetrics {
+ public:
+  void start(uint64_t position);
+  void sent(uint64_t bytes);
+  void finish(uint64_t position);
+
+ private:
+  bool active_ = false;
+  bool first_byte_ = false;  ///< Первые данные уже отправлены.
+  uint64_t start_ = 0;
+  int64_t start_us_ = 0;
+};
+
+/**
+ * @struct ProtocolConnection
+ * @brief Состояние протокола одного подключения, общее для событийных
+ * моделей ("epoll", "io_uring"); модели дополняют его своими полями ввода-
+ * вывода.
+ */
+struct ProtocolConnection {
+  int fd = -1;
+  uint64_t serial = 0;  ///< Отличает подключения с повторно выданным fd.
+  ConnState state = ConnState::ReadId;
+  int client_id = 0;
+  uint16_t codecs = 0;  ///< Кодеки, которые знает клиент.
+  std::shared_ptr<ProgressStore> progress;
+  std::string file_name;
+  std::shared_ptr<CachedFile> file;  ///< Передаваемый файл.
+  std::string in;         ///< Принятые, но ещё не разобранные байты.
+  std::string out;        ///< Кадры, ожидающие отправки.
+  uint64_t file_pos = 0;  ///< Позиция, до которой данные отправлены.
+  uint64_t file_end = 0;  ///< Позиция, до которой нужно отправить данные.
+  bool whole_tail = true;  ///< Отправка до конца файла, а не диапазона.
+  ProgressCheckpoint checkpoint;
+  IoPolicy io;
+  DeltaRequest delta;  ///< Принятые подписи копии клиента.
+  ChunkCompressor compressor;
+  TrafficShaper shaper;
+  TcpTuner tcp;
+  int64_t accepted_us = 0;  ///< Время подключения.
+  TransferMetrics metrics;
+};
+
+/**
+ * @class ProtocolWorker
+ * @brief Конечный автомат протокола для потока событийной модели (см.
+ * server_protocol.cpp).
+ *
+ * Разбирает кадры клиента, начинает и завершает передачи и считает
+ * манифесты, дельты, списки кусков и архивы мелких файлов в отдельных
+ * потоках. Модель реализует
+ * только ввод-вывод: подготовку и завершение передачи, поиск подключения
+ * по готовому результату подсчёта и продолжение работы с ним.
+ */
+class ProtocolWorker {
+ public:
+  explicit ProtocolWorker(ServerConfig& config) : config_(config) {}
+  virtual ~ProtocolWorker() = default;
+
+ protected:
+  bool processInput(ProtocolConnection& conn);
+  void finishSending(ProtocolConnection& conn);
+  void abortSending(ProtocolConnection& conn);
+  void completeManifests();
+
+  /// Готовит ввод-вывод передачи, когда файл уже открыт.
+  virtual void beginSending(ProtocolConnection& conn) = 0;
+  /// Освобождает ввод-вывод передачи до закрытия файла.
+  virtual void endSending(ProtocolConnection& conn) = 0;
+  /// Возвращает подключение, ждущее результат подсчёта, или nullptr.
+  virtual ProtocolConnection* findConnection(int fd, uint64_t serial) = 0;
+  /// Продолжает работу с подключением после получения результата.
+  virtual void resume(ProtocolConnection& conn) = 0;
+
+  ServerConfig& config_;
+  int event_fd_ = -1;  ///< Сигнал о готовых манифестах.
+
+ private:
+  bool handleFrame(ProtocolConnection& conn, const FrameHeader& header,
+                   const std::string& payload);
+  void acceptFile(ProtocolConnection& conn, const FrameHeader& request,
+                  const std::string& name);
+  void startSending(ProtocolConnection& conn, size_t startPos, size_t length);
+  void startFileStatus(ProtocolConnection& conn, const FrameHeader& request,
+                       const std::string& payload);
+  void startManifest(ProtocolConnection& conn);
+  void startDelta(ProtocolConnection& conn);
+  void startChunkList(ProtocolConnection& conn);
+  void startHashing(ProtocolConnection& conn, ConnState next,
+                    std::function<std::string()> compute,
+                    std::function<void(ProtocolConnection&)> then = nullptr);
+
+  std::mutex manifests_mutex_;
+  std::vector<ManifestResult> manifests_;  ///< Готовые манифесты.
+};
+
+struct SessionTable;
+SessionTable* sessionTable();
+bool openSession(const ServerConfig& config, const FrameHeader& header,
+                 const std::string& payload, int& client_id,
+                 std::string& reply);
+
+ServerConfig readServerConfig(const std::string& filename);
+void checkDirectory(ServerConfig& config);
+std::shared_ptr<ProgressStore> checkFileExistance(ServerConfig& config,
+                                                  int client_id);
+std::shared_ptr<ProgressStore> openProgressStore(const ServerConfig& config,
+                                                 int client_id);
+std::string checkFileStatus(ProgressStore& progress, int new_socket,
+                            bool& connected, FrameHeader& header);
+bool prepareFileStatus(ProgressStore& progress, const FrameHeader& request,
+                       std::string& clientFileName, int64_t& recorded,
+                       std::string& status);
+int64_t readClientFile(ProgressStore& progress, const std::string& fileName);
+bool sendFileData(ServerConfig& config, ProgressStore& progress, int new_socket,
+                  const std::string& file_name, size_t startPos,
+                  size_t length = SIZE_MAX, uint16_t codecs = 0,
+                  int client_id = 0);
+ssize_t sendFileZeroCopy(int file_fd, int new_socket, size_t offset,
+                         size_t length);
+bool sendFileCopy(ServerConfig& config, int file_fd, int new_socket,
+                  size_t offset, size_t length);
+bool sendFileMapped(MappedSender& sender, size_t offset, size_t length);
+void updateProgressFile(ProgressStore& progress, const std::string& fileName,
+                        size_t sentBytes);
+std::string progressFilePath(const ServerConfig& config, int client_id);
+
+bool loadManifest(const std::string& file_name,
+                  std::vector<uint32_t>& manifest);
+std::string encodeManifest(const std::vector<uint32_t>& manifest);
+bool sendManifest(int new_socket, const std::string& file_name);
+
+std::string computeChunkList(const std::string& file_name);
+bool sendChunkList(int new_socket, const std::string& file_name);
+
+bool addDeltaSignatures(DeltaRequest& request, const FrameHeader& header,
+                        const std::string& payload);
+std::string computeDelta(const std::string& file_name,
+                         const DeltaRequest& request);
+bool sendDelta(int new_socket, const std::string& file_name,
+               FrameHeader& header, std::string& payload);
+
+void serveClient(ServerConfig& config, int new_socket, int64_t accepted_us);
+void runPreforkServer(ServerConfig& config, int server_fd);
+void runEpollServer(ServerConfig& config, int server_fd);
+bool runUringServer(ServerConfig& config, int server_fd);
+
+#endif  // SERVER_H
@@ -0,0 +1,316 @@
+/**
+ * @file server_bundle.cpp
+ * @brief Сборка архива мелких файлов (см. bundle.h).
+ *
+ * Архив собирается в файле "server_files/.bundles/<хэш шаблона>-<идентификатор
+ * архива>" и попадает в кэш файлов под именем bundleName(шаблон). Это имя
+ * содержит '/', поэтому не совпадает ни с одним файлом директории, а всё
+ * остальное - передача любым способом, догрузка, запись прогресса, сжатие
+ * кусков - работает с архивом так же, как с обычным файлом. Любое изменение
+ * в директории вытесняет архивы из кэша; следующий запрос считает
+ * идентификатор заново и, если такой архив уже собран, берёт готовый файл.
+ *
+ * Готовый файл общий для всех процессов, поэтому в модели "fork" дочерние
+ * процессы не собирают один и тот же архив каждый в своей памяти. Сборку
+ * одного архива ведёт один процесс под блокировкой flock, остальные ждут
+ * её; после сборки прежние версии архива по тому же шаблону удаляются.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bundle.h"
+#include "protocol.h"
+#include "server.h"
+
+/// Префикс имён архивов в кэше файлов.
+static const std::string BUNDLE_PREFIX = "/bundle/";
+/// Директория собранных архивов в директории сервера.
+static const std::string BUNDLE_DIRECTORY = "/.bundles";
+
+/**
+ * @brief Имя архива в кэше файлов.
+ *
+ * @param pattern Шаблон имён файлов.
+ */
+
+std::string bundleName(const std::string& pattern) {
+  return BUNDLE_PREFIX + pattern;
+}
+
+/**
+ * @brief Проверяет, что имя в кэше файлов - имя архива.
+ */
+
+bool isBundleName(const std::string& name) {
+  return name.compare(0, BUNDLE_PREFIX.size(), BUNDLE_PREFIX) == 0;
+}
+
+/**
+ * @brief Добавляет к хэшу FNV-1a байты значения.
+ */
+
+static void hashBytes(uint64_t& hash, const void* data, size_t size) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+}
+
+/**
+ * @brief Дописывает участок файла в архив, по возможности средствами ядра.
+ *
+ * @param to Архив.
+ * @param from Файл.
+ * @param start Позиция участка в файле.
+ * @param size Размер участка.
+ * @return false, если участок не удалось прочитать целиком.
+ */
+
+static bool appendFile(int to, int from, uint64_t start, uint64_t size) {
+  off_t offset = start;
+  uint64_t end = start + size;
+  while ((uint64_t)offset < end) {
+    ssize_t n = sendfile(to, from, &offset, end - offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+  }
+  // sendfile не поддерживается - копируем через буфер
+  std::vector<char> buffer(std::min<uint64_t>(end - offset, 64 << 10));
+  while ((uint64_t)offset < end) {
+    ssize_t n = pread(from, buffer.data(),
+                      std::min<uint64_t>(end - offset, buffer.size()), offset);
+    if (n <= 0 || write(to, buffer.data(), n) != n) return false;
+    offset += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Дописывает в архив файл из хранилища кусков по его участкам.
+ *
+ * @param to Архив.
+ * @param file Файл из хранилища.
+ * @return false, если файл не удалось прочитать целиком.
+ */
+
+static bool appendStored(int to, const CachedFile& file) {
+  for (const auto& extent : file.extents) {
+    if (!appendFile(to, file.fd, extent.offset, extent.length)) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Открывает собранный архив, если его размер совпадает с ожидаемым.
+ *
+ * @param path Путь к архиву.
+ * @param size Ожидаемый размер.
+ * @return Дескриптор или -1.
+ */
+
+static int openBundle(const std::string& path, uint64_t size) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && (fstat(fd, &st) != 0 || (uint64_t)st.st_size != size)) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Записывает архив во временный файл и переименовывает его.
+ *
+ * @param bundles Директория архивов.
+ * @param name Имя архива.
+ * @param table Заголовок и таблица архива.
+ * @param entries Файлы архива.
+ * @param fds Открытые файлы директории.
+ * @param stored_files Файлы из хранилища кусков; nullptr для файлов
+ * директории.
+ * @param pattern Шаблон имён, для журнала.
+ * @return false, если архив не удалось собрать.
+ */
+
+static bool writeBundle(
+    const std::string& bundles, const std::string& name,
+    const std::string& table,
+    const std::vector<BundleEntry>& entries, const std::vector<int>& fds,
+    const std::vector<std::shared_ptr<CachedFile>>& stored_files,
+    const std::string& pattern) {
+  std::string path = bundles + "/" + name;
+  std::string tmp_path = bundles + "/." + name + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  bool ok = fd >= 0 &&
+            write(fd, table.data(), table.size()) == (ssize_t)table.size();
+  if (!ok) perror("Failed to create bundle");
+  for (size_t i = 0; ok && i < fds.size(); i++) {
+    // Файл, укоротившийся во время сборки, испортил бы смещения таблицы
+    if (!(stored_files[i] ? appendStored(fd, *stored_files[i])
+                          : appendFile(fd, fds[i], 0, entries[i].size))) {
+      logWarn() << "Bundle " << pattern << ": " << entries[i].name
+                << " changed while bundling";
+      ok = false;
+    }
+  }
+  if (fd >= 0) close(fd);
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Удаляет прежние версии архива по тому же шаблону.
+ *
+ * Передачи, уже открывшие прежнюю версию, дочитывают её.
+ *
+ * @param bundles Директория архивов.
+ * @param prefix Начало имён архивов шаблона.
+ * @param keep Имя текущей версии.
+ */
+
+static void removeOldBundles(const std::string& bundles,
+                             const std::string& prefix,
+                             const std::string& keep) {
+  DIR* dir = opendir(bundles.c_str());
+  if (dir == nullptr) return;
+  while (struct dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name != keep && name.compare(0, prefix.size(), prefix) == 0)
+      unlinkat(dirfd(dir), entry->d_name, 0);
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Собирает архив файлов директории, подходящих под шаблон.
+ *
+ * Служебные файлы (начинающиеся с точки), файлы крупнее
+ * BUNDLE_MAX_FILE_SIZE и файлы сверх BUNDLE_MAX_SIZE байт в архив не входят.
+ * Файлы из хранилища кусков входят в архив наравне с файлами директории.
+ *
+ * @param directory Директория с файлами сервера.
+ * @param pattern Шаблон имён файлов.
+ * @return Запись кэша с архивом или nullptr, если подходящих файлов нет.
+ */
+
+std::shared_ptr<CachedFile> buildBundle(const std::string& directory,
+                                        const std::string& pattern) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) return nullptr;
+  std::vector<std::string> names =
+      contentStore().names(BUNDLE_MAX_FILE_SIZE);
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+  }
+  closedir(dir);
+  names.erase(std::remove_if(names.begin(), names.end(),
+                             [&pattern](const std::string& name) {
+                               return fnmatch(pattern.c_str(), name.c_str(),
+                                              0) != 0;
+                             }),
+              names.end());
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+
+  // Идентификатор архива зависит от имён, размеров и времени изменения
+  uint64_t id = 0xcbf29ce484222325;
+  uint64_t total = 0;
+  std::vector<BundleEntry> entries;
+  std::vector<int> fds;
+  std::vector<std::shared_ptr<CachedFile>> stored_files;
+  for (const auto& name : names) {
+    if (entries.size() >= BUNDLE_MAX_FILES) break;
+    int fd = ::open((directory + "/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    bool ok = fd >= 0 && fstat(fd, &st) == 0;
+    std::shared_ptr<CachedFile> stored;
+    if (fd < 0 && errno == ENOENT) {
+      // Файл из хранилища кусков берётся из файла кусков, с размером и
+      // временем изменения из рецепта
+      stored = fileCache().lookup(name);
+      if (stored) fd = fcntl(stored->fd, F_DUPFD_CLOEXEC, 0);
+      ok = fd >= 0 && fstat(fd, &st) == 0;
+      if (ok) {
+        st.st_size = stored->size;
+        st.st_mtim = stored->mtime;
+      }
+    }
+    if (fd < 0) continue;
+    if (!ok || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size > BUNDLE_MAX_FILE_SIZE ||
+        total + st.st_size > BUNDLE_MAX_SIZE) {
+      close(fd);
+      continue;
+    }
+    entries.push_back({name, 0, (uint64_t)st.st_size});
+    fds.push_back(fd);
+    stored_files.push_back(stored);
+    total += st.st_size;
+    hashBytes(id, name.data(), name.size() + 1);
+    hashBytes(id, &st.st_size, sizeof(st.st_size));
+    hashBytes(id, &st.st_mtim, sizeof(st.st_mtim));
+  }
+
+  char prefix[24], id_text[24];
+  uint64_t pattern_hash = 0xcbf29ce484222325;
+  hashBytes(pattern_hash, pattern.data(), pattern.size());
+  snprintf(prefix, sizeof(prefix), "%016llx-",
+           (unsigned long long)pattern_hash);
+  snprintf(id_text, sizeof(id_text), "%016llx", (unsigned long long)id);
+  std::string bundles = directory + BUNDLE_DIRECTORY;
+  std::string name = std::string(prefix) + id_text;
+  std::string path = bundles + "/" + name;
+  std::string table = encodeBundleTable(id, entries);
+
+  auto file = std::make_shared<CachedFile>();
+  bool ok = !entries.empty();
+  // Архив с тем же идентификатором мог собрать другой процесс
+  if (ok) file->fd = openBundle(path, table.size() + total);
+  if (ok && file->fd < 0) {
+    if (mkdir(bundles.c_str(), 0700) != 0 && errno != EEXIST)
+      perror(("Failed to create " + bundles).c_str());
+    std::string lock_path = bundles + "/." + name + ".lock";
+    int lock = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    ok = lock >= 0 && flock(lock, LOCK_EX) == 0;
+    if (ok) file->fd = openBundle(path, table.size() + total);
+    if (ok && file->fd < 0) {
+      ok = writeBundle(bundles, name, table, entries, fds, stored_files,
+                       pattern);
+      if (ok) file->fd = openBundle(path, table.size() + total);
+      ok = file->fd >= 0;
+      if (ok) {
+        // Ждущие блокировку найдут готовый архив, новым она не нужна
+        unlink(lock_path.c_str());
+        removeOldBundles(bundles, prefix, name);
+        logInfo() << "Bundle " << pattern << ": " << entries.size()
+                  << " files, " << table.size() + total << " bytes";
+      }
+    }
+    if (lock >= 0) close(lock);
+  }
+  for (int fd : fds) close(fd);
+  struct stat st;
+  if (!ok || fstat(file->fd, &st) != 0) return nullptr;
+  file->size = st.st_size;
+  file->mtime = st.st_mtim;
+  file->bundle_id = id;
+  return file;
+}
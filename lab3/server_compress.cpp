@@ -0,0 +1,227 @@
+/**
+ * @file server_compress.cpp
+ * @brief Сжатие кусков файла при передаче.
+ *
+ * Кодек выбирается на каждую передачу: лучший из тех, что клиент перечислил
+ * в FRAME_HELLO и что разрешены параметром compression. Куски выравниваются
+ * по MAX_DATA_PAYLOAD, чтобы у одного места файла всегда был один и тот же
+ * сжатый кусок: для файлов, которые запрашиваются повторно, такие куски
+ * кэшируются в записи кэша файлов в пределах общего бюджета
+ * compression_cache байт.
+ *
+ * Чтобы не тратить процессор на уже сжатые данные (архивы, изображения,
+ * видео), сначала сжимается только начало куска; если оно уменьшается меньше
+ * чем на COMPRESS_MIN_SAVING_PERCENT процентов, кусок уходит без сжатия.
+ * После каждой неудачи следующие куски отправляются без попытки сжатия,
+ * и эта пауза удваивается до COMPRESS_MAX_BACKOFF кусков. Если несжимаемыми
+ * оказались первые COMPRESS_GIVE_UP_AFTER попыток, файл помечается
+ * несжимаемым до своего изменения.
+ *
+ * Число передач файла и отметка о несжимаемости хранятся в общей для
+ * процессов записи FileActivity, поэтому в моделях "fork" и "prefork" их
+ * узнаёт один процесс, а пользуются все. Сами сжатые куски лежат в памяти
+ * процесса: в модели "fork" они живут только до конца подключения и
+ * помогают лишь повторным запросам того же клиента, а в "prefork" - всем
+ * клиентам рабочего процесса.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "codec.h"
+#include "protocol.h"
+#include "server.h"
+
+/// Размер начала куска, по которому оценивается сжимаемость.
+const size_t COMPRESS_SAMPLE_SIZE = 64 << 10;
+/// Минимальная экономия, ради которой кусок отправляется сжатым.
+const uint64_t COMPRESS_MIN_SAVING_PERCENT = 10;
+/// Максимальная пауза в кусках после неудачной попытки сжатия.
+const int COMPRESS_MAX_BACKOFF = 64;
+/// Сколько неудачных попыток подряд делает файл несжимаемым.
+const int COMPRESS_GIVE_UP_AFTER = 4;
+
+/// Объём сжатых кусков во всех записях кэша файлов.
+static std::atomic<uint64_t> compressed_cache_bytes{0};
+
+/**
+ * @brief Возвращает в бюджет место, занятое сжатыми кусками записи.
+ *
+ * @param bytes Объём кусков.
+ */
+
+void releaseCompressedChunks(uint64_t bytes) {
+  compressed_cache_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Проверяет, что сжатие окупается.
+ */
+
+static bool worthCompressing(size_t compressed, size_t raw) {
+  return compressed * 100 <= raw * (100 - COMPRESS_MIN_SAVING_PERCENT);
+}
+
+/**
+ * @brief Возвращает общую для процессов запись файла, сбрасывая сведения о
+ * сжатии, если файл изменился.
+ *
+ * @param file Файл.
+ * @return Запись или nullptr.
+ */
+
+static FileActivity* sharedState(const CachedFile& file) {
+  FileActivity* shared = file.activity;
+  if (shared == nullptr) return nullptr;
+  uint64_t version = file.size * 0x9e3779b97f4a7c15 ^
+                     ((uint64_t)file.mtime.tv_sec * 1000000000 +
+                      file.mtime.tv_nsec);
+  uint64_t current = shared->version.load(std::memory_order_acquire);
+  if (current != version &&
+      shared->version.compare_exchange_strong(current, version,
+                                              std::memory_order_acq_rel)) {
+    shared->transfers.store(0, std::memory_order_relaxed);
+    shared->incompressible.store(false, std::memory_order_relaxed);
+  }
+  return shared;
+}
+
+/**
+ * @brief Начинает передачу файла.
+ *
+ * @param config Конфигурация сервера.
+ * @param codecs Маска кодеков клиента из FRAME_HELLO.
+ * @param file Передаваемый файл.
+ */
+
+void ChunkCompressor::start(const ServerConfig& config, uint16_t codecs,
+                            const std::shared_ptr<CachedFile>& file) {
+  file_ = file;
+  shared_ = sharedState(*file_);
+  codec_ = chooseCodec(codecs & parseCodecs(config.compression));
+  if ((shared_ ? shared_->incompressible : file_->incompressible)
+          .load(std::memory_order_relaxed))
+    codec_ = 0;
+  cache_limit_ = config.compression_cache;
+  // Кэшируем только файлы, которые запрашиваются не в первый раз
+  hot_ = (shared_ ? shared_->transfers : file_->transfers)
+             .fetch_add(1, std::memory_order_relaxed) > 0;
+  skip_ = 0;
+  backoff_ = 0;
+  failures_ = 0;
+  raw_bytes_ = 0;
+  compressed_bytes_ = 0;
+}
+
+/**
+ * @brief Длина следующего куска: до границы MAX_DATA_PAYLOAD.
+ *
+ * @param position Позиция куска.
+ * @param end Позиция, до которой идёт передача.
+ */
+
+size_t ChunkCompressor::chunkLength(uint64_t position, uint64_t end) const {
+  return std::min<uint64_t>(end - position,
+                            MAX_DATA_PAYLOAD - position % MAX_DATA_PAYLOAD);
+}
+
+/**
+ * @brief Пытается сжать кусок файла.
+ *
+ * @param position Позиция куска.
+ * @param length Длина куска.
+ * @param data Данные куска или nullptr - тогда они читаются из файла.
+ * @param frame Сжатый кадр FRAME_DATA вместе с заголовком.
+ * @return false, если кусок нужно отправить без сжатия.
+ */
+
+bool ChunkCompressor::encode(uint64_t position, size_t length,
+                             const char* data, std::string& frame) {
+  if (codec_ == 0 || length == 0) return false;
+  if (skip_ > 0) {
+    skip_--;
+    return false;
+  }
+
+  bool whole = position % MAX_DATA_PAYLOAD == 0 &&
+               (length == MAX_DATA_PAYLOAD || position + length == file_->size);
+  bool cacheable = hot_ && whole && cache_limit_ > 0;
+  // Кусок выровнен, поэтому младшие биты позиции свободны под кодек
+  uint64_t key = position | codec_;
+  std::string payload;
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(file_->chunks_mutex);
+    auto it = file_->chunks.find(key);
+    if (it != file_->chunks.end()) payload = it->second;
+  }
+
+  if (payload.empty()) {
+    if (data == nullptr) {
+      buffer_.resize(MAX_DATA_PAYLOAD);
+      // Ошибку увидит передача без сжатия
+      if (file_->readAt(buffer_.data(), length, position) != (ssize_t)length)
+        return false;
+      data = buffer_.data();
+    }
+    size_t sample = std::min(length, COMPRESS_SAMPLE_SIZE);
+    bool ok = sample == length ||
+              (compressPayload(codec_, data, sample, payload) &&
+               worthCompressing(payload.size(), sample));
+    ok = ok && compressPayload(codec_, data, length, payload) &&
+         worthCompressing(payload.size(), length);
+    if (!ok) {
+      reject();
+      return false;
+    }
+    failures_ = 0;
+    backoff_ = 0;
+    if (cacheable) {
+      uint64_t used = compressed_cache_bytes.fetch_add(
+          payload.size(), std::memory_order_relaxed);
+      std::lock_guard<std::mutex> lock(file_->chunks_mutex);
+      if (used + payload.size() <= cache_limit_ &&
+          file_->chunks.emplace(key, payload).second) {
+        file_->chunks_bytes += payload.size();
+      } else {
+        releaseCompressedChunks(payload.size());
+      }
+    }
+  }
+
+  frame = encodeFrame(FRAME_DATA, codec_, position, payload);
+  raw_bytes_ += length;
+  compressed_bytes_ += payload.size();
+  return true;
+}
+
+/**
+ * @brief Учитывает несжимаемый кусок и откладывает следующую попытку.
+ */
+
+void ChunkCompressor::reject() {
+  failures_++;
+  backoff_ = std::min(std::max(backoff_ * 2, 1), COMPRESS_MAX_BACKOFF);
+  skip_ = backoff_;
+  if (raw_bytes_ == 0 && failures_ >= COMPRESS_GIVE_UP_AFTER) {
+    (shared_ ? shared_->incompressible : file_->incompressible)
+        .store(true, std::memory_order_relaxed);
+    codec_ = 0;
+  }
+}
+
+/**
+ * @brief Завершает передачу и выводит, сколько удалось сэкономить.
+ */
+
+void ChunkCompressor::finish() {
+  if (raw_bytes_ > 0) {
+    logInfo() << "Compressed " << raw_bytes_ << " bytes to "
+              << compressed_bytes_ << " (" << codecName(codec_) << ")";
+  }
+  raw_bytes_ = 0;
+  codec_ = 0;
+  shared_ = nullptr;
+  file_.reset();
+}
@@ -0,0 +1,309 @@
+/**
+ * @file server_delta.cpp
+ * @brief Поиск участков новой версии файла в прежней версии у клиента.
+ *
+ * Клиент присылает подписи блоков своей копии (см. delta.h). Сервер
+ * отображает файл в память (файл из хранилища кусков читается в буфер по
+ * DELTA_WINDOW байт) и сдвигает по нему окно длины блока, пересчитывая
+ * слабую сумму на байт за O(1). Для окна, слабая сумма которого есть среди
+ * подписей, считается CRC32C; при совпадении окно становится участком,
+ * который клиент возьмёт из своей копии, и следующее окно начинается сразу
+ * за ним. Соседние совпавшие блоки, идущие подряд и в копии клиента,
+ * объединяются в один участок, а следующий по порядку блок проверяется
+ * первым, поэтому неизменённые части файла находятся без лишних сравнений.
+ */
+
+#include <endian.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "checksum.h"
+#include "delta.h"
+#include "protocol.h"
+#include "server.h"
+
+/// Сколько байт файла из хранилища кусков читается за раз.
+const uint64_t DELTA_WINDOW = 8 << 20;
+
+/**
+ * @struct BlockSignature
+ * @brief Подпись блока копии клиента.
+ */
+struct BlockSignature {
+  uint32_t weak;
+  uint32_t strong;
+  uint32_t index;  ///< Номер блока в копии клиента.
+};
+
+/**
+ * @brief Индекс таблицы быстрого отказа для слабой суммы.
+ */
+
+static uint32_t signatureTag(uint32_t weak) {
+  return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+/**
+ * @brief Добавляет к запросу подписи из кадра FRAME_DELTA_REQUEST.
+ *
+ * @param request Запрос.
+ * @param header Заголовок кадра; offset - длина блока.
+ * @param payload Подписи блоков.
+ * @return false при нарушении протокола.
+ */
+
+bool addDeltaSignatures(DeltaRequest& request, const FrameHeader& header,
+                        const std::string& payload) {
+  if (header.offset < DELTA_MIN_BLOCK || header.offset > DELTA_MAX_BLOCK ||
+      payload.size() % DELTA_SIGNATURE_SIZE != 0)
+    return false;
+  if (request.block_size != 0 && request.block_size != header.offset)
+    return false;
+  request.block_size = header.offset;
+  if ((request.signatures.size() + payload.size()) / DELTA_SIGNATURE_SIZE >
+      DELTA_MAX_BLOCKS)
+    return false;
+  request.signatures += payload;
+  return true;
+}
+
+/**
+ * @brief Ищет в подписях блок с заданной слабой суммой и данными окна.
+ *
+ * @param signatures Подписи, упорядоченные по слабой сумме.
+ * @param weak Слабая сумма окна.
+ * @param data Окно.
+ * @param length Длина окна.
+ * @param expected Блок, следующий за предыдущим совпадением.
+ * @return Номер блока или -1.
+ */
+
+static int64_t findBlock(const std::vector<BlockSignature>& signatures,
+                         uint32_t weak, const unsigned char* data,
+                         uint64_t length, uint64_t expected) {
+  auto it = std::lower_bound(
+      signatures.begin(), signatures.end(), weak,
+      [](const BlockSignature& s, uint32_t value) { return s.weak < value; });
+  bool hashed = false;
+  uint32_t strong = 0;
+  int64_t found = -1;
+  for (; it != signatures.end() && it->weak == weak; ++it) {
+    if (!hashed) {
+      strong = crc32c(data, length);
+      hashed = true;
+    }
+    if (it->strong != strong) continue;
+    if (it->index == expected) return expected;
+    if (found < 0) found = it->index;
+  }
+  return found;
+}
+
+/**
+ * @class DeltaWindow
+ * @brief Данные новой версии файла вокруг текущей позиции поиска.
+ *
+ * Отображённый в память файл доступен целиком. Файл из хранилища кусков
+ * не лежит в fd подряд, поэтому читается через CachedFile::readAt в буфер,
+ * который сдвигается вперёд вслед за позицией поиска.
+ */
+class DeltaWindow {
+ public:
+  DeltaWindow(const unsigned char* data, uint64_t size)
+      : data_(data), end_(size), size_(size) {}
+  explicit DeltaWindow(const CachedFile& file)
+      : file_(&file), buffer_(DELTA_WINDOW), size_(file.size) {}
+
+  /**
+   * @brief Возвращает данные с позиции pos длиной length.
+   *
+   * @return nullptr при ошибке чтения.
+   */
+  const unsigned char* view(uint64_t pos, uint64_t length) {
+    if (pos < start_ || pos + length > end_) {
+      if (file_ == nullptr) return nullptr;
+      uint64_t want = std::min<uint64_t>(buffer_.size(), size_ - pos);
+      if (want < length ||
+          file_->readAt(buffer_.data(), want, pos) != (ssize_t)want)
+        return nullptr;
+      data_ = buffer_.data();
+      start_ = pos;
+      end_ = pos + want;
+    }
+    return data_ + (pos - start_);
+  }
+  uint64_t size() const { return size_; }
+
+ private:
+  const CachedFile* file_ = nullptr;
+  std::vector<unsigned char> buffer_;
+  const unsigned char* data_ = nullptr;
+  uint64_t start_ = 0;  ///< Позиция data_ в файле.
+  uint64_t end_ = 0;
+  uint64_t size_;
+};
+
+/**
+ * @brief Находит участки данных, которые есть в копии клиента.
+ *
+ * @param window Новая версия файла.
+ * @param request Подписи копии клиента.
+ * @param copies Найденные участки в порядке позиций в файле.
+ * @return false при ошибке чтения файла.
+ */
+
+static bool findCopies(DeltaWindow& window, const DeltaRequest& request,
+                       std::vector<DeltaCopy>& copies) {
+  uint64_t block = request.block_size;
+  uint64_t size = window.size();
+  size_t count = request.signatures.size() / DELTA_SIGNATURE_SIZE;
+  std::vector<BlockSignature> signatures(count);
+  std::vector<uint8_t> tags(1 << 16);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t be[2];
+    memcpy(be, &request.signatures[i * DELTA_SIGNATURE_SIZE], sizeof(be));
+    signatures[i] = {be32toh(be[0]), be32toh(be[1]), (uint32_t)i};
+    tags[signatureTag(signatures[i].weak)] = 1;
+  }
+  std::sort(signatures.begin(), signatures.end(),
+            [](const BlockSignature& x, const BlockSignature& y) {
+              return x.weak < y.weak || (x.weak == y.weak && x.index < y.index);
+            });
+
+  uint64_t pos = 0;
+  uint64_t expected = UINT64_MAX;
+  uint32_t a = 0, b = 0;
+  const unsigned char* data = window.view(0, block);
+  if (data == nullptr) return false;
+  rollingSums(data, block, a, b);
+  while (pos + block <= size) {
+    uint32_t weak = rollingDigest(a, b);
+    int64_t match = -1;
+    if (tags[signatureTag(weak)]) {
+      if ((data = window.view(pos, block)) == nullptr) return false;
+      match = findBlock(signatures, weak, data, block, expected);
+    }
+    if (match >= 0) {
+      uint64_t source = match * block;
+      DeltaCopy* last = copies.empty() ? nullptr : &copies.back();
+      if (last != nullptr && last->target + last->length == pos &&
+          last->source + last->length == source)
+        last->length += block;
+      else
+        copies.push_back({pos, source, block});
+      pos += block;
+      expected = match + 1;
+      a = b = 0;
+      if (pos + block <= size) {
+        if ((data = window.view(pos, block)) == nullptr) return false;
+        rollingSums(data, block, a, b);
+      }
+      continue;
+    }
+    if (pos + block < size) {
+      if ((data = window.view(pos, block + 1)) == nullptr) return false;
+      rollingShift(a, b, block, data[0], data[block]);
+    }
+    pos++;
+  }
+  return true;
+}
+
+/**
+ * @brief Формирует кадры FRAME_DELTA.
+ *
+ * Последний кадр отмечается флагом FLAG_LAST; если участков нет,
+ * отправляется один пустой кадр.
+ */
+
+static std::string encodeDelta(const std::vector<DeltaCopy>& copies) {
+  const size_t per_frame = MAX_DATA_PAYLOAD / DELTA_COPY_SIZE;
+  std::string frames;
+  size_t first = 0;
+  do {
+    size_t count = std::min(per_frame, copies.size() - first);
+    std::string payload(count * DELTA_COPY_SIZE, '\0');
+    for (size_t i = 0; i < count; i++) {
+      const DeltaCopy& copy = copies[first + i];
+      uint64_t be[3] = {htobe64(copy.target), htobe64(copy.source),
+                        htobe64(copy.length)};
+      memcpy(&payload[i * DELTA_COPY_SIZE], be, sizeof(be));
+    }
+    bool last = first + count == copies.size();
+    frames += encodeFrame(FRAME_DELTA, last ? FLAG_LAST : 0, first, payload);
+    first += count;
+  } while (first < copies.size());
+  return frames;
+}
+
+/**
+ * @brief Сравнивает файл с копией клиента.
+ *
+ * @param file_name Имя файла.
+ * @param request Подписи копии клиента.
+ * @return Кадры FRAME_DELTA одной строкой.
+ */
+
+std::string computeDelta(const std::string& file_name,
+                         const DeltaRequest& request) {
+  std::vector<DeltaCopy> copies;
+  std::shared_ptr<CachedFile> file = fileCache().lookup(file_name);
+  if (file && !request.signatures.empty() &&
+      file->size >= request.block_size) {
+    bool found = false;
+    if (!file->extents.empty()) {
+      // Файл из хранилища кусков не лежит в fd подряд и не отображается
+      DeltaWindow window(*file);
+      found = findCopies(window, request, copies);
+    } else {
+      void* map =
+          mmap(nullptr, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, file->size, MADV_SEQUENTIAL);
+        DeltaWindow window(static_cast<const unsigned char*>(map),
+                           file->size);
+        found = findCopies(window, request, copies);
+        munmap(map, file->size);
+      }
+    }
+    if (!found) {
+      logError() << "Failed to read file: " << file_name;
+      copies.clear();
+    }
+  }
+
+  uint64_t reused = 0;
+  for (const auto& copy : copies) reused += copy.length;
+  logInfo() << "Delta for " << file_name << ": " << reused << " of "
+            << (file ? file->size : 0) << " bytes found in client copy";
+  return encodeDelta(copies);
+}
+
+/**
+ * @brief Принимает подписи копии клиента и отправляет ему дельту.
+ *
+ * @param new_socket Сокет клиента.
+ * @param file_name Имя файла.
+ * @param header Заголовок первого кадра FRAME_DELTA_REQUEST.
+ * @param payload Нагрузка первого кадра.
+ * @return false при разрыве соединения или нарушении протокола.
+ */
+
+bool sendDelta(int new_socket, const std::string& file_name,
+               FrameHeader& header, std::string& payload) {
+  DeltaRequest request;
+  while (1) {
+    if (header.type != FRAME_DELTA_REQUEST ||
+        !addDeltaSignatures(request, header, payload))
+      return false;
+    if (header.flags & FLAG_LAST) break;
+    if (!recvFrame(new_socket, header, payload)) return false;
+  }
+  std::string frames = computeDelta(file_name, request);
+  return writeFull(new_socket, frames.data(), frames.size());
+}
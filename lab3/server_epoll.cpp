@@ -0,0 +1,466 @@
+/**
+ * @file server_epoll.cpp
+ * @brief Событийная модель сервера: пул потоков с циклами epoll.
+ *
+ * Каждый поток владеет своим экземпляром epoll и обслуживает подключения в
+ * неблокирующем режиме. Протокол ведётся общим конечным автоматом (см.
+ * server_protocol.cpp); здесь - только приём и отправка по готовности
+ * сокетов.
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+#include "server.h"
+
+/**
+ * @struct Connection
+ * @brief Подключение модели epoll: состояние протокола и отправки данных
+ * по готовности сокета.
+ */
+struct Connection : ProtocolConnection {
+  size_t out_pos = 0;  ///< Сколько байт из out уже отправлено.
+  int file_fd = -1;
+  size_t chunk_remaining = 0;  ///< Остаток нагрузки текущего FRAME_DATA.
+  bool zero_copy = true;
+  bool mapped = false;  ///< Передача из отображения файла (режим "mmap").
+  MappedSender mapping;
+  size_t compressed_end = 0;  ///< Конец куска, сжатый кадр которого в out.
+  int64_t paused_until = 0;  ///< Кадр в out ждёт корзин маркеров до этого
+                             ///< времени (мкс).
+};
+
+static void setNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @class EpollWorker
+ * @brief Поток с собственным циклом epoll.
+ */
+class EpollWorker : public ProtocolWorker {
+ public:
+  EpollWorker(ServerConfig& config, int server_fd)
+      : ProtocolWorker(config),
+        server_fd_(server_fd),
+        buffer_(config.buffer_size) {}
+
+  void run();
+
+ protected:
+  void beginSending(ProtocolConnection& conn) override;
+  void endSending(ProtocolConnection& conn) override;
+  ProtocolConnection* findConnection(int fd, uint64_t serial) override;
+  void resume(ProtocolConnection& conn) override;
+
+ private:
+  void acceptClients();
+  void handleEvent(Connection& conn, uint32_t events);
+  bool flush(Connection& conn);
+  bool throttle(Connection& conn, uint64_t bytes);
+  void resumePaused();
+  void updateEvents(Connection& conn);
+  void closeConnection(int fd);
+  void readEvent();
+
+  int server_fd_;
+  int epoll_fd_ = -1;
+  std::vector<char> buffer_;
+  std::map<int, std::unique_ptr<Connection>> connections_;
+  uint64_t next_serial_ = 0;
+  /// Подключения, ждущие корзин маркеров: время -> (fd, серийный номер).
+  std::multimap<int64_t, std::pair<int, uint64_t>> paused_;
+};
+
+/**
+ * @brief Запускает событийную модель сервера.
+ *
+ * @param config Конфигурация сервера.
+ * @param server_fd Прослушивающий сокет.
+ */
+
+void runEpollServer(ServerConfig& config, int server_fd) {
+  setNonBlocking(server_fd);
+  checkDirectory(config);
+
+  int workers = config.workers;
+  if (workers <= 0) workers = std::thread::hardware_concurrency();
+  if (workers <= 0) workers = 1;
+  logInfo() << "Workers: " << workers;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++) {
+    threads.emplace_back([&config, server_fd]() {
+      EpollWorker worker(config, server_fd);
+      worker.run();
+    });
+  }
+  for (auto& thread : threads) thread.join();
+}
+
+/**
+ * @brief Цикл обработки событий потока.
+ */
+
+void EpollWorker::run() {
+  epoll_fd_ = epoll_create1(0);
+  if (epoll_fd_ < 0) {
+    perror("epoll_create1 failed");
+    return;
+  }
+
+  // EPOLLEXCLUSIVE будит только один поток на каждое новое подключение
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.fd = server_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, server_fd_, &ev);
+
+  event_fd_ = eventfd(0, EFD_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.fd = event_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+  const int max_events = 64;
+  struct epoll_event events[max_events];
+  while (1) {
+    int timeout = -1;
+    if (!paused_.empty()) {
+      int64_t wait = paused_.begin()->first - monotonicUs();
+      timeout = wait > 0 ? (wait + 999) / 1000 : 0;
+    }
+    int n = epoll_wait(epoll_fd_, events, max_events, timeout);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == server_fd_) {
+        acceptClients();
+        continue;
+      }
+      if (fd == event_fd_) {
+        readEvent();
+        continue;
+      }
+      auto it = connections_.find(fd);
+      if (it != connections_.end()) handleEvent(*it->second, events[i].events);
+    }
+    resumePaused();
+  }
+  close(epoll_fd_);
+}
+
+/**
+ * @brief Продолжает передачи, которым корзины маркеров уже разрешили
+ * отправку.
+ */
+
+void EpollWorker::resumePaused() {
+  int64_t now = monotonicUs();
+  while (!paused_.empty() && paused_.begin()->first <= now) {
+    std::pair<int, uint64_t> paused = paused_.begin()->second;
+    paused_.erase(paused_.begin());
+    auto it = connections_.find(paused.first);
+    if (it == connections_.end() || it->second->serial != paused.second)
+      continue;  // Подключение уже закрыто
+    it->second->paused_until = 0;
+    handleEvent(*it->second, 0);
+  }
+}
+
+/**
+ * @brief Принимает все ожидающие подключения.
+ */
+
+void EpollWorker::acceptClients() {
+  while (1) {
+    int fd = accept4(server_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept failed");
+      return;
+    }
+    auto conn = std::make_unique<Connection>();
+    conn->fd = fd;
+    conn->serial = ++next_serial_;
+    conn->accepted_us = monotonicUs();
+    metricAdd(METRIC_CONNECTIONS);
+    metricAdd(METRIC_ACTIVE_CONNECTIONS);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    connections_[fd] = std::move(conn);
+  }
+}
+
+/**
+ * @brief Обрабатывает событие готовности сокета.
+ *
+ * @param conn Подключение.
+ * @param events Маска событий epoll.
+ */
+
+void EpollWorker::handleEvent(Connection& conn, uint32_t events) {
+  // Уведомления MSG_ZEROCOPY тоже приходят как EPOLLERR
+  if ((events & EPOLLERR) && conn.mapping.reap()) events &= ~EPOLLERR;
+  if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+    closeConnection(conn.fd);
+    return;
+  }
+
+  bool busy =
+      conn.state == ConnState::Sending || conn.state == ConnState::Hashing;
+  if ((events & EPOLLIN) && !busy) {
+    ssize_t valread = read(conn.fd, buffer_.data(), buffer_.size());
+    if (valread == 0 || (valread < 0 && errno != EAGAIN && errno != EINTR)) {
+      closeConnection(conn.fd);
+      return;
+    }
+    if (valread > 0) conn.in.append(buffer_.data(), valread);
+  }
+
+  // Кадры, пришедшие во время передачи файла, разбираются после её окончания
+  while (1) {
+    if (!processInput(conn) || !flush(conn)) {
+      closeConnection(conn.fd);
+      return;
+    }
+    if (conn.state == ConnState::Sending ||
+        conn.state == ConnState::Hashing || conn.in.size() < FRAME_HEADER_SIZE)
+      break;
+    FrameHeader header;
+    decodeFrameHeader(reinterpret_cast<const unsigned char*>(conn.in.data()),
+                      header);
+    if (conn.in.size() < FRAME_HEADER_SIZE + header.length) break;
+  }
+  updateEvents(conn);
+}
+
+/**
+ * @brief Готовит передачу файла: отправку через sendfile, отображение или
+ * буфер.
+ *
+ * @param base Подключение.
+ */
+
+void EpollWorker::beginSending(ProtocolConnection& base) {
+  Connection& conn = static_cast<Connection&>(base);
+  conn.file_fd = conn.file->fd;
+  conn.chunk_remaining = 0;
+  conn.zero_copy = config_.transfer_mode == "sendfile";
+  // Файл из хранилища кусков не лежит в fd подряд и не отображается
+  conn.mapped = config_.transfer_mode == "mmap" &&
+                conn.file->extents.empty() &&
+                conn.mapping.start(config_, conn.fd, conn.file_fd,
+                                   conn.file->size, conn.file_pos);
+}
+
+/**
+ * @brief Освобождает отображение и дескриптор завершённой передачи.
+ *
+ * @param base Подключение.
+ */
+
+void EpollWorker::endSending(ProtocolConnection& base) {
+  Connection& conn = static_cast<Connection&>(base);
+  conn.mapping.finish();
+  conn.file_fd = -1;
+}
+
+/**
+ * @brief Отправляет накопленные кадры и данные файла, пока сокет принимает
+ * их.
+ *
+ * @param conn Подключение.
+ * @return false при ошибке сокета.
+ */
+
+bool EpollWorker::flush(Connection& conn) {
+  if (conn.paused_until > 0) return true;
+  while (1) {
+    while (conn.out_pos < conn.out.size()) {
+      // Заголовок FRAME_DATA уходит вместе с началом полезной нагрузки
+      int flags = MSG_NOSIGNAL | (conn.chunk_remaining > 0 ? MSG_MORE : 0);
+      ssize_t sent = send(conn.fd, conn.out.data() + conn.out_pos,
+                          conn.out.size() - conn.out_pos, flags);
+      if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          return true;
+        return false;
+      }
+      conn.out_pos += sent;
+      if (conn.chunk_remaining > 0 || conn.compressed_end > 0)
+        conn.metrics.sent(sent);  // Заголовок или сжатый кадр данных
+    }
+    conn.out.clear();
+    conn.out_pos = 0;
+    if (conn.compressed_end > 0) {
+      // Сжатый кадр отправлен целиком
+      conn.file_pos = conn.compressed_end;
+      conn.compressed_end = 0;
+      conn.checkpoint.update(conn.file_pos);
+    }
+
+    if (conn.state != ConnState::Sending) return true;
+
+    if (conn.chunk_remaining == 0) {
+      if (conn.file_pos < conn.file_end) {
+        size_t chunk_size = conn.tcp.chunkSize(
+            conn.file_pos, conn.zero_copy || conn.mapped
+                               ? MAX_DATA_PAYLOAD
+                               : config_.buffer_size);
+        size_t length = std::min(chunk_size, conn.file_end - conn.file_pos);
+        if (conn.compressor.active())
+          length = conn.compressor.chunkLength(conn.file_pos, conn.file_end);
+        conn.io.advance(conn.file_pos, length);
+        if (conn.compressor.encode(conn.file_pos, length, nullptr,
+                                   conn.out)) {
+          conn.compressed_end = conn.file_pos + length;
+          if (throttle(conn, conn.out.size())) return true;
+          continue;
+        }
+        // Кадр файла из хранилища не выходит за участок, лежащий в fd подряд
+        uint64_t run = length;
+        conn.file->locate(conn.file_pos, run);
+        conn.chunk_remaining = run;
+        conn.out = encodeFrame(FRAME_DATA, 0, conn.file_pos, "",
+                               conn.chunk_remaining);
+        if (throttle(conn, conn.out.size() + run)) return true;
+        continue;
+      }
+      finishSending(conn);
+      continue;
+    }
+
+    uint64_t run = conn.chunk_remaining;
+    off_t offset = conn.file->locate(conn.file_pos, run);
+    ssize_t sent;
+    if (conn.mapped) {
+      sent = conn.mapping.send(conn.file_pos, conn.chunk_remaining,
+                               MSG_NOSIGNAL);
+    } else if (conn.zero_copy) {
+      sent = sendfile(conn.fd, conn.file_fd, &offset, conn.chunk_remaining);
+      if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        conn.zero_copy = false;  // Переходим на передачу через буфер
+        continue;
+      }
+    } else {
+      ssize_t bytes_read =
+          pread(conn.file_fd, buffer_.data(),
+                std::min(buffer_.size(), conn.chunk_remaining), offset);
+      if (bytes_read <= 0) return false;
+      // Неотправленный остаток будет прочитан заново из page cache
+      sent = send(conn.fd, buffer_.data(), bytes_read, MSG_NOSIGNAL);
+    }
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return true;
+      return false;
+    }
+    if (sent == 0) return false;  // Файл укоротился во время передачи
+    conn.metrics.sent(sent);
+    conn.file_pos += sent;
+    conn.chunk_remaining -= sent;
+    conn.checkpoint.update(conn.file_pos);
+  }
+}
+
+/**
+ * @brief Резервирует отправку кадра в корзинах маркеров.
+ *
+ * @param conn Подключение.
+ * @param bytes Объём кадра.
+ * @return true, если кадр нужно отложить; подключение продолжит передачу
+ * из resumePaused().
+ */
+
+bool EpollWorker::throttle(Connection& conn, uint64_t bytes) {
+  int64_t wait = conn.shaper.reserve(bytes);
+  if (wait <= 0) return false;
+  conn.paused_until = monotonicUs() + wait;
+  paused_.emplace(conn.paused_until, std::make_pair(conn.fd, conn.serial));
+  return true;
+}
+
+/**
+ * @brief Обновляет набор отслеживаемых событий в зависимости от состояния.
+ *
+ * @param conn Подключение.
+ */
+
+void EpollWorker::updateEvents(Connection& conn) {
+  struct epoll_event ev = {};
+  if (conn.state == ConnState::Sending && conn.paused_until > 0)
+    ev.events = EPOLLRDHUP;  // Передачу продолжит resumePaused()
+  else if (conn.state == ConnState::Sending)
+    ev.events = EPOLLOUT;
+  else if (conn.state == ConnState::Hashing)
+    ev.events = EPOLLRDHUP;  // Только разрыв соединения
+  else if (!conn.out.empty())
+    ev.events = EPOLLIN | EPOLLOUT;
+  else
+    ev.events = EPOLLIN;
+  ev.data.fd = conn.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+/**
+ * @brief Закрывает подключение и освобождает связанные с ним ресурсы.
+ *
+ * @param fd Дескриптор сокета.
+ */
+
+void EpollWorker::closeConnection(int fd) {
+  auto it = connections_.find(fd);
+  if (it == connections_.end()) return;
+  // Передача прервана: сохраняем, сколько успели отправить
+  abortSending(*it->second);
+  metricAdd(METRIC_ACTIVE_CONNECTIONS, -1);
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  connections_.erase(it);
+}
+
+/**
+ * @brief Забирает сигнал eventfd и отправляет готовые манифесты.
+ */
+
+void EpollWorker::readEvent() {
+  uint64_t count;
+  if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd read failed");
+  completeManifests();
+}
+
+ProtocolConnection* EpollWorker::findConnection(int fd, uint64_t serial) {
+  auto it = connections_.find(fd);
+  if (it == connections_.end() || it->second->serial != serial)
+    return nullptr;
+  return it->second.get();
+}
+
+void EpollWorker::resume(ProtocolConnection& conn) {
+  handleEvent(static_cast<Connection&>(conn), 0);
+}
@@ -0,0 +1,312 @@
+/**
+ * @file server_filecache.cpp
+ * @brief Кэш открытых файлов и их метаданных.
+ *
+ * Для каждого запрошенного имени кэш хранит открытый дескриптор, размер,
+ * время изменения и манифест контрольных сумм, поэтому повторные запросы
+ * обходятся без поиска пути, open и stat. Изменения в директории отслеживаются
+ * через inotify: событие по имени файла вытесняет его запись, а переполнение
+ * очереди событий очищает весь кэш. Передачи, начатые до вытеснения,
+ * продолжают работать со своим дескриптором. Архивы мелких файлов (см.
+ * server_bundle.cpp) зависят от многих файлов сразу, поэтому вытесняются
+ * любым событием, кроме событий служебных файлов. Файл, которого нет в
+ * директории, ищется в хранилище кусков (см. server_store.cpp).
+ *
+ * В модели "epoll" кэш общий для всех потоков. В модели "fork" родительский
+ * процесс заранее открывает файлы директории, и каждый дочерний процесс
+ * наследует готовые записи вместе с дескрипторами; дочерний процесс заводит
+ * собственный экземпляр inotify, так как очередь событий унаследованного
+ * дескриптора разделена с родителем.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include "server.h"
+
+/// Максимальное количество открытых файлов в кэше.
+const size_t FILE_CACHE_MAX_ENTRIES = 256;
+
+CachedFile::~CachedFile() {
+  if (residency_map != nullptr) munmap(residency_map, residency_size);
+  if (fd >= 0) close(fd);
+  releaseCompressedChunks(chunks_bytes);
+}
+
+/**
+ * @brief Находит место участка файла в fd.
+ *
+ * @param position Позиция в файле, меньше размера файла.
+ * @param length Длина участка; уменьшается до части, лежащей в fd подряд.
+ * @return Позиция участка в fd.
+ */
+
+uint64_t CachedFile::locate(uint64_t position, uint64_t& length) const {
+  if (extents.empty()) return position;
+  auto it = std::upper_bound(
+      extents.begin(), extents.end(), position,
+      [](uint64_t pos, const FileExtent& extent) {
+        return pos < extent.position;
+      });
+  if (it == extents.begin() || position >= size) {
+    length = 0;
+    return 0;
+  }
+  --it;
+  uint64_t skip = position - it->position;
+  length = std::min(length, it->length - skip);
+  return it->offset + skip;
+}
+
+/**
+ * @brief Читает данные файла, как pread, но по позициям файла, а не fd.
+ *
+ * @param buffer Буфер.
+ * @param length Сколько байт прочитать.
+ * @param position Позиция в файле.
+ * @return Количество прочитанных байт (меньше length только в конце файла)
+ * или -1 при ошибке.
+ */
+
+ssize_t CachedFile::readAt(void* buffer, size_t length,
+                           uint64_t position) const {
+  size_t done = 0;
+  while (done < length && position + done < size) {
+    uint64_t run = length - done;
+    uint64_t offset = locate(position + done, run);
+    ssize_t n = pread(fd, static_cast<char*>(buffer) + done, run, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return done > 0 ? (ssize_t)done : -1;
+    if (n == 0) break;  // Файл укоротился
+    done += n;
+  }
+  return done;
+}
+
+FileCache::~FileCache() {
+  if (notify_fd_ >= 0) close(notify_fd_);
+}
+
+/**
+ * @brief Возвращает кэш файлов процесса.
+ */
+
+FileCache& fileCache() {
+  static FileCache cache;
+  return cache;
+}
+
+/**
+ * @brief Начинает отслеживать директорию с файлами.
+ *
+ * @param directory Директория с файлами сервера.
+ */
+
+void FileCache::open(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_ = directory;
+  watch();
+}
+
+/**
+ * @brief Заводит экземпляр inotify и следит за директорией.
+ *
+ * Если inotify недоступен, кэш работает без хранения записей.
+ */
+
+void FileCache::watch() {
+  if (notify_fd_ >= 0) close(notify_fd_);
+  files_.clear();
+  watching_ = false;
+  notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify_fd_ < 0) {
+    perror("inotify_init1 failed, file cache disabled");
+    return;
+  }
+  uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM |
+                  IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+  if (inotify_add_watch(notify_fd_, directory_.c_str(), mask) < 0) {
+    perror("inotify_add_watch failed, file cache disabled");
+    return;
+  }
+  watching_ = true;
+}
+
+/**
+ * @brief Открывает все обычные файлы директории.
+ *
+ * Вызывается в родительском процессе модели "fork", чтобы дочерние
+ * процессы получали уже открытые файлы.
+ */
+
+void FileCache::preload() {
+  DIR* dir = opendir(directory_.c_str());
+  if (dir == nullptr) return;
+  size_t count = 0;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;  // Служебные файлы и манифесты
+    if (count >= FILE_CACHE_MAX_ENTRIES) break;
+    if (lookup(entry->d_name)) count++;
+  }
+  closedir(dir);
+  logInfo() << "File cache: " << count << " files preloaded";
+}
+
+/**
+ * @brief Заводит собственный экземпляр inotify в дочернем процессе,
+ * сохраняя унаследованные записи.
+ */
+
+void FileCache::rewatch() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto inherited = files_;
+  watch();
+  if (watching_) files_.swap(inherited);
+}
+
+/**
+ * @brief Применяет накопившиеся события inotify.
+ */
+
+void FileCache::processEvents() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  processEventsLocked();
+}
+
+void FileCache::processEventsLocked() {
+  if (!watching_) return;
+  alignas(struct inotify_event) char buffer[4096];
+  while (1) {
+    ssize_t n = read(notify_fd_, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    for (char* p = buffer; p < buffer + n;) {
+      struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+      if (event->mask & IN_Q_OVERFLOW) {
+        files_.clear();  // Пропущенные события: доверять записям нельзя
+        generation_++;
+      } else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        logWarn() << "File cache: " << directory_ << " is no longer watched";
+        files_.clear();
+        watching_ = false;
+        return;
+      } else if (event->len > 0 && event->name[0] != '.') {
+        files_.erase(event->name);
+        // Имена архивов начинаются с '/' и идут в начале таблицы
+        auto it = files_.begin();
+        while (it != files_.end() && isBundleName(it->first))
+          it = files_.erase(it);
+        generation_++;
+      } else if (event->len > 0) {
+        files_.erase(event->name);
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+/**
+ * @brief Возвращает открытый файл по имени.
+ *
+ * @param name Имя файла в директории.
+ * @return Запись или nullptr, если файла нет или это не обычный файл.
+ */
+
+std::shared_ptr<CachedFile> FileCache::lookup(const std::string& name) {
+  if (isBundleName(name)) return lookupAssembled(name);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    processEventsLocked();
+    if (watching_) {
+      auto it = files_.find(name);
+      if (it != files_.end()) {
+        it->second.last_used = ++use_clock_;
+        return it->second.file;
+      }
+    }
+
+    auto file = std::make_shared<CachedFile>();
+    std::string path = directory_ + "/" + name;
+    file->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd >= 0 || errno != ENOENT || !contentStore().enabled()) {
+      struct stat st;
+      if (file->fd < 0 || fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return nullptr;
+      file->size = st.st_size;
+      file->mtime = st.st_mtim;
+      file->activity = fileActivity(st.st_dev, st.st_ino);
+      if (watching_) insertLocked(name, file);
+      return file;
+    }
+  }
+  // Файла нет в директории - он может быть в хранилище кусков
+  return lookupAssembled(name);
+}
+
+/**
+ * @brief Возвращает архив мелких файлов или файл из хранилища кусков,
+ * собирая его при необходимости.
+ *
+ * Запись собирается без блокировки кэша. Если за время сборки в директории
+ * что-то изменилось, запись передаётся, но не кэшируется.
+ *
+ * @param name Имя архива (см. bundleName()) или файла.
+ * @return Запись или nullptr, если подходящих файлов нет.
+ */
+
+std::shared_ptr<CachedFile> FileCache::lookupAssembled(
+    const std::string& name) {
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    processEventsLocked();
+    if (watching_) {
+      auto it = files_.find(name);
+      if (it != files_.end()) {
+        it->second.last_used = ++use_clock_;
+        return it->second.file;
+      }
+    }
+    generation = generation_;
+  }
+
+  std::shared_ptr<CachedFile> file =
+      isBundleName(name)
+          ? buildBundle(directory_, name.substr(bundleName("").size()))
+          : contentStore().load(name);
+  if (!file) return nullptr;
+  std::lock_guard<std::mutex> lock(mutex_);
+  processEventsLocked();
+  if (watching_ && generation == generation_) insertLocked(name, file);
+  return file;
+}
+
+/**
+ * @brief Добавляет запись в кэш, вытесняя давнее всего использованную,
+ * если кэш заполнен.
+ *
+ * @param name Имя файла.
+ * @param file Запись.
+ */
+
+void FileCache::insertLocked(const std::string& name,
+                             std::shared_ptr<CachedFile> file) {
+  if (files_.size() >= FILE_CACHE_MAX_ENTRIES && !files_.count(name)) {
+    auto oldest = files_.begin();
+    for (auto it = files_.begin(); it != files_.end(); ++it) {
+      if (it->second.last_used < oldest->second.last_used) oldest = it;
+    }
+    files_.erase(oldest);
+  }
+  CacheEntry& entry = files_[name];
+  entry.file = std::move(file);
+  entry.last_used = ++use_clock_;
+}
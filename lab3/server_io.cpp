@@ -0,0 +1,294 @@
+/**
+ * @file server_io.cpp
+ * @brief Политика чтения файлов: подсказки ядру и учёт page cache.
+ *
+ * В режиме "sequential" файл помечается POSIX_FADV_SEQUENTIAL, а впереди
+ * позиции отправки поддерживается окно упреждающего чтения
+ * (POSIX_FADV_WILLNEED), размер которого подбирается по скорости клиента:
+ * медленному клиенту не нужно держать в памяти десятки мегабайт впереди.
+ * В режиме "oneshot" страницы позади позиции отправки дополнительно
+ * вытесняются (POSIX_FADV_DONTNEED), чтобы большой файл, читаемый один раз,
+ * не вытеснял из page cache остальные, если файл в это время не
+ * отправляется кому-то ещё. Передачи файла считаются в разделяемой таблице
+ * по устройству и inode, общей для всех процессов моделей "fork" и
+ * "prefork"; если таблица заполнена, страницы файла не вытесняются. Перед
+ * отправкой каждого куска mincore считает, сколько его страниц уже было в
+ * page cache; отображение для mincore создаётся одно на запись кэша файлов
+ * и живёт вместе с ней.
+ *
+ * У файла из хранилища кусков подсказки и mincore относятся к его участкам
+ * в файле кусков. Такие страницы не вытесняются: те же куски могут
+ * принадлежать другим файлам.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "protocol.h"
+#include "server.h"
+
+/// Вытеснять страницы позади позиции отправки порциями не меньше этой.
+const uint64_t DROP_BEHIND_STEP = 8 << 20;
+/// Количество записей в таблице передач файлов.
+const size_t FILE_ACTIVITY_SLOTS = 4096;
+
+/**
+ * @brief Возвращает счётчики page cache, общие для всех процессов сервера.
+ *
+ * Первый вызов должен произойти до fork, чтобы дочерние процессы
+ * унаследовали разделяемое отображение.
+ */
+
+IoStats* ioStats() {
+  static IoStats* stats = [] {
+    void* map = mmap(nullptr, sizeof(IoStats), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return new IoStats();
+    return static_cast<IoStats*>(map);
+  }();
+  return stats;
+}
+
+/**
+ * @brief Возвращает таблицу передач файлов, общую для всех процессов
+ * сервера.
+ *
+ * Первый вызов должен произойти до fork. Записи не удаляются: inode, с
+ * которого читали, скорее всего будут читать снова.
+ */
+
+FileActivity* fileActivityTable() {
+  static FileActivity* table = [] {
+    size_t size = sizeof(FileActivity) * FILE_ACTIVITY_SLOTS;
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return new FileActivity[FILE_ACTIVITY_SLOTS]();
+    return static_cast<FileActivity*>(map);
+  }();
+  return table;
+}
+
+/**
+ * @brief Находит или занимает запись таблицы передач для файла.
+ *
+ * @param device Устройство файла.
+ * @param inode Inode файла.
+ * @return Запись или nullptr, если таблица заполнена.
+ */
+
+FileActivity* fileActivity(dev_t device, ino_t inode) {
+  uint64_t key = ((uint64_t)device << 48) ^ (uint64_t)inode;
+  if (key == 0) key = 1;
+  FileActivity* table = fileActivityTable();
+  for (size_t i = 0; i < FILE_ACTIVITY_SLOTS; i++) {
+    FileActivity& slot = table[(key + i) % FILE_ACTIVITY_SLOTS];
+    uint64_t current = slot.key.load(std::memory_order_acquire);
+    if (current == 0 &&
+        slot.key.compare_exchange_strong(current, key,
+                                         std::memory_order_acq_rel))
+      return &slot;
+    if (current == key) return &slot;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Меняет число идущих передач файла.
+ */
+
+static void countTransfer(const CachedFile& file, int delta) {
+  if (file.activity != nullptr)
+    file.activity->active_transfers.fetch_add(delta,
+                                              std::memory_order_relaxed);
+}
+
+/**
+ * @brief Проверяет, что файл сейчас отправляет только эта передача.
+ */
+
+static bool onlyTransfer(const CachedFile& file) {
+  return file.activity != nullptr &&
+         file.activity->active_transfers.load(std::memory_order_relaxed) == 1;
+}
+
+IoPolicy::~IoPolicy() {
+  if (file_) countTransfer(*file_, -1);
+}
+
+/**
+ * @brief Возвращает отображение файла для mincore, создавая его при первом
+ * обращении.
+ *
+ * Отображение не читает файл, а только позволяет спросить mincore.
+ *
+ * @param file Запись кэша файлов.
+ * @return Отображение или nullptr.
+ */
+
+static const unsigned char* residencyMap(CachedFile& file) {
+  std::call_once(file.residency_once, [&file] {
+    size_t size = file.size;
+    for (const auto& extent : file.extents)
+      size = std::max<uint64_t>(size, extent.offset + extent.length);
+    if (size == 0) return;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, file.fd, 0);
+    if (map == MAP_FAILED) return;
+    file.residency_map = map;
+    file.residency_size = size;
+  });
+  return static_cast<const unsigned char*>(file.residency_map);
+}
+
+/**
+ * @brief Начинает передачу участка файла.
+ *
+ * @param config Конфигурация сервера.
+ * @param file Файл.
+ * @param position Позиция, с которой начинается передача.
+ * @param end Позиция, до которой идёт передача.
+ */
+
+void IoPolicy::start(const ServerConfig& config,
+                     std::shared_ptr<CachedFile> file, uint64_t position,
+                     uint64_t end) {
+  if (file_) countTransfer(*file_, -1);
+  file_ = std::move(file);
+  countTransfer(*file_, 1);
+  fd_ = file_->fd;
+  hints_ = config.io_policy == "sequential" || config.io_policy == "oneshot";
+  drop_behind_ = config.io_policy == "oneshot" && file_->extents.empty() &&
+                 file_->activity != nullptr;
+  window_ms_ = config.readahead_ms;
+  window_max_ = std::max<uint64_t>(config.readahead_max, MAX_DATA_PAYLOAD);
+  start_ = position;
+  end_ = end;
+  ahead_ = position;
+  dropped_ = position;
+  start_ms_ = monotonicMs();
+  resident_ = 0;
+  missing_ = 0;
+  // Файл кусков открыт для каждого файла отдельно: подсказка - на весь fd
+  if (hints_ && file_->extents.empty())
+    posix_fadvise(fd_, position, end - position, POSIX_FADV_SEQUENTIAL);
+  else if (hints_)
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * @brief Учитывает, сколько страниц участка fd в page cache.
+ *
+ * @param map Отображение fd.
+ * @param offset Позиция участка в fd.
+ * @param length Длина участка.
+ */
+
+void IoPolicy::countResident(const unsigned char* map, uint64_t offset,
+                             uint64_t length) {
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t first = offset / page * page;
+  uint64_t last = offset + length;
+  size_t pages = (last - first + page - 1) / page;
+  if (residency_.size() < pages) residency_.resize(pages);
+  if (mincore(const_cast<unsigned char*>(map) + first, last - first,
+              residency_.data()) == 0) {
+    uint64_t resident = 0;
+    for (size_t i = 0; i < pages; i++) resident += residency_[i] & 1;
+    resident_ += resident;
+    missing_ += pages - resident;
+  }
+}
+
+/**
+ * @brief Даёт ядру подсказку об участке файла.
+ *
+ * @param position Позиция участка в файле.
+ * @param length Длина участка.
+ * @param advice Подсказка posix_fadvise.
+ */
+
+void IoPolicy::advise(uint64_t position, uint64_t length, int advice) {
+  uint64_t end = std::min(position + length, file_->size);
+  while (position < end) {
+    uint64_t run = end - position;
+    uint64_t offset = file_->locate(position, run);
+    if (run == 0) break;
+    posix_fadvise(fd_, offset, run, advice);
+    position += run;
+  }
+}
+
+/**
+ * @brief Вызывается перед отправкой очередного куска файла.
+ *
+ * Учитывает, сколько страниц куска уже в page cache, продлевает окно
+ * упреждающего чтения и вытесняет страницы позади позиции отправки.
+ *
+ * @param position Позиция начала куска.
+ * @param length Длина куска.
+ */
+
+void IoPolicy::advance(uint64_t position, uint64_t length) {
+  const unsigned char* map = residencyMap(*file_);
+  uint64_t end = std::min(position + length, file_->size);
+  for (uint64_t pos = position; map != nullptr && pos < end;) {
+    uint64_t run = end - pos;
+    uint64_t offset = file_->locate(pos, run);
+    if (run == 0) break;
+    countResident(map, offset, run);
+    pos += run;
+  }
+
+  if (hints_) {
+    // Окно - readahead_ms передачи на средней скорости клиента
+    int64_t elapsed = std::max<int64_t>(monotonicMs() - start_ms_, 1);
+    uint64_t rate = (position - start_) * 1000 / elapsed;
+    uint64_t window = rate * window_ms_ / 1000;
+    window = std::min(std::max<uint64_t>(window, MAX_DATA_PAYLOAD),
+                      window_max_);
+    uint64_t target = std::min(position + window, end_);
+    // Продлеваем окно, когда отправка прошла его половину
+    if (ahead_ < target && ahead_ - std::min(ahead_, position) < window / 2) {
+      uint64_t from = std::max(ahead_, position);
+      // readahead(2) может задержать поток отправки на вводе-выводе,
+      // а WILLNEED - только подсказка ядру
+      advise(from, target - from, POSIX_FADV_WILLNEED);
+      ahead_ = target;
+    }
+  }
+
+  // Страницы, которые читает другая передача того же файла, не вытесняются
+  if (drop_behind_ && position - dropped_ >= DROP_BEHIND_STEP) {
+    if (onlyTransfer(*file_))
+      posix_fadvise(fd_, dropped_, position - dropped_, POSIX_FADV_DONTNEED);
+    dropped_ = position;
+  }
+}
+
+/**
+ * @brief Завершает передачу и добавляет её статистику к общей.
+ *
+ * @param position Позиция, до которой данные отправлены.
+ */
+
+void IoPolicy::finish(uint64_t position) {
+  if (fd_ < 0) return;
+  if (drop_behind_ && position > dropped_ && onlyTransfer(*file_))
+    posix_fadvise(fd_, dropped_, position - dropped_, POSIX_FADV_DONTNEED);
+  countTransfer(*file_, -1);
+  file_.reset();
+  fd_ = -1;
+
+  IoStats* stats = ioStats();
+  uint64_t total_resident =
+      __atomic_add_fetch(&stats->resident_pages, resident_, __ATOMIC_RELAXED);
+  uint64_t total_missing =
+      __atomic_add_fetch(&stats->missing_pages, missing_, __ATOMIC_RELAXED);
+  if (resident_ + missing_ == 0) return;
+  logDebug() << "Page cache hits: " << resident_ * 100 / (resident_ + missing_)
+            << "% (" << total_resident * 100 / (total_resident + total_missing)
+            << "% since start)";
+}
@@ -0,0 +1,209 @@
+/**
+ * @file server_log.cpp
+ * @brief Асинхронный журнал сервера с уровнями сообщений.
+ *
+ * Сообщение собирается в потоке, который его пишет (см. LogLine в
+ * server.h), и ставится в очередь; в stdout (Info, Debug) и stderr (Error,
+ * Warn) очередь выводит отдельный поток, поэтому передачи не ждут вывода.
+ * Сообщения уровней выше log_level не форматируются вовсе. Если очередь
+ * заполнена, сообщение отбрасывается и учитывается в счётчике
+ * METRIC_LOG_DROPPED.
+ *
+ * В модели "fork" поток вывода запускается в каждом процессе при первом
+ * сообщении, а при завершении процесса очередь выводится целиком.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "server.h"
+
+/// Максимальная длина очереди сообщений.
+const size_t LOG_QUEUE_MAX = 16384;
+
+static std::atomic<int> log_level{static_cast<int>(LogLevel::Info)};
+
+/**
+ * @struct LogQueue
+ * @brief Очередь сообщений процесса.
+ */
+struct LogQueue {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::pair<LogLevel, std::string>> messages;
+  std::mutex write_mutex;  ///< Держится, пока выводится извлечённая часть.
+  bool running = false;    ///< Поток вывода запущен в этом процессе.
+};
+
+static void prepareFork();
+static void parentFork();
+static void childFork();
+static void flushLog();
+
+/**
+ * @brief Возвращает очередь журнала.
+ *
+ * Очередь не уничтожается: поток вывода может работать до самого
+ * завершения процесса.
+ */
+
+static LogQueue& logQueue() {
+  static LogQueue* queue = [] {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    atexit(flushLog);
+    return new LogQueue();
+  }();
+  return *queue;
+}
+
+/**
+ * @brief Записывает текст в дескриптор целиком.
+ */
+
+static void writeAll(int fd, const std::string& text) {
+  size_t done = 0;
+  while (done < text.size()) {
+    ssize_t n = write(fd, text.data() + done, text.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    done += n;
+  }
+}
+
+/**
+ * @brief Выводит сообщения: уровни Error и Warn в stderr, остальные в
+ * stdout.
+ *
+ * Каждый поток вывода получает целые строки одним вызовом write, чтобы
+ * строки процессов модели "fork" не перемешивались.
+ */
+
+static void writeMessages(
+    const std::deque<std::pair<LogLevel, std::string>>& messages) {
+  std::string out, err;
+  for (const auto& message : messages) {
+    std::string& text = message.first <= LogLevel::Warn ? err : out;
+    text += message.second;
+    text += '\n';
+  }
+  if (!err.empty()) writeAll(STDERR_FILENO, err);
+  if (!out.empty()) writeAll(STDOUT_FILENO, out);
+}
+
+/**
+ * @brief Цикл потока вывода.
+ */
+
+static void runWriter() {
+  LogQueue& queue = logQueue();
+  std::unique_lock<std::mutex> lock(queue.mutex);
+  while (1) {
+    queue.cv.wait(lock, [&queue] { return !queue.messages.empty(); });
+    std::deque<std::pair<LogLevel, std::string>> messages;
+    messages.swap(queue.messages);
+    std::unique_lock<std::mutex> write(queue.write_mutex);
+    lock.unlock();
+    writeMessages(messages);
+    write.unlock();
+    lock.lock();
+  }
+}
+
+/**
+ * @brief Выводит остаток очереди при завершении процесса.
+ */
+
+static void flushLog() {
+  LogQueue& queue = logQueue();
+  std::unique_lock<std::mutex> lock(queue.mutex);
+  std::deque<std::pair<LogLevel, std::string>> messages;
+  messages.swap(queue.messages);
+  // Дожидаемся, пока поток вывода допишет то, что уже извлёк
+  std::lock_guard<std::mutex> write(queue.write_mutex);
+  lock.unlock();
+  writeMessages(messages);
+}
+
+// fork не должен застать блокировки очереди занятыми
+static void prepareFork() {
+  logQueue().mutex.lock();
+  logQueue().write_mutex.lock();
+}
+
+static void parentFork() {
+  logQueue().write_mutex.unlock();
+  logQueue().mutex.unlock();
+}
+
+static void childFork() {
+  LogQueue& queue = logQueue();
+  queue.write_mutex.unlock();
+  queue.mutex.unlock();
+  // Сообщения родителя выведет родитель, а поток вывода не унаследован.
+  // Условная переменная помнит ожидающий поток родителя, поэтому
+  // создаётся заново
+  queue.messages.clear();
+  queue.running = false;
+  new (&queue.cv) std::condition_variable();
+}
+
+/**
+ * @brief Задаёт уровень журнала.
+ *
+ * @param level "error", "warn", "info", "debug" или "off".
+ */
+
+void setLogLevel(const std::string& level) {
+  LogLevel value = LogLevel::Info;
+  if (level == "off")
+    value = LogLevel::Off;
+  else if (level == "error")
+    value = LogLevel::Error;
+  else if (level == "warn")
+    value = LogLevel::Warn;
+  else if (level == "debug")
+    value = LogLevel::Debug;
+  log_level.store(static_cast<int>(value), std::memory_order_relaxed);
+}
+
+/**
+ * @brief Проверяет, выводятся ли сообщения уровня.
+ */
+
+bool logEnabled(LogLevel level) {
+  return level != LogLevel::Off &&
+         static_cast<int>(level) <= log_level.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Ставит сообщение в очередь журнала.
+ *
+ * @param level Уровень сообщения.
+ * @param message Текст без перевода строки.
+ */
+
+void logMessage(LogLevel level, std::string message) {
+  LogQueue& queue = logQueue();
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (!queue.running) {
+    std::thread(runWriter).detach();
+    queue.running = true;
+  }
+  if (queue.messages.size() >= LOG_QUEUE_MAX) {
+    metricAdd(METRIC_LOG_DROPPED);
+    return;
+  }
+  queue.messages.emplace_back(level, std::move(message));
+  queue.cv.notify_one();
+}
@@ -0,0 +1,210 @@
+/**
+ * @file server_manifest.cpp
+ * @brief Манифест контрольных сумм блоков файлов сервера.
+ *
+ * Для файла один раз считаются CRC32C всех блоков по HASH_BLOCK_SIZE байт.
+ * Результат кэшируется рядом с файлом, в "server_files/.<имя>.crc32c", вместе
+ * с размером и временем изменения файла (для файла из хранилища - из его
+ * рецепта, см. server_store.cpp); если файл изменился, манифест считается
+ * заново. Кэш пишется во временный файл и переименовывается, поэтому
+ * другие процессы никогда не видят его записанным наполовину. Загруженный
+ * манифест также хранится в записи кэша открытых файлов (FileCache).
+ */
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checksum.h"
+#include "protocol.h"
+#include "server.h"
+
+const uint64_t MANIFEST_MAGIC = 0x314e414d43525243;  // "CRRCMAN1"
+
+/**
+ * @struct ManifestHeader
+ * @brief Заголовок файла кэша манифеста.
+ */
+struct ManifestHeader {
+  uint64_t magic;
+  uint64_t block_size;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+/**
+ * @brief Возвращает путь к кэшу манифеста файла.
+ */
+
+static std::string manifestPath(const std::string& file_name) {
+  return "server_files/." + file_name + ".crc32c";
+}
+
+/**
+ * @brief Читает кэш манифеста, если он соответствует текущей версии файла.
+ *
+ * @param file_name Имя файла.
+ * @param file Открытый файл.
+ * @param manifest Контрольные суммы блоков.
+ * @return false, если кэша нет или он устарел.
+ */
+
+static bool readManifestCache(const std::string& file_name,
+                              const CachedFile& file,
+                              std::vector<uint32_t>& manifest) {
+  int fd = open(manifestPath(file_name).c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  ManifestHeader header;
+  uint64_t blocks = hashBlockCount(file.size);
+  manifest.resize(blocks);
+  size_t size = blocks * sizeof(uint32_t);
+  bool valid =
+      pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+      header.magic == MANIFEST_MAGIC && header.block_size == HASH_BLOCK_SIZE &&
+      header.file_size == file.size && header.mtime_sec == file.mtime.tv_sec &&
+      header.mtime_nsec == file.mtime.tv_nsec &&
+      (size == 0 ||
+       pread(fd, manifest.data(), size, sizeof(header)) == (ssize_t)size);
+  close(fd);
+  return valid;
+}
+
+/**
+ * @brief Сохраняет манифест в кэш.
+ *
+ * @param file_name Имя файла.
+ * @param file Открытый файл, по которому посчитан манифест.
+ * @param manifest Контрольные суммы блоков.
+ */
+
+static void writeManifestCache(const std::string& file_name,
+                               const CachedFile& file,
+                               const std::vector<uint32_t>& manifest) {
+  std::string path = manifestPath(file_name);
+  std::string tmp_path = path + "." + std::to_string(getpid()) + "." +
+                         std::to_string(std::hash<std::thread::id>()(
+                             std::this_thread::get_id()));
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;  // Без кэша манифест просто посчитается снова
+  ManifestHeader header = {MANIFEST_MAGIC, HASH_BLOCK_SIZE, file.size,
+                           file.mtime.tv_sec, file.mtime.tv_nsec};
+  size_t size = manifest.size() * sizeof(uint32_t);
+  bool written =
+      write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+      (size == 0 || write(fd, manifest.data(), size) == (ssize_t)size);
+  close(fd);
+  if (!written || rename(tmp_path.c_str(), path.c_str()) != 0)
+    unlink(tmp_path.c_str());
+}
+
+/**
+ * @brief Возвращает контрольные суммы блоков файла, считая их при первом
+ * обращении.
+ *
+ * @param file_name Имя файла в директории server_files.
+ * @param manifest Контрольные суммы блоков.
+ * @return false, если файл не удалось прочитать.
+ */
+
+bool loadManifest(const std::string& file_name,
+                  std::vector<uint32_t>& manifest) {
+  std::shared_ptr<CachedFile> file = fileCache().lookup(file_name);
+  if (!file) return false;
+  // Один поток считает манифест, остальные ждут готовый результат
+  std::lock_guard<std::mutex> lock(file->manifest_mutex);
+  if (file->manifest_ready) {
+    manifest = file->manifest;
+    return true;
+  }
+  // Архив мелких файлов существует только в памяти, как и его манифест
+  bool cached = !isBundleName(file_name);
+  if (cached && readManifestCache(file_name, *file, manifest)) {
+    file->manifest = manifest;
+    file->manifest_ready = true;
+    return true;
+  }
+
+  logDebug() << "Computing manifest for: " << file_name;
+  uint64_t blocks = hashBlockCount(file->size);
+  manifest.assign(blocks, 0);
+  std::vector<char> buffer(HASH_BLOCK_SIZE);
+  for (uint64_t i = 0; i < blocks; i++) {
+    uint64_t offset = i * HASH_BLOCK_SIZE;
+    size_t length = std::min<uint64_t>(HASH_BLOCK_SIZE, file->size - offset);
+    // Файл укоротился или ошибка чтения
+    if (file->readAt(buffer.data(), length, offset) != (ssize_t)length)
+      return false;
+    manifest[i] = crc32c(buffer.data(), length);
+  }
+  // Файл могли изменить, пока считался манифест: такой результат не
+  // кэшируем. Куски файла из хранилища не меняются, а его размер и время
+  // изменения взяты из рецепта, а не из файла кусков.
+  struct stat after;
+  if (!file->extents.empty() ||
+      (fstat(file->fd, &after) == 0 && (uint64_t)after.st_size == file->size &&
+       after.st_mtim.tv_sec == file->mtime.tv_sec &&
+       after.st_mtim.tv_nsec == file->mtime.tv_nsec)) {
+    if (cached) writeManifestCache(file_name, *file, manifest);
+    file->manifest = manifest;
+    file->manifest_ready = true;
+  }
+  return true;
+}
+
+/**
+ * @brief Формирует кадры FRAME_MANIFEST с контрольными суммами блоков.
+ *
+ * Последний кадр отмечается флагом FLAG_LAST. Если манифест пуст (пустой
+ * файл или ошибка чтения), отправляется один пустой кадр.
+ *
+ * @param manifest Контрольные суммы блоков.
+ * @return Кадры одной строкой.
+ */
+
+std::string encodeManifest(const std::vector<uint32_t>& manifest) {
+  const size_t per_frame = MAX_DATA_PAYLOAD / sizeof(uint32_t);
+  std::string frames;
+  size_t first = 0;
+  do {
+    size_t count = std::min(per_frame, manifest.size() - first);
+    std::string payload(count * sizeof(uint32_t), '\0');
+    for (size_t i = 0; i < count; i++) {
+      uint32_t be = htobe32(manifest[first + i]);
+      memcpy(&payload[i * sizeof(be)], &be, sizeof(be));
+    }
+    bool last = first + count == manifest.size();
+    frames += encodeFrame(FRAME_MANIFEST, last ? FLAG_LAST : 0, first, payload);
+    first += count;
+  } while (first < manifest.size());
+  return frames;
+}
+
+/**
+ * @brief Отправляет клиенту манифест файла.
+ *
+ * @param new_socket Сокет клиента.
+ * @param file_name Имя файла.
+ * @return false при разрыве соединения.
+ */
+
+bool sendManifest(int new_socket, const std::string& file_name) {
+  std::vector<uint32_t> manifest;
+  if (!loadManifest(file_name, manifest)) {
+    logError() << "Failed to compute manifest for: " << file_name;
+    manifest.clear();
+  }
+  std::string frames = encodeManifest(manifest);
+  return writeFull(new_socket, frames.data(), frames.size());
+}
@@ -0,0 +1,341 @@
+/**
+ * @file server_metrics.cpp
+ * @brief Счётчики и гистограммы сервера и их выдача в формате Prometheus.
+ *
+ * Метрики лежат в разделяемой памяти, общей для всех процессов модели
+ * "fork", и разбиты на METRICS_SHARDS частей по строкам кэша: поток пишет
+ * в часть, выбранную по его идентификатору, поэтому потоки и процессы почти
+ * не делят строки кэша. При выдаче части суммируются.
+ *
+ * Гистограммы логарифмически-линейные, как HDR: каждая октава значений
+ * делится на HISTOGRAM_SUB_BUCKETS равных корзин, так что относительная
+ * погрешность не превышает 25% при любом порядке значения.
+ *
+ * Если задан metrics_port, поток главного процесса отдаёт метрики по HTTP
+ * на 127.0.0.1:<metrics_port> в текстовом формате Prometheus.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "protocol.h"
+#include "server.h"
+
+/// Количество частей метрик.
+const size_t METRICS_SHARDS = 64;
+/// Количество корзин в октаве гистограммы.
+const size_t HISTOGRAM_SUB_BUCKETS = 4;
+/// Количество корзин гистограммы: покрывает все 64-битные значения.
+const size_t HISTOGRAM_BUCKETS = 252;
+
+/**
+ * @struct MetricsShard
+ * @brief Часть метрик, в которую пишут потоки с одним номером части.
+ */
+struct alignas(64) MetricsShard {
+  std::atomic<uint64_t> counters[METRIC_COUNT];
+  std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> sums[HISTOGRAM_COUNT];
+};
+
+/**
+ * @struct MetricsState
+ * @brief Все метрики сервера.
+ */
+struct MetricsState {
+  MetricsShard shards[METRICS_SHARDS];
+};
+
+/**
+ * @struct MetricInfo
+ * @brief Имя, тип и описание метрики в выдаче.
+ */
+struct MetricInfo {
+  const char* name;
+  const char* type;
+  const char* help;
+  double scale;  ///< Множитель значений гистограммы.
+};
+
+static const MetricInfo COUNTER_INFO[METRIC_COUNT] = {
+    {"rps_connections_total", "counter", "Accepted connections.", 1},
+    {"rps_active_connections", "gauge", "Open connections.", 1},
+    {"rps_transfers_total", "counter",
+     "File transfers, finished or interrupted.", 1},
+    {"rps_data_bytes_sent_total", "counter",
+     "Bytes of data frames handed to the kernel.", 1},
+    {"rps_files_not_found_total", "counter", "Requests for missing files.", 1},
+    {"rps_log_dropped_total", "counter", "Log lines dropped on a full queue.",
+     1},
+    {"rps_sessions_resumed_total", "counter",
+     "Connections that resumed a client session.", 1},
+};
+
+static const MetricInfo HISTOGRAM_INFO[HISTOGRAM_COUNT] = {
+    {"rps_handshake_seconds", "histogram",
+     "Time from accept to the client hello.", 1e-6},
+    {"rps_first_byte_seconds", "histogram",
+     "Time from a transfer request to its first data byte.", 1e-6},
+    {"rps_transfer_throughput_bytes_per_second", "histogram",
+     "Throughput of single transfers.", 1},
+};
+
+/// Номер части метрик потока; -1 - ещё не выбран.
+static thread_local int metrics_shard = -1;
+/// Сокет выдачи метрик.
+static int metrics_fd = -1;
+
+/**
+ * @brief Возвращает метрики, общие для всех процессов сервера.
+ *
+ * Первый вызов должен произойти до fork. Анонимное отображение заполнено
+ * нулями, что соответствует нулевым метрикам.
+ */
+
+MetricsState* metricsState() {
+  static MetricsState* state = [] {
+    // Дочерний процесс выбирает часть по своему идентификатору
+    pthread_atfork(nullptr, nullptr, [] { metrics_shard = -1; });
+    void* map = mmap(nullptr, sizeof(MetricsState), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return new MetricsState();
+    return static_cast<MetricsState*>(map);
+  }();
+  return state;
+}
+
+/**
+ * @brief Часть метрик текущего потока.
+ */
+
+static MetricsShard& shard() {
+  if (metrics_shard < 0) metrics_shard = syscall(SYS_gettid) % METRICS_SHARDS;
+  return metricsState()->shards[metrics_shard];
+}
+
+/**
+ * @brief Увеличивает счётчик.
+ *
+ * @param metric Счётчик.
+ * @param value Приращение; может быть отрицательным.
+ */
+
+void metricAdd(Metric metric, int64_t value) {
+  shard().counters[metric].fetch_add(value, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Номер корзины гистограммы для значения.
+ *
+ * Значения меньше HISTOGRAM_SUB_BUCKETS получают по корзине; дальше октава
+ * [2^k, 2^(k+1)) делится на HISTOGRAM_SUB_BUCKETS корзин.
+ */
+
+static size_t bucketIndex(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) return value;
+  int octave = 63 - __builtin_clzll(value);
+  size_t sub = (value >> (octave - 2)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (octave - 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief Наибольшее значение, попадающее в корзину.
+ */
+
+static uint64_t bucketUpper(size_t index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) return index;
+  int octave = index / HISTOGRAM_SUB_BUCKETS + 1;
+  uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+  uint64_t width = 1ULL << (octave - 2);
+  return (HISTOGRAM_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+/**
+ * @brief Добавляет значение в гистограмму.
+ *
+ * @param histogram Гистограмма.
+ * @param value Значение в единицах гистограммы (см. MetricHistogram).
+ */
+
+void metricRecord(MetricHistogram histogram, uint64_t value) {
+  MetricsShard& part = shard();
+  part.buckets[histogram][bucketIndex(value)].fetch_add(
+      1, std::memory_order_relaxed);
+  part.sums[histogram].fetch_add(value, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Формирует выдачу метрик в текстовом формате Prometheus.
+ *
+ * Корзины гистограмм выводятся накопленными до последней непустой.
+ */
+
+std::string formatMetrics() {
+  MetricsState* state = metricsState();
+  std::ostringstream out;
+  out << std::setprecision(12);
+  for (size_t i = 0; i < METRIC_COUNT; i++) {
+    uint64_t total = 0;
+    for (const auto& part : state->shards)
+      total += part.counters[i].load(std::memory_order_relaxed);
+    const MetricInfo& info = COUNTER_INFO[i];
+    out << "# HELP " << info.name << " " << info.help << "\n"
+        << "# TYPE " << info.name << " " << info.type << "\n"
+        << info.name << " " << (int64_t)total << "\n";
+  }
+  IoStats* stats = ioStats();
+  out << "# TYPE rps_page_cache_resident_pages_total counter\n"
+      << "rps_page_cache_resident_pages_total " << stats->resident_pages
+      << "\n"
+      << "# TYPE rps_page_cache_missing_pages_total counter\n"
+      << "rps_page_cache_missing_pages_total " << stats->missing_pages << "\n";
+
+  for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t sum = 0;
+    size_t used = 0;
+    for (const auto& part : state->shards) {
+      for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        buckets[b] += part.buckets[i][b].load(std::memory_order_relaxed);
+        if (buckets[b] != 0) used = std::max(used, b + 1);
+      }
+      sum += part.sums[i].load(std::memory_order_relaxed);
+    }
+    const MetricInfo& info = HISTOGRAM_INFO[i];
+    out << "# HELP " << info.name << " " << info.help << "\n"
+        << "# TYPE " << info.name << " " << info.type << "\n";
+    uint64_t count = 0;
+    for (size_t b = 0; b < used; b++) {
+      count += buckets[b];
+      out << info.name << "_bucket{le=\"" << bucketUpper(b) * info.scale
+          << "\"} " << count << "\n";
+    }
+    out << info.name << "_bucket{le=\"+Inf\"} " << count << "\n"
+        << info.name << "_sum " << sum * info.scale << "\n"
+        << info.name << "_count " << count << "\n";
+  }
+  return out.str();
+}
+
+/**
+ * @brief Отвечает на запросы метрик, пока сервер работает.
+ */
+
+static void serveMetrics() {
+  while (1) {
+    int client = accept(metrics_fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("metrics accept failed");
+      return;
+    }
+    struct timeval timeout = {1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // Запрос читается до пустой строки; путь не важен
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < 8192) {
+      ssize_t n = read(client, buffer, sizeof(buffer));
+      if (n <= 0) break;
+      request.append(buffer, n);
+    }
+    std::string body = formatMetrics();
+    std::string response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    writeFull(client, response.data(), response.size());
+    close(client);
+  }
+}
+
+/**
+ * @brief Запускает поток выдачи метрик, если задан metrics_port.
+ *
+ * @param config Конфигурация сервера.
+ * @return false, если порт не удалось открыть.
+ */
+
+bool startMetricsServer(const ServerConfig& config) {
+  if (config.metrics_port <= 0) return true;
+  metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int opt = 1;
+  setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(config.metrics_port);
+  if (metrics_fd < 0 ||
+      bind(metrics_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(metrics_fd, 16) < 0) {
+    perror("metrics socket failed");
+    if (metrics_fd >= 0) close(metrics_fd);
+    metrics_fd = -1;
+    return false;
+  }
+  // Дочерним процессам модели "fork" сокет метрик не нужен
+  pthread_atfork(nullptr, nullptr, [] { close(metrics_fd); });
+  std::thread(serveMetrics).detach();
+  logInfo() << "Metrics: http://127.0.0.1:" << config.metrics_port
+            << "/metrics";
+  return true;
+}
+
+/**
+ * @brief Начинает передачу.
+ *
+ * @param position Позиция, с которой начинается передача.
+ */
+
+void TransferMetrics::start(uint64_t position) {
+  active_ = true;
+  first_byte_ = false;
+  start_ = position;
+  start_us_ = monotonicUs();
+}
+
+/**
+ * @brief Учитывает байты кадров данных, отданные ядру.
+ *
+ * @param bytes Объём.
+ */
+
+void TransferMetrics::sent(uint64_t bytes) {
+  metricAdd(METRIC_BYTES_SENT, bytes);
+  if (!active_ || first_byte_) return;
+  first_byte_ = true;
+  metricRecord(HISTOGRAM_FIRST_BYTE, monotonicUs() - start_us_);
+}
+
+/**
+ * @brief Завершает передачу, в том числе прерванную.
+ *
+ * @param position Позиция, до которой данные отправлены.
+ */
+
+void TransferMetrics::finish(uint64_t position) {
+  if (!active_) return;
+  active_ = false;
+  metricAdd(METRIC_TRANSFERS);
+  int64_t elapsed = monotonicUs() - start_us_;
+  if (position > start_ && elapsed > 0)
+    metricRecord(HISTOGRAM_THROUGHPUT,
+                 (unsigned __int128)(position - start_) * 1000000 / elapsed);
+}
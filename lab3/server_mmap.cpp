@@ -0,0 +1,197 @@
+/**
+ * @file server_mmap.cpp
+ * @brief Передача файла из его отображения в память.
+ *
+ * В режиме "mmap" файл отображается окнами по mmap_window байт, и данные
+ * отправляются в сокет прямо из отображения. Отображение MAP_SHARED
+ * указывает на страницы page cache, поэтому процессы, отдающие один и тот же
+ * файл, не заводят собственных буферов и копий данных. Окна выровнены по
+ * размеру huge page; при mmap_hugepages ядру дополнительно предлагается
+ * отображать их huge pages, при mmap_populate окно читается целиком сразу
+ * при отображении.
+ *
+ * Если ядро поддерживает MSG_ZEROCOPY, данные отправляются без копирования в
+ * буфер сокета. Уведомления о завершении таких отправок приходят в очередь
+ * ошибок сокета и разбираются в reap(). Если ядро всё равно скопировало
+ * данные (например, на loopback), MSG_ZEROCOPY отключается: накладные
+ * расходы на уведомления тогда ничего не дают.
+ */
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>  // Требует struct timespec
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include "server.h"
+
+/// Размер huge page, по которому выравниваются окна отображения.
+const uint64_t HUGE_PAGE_SIZE = 2 << 20;
+
+MappedSender::~MappedSender() { unmap(); }
+
+/**
+ * @brief Начинает передачу файла через отображение.
+ *
+ * @param config Конфигурация сервера.
+ * @param socket Сокет клиента.
+ * @param fd Дескриптор файла.
+ * @param file_size Размер файла.
+ * @param position Позиция, с которой начинается передача.
+ * @return false, если файл не удалось отобразить.
+ */
+
+bool MappedSender::start(const ServerConfig& config, int socket, int fd,
+                         uint64_t file_size, uint64_t position) {
+  if (socket_ != socket) {
+    socket_ = socket;
+    int one = 1;
+    zero_copy_ = setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one,
+                            sizeof(one)) == 0;
+    pending_ = 0;
+  }
+  unmap();
+  fd_ = fd;
+  file_size_ = file_size;
+  window_size_ = std::max<uint64_t>(config.mmap_window / HUGE_PAGE_SIZE, 1) *
+                 HUGE_PAGE_SIZE;
+  populate_ = config.mmap_populate;
+  hugepages_ = config.mmap_hugepages;
+  return position >= file_size || map(position);
+}
+
+/**
+ * @brief Отображает окно файла, содержащее указанную позицию.
+ *
+ * @param position Позиция в файле.
+ * @return false при ошибке mmap.
+ */
+
+bool MappedSender::map(uint64_t position) {
+  unmap();
+  uint64_t offset = position / window_size_ * window_size_;
+  size_t size = std::min(window_size_, file_size_ - offset);
+  int flags = MAP_SHARED | (populate_ ? MAP_POPULATE : 0);
+  void* map = mmap(nullptr, size, PROT_READ, flags, fd_, offset);
+  if (map == MAP_FAILED) {
+    perror("mmap failed");
+    return false;
+  }
+  if (hugepages_) madvise(map, size, MADV_HUGEPAGE);
+  map_ = static_cast<char*>(map);
+  map_offset_ = offset;
+  map_size_ = size;
+  return true;
+}
+
+void MappedSender::unmap() {
+  if (map_ != nullptr) munmap(map_, map_size_);
+  map_ = nullptr;
+  map_size_ = 0;
+}
+
+/**
+ * @brief Отправляет в сокет участок файла из отображения.
+ *
+ * За один вызов отправляется не больше, чем осталось до конца текущего окна.
+ * Страницы, переданные с MSG_ZEROCOPY, удерживаются ядром, поэтому окно можно
+ * снять, не дожидаясь уведомлений.
+ *
+ * @param position Позиция в файле.
+ * @param length Количество байт.
+ * @param flags Флаги send.
+ * @return Количество отправленных байт или -1 с кодом ошибки в errno.
+ */
+
+ssize_t MappedSender::send(uint64_t position, size_t length, int flags) {
+  if (map_ == nullptr || position < map_offset_ ||
+      position >= map_offset_ + map_size_) {
+    if (!map(position)) return -1;
+  }
+  const char* data = map_ + (position - map_offset_);
+  size_t count = std::min<uint64_t>(length, map_offset_ + map_size_ - position);
+  if (zero_copy_) {
+    if (pending_ > 0) reap();
+    ssize_t sent = ::send(socket_, data, count, flags | MSG_ZEROCOPY);
+    if (sent > 0) pending_++;
+    // ENOBUFS: исчерпан лимит памяти под уведомления, отправляем с копией
+    if (sent >= 0 || errno != ENOBUFS) return sent;
+  }
+  return ::send(socket_, data, count, flags);
+}
+
+/**
+ * @brief Разбирает уведомления о завершении отправок MSG_ZEROCOPY.
+ *
+ * Уведомления вызывают EPOLLERR, поэтому событийная модель вызывает reap(),
+ * чтобы отличить их от настоящей ошибки сокета.
+ *
+ * @return true, если на сокете нет ошибки.
+ */
+
+bool MappedSender::reap() {
+  if (socket_ < 0) return false;
+  while (1) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      bool recverr =
+          (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+      if (!recverr) continue;
+      const struct sock_extended_err* err =
+          reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cmsg));
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      // Уведомление покрывает отправки с номерами [ee_info, ee_data]
+      uint32_t count = err->ee_data - err->ee_info + 1;
+      pending_ -= std::min(pending_, count);
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zero_copy_ = false;
+    }
+  }
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(socket_, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+    return false;
+  return error == 0;
+}
+
+/**
+ * @brief Завершает передачу и снимает отображение.
+ */
+
+void MappedSender::finish() {
+  unmap();
+  if (pending_ > 0) reap();
+}
+
+/**
+ * @brief Передаёт участок файла из отображения через блокирующий сокет.
+ *
+ * @param sender Отображение файла.
+ * @param offset Позиция в файле, с которой начинается отправка.
+ * @param length Количество байт для отправки.
+ * @return false при разрыве соединения или ошибке отображения.
+ */
+
+bool sendFileMapped(MappedSender& sender, size_t offset, size_t length) {
+  while (length > 0) {
+    ssize_t sent = sender.send(offset, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    offset += sent;
+    length -= sent;
+  }
+  return true;
+}
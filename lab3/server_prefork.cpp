@@ -0,0 +1,172 @@
+/**
+ * @file server_prefork.cpp
+ * @brief Модель "prefork": заранее созданные рабочие процессы.
+ *
+ * При запуске создаётся workers процессов. Каждый открывает свой
+ * прослушивающий сокет с SO_REUSEPORT на адресе сервера, и ядро само
+ * распределяет новые подключения между сокетами по хэшу адресов: процессы не
+ * делят одну очередь и не будят друг друга. Процесс обслуживает клиентов по
+ * одному в блокирующем режиме, как дочерний процесс модели "fork", но без
+ * fork на каждое подключение.
+ *
+ * Главный процесс только следит за рабочими: завершившийся процесс (после
+ * max_requests подключений или аварийно) заменяется новым. Подключения,
+ * ожидавшие в очереди завершившегося процесса, сбрасываются ядром.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "server.h"
+
+/// Процесс, завершившийся быстрее, заменяется не сразу.
+const int64_t PREFORK_RESPAWN_MS = 1000;
+
+/**
+ * @brief Открывает прослушивающий сокет рабочего процесса.
+ *
+ * @param config Конфигурация сервера.
+ * @return Дескриптор сокета или -1 при ошибке.
+ */
+
+static int openListener(const ServerConfig& config) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket failed");
+    return -1;
+  }
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = inet_addr(config.server_address.c_str());
+  address.sin_port = htons(config.port);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(fd, config.backlog) < 0) {
+    perror("bind failed");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Цикл рабочего процесса. Не возвращает управление.
+ *
+ * @param config Конфигурация сервера.
+ * @param server_fd Прослушивающий сокет главного процесса.
+ */
+
+[[noreturn]] static void runWorker(ServerConfig& config, int server_fd) {
+  close(server_fd);
+  int listen_fd = openListener(config);
+  if (listen_fd < 0) exit(EXIT_FAILURE);
+  fileCache().rewatch();
+
+  int served = 0;
+  while (config.max_requests <= 0 || served < config.max_requests) {
+    int new_socket = accept(listen_fd, nullptr, nullptr);
+    if (new_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept failed");
+      exit(EXIT_FAILURE);
+    }
+    int64_t accepted_us = monotonicUs();
+    metricAdd(METRIC_CONNECTIONS);
+    metricAdd(METRIC_ACTIVE_CONNECTIONS);
+    serveClient(config, new_socket, accepted_us);
+    served++;
+  }
+  logDebug() << "Worker " << getpid() << " served " << served
+             << " connections, exiting";
+  exit(0);
+}
+
+/**
+ * @brief Запускает рабочий процесс.
+ *
+ * @return Идентификатор процесса.
+ */
+
+static pid_t spawnWorker(ServerConfig& config, int server_fd) {
+  pid_t pid;
+  while ((pid = fork()) < 0) {
+    perror("fork failed");
+    sleep(1);
+  }
+  if (pid == 0) runWorker(config, server_fd);
+  return pid;
+}
+
+/**
+ * @brief Запускает модель "prefork" и следит за рабочими процессами.
+ *
+ * Возвращает управление только при ошибке.
+ *
+ * @param config Конфигурация сервера.
+ * @param server_fd Прослушивающий сокет с SO_REUSEPORT.
+ */
+
+void runPreforkServer(ServerConfig& config, int server_fd) {
+  checkDirectory(config);
+
+  int workers = config.workers;
+  if (workers <= 0) workers = std::thread::hardware_concurrency();
+  if (workers <= 0) workers = 1;
+  logInfo() << "Workers: " << workers;
+
+  std::vector<pid_t> pids(workers);
+  std::vector<int64_t> started(workers);
+  for (int i = 0; i < workers; i++) {
+    pids[i] = spawnWorker(config, server_fd);
+    started[i] = monotonicMs();
+  }
+  // Сокеты рабочих процессов уже в группе SO_REUSEPORT, и подключения,
+  // пришедшие на этот сокет до их запуска, будут сброшены
+  close(server_fd);
+  server_fd = -1;
+
+  while (1) {
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      perror("waitpid failed");
+      return;
+    }
+    auto it = std::find(pids.begin(), pids.end(), pid);
+    if (it == pids.end()) continue;
+    size_t index = it - pids.begin();
+
+    bool crashed = true;
+    if (WIFSIGNALED(status))
+      logWarn() << "Worker " << pid << " killed by signal "
+                << WTERMSIG(status);
+    else if (WEXITSTATUS(status) != 0)
+      logWarn() << "Worker " << pid << " exited with status "
+                << WEXITSTATUS(status);
+    else
+      crashed = false;
+    // Процесс, который падает сразу после запуска, не перезапускается
+    // в цикле без паузы
+    if (crashed && monotonicMs() - started[index] < PREFORK_RESPAWN_MS)
+      sleep(1);
+
+    // Новый процесс наследует кэш файлов с учётом изменений директории
+    fileCache().processEvents();
+    pids[index] = spawnWorker(config, server_fd);
+    started[index] = monotonicMs();
+  }
+}
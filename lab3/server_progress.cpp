@@ -0,0 +1,339 @@
+/**
+ * @file server_progress.cpp
+ * @brief Хранилище прогресса передачи файлов клиента.
+ *
+ * Прогресс клиента хранится в файле "client_<id>.progress" - отображаемой в
+ * память хеш-таблице с записями фиксированной длины и открытой адресацией.
+ * Поиск записи выполняется без блокировок, смещение обновляется на месте
+ * атомарной записью в разделяемое отображение, поэтому подтверждённые
+ * смещения переживают аварийное завершение процесса. Добавление новых
+ * записей защищено flock (между процессами) и мьютексом (между потоками).
+ * Файл создаётся разреженным: место на диске занимают только страницы с
+ * записями.
+ */
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#include "server.h"
+
+const uint64_t PROGRESS_MAGIC = 0x31474f5250535052;  // "RPSPROG1"
+const size_t PROGRESS_HEADER_SIZE = 4096;
+const uint32_t PROGRESS_SLOTS = 1 << 16;
+
+enum : uint32_t { SLOT_EMPTY = 0, SLOT_READY = 1 };
+
+/**
+ * @struct ProgressHeader
+ * @brief Заголовок файла прогресса.
+ */
+struct ProgressHeader {
+  uint64_t magic;
+  uint32_t slots;
+};
+
+/**
+ * @struct ProgressRecord
+ * @brief Запись о прогрессе передачи одного файла (256 байт).
+ */
+struct ProgressRecord {
+  uint64_t offset;  ///< Подтверждённое смещение, обновляется атомарно.
+  uint64_t hash;    ///< Хеш имени файла.
+  uint32_t state;   ///< SLOT_EMPTY или SLOT_READY, пишется последним.
+  uint16_t name_length;
+  char name[PROGRESS_NAME_MAX + 1];
+};
+
+static_assert(sizeof(ProgressRecord) == 256,
+              "ProgressRecord must be 256 bytes");
+
+/**
+ * @brief FNV-1a хеш имени файла.
+ */
+
+static uint64_t hashName(const std::string& name) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+ProgressStore::~ProgressStore() {
+  if (map_ != nullptr) munmap(map_, map_size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+/**
+ * @brief Открывает файл прогресса, создавая его при необходимости.
+ *
+ * @param path Путь к файлу прогресса.
+ * @return false, если файл не удалось открыть или он повреждён.
+ */
+
+bool ProgressStore::open(const std::string& path) {
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd_ < 0) return false;
+  map_size_ =
+      PROGRESS_HEADER_SIZE + (size_t)PROGRESS_SLOTS * sizeof(ProgressRecord);
+
+  flock(fd_, LOCK_EX);
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    flock(fd_, LOCK_UN);
+    return false;
+  }
+  bool created = st.st_size == 0;
+  // Обращение к отображению за концом укороченного файла вызвало бы SIGBUS:
+  // недостающие записи дополняются нулями
+  if ((uint64_t)st.st_size < map_size_ && ftruncate(fd_, map_size_) < 0) {
+    flock(fd_, LOCK_UN);
+    return false;
+  }
+  map_ = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map_ == MAP_FAILED) {
+    map_ = nullptr;
+    flock(fd_, LOCK_UN);
+    return false;
+  }
+  ProgressHeader* header = static_cast<ProgressHeader*>(map_);
+  if (created) {
+    header->slots = PROGRESS_SLOTS;
+    __atomic_store_n(&header->magic, PROGRESS_MAGIC, __ATOMIC_RELEASE);
+    msync(map_, PROGRESS_HEADER_SIZE, MS_SYNC);
+  }
+  flock(fd_, LOCK_UN);
+
+  if (header->magic != PROGRESS_MAGIC || header->slots != PROGRESS_SLOTS) {
+    logError() << "Corrupted progress file: " << path;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Ищет запись о файле.
+ *
+ * @param fileName Имя файла.
+ * @param create Добавить запись с нулевым смещением, если её нет.
+ * @return Указатель на смещение в записи или nullptr.
+ */
+
+uint64_t* ProgressStore::find(const std::string& fileName, bool create) {
+  if (map_ == nullptr || fileName.size() > PROGRESS_NAME_MAX) return nullptr;
+  ProgressRecord* records = reinterpret_cast<ProgressRecord*>(
+      static_cast<char*>(map_) + PROGRESS_HEADER_SIZE);
+  uint64_t hash = hashName(fileName);
+  uint32_t mask = PROGRESS_SLOTS - 1;
+
+  for (uint32_t i = 0; i < PROGRESS_SLOTS; i++) {
+    ProgressRecord& record = records[(hash + i) & mask];
+    uint32_t state = __atomic_load_n(&record.state, __ATOMIC_ACQUIRE);
+    if (state == SLOT_EMPTY) {
+      if (!create) return nullptr;
+      std::lock_guard<std::mutex> lock(insert_mutex_);
+      flock(fd_, LOCK_EX);
+      // Слот мог занять другой процесс, пока мы ждали блокировку
+      if (__atomic_load_n(&record.state, __ATOMIC_ACQUIRE) == SLOT_EMPTY) {
+        record.offset = 0;
+        record.hash = hash;
+        record.name_length = fileName.size();
+        memcpy(record.name, fileName.c_str(), fileName.size() + 1);
+        __atomic_store_n(&record.state, SLOT_READY, __ATOMIC_RELEASE);
+        flock(fd_, LOCK_UN);
+        return &record.offset;
+      }
+      flock(fd_, LOCK_UN);
+    }
+    if (record.hash == hash && record.name_length == fileName.size() &&
+        memcmp(record.name, fileName.data(), fileName.size()) == 0)
+      return &record.offset;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Возвращает сохранённое смещение.
+ *
+ * @param fileName Имя файла.
+ * @return Смещение или -1, если записи нет.
+ */
+
+int64_t ProgressStore::get(const std::string& fileName) {
+  uint64_t* offset = find(fileName, false);
+  if (offset == nullptr) return -1;
+  return __atomic_load_n(offset, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Записывает смещение на месте, добавляя запись при необходимости.
+ *
+ * @param fileName Имя файла.
+ * @param value Новое смещение.
+ * @return false, если запись не удалось добавить.
+ */
+
+bool ProgressStore::set(const std::string& fileName, uint64_t value) {
+  uint64_t* offset = find(fileName, true);
+  if (offset == nullptr) return false;
+  __atomic_store_n(offset, value, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Сбрасывает страницу с записью о файле на диск.
+ *
+ * Запись в отображение уже переживает аварийное завершение процесса; sync
+ * нужен, чтобы смещение пережило и сбой системы.
+ *
+ * @param fileName Имя файла.
+ * @param wait Дождаться окончания записи (MS_SYNC) или только начать её.
+ */
+
+void ProgressStore::sync(const std::string& fileName, bool wait) {
+  uint64_t* offset = find(fileName, false);
+  if (offset == nullptr) return;
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start =
+      reinterpret_cast<uintptr_t>(offset) & ~(uintptr_t)(page - 1);
+  msync(reinterpret_cast<void*>(start), page, wait ? MS_SYNC : MS_ASYNC);
+}
+
+/**
+ * @brief Переносит записи из текстового файла прогресса старого формата.
+ *
+ * Строки вида "имя: смещение"; повреждённые строки пропускаются.
+ *
+ * @param path Путь к текстовому файлу.
+ */
+
+void ProgressStore::import(const std::string& path) {
+  std::ifstream inFile(path);
+  std::string line;
+  while (getline(inFile, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos || colon == 0) continue;
+    std::istringstream iss(line.substr(colon + 1));
+    uint64_t value;
+    if (iss >> value && get(line.substr(0, colon)) < 0)
+      set(line.substr(0, colon), value);
+  }
+}
+
+/**
+ * @brief Открывает хранилище прогресса клиента.
+ *
+ * Внутри процесса хранилище одного клиента разделяется всеми подключениями.
+ * При первом открытии в него переносятся записи из файла client_<id>.txt
+ * старого формата.
+ *
+ * @param config Конфигурация сервера.
+ * @param client_id Идентификатор клиента.
+ * @return Хранилище или nullptr при ошибке.
+ */
+
+std::shared_ptr<ProgressStore> openProgressStore(const ServerConfig& config,
+                                                 int client_id) {
+  static std::mutex mutex;
+  static std::map<int, std::weak_ptr<ProgressStore>> stores;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<ProgressStore> store = stores[client_id].lock();
+  if (store) return store;
+
+  std::string path = progressFilePath(config, client_id);
+  bool exists = access(path.c_str(), F_OK) == 0;
+  store = std::make_shared<ProgressStore>();
+  if (!store->open(path)) return nullptr;
+  if (!exists) {
+    std::string legacy =
+        config.directory + "/client_" + std::to_string(client_id) + ".txt";
+    if (access(legacy.c_str(), F_OK) == 0) {
+      logInfo() << "Importing progress from " << legacy;
+      store->import(legacy);
+    }
+  }
+  stores[client_id] = store;
+  return store;
+}
+
+/**
+ * @brief Возвращает время монотонных часов в миллисекундах.
+ */
+
+int64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Начинает отслеживание передачи файла.
+ *
+ * @param config Конфигурация сервера.
+ * @param progress Хранилище прогресса; nullptr отключает контрольные точки
+ * (например, для передачи диапазона).
+ * @param fileName Имя файла.
+ * @param position Позиция, с которой начинается передача.
+ */
+
+void ProgressCheckpoint::start(const ServerConfig& config,
+                               ProgressStore* progress,
+                               const std::string& fileName,
+                               uint64_t position) {
+  progress_ = progress;
+  file_name_ = fileName;
+  bytes_ = config.checkpoint_bytes;
+  interval_ms_ = config.checkpoint_interval_ms;
+  last_position_ = position;
+  last_time_ms_ = monotonicMs();
+}
+
+/**
+ * @brief Сохраняет позицию, если с прошлой контрольной точки передано
+ * достаточно байт или прошло достаточно времени.
+ *
+ * @param position Позиция, до которой данные отправлены.
+ */
+
+void ProgressCheckpoint::update(uint64_t position) {
+  if (progress_ == nullptr) return;
+  if (bytes_ > 0 && position - last_position_ >= bytes_) {
+    save(position);
+    return;
+  }
+  if (interval_ms_ > 0) {
+    int64_t now = monotonicMs();
+    if (now - last_time_ms_ >= interval_ms_) save(position);
+  }
+}
+
+/**
+ * @brief Сохраняет последнюю позицию при прерывании передачи и прекращает
+ * отслеживание.
+ *
+ * @param position Позиция, до которой данные отправлены.
+ */
+
+void ProgressCheckpoint::finish(uint64_t position) {
+  if (progress_ != nullptr && position != last_position_) save(position);
+  progress_ = nullptr;
+}
+
+void ProgressCheckpoint::save(uint64_t position) {
+  if (progress_->set(file_name_, position)) progress_->sync(file_name_, false);
+  last_position_ = position;
+  last_time_ms_ = monotonicMs();
+}
@@ -0,0 +1,439 @@
+/**
+ * @file server_protocol.cpp
+ * @brief Конечный автомат протокола, общий для событийных моделей сервера
+ * ("epoll", "io_uring").
+ *
+ * Протокол для каждого подключения ведётся конечным автоматом:
+ * FRAME_HELLO -> FRAME_FILE_REQUEST -> FRAME_SEND_DATA (с флагом
+ * FLAG_RESUME или без) -> кадры FRAME_DATA -> FRAME_END_OF_DATA. Модель
+ * складывает принятые байты в ProtocolConnection::in и отправляет кадры из
+ * ProtocolConnection::out, а данные файла в состоянии Sending передаёт сама.
+ *
+ * Манифест контрольных сумм может потребовать чтения всего файла, а архив
+ * мелких файлов - открытия тысяч файлов, поэтому они готовятся в пуле из
+ * hash_threads потоков, общем для всех потоков модели; готовые кадры
+ * возвращаются в поток модели через очередь и eventfd. Запросы сверх числа
+ * потоков пула ждут в его очереди.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+#include "server.h"
+
+/**
+ * @class HashingPool
+ * @brief Потоки, по очереди выполняющие долгие подсчёты для подключений.
+ */
+class HashingPool {
+ public:
+  explicit HashingPool(int threads);
+  void submit(std::function<void()> job);
+
+ private:
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> jobs_;
+};
+
+/**
+ * @brief Запускает потоки пула.
+ *
+ * @param threads Количество потоков; 0 - по числу ядер.
+ */
+
+HashingPool::HashingPool(int threads) {
+  if (threads <= 0) threads = std::thread::hardware_concurrency();
+  if (threads <= 0) threads = 1;
+  logInfo() << "Hashing threads: " << threads;
+  for (int i = 0; i < threads; i++)
+    std::thread(&HashingPool::run, this).detach();
+}
+
+/**
+ * @brief Ставит подсчёт в очередь пула.
+ *
+ * @param job Подсчёт.
+ */
+
+void HashingPool::submit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+/**
+ * @brief Цикл потока пула.
+ */
+
+void HashingPool::run() {
+  while (1) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return !jobs_.empty(); });
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    job();
+  }
+}
+
+/**
+ * @brief Возвращает пул процесса, создавая его при первом обращении.
+ *
+ * Пул не разрушается: его потоки работают до выхода из процесса.
+ *
+ * @param config Конфигурация сервера.
+ */
+
+static HashingPool& hashingPool(const ServerConfig& config) {
+  static HashingPool* pool = new HashingPool(config.hash_threads);
+  return *pool;
+}
+
+/**
+ * @brief Разбирает все полностью принятые кадры.
+ *
+ * @param conn Подключение.
+ * @return false при нарушении протокола.
+ */
+
+bool ProtocolWorker::processInput(ProtocolConnection& conn) {
+  size_t pos = 0;
+  while (conn.state != ConnState::Sending &&
+         conn.state != ConnState::Hashing &&
+         conn.in.size() - pos >= FRAME_HEADER_SIZE) {
+    FrameHeader header;
+    if (!decodeFrameHeader(
+            reinterpret_cast<const unsigned char*>(conn.in.data() + pos),
+            header) ||
+        header.length > MAX_CONTROL_PAYLOAD)
+      return false;
+    if (conn.in.size() - pos < FRAME_HEADER_SIZE + header.length) break;
+    std::string payload =
+        conn.in.substr(pos + FRAME_HEADER_SIZE, header.length);
+    pos += FRAME_HEADER_SIZE + header.length;
+    if (!handleFrame(conn, header, payload)) return false;
+  }
+  conn.in.erase(0, pos);
+  return true;
+}
+
+/**
+ * @brief Обрабатывает кадр клиента в соответствии с текущим состоянием.
+ *
+ * @param conn Подключение.
+ * @param header Заголовок кадра.
+ * @param payload Полезная нагрузка кадра.
+ * @return false, если подключение нужно закрыть.
+ */
+
+bool ProtocolWorker::handleFrame(ProtocolConnection& conn,
+                                 const FrameHeader& header,
+                                 const std::string& payload) {
+  switch (conn.state) {
+    case ConnState::ReadId: {
+      if (header.type != FRAME_HELLO) return false;
+      std::string reply;
+      if (!openSession(config_, header, payload, conn.client_id, reply)) {
+        // Подключение закрывается: короткий ответ уходит в пустой буфер
+        // сокета сразу
+        send(conn.fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+        return false;
+      }
+      conn.out += reply;
+      conn.codecs = header.offset;
+      metricRecord(HISTOGRAM_HANDSHAKE, monotonicUs() - conn.accepted_us);
+      logInfo() << "Client id: " << conn.client_id;
+      conn.progress = checkFileExistance(config_, conn.client_id);
+      if (!conn.progress) return false;
+      conn.state = ConnState::ReadFileName;
+      return true;
+    }
+    case ConnState::ReadFileName: {
+      if (header.type != FRAME_FILE_REQUEST) return false;
+      if (header.flags & FLAG_BUNDLE) {
+        startFileStatus(conn, header, payload);
+        return true;
+      }
+      int64_t recorded = 0;
+      std::string name = payload, status;
+      bool found =
+          prepareFileStatus(*conn.progress, header, name, recorded, status);
+      conn.out += encodeFrame(FRAME_FILE_STATUS, found ? FLAG_FOUND : 0,
+                              recorded, status);
+      if (found) acceptFile(conn, header, name);
+      return true;
+    }
+    case ConnState::ReadCommand: {
+      if (header.type == FRAME_MANIFEST_REQUEST) {
+        startManifest(conn);
+        return true;
+      }
+      if (header.type == FRAME_DELTA_REQUEST) {
+        if (!addDeltaSignatures(conn.delta, header, payload)) return false;
+        if (header.flags & FLAG_LAST) startDelta(conn);
+        return true;
+      }
+      if (header.type == FRAME_CHUNKS_REQUEST) {
+        startChunkList(conn);
+        return true;
+      }
+      if (header.type != FRAME_SEND_DATA) return false;
+      size_t position = 0;
+      size_t length = SIZE_MAX;
+      if (header.flags & FLAG_RANGE) {
+        position = header.offset;
+        length = decodeU64(payload);
+      } else if (header.flags & FLAG_RESUME) {
+        position = header.offset;
+        logDebug() << "Resuming file transfer from: " << position
+                   << " for file: " << conn.file_name;
+      }
+      startSending(conn, position, length);
+      return true;
+    }
+    case ConnState::Hashing:
+    case ConnState::Sending:
+      return true;
+  }
+  return true;
+}
+
+/**
+ * @brief Переводит подключение к командам для найденного файла.
+ *
+ * @param conn Подключение.
+ * @param request Заголовок запроса FRAME_FILE_REQUEST.
+ * @param name Имя файла в кэше файлов.
+ */
+
+void ProtocolWorker::acceptFile(ProtocolConnection& conn,
+                                const FrameHeader& request,
+                                const std::string& name) {
+  conn.file_name = name;
+  conn.state = ConnState::ReadCommand;
+  // Конвейерный запрос: передача начинается без FRAME_SEND_DATA
+  if (request.flags & FLAG_STREAM)
+    startSending(conn, request.offset, SIZE_MAX);
+}
+
+/**
+ * @brief Открывает запрошенный файл и переводит подключение в режим передачи.
+ *
+ * @param conn Подключение.
+ * @param startPos Позиция в файле, с которой начинается отправка данных.
+ * @param length Количество байт для отправки; SIZE_MAX - до конца файла.
+ */
+
+void ProtocolWorker::startSending(ProtocolConnection& conn, size_t startPos,
+                                  size_t length) {
+  conn.file = fileCache().lookup(conn.file_name);
+  if (!conn.file) {
+    logError() << "Failed to open file: server_files/" << conn.file_name;
+    conn.out += encodeFrame(FRAME_END_OF_DATA, 0, startPos);
+    conn.state = ConnState::ReadFileName;
+    return;
+  }
+  uint64_t file_size = conn.file->size;
+  conn.file_pos = startPos > file_size ? file_size : startPos;
+  conn.file_end = length < file_size - conn.file_pos ? conn.file_pos + length
+                                                     : file_size;
+  conn.whole_tail = length == SIZE_MAX;
+  conn.checkpoint.start(config_,
+                        conn.whole_tail ? conn.progress.get() : nullptr,
+                        conn.file_name, conn.file_pos);
+  conn.io.start(config_, conn.file, conn.file_pos, conn.file_end);
+  beginSending(conn);
+  conn.compressor.start(config_, conn.codecs, conn.file);
+  conn.shaper.start(config_, conn.client_id, conn.file_name);
+  conn.tcp.start(config_, conn.fd);
+  conn.metrics.start(conn.file_pos);
+  conn.state = ConnState::Sending;
+}
+
+/**
+ * @brief Завершает передачу файла кадром FRAME_END_OF_DATA.
+ *
+ * @param conn Подключение.
+ */
+
+void ProtocolWorker::finishSending(ProtocolConnection& conn) {
+  conn.metrics.finish(conn.file_pos);
+  conn.io.finish(conn.file_pos);
+  conn.compressor.finish();
+  conn.tcp.finish();
+  endSending(conn);
+  conn.file.reset();
+  conn.checkpoint.finish(conn.file_pos);
+  if (conn.whole_tail)
+    updateProgressFile(*conn.progress, conn.file_name, conn.file_pos);
+  logInfo() << "Total bytes sent for " << conn.file_name << ": "
+            << conn.file_pos;
+  conn.out += encodeFrame(FRAME_END_OF_DATA, 0, conn.file_pos);
+  conn.state = ConnState::ReadFileName;
+}
+
+/**
+ * @brief Сохраняет, сколько данных успели отправить, если подключение
+ * закрывается посреди передачи.
+ *
+ * @param conn Подключение.
+ */
+
+void ProtocolWorker::abortSending(ProtocolConnection& conn) {
+  if (conn.state != ConnState::Sending) return;
+  conn.checkpoint.finish(conn.file_pos);
+  conn.io.finish(conn.file_pos);
+  conn.metrics.finish(conn.file_pos);
+}
+
+/**
+ * @brief Готовит ответ на запрос архива мелких файлов в пуле потоков.
+ *
+ * Сборка архива открывает и копирует до BUNDLE_MAX_FILES файлов и не должна
+ * задерживать остальные подключения потока модели.
+ *
+ * @param conn Подключение.
+ * @param request Заголовок запроса FRAME_FILE_REQUEST.
+ * @param payload Шаблон имён.
+ */
+
+void ProtocolWorker::startFileStatus(ProtocolConnection& conn,
+                                     const FrameHeader& request,
+                                     const std::string& payload) {
+  std::shared_ptr<ProgressStore> progress = conn.progress;
+  auto name = std::make_shared<std::string>(payload);
+  auto found = std::make_shared<bool>(false);
+  startHashing(
+      conn, ConnState::ReadFileName,
+      [progress, request, name, found]() {
+        int64_t recorded = 0;
+        std::string status;
+        *found = prepareFileStatus(*progress, request, *name, recorded, status);
+        return encodeFrame(FRAME_FILE_STATUS, *found ? FLAG_FOUND : 0,
+                           recorded, status);
+      },
+      [this, request, name, found](ProtocolConnection& conn) {
+        if (*found) acceptFile(conn, request, *name);
+      });
+}
+
+/**
+ * @brief Запускает подсчёт манифеста запрошенного файла в пуле потоков.
+ *
+ * @param conn Подключение.
+ */
+
+void ProtocolWorker::startManifest(ProtocolConnection& conn) {
+  std::string file_name = conn.file_name;
+  startHashing(conn, ConnState::ReadCommand, [file_name]() {
+    std::vector<uint32_t> manifest;
+    if (!loadManifest(file_name, manifest)) {
+      logError() << "Failed to compute manifest for: " << file_name;
+      manifest.clear();
+    }
+    return encodeManifest(manifest);
+  });
+}
+
+/**
+ * @brief Запускает сравнение запрошенного файла с копией клиента в
+ * пуле потоков.
+ *
+ * После отправки дельты клиент запрашивает недостающие участки заново, с
+ * кадра FRAME_FILE_REQUEST.
+ *
+ * @param conn Подключение.
+ */
+
+void ProtocolWorker::startDelta(ProtocolConnection& conn) {
+  std::string file_name = conn.file_name;
+  auto request = std::make_shared<DeltaRequest>(std::move(conn.delta));
+  conn.delta = DeltaRequest();
+  startHashing(conn, ConnState::ReadFileName, [file_name, request]() {
+    return computeDelta(file_name, *request);
+  });
+}
+
+/**
+ * @brief Запускает деление запрошенного файла на куски в пуле потоков.
+ *
+ * Как и после дельты, недостающие куски клиент запрашивает заново, с кадра
+ * FRAME_FILE_REQUEST.
+ *
+ * @param conn Подключение.
+ */
+
+void ProtocolWorker::startChunkList(ProtocolConnection& conn) {
+  std::string file_name = conn.file_name;
+  startHashing(conn, ConnState::ReadFileName,
+               [file_name]() { return computeChunkList(file_name); });
+}
+
+/**
+ * @brief Ставит долгий подсчёт для подключения в очередь пула.
+ *
+ * До получения результата кадры клиента не разбираются.
+ *
+ * @param conn Подключение.
+ * @param next Состояние подключения после отправки результата.
+ * @param compute Подсчёт, возвращающий кадры для отправки клиенту.
+ * @param then Вызывается в потоке модели после смены состояния.
+ */
+
+void ProtocolWorker::startHashing(
+    ProtocolConnection& conn, ConnState next,
+    std::function<std::string()> compute,
+    std::function<void(ProtocolConnection&)> then) {
+  conn.state = ConnState::Hashing;
+  int fd = conn.fd;
+  uint64_t serial = conn.serial;
+  hashingPool(config_).submit([this, fd, serial, next, compute, then]() {
+    ManifestResult result = {fd, serial, compute(), next, then};
+    {
+      std::lock_guard<std::mutex> lock(manifests_mutex_);
+      manifests_.push_back(std::move(result));
+    }
+    uint64_t one = 1;
+    if (write(event_fd_, &one, sizeof(one)) < 0) perror("eventfd write failed");
+  });
+}
+
+/**
+ * @brief Отправляет готовые манифесты, дельты и ответы на запросы архивов
+ * и возобновляет разбор кадров.
+ */
+
+void ProtocolWorker::completeManifests() {
+  std::vector<ManifestResult> ready;
+  {
+    std::lock_guard<std::mutex> lock(manifests_mutex_);
+    ready.swap(manifests_);
+  }
+  for (auto& result : ready) {
+    // Подключение могли закрыть, а его fd - выдать новому клиенту
+    ProtocolConnection* conn = findConnection(result.fd, result.serial);
+    if (conn == nullptr || conn->state != ConnState::Hashing) continue;
+    conn->out += result.frames;
+    conn->state = result.next;
+    if (result.then) result.then(*conn);
+    resume(*conn);
+  }
+}
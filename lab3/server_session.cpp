@@ -0,0 +1,168 @@
+/**
+ * @file server_session.cpp
+ * @brief Сессии клиентов.
+ *
+ * В ответ на FRAME_HELLO с флагом FLAG_SESSION сервер выдаёт клиенту маркер
+ * сессии (FRAME_SESSION). Переподключившись после разрыва или при следующем
+ * запуске, клиент отправляет вместо идентификатора маркер (FLAG_SESSION |
+ * FLAG_RESUME) и сразу за ним - запросы файлов: сервер находит по маркеру
+ * идентификатор клиента, и в продолжении сессии нет ни одного лишнего
+ * обмена. Маркер - случайное 64-битное число, поэтому подобрать чужую
+ * сессию нельзя.
+ *
+ * Сессии хранятся в разделяемой памяти, общей для процессов моделей "fork"
+ * и "prefork", - открытая адресация по маркеру на SESSION_PROBES записей от
+ * начальной. Сессия живёт session_ttl секунд после последнего подключения,
+ * после чего её запись может занять новая сессия. Запись меняется без
+ * блокировок: на время записи срок сессии равен SESSION_BUSY, а читатель
+ * принимает запись, только если срок до и после чтения одинаков.
+ */
+
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include "protocol.h"
+#include "server.h"
+
+/// Количество записей таблицы сессий.
+const size_t SESSION_SLOTS = 4096;
+/// Сколько записей от начальной просматривается при поиске сессии.
+const size_t SESSION_PROBES = 32;
+/// Срок записи, которая сейчас заполняется.
+const int64_t SESSION_BUSY = INT64_MAX;
+
+/**
+ * @struct SessionSlot
+ * @brief Запись таблицы сессий.
+ */
+struct SessionSlot {
+  std::atomic<uint64_t> token;
+  std::atomic<int32_t> client_id;
+  std::atomic<int64_t> expires;  ///< Монотонное время в мс; 0 - свободна.
+};
+
+/**
+ * @struct SessionTable
+ * @brief Сессии всех процессов сервера.
+ */
+struct SessionTable {
+  SessionSlot slots[SESSION_SLOTS];
+};
+
+/**
+ * @brief Возвращает таблицу сессий, общую для всех процессов сервера.
+ *
+ * Первый вызов должен произойти до fork.
+ */
+
+SessionTable* sessionTable() {
+  static SessionTable* table = [] {
+    void* map = mmap(nullptr, sizeof(SessionTable), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return new SessionTable();
+    return static_cast<SessionTable*>(map);
+  }();
+  return table;
+}
+
+/**
+ * @brief Заводит сессию клиента.
+ *
+ * @param config Конфигурация сервера.
+ * @param client_id Идентификатор клиента.
+ * @return Маркер сессии или 0, если сессии отключены или таблица заполнена.
+ */
+
+static uint64_t createSession(const ServerConfig& config, int client_id) {
+  uint64_t token = 0;
+  if (config.session_ttl <= 0 ||
+      getrandom(&token, sizeof(token), 0) != sizeof(token) || token == 0)
+    return 0;
+  int64_t now = monotonicMs();
+  SessionTable* table = sessionTable();
+  for (size_t i = 0; i < SESSION_PROBES; i++) {
+    SessionSlot& slot = table->slots[(token + i) % SESSION_SLOTS];
+    int64_t expires = slot.expires.load();
+    if (expires > now || !slot.expires.compare_exchange_strong(
+                             expires, SESSION_BUSY))
+      continue;
+    slot.client_id.store(client_id);
+    slot.token.store(token);
+    slot.expires.store(now + (int64_t)config.session_ttl * 1000);
+    return token;
+  }
+  return 0;
+}
+
+/**
+ * @brief Находит действующую сессию и продлевает её.
+ *
+ * @param config Конфигурация сервера.
+ * @param token Маркер сессии.
+ * @param client_id Идентификатор клиента сессии.
+ * @return false, если сессии нет или её срок истёк.
+ */
+
+static bool findSession(const ServerConfig& config, uint64_t token,
+                        int& client_id) {
+  if (token == 0) return false;
+  int64_t now = monotonicMs();
+  SessionTable* table = sessionTable();
+  for (size_t i = 0; i < SESSION_PROBES; i++) {
+    SessionSlot& slot = table->slots[(token + i) % SESSION_SLOTS];
+    int64_t expires = slot.expires.load();
+    if (slot.token.load() != token) continue;
+    int id = slot.client_id.load();
+    if (expires == SESSION_BUSY || expires <= now ||
+        slot.expires.load() != expires)
+      return false;
+    // Продление не должно затереть запись, которую уже заняли заново
+    slot.expires.compare_exchange_strong(
+        expires, now + (int64_t)config.session_ttl * 1000);
+    client_id = id;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Разбирает FRAME_HELLO: заводит новую сессию или продолжает прежнюю.
+ *
+ * @param config Конфигурация сервера.
+ * @param header Заголовок FRAME_HELLO.
+ * @param payload Полезная нагрузка FRAME_HELLO.
+ * @param client_id Идентификатор клиента.
+ * @param reply Кадр FRAME_SESSION для клиента; пустая строка, если клиент не
+ * просил сессию.
+ * @return false, если сессию продолжить нельзя: клиенту отправляется reply,
+ * и подключение закрывается.
+ */
+
+bool openSession(const ServerConfig& config, const FrameHeader& header,
+                 const std::string& payload, int& client_id,
+                 std::string& reply) {
+  reply.clear();
+  if (!(header.flags & FLAG_SESSION)) {
+    client_id = atoi(payload.c_str());
+    return true;
+  }
+  if (header.flags & FLAG_RESUME) {
+    uint64_t token = decodeU64(payload);
+    if (!findSession(config, token, client_id)) {
+      logInfo() << "Unknown or expired session";
+      reply = encodeFrame(FRAME_SESSION, 0, 0);
+      return false;
+    }
+    metricAdd(METRIC_SESSIONS_RESUMED);
+    reply = encodeFrame(FRAME_SESSION, FLAG_RESUME, token);
+    return true;
+  }
+  client_id = atoi(payload.c_str());
+  reply = encodeFrame(FRAME_SESSION, 0, createSession(config, client_id));
+  return true;
+}
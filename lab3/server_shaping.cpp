@@ -0,0 +1,220 @@
+/**
+ * @file server_shaping.cpp
+ * @brief Ограничение скорости отдачи корзинами маркеров.
+ *
+ * Корзины есть у сервера в целом (rate_limit), у каждого идентификатора
+ * клиента (client_rate_limit) и у каждого файла (file_rate_limit). Корзина
+ * хранится как одно атомарное число - теоретическое время освобождения
+ * (алгоритм GCRA): отправка куска сдвигает его на длительность передачи
+ * куска на заданной скорости, а если это время ушло вперёд больше чем на
+ * SHAPING_BURST_NS, отправитель ждёт разницу. Сдвиг делается одним
+ * compare-and-swap, поэтому корзины обходятся без блокировок и лежат в
+ * разделяемой памяти, общей для всех процессов модели "fork".
+ *
+ * Полоса сервера делится между клиентами пропорционально весам
+ * (client_weights): скорость корзины клиента - его доля rate_limit среди
+ * клиентов, отправлявших данные за последние SHAPING_IDLE_NS. Так жадный
+ * клиент не забирает полосу остальных, а полоса простаивающих клиентов
+ * достаётся активным.
+ *
+ * Корзины клиентов и файлов - открытая адресация по идентификатору клиента
+ * и хэшу имени файла. Записи не удаляются; если таблица заполнена, передача
+ * ограничивается только остальными корзинами. Разные файлы с одинаковым
+ * хэшем делят одну корзину.
+ */
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "server.h"
+
+/// Количество корзин клиентов и корзин файлов.
+const size_t SHAPING_SLOTS = 1024;
+/// Сколько времени корзина может отставать от часов: допустимый всплеск.
+const int64_t SHAPING_BURST_NS = 50000000;
+/// Клиент без отправок дольше этого не участвует в делении полосы.
+const int64_t SHAPING_IDLE_NS = 200000000;
+/// Как часто пересчитывается сумма весов активных клиентов.
+const int64_t SHAPING_SHARE_NS = 10000000;
+
+/**
+ * @struct ShapingSlot
+ * @brief Корзина маркеров клиента или файла.
+ */
+struct ShapingSlot {
+  std::atomic<uint64_t> key;  ///< 0 - свободная запись.
+  std::atomic<int64_t> tat;   ///< Теоретическое время освобождения, нс.
+  std::atomic<uint32_t> weight;
+};
+
+/**
+ * @struct ShapingState
+ * @brief Все корзины сервера.
+ */
+struct ShapingState {
+  std::atomic<int64_t> tat;  ///< Корзина сервера.
+  ShapingSlot clients[SHAPING_SLOTS];
+  ShapingSlot files[SHAPING_SLOTS];
+};
+
+/**
+ * @brief Возвращает корзины, общие для всех процессов сервера.
+ *
+ * Первый вызов должен произойти до fork. Анонимное отображение заполнено
+ * нулями, что соответствует пустым корзинам.
+ */
+
+ShapingState* shapingState() {
+  static ShapingState* state = [] {
+    void* map = mmap(nullptr, sizeof(ShapingState), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return new ShapingState();
+    return static_cast<ShapingState*>(map);
+  }();
+  return state;
+}
+
+/**
+ * @brief Точное монотонное время в микросекундах.
+ */
+
+int64_t monotonicUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Находит или занимает корзину по ключу.
+ *
+ * @param slots Таблица корзин.
+ * @param key Ненулевой ключ.
+ * @return Корзина или nullptr, если таблица заполнена.
+ */
+
+static ShapingSlot* findSlot(ShapingSlot* slots, uint64_t key) {
+  for (size_t i = 0; i < SHAPING_SLOTS; i++) {
+    ShapingSlot& slot = slots[(key + i) % SHAPING_SLOTS];
+    uint64_t current = slot.key.load(std::memory_order_acquire);
+    if (current == 0 &&
+        slot.key.compare_exchange_strong(current, key,
+                                         std::memory_order_acq_rel))
+      return &slot;
+    if (current == key) return &slot;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Резервирует в корзине передачу нескольких байт.
+ *
+ * @param tat Теоретическое время освобождения корзины.
+ * @param rate Скорость корзины, байт в секунду.
+ * @param bytes Объём.
+ * @param now Текущее время.
+ * @return Сколько наносекунд нужно подождать перед отправкой.
+ */
+
+static int64_t reserveTokens(std::atomic<int64_t>& tat, uint64_t rate,
+                             uint64_t bytes, int64_t now) {
+  int64_t cost = (int64_t)((__int128)bytes * 1000000000 / rate);
+  int64_t old = tat.load(std::memory_order_relaxed);
+  int64_t next;
+  do {
+    // Неиспользованная полоса копится не больше чем на SHAPING_BURST_NS
+    next = std::max(old, now - SHAPING_BURST_NS) + cost;
+  } while (!tat.compare_exchange_weak(old, next, std::memory_order_relaxed));
+  return std::max<int64_t>(0, next - now - SHAPING_BURST_NS);
+}
+
+/**
+ * @brief Начинает передачу файла.
+ *
+ * @param config Конфигурация сервера.
+ * @param client_id Идентификатор клиента.
+ * @param file_name Имя файла.
+ */
+
+void TrafficShaper::start(const ServerConfig& config, int client_id,
+                          const std::string& file_name) {
+  rate_limit_ = config.rate_limit;
+  client_rate_limit_ = config.client_rate_limit;
+  file_rate_limit_ = config.file_rate_limit;
+  active_ = rate_limit_ > 0 || client_rate_limit_ > 0 || file_rate_limit_ > 0;
+  client_ = nullptr;
+  file_ = nullptr;
+  share_time_ = 0;
+  if (!active_) return;
+
+  ShapingState* state = shapingState();
+  auto weight = config.client_weights.find(client_id);
+  weight_ = weight != config.client_weights.end() && weight->second > 0
+                ? weight->second
+                : 1;
+  if (rate_limit_ > 0 || client_rate_limit_ > 0) {
+    client_ = findSlot(state->clients, (uint64_t)(uint32_t)client_id + 1);
+    if (client_ != nullptr)
+      client_->weight.store(weight_, std::memory_order_relaxed);
+  }
+  if (file_rate_limit_ > 0) {
+    // FNV-1a; единица в старшем бите делает ключ ненулевым
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : file_name) hash = (hash ^ c) * 0x100000001b3;
+    file_ = findSlot(state->files, hash | 1ULL << 63);
+  }
+}
+
+/**
+ * @brief Скорость корзины клиента: его доля полосы сервера, но не больше
+ * client_rate_limit.
+ *
+ * @param now Текущее время.
+ * @return Скорость или 0, если скорость клиента не ограничена.
+ */
+
+uint64_t TrafficShaper::clientRate(int64_t now) {
+  if (rate_limit_ == 0) return client_rate_limit_;
+  if (now - share_time_ >= SHAPING_SHARE_NS) {
+    share_weight_ = 0;
+    for (const ShapingSlot& slot : shapingState()->clients) {
+      if (&slot == client_ || slot.key.load(std::memory_order_relaxed) == 0)
+        continue;
+      if (slot.tat.load(std::memory_order_relaxed) > now - SHAPING_IDLE_NS)
+        share_weight_ += slot.weight.load(std::memory_order_relaxed);
+    }
+    share_weight_ += weight_;
+    share_time_ = now;
+  }
+  uint64_t share = std::max<uint64_t>(
+      1, (unsigned __int128)rate_limit_ * weight_ / share_weight_);
+  if (client_rate_limit_ > 0) share = std::min(share, client_rate_limit_);
+  return share;
+}
+
+/**
+ * @brief Резервирует отправку куска во всех корзинах передачи.
+ *
+ * @param bytes Объём куска вместе с заголовком кадра.
+ * @return Сколько микросекунд нужно подождать перед отправкой.
+ */
+
+int64_t TrafficShaper::reserve(uint64_t bytes) {
+  if (!active_) return 0;
+  int64_t now = monotonicUs() * 1000;
+  int64_t wait = 0;
+  ShapingState* state = shapingState();
+  if (rate_limit_ > 0)
+    wait = reserveTokens(state->tat, rate_limit_, bytes, now);
+  uint64_t client_rate = clientRate(now);
+  if (client_ != nullptr && client_rate > 0)
+    wait = std::max(wait, reserveTokens(client_->tat, client_rate, bytes, now));
+  if (file_ != nullptr)
+    wait = std::max(wait,
+                    reserveTokens(file_->tat, file_rate_limit_, bytes, now));
+  return (wait + 999) / 1000;
+}
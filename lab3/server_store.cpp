@@ -0,0 +1,487 @@
+/**
+ * @file server_store.cpp
+ * @brief Хранилище файлов кусками без повторов (storage: cas).
+ *
+ * Перенос файлов в хранилище - отдельный шаг, "./server <config> --import":
+ * сервер делит каждый файл server_files на куски по содержимому (см.
+ * cas.h) и дописывает в общий файл кусков "server_files/.store/.pack"
+ * только те, которых там ещё нет; одинаковые куски разных файлов и версий
+ * хранятся один раз. Для файла сохраняется рецепт "server_files/.store/<имя>"
+ * - размер и список кусков с их местом в файле кусков, - после чего сам файл
+ * удаляется, и каждое удаление пишется в журнал. Время изменения рецепта
+ * совпадает со временем изменения файла, поэтому кэш манифеста и прогресс
+ * передачи остаются действительными. Совпадение хэша проверяется сравнением
+ * данных: куски с одинаковым хэшем, но разным содержимым хранятся по
+ * отдельности.
+ *
+ * При обычном запуске хранилище только открывается. Файл, которого нет в
+ * директории, ищется в хранилище и отдаётся прямо из файла кусков: запись
+ * кэша файлов открывает файл кусков и отображает позиции файла на его
+ * участки в файле кусков (CachedFile::extents), а передача, манифест, сжатие
+ * и дельта читают данные по этим участкам. Копий файла не создаётся, и
+ * страницы кусков в page cache общие для всех файлов, в которые они входят.
+ * Файлы, лежащие в директории, передаются как есть, пока их не перенесут
+ * следующим --import. Место кусков, на которые больше не ссылается ни один
+ * рецепт, не освобождается.
+ */
+
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cas.h"
+#include "protocol.h"
+#include "server.h"
+
+const uint64_t RECIPE_MAGIC = 0x3145504943455243;  // "CRECIPE1"
+
+/**
+ * @struct RecipeHeader
+ * @brief Заголовок рецепта файла.
+ */
+struct RecipeHeader {
+  uint64_t magic;
+  uint64_t file_size;
+  uint64_t count;  ///< Количество кусков.
+};
+
+/**
+ * @struct RecipeEntry
+ * @brief Кусок в рецепте файла.
+ */
+struct RecipeEntry {
+  uint64_t hash_low;
+  uint64_t hash_high;
+  uint64_t offset;  ///< Позиция в файле кусков.
+  uint64_t length;
+};
+
+ContentStore::~ContentStore() {
+  if (pack_fd_ >= 0) close(pack_fd_);
+}
+
+/**
+ * @brief Возвращает хранилище кусков процесса.
+ */
+
+ContentStore& contentStore() {
+  static ContentStore store;
+  return store;
+}
+
+/**
+ * @brief Открывает хранилище.
+ *
+ * Вызывается один раз при запуске, до fork и создания потоков.
+ *
+ * @param directory Директория с файлами сервера.
+ * @return false, если хранилище не удалось открыть.
+ */
+
+bool ContentStore::open(const std::string& directory) {
+  directory_ = directory;
+  store_ = directory + "/.store";
+  if (mkdir(store_.c_str(), 0700) != 0 && errno != EEXIST) {
+    perror(("Failed to create " + store_).c_str());
+    return false;
+  }
+  pack_fd_ = ::open((store_ + "/.pack").c_str(),
+                    O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (pack_fd_ < 0 || fstat(pack_fd_, &st) != 0) {
+    perror("Failed to open chunk pack");
+    if (pack_fd_ >= 0) close(pack_fd_);
+    pack_fd_ = -1;
+    return false;
+  }
+  pack_size_ = st.st_size;
+  return true;
+}
+
+/**
+ * @brief Переносит в хранилище файлы директории (./server <config>
+ * --import).
+ *
+ * Перенесённые файлы удаляются из директории. Импорт держит блокировку
+ * файла кусков, поэтому одновременные импорты идут по очереди; работающий
+ * сервер останавливать не нужно.
+ *
+ * @return Количество перенесённых файлов.
+ */
+
+size_t ContentStore::importFiles() {
+  // Другой импорт мог дописать файл кусков, пока ждали блокировку
+  struct stat st;
+  if (flock(pack_fd_, LOCK_EX) != 0 || fstat(pack_fd_, &st) != 0) {
+    logError() << "Store: failed to lock chunk pack";
+    return 0;
+  }
+  pack_size_ = st.st_size;
+  loadIndex();
+  std::vector<std::string> names;
+  if (DIR* dir = opendir(directory_.c_str())) {
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+  }
+  uint64_t before = pack_size_;
+  size_t imported = 0;
+  for (const auto& name : names) {
+    if (import(name)) imported++;
+  }
+  logInfo() << "Store: " << imported << " files imported, "
+            << pack_size_ - before << " new bytes, " << index_.size()
+            << " chunks, pack " << pack_size_ << " bytes";
+  index_.clear();  // Нужен только для импорта
+  flock(pack_fd_, LOCK_UN);
+  return imported;
+}
+
+/**
+ * @brief Читает рецепт файла.
+ *
+ * @param path Путь к рецепту.
+ * @param size Размер файла.
+ * @param extents Куски файла по порядку.
+ * @return false, если рецепта нет или он повреждён.
+ */
+
+bool ContentStore::readRecipe(const std::string& path, uint64_t& size,
+                              std::vector<Extent>& extents) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  RecipeHeader header;
+  bool valid =
+      pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+      header.magic == RECIPE_MAGIC &&
+      header.count <= header.file_size / CAS_MIN_CHUNK + 1;
+  std::vector<RecipeEntry> entries;
+  if (valid) {
+    entries.resize(header.count);
+    size_t length = entries.size() * sizeof(RecipeEntry);
+    valid = length == 0 || pread(fd, entries.data(), length,
+                                 sizeof(header)) == (ssize_t)length;
+  }
+  close(fd);
+  // Куски записываются раньше рецепта, поэтому размер файла кусков после
+  // чтения рецепта покрывает их и при импорте во время работы сервера
+  struct stat pack;
+  if (!valid || fstat(pack_fd_, &pack) != 0) return false;
+  uint64_t pack_size = pack.st_size;
+  uint64_t total = 0;
+  for (size_t i = 0; valid && i < entries.size(); i++) {
+    const RecipeEntry& entry = entries[i];
+    valid = entry.length <= CAS_MAX_CHUNK && entry.offset <= pack_size &&
+            entry.length <= pack_size - entry.offset;
+    Extent extent;
+    extent.hash.low = entry.hash_low;
+    extent.hash.high = entry.hash_high;
+    extent.offset = entry.offset;
+    extent.length = entry.length;
+    extents.push_back(extent);
+    total += entry.length;
+  }
+  if (!valid || total != header.file_size) return false;
+  size = header.file_size;
+  return true;
+}
+
+/**
+ * @brief Заполняет индекс кусков по рецептам хранилища.
+ */
+
+void ContentStore::loadIndex() {
+  DIR* dir = opendir(store_.c_str());
+  if (dir == nullptr) return;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;  // Файл кусков и временные файлы
+    uint64_t size = 0;
+    std::vector<Extent> extents;
+    if (!readRecipe(store_ + "/" + entry->d_name, size, extents)) {
+      logWarn() << "Store: damaged recipe " << entry->d_name;
+      continue;
+    }
+    for (const auto& extent : extents) index_.insert({extent.hash, extent});
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Находит кусок в хранилище или дописывает его в файл кусков.
+ *
+ * @param data Данные куска.
+ * @param length Длина куска.
+ * @param extent Место куска в файле кусков.
+ * @return false при ошибке записи.
+ */
+
+bool ContentStore::storeChunk(const unsigned char* data, size_t length,
+                              Extent& extent) {
+  extent.hash = casHash(data, length);
+  extent.length = length;
+  auto it = index_.find(extent.hash);
+  if (it != index_.end() && it->second.length == length) {
+    std::vector<unsigned char> stored(length);
+    if (pread(pack_fd_, stored.data(), length, it->second.offset) ==
+            (ssize_t)length &&
+        memcmp(stored.data(), data, length) == 0) {
+      extent.offset = it->second.offset;
+      return true;
+    }
+    // Совпал только хэш - кусок хранится отдельно
+  }
+  extent.offset = pack_size_;
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = pwrite(pack_fd_, data + done, length - done,
+                       extent.offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  pack_size_ += length;
+  if (it == index_.end()) index_.insert({extent.hash, extent});
+  return true;
+}
+
+/**
+ * @brief Переносит файл директории в хранилище.
+ *
+ * Файл удаляется только после того, как куски и рецепт записаны на диск, и
+ * только если за время импорта он не изменился.
+ *
+ * @param name Имя файла.
+ * @return true, если файл перенесён.
+ */
+
+bool ContentStore::import(const std::string& name) {
+  std::string path = directory_ + "/" + name;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0) return false;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  std::vector<Extent> extents;
+  bool ok = casSplitFile(
+      fd, st.st_size, [this, &extents](const unsigned char* data,
+                                       size_t length) {
+        Extent extent;
+        if (!storeChunk(data, length, extent)) return false;
+        extents.push_back(extent);
+        return true;
+      });
+  close(fd);
+  if (!ok || fdatasync(pack_fd_) != 0) {
+    logError() << "Store: failed to import " << name;
+    return false;
+  }
+
+  std::string recipe = store_ + "/" + name;
+  std::string tmp_path = store_ + "/." + name + ".tmp";
+  int out = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644);
+  if (out < 0) return false;
+  RecipeHeader header = {RECIPE_MAGIC, (uint64_t)st.st_size, extents.size()};
+  std::vector<RecipeEntry> entries;
+  for (const auto& extent : extents)
+    entries.push_back({extent.hash.low, extent.hash.high, extent.offset,
+                       extent.length});
+  size_t length = entries.size() * sizeof(RecipeEntry);
+  struct timespec times[2] = {st.st_atim, st.st_mtim};
+  ok = write(out, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+       (length == 0 ||
+        write(out, entries.data(), length) == (ssize_t)length) &&
+       futimens(out, times) == 0 && fsync(out) == 0;
+  close(out);
+  if (!ok || rename(tmp_path.c_str(), recipe.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    logError() << "Store: failed to write recipe for " << name;
+    return false;
+  }
+
+  // Файл, изменённый во время импорта, остаётся в директории
+  struct stat after;
+  if (stat(path.c_str(), &after) != 0 || after.st_ino != st.st_ino ||
+      after.st_size != st.st_size ||
+      after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+      after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)
+    return false;
+  if (unlink(path.c_str()) != 0) {
+    logError() << "Store: failed to remove " << path;
+    return false;
+  }
+  logWarn() << "Store: " << path << " removed, imported as "
+            << extents.size() << " chunks";
+  return true;
+}
+
+/**
+ * @brief Возвращает имена файлов в хранилище.
+ *
+ * @param max_size Наибольший размер файла.
+ */
+
+std::vector<std::string> ContentStore::names(uint64_t max_size) {
+  std::vector<std::string> names;
+  if (!enabled()) return names;
+  DIR* dir = opendir(store_.c_str());
+  if (dir == nullptr) return names;
+  while (struct dirent* entry = readdir(dir)) {
+    uint64_t size = 0;
+    std::vector<Extent> extents;
+    if (entry->d_name[0] != '.' &&
+        readRecipe(store_ + "/" + entry->d_name, size, extents) &&
+        size <= max_size)
+      names.push_back(entry->d_name);
+  }
+  closedir(dir);
+  return names;
+}
+
+/**
+ * @brief Открывает файл из хранилища: его данные читаются из файла кусков.
+ *
+ * @param name Имя файла.
+ * @return Запись кэша или nullptr, если файла нет в хранилище.
+ */
+
+std::shared_ptr<CachedFile> ContentStore::load(const std::string& name) {
+  if (!enabled() || name.empty() || name[0] == '.' ||
+      name.find('/') != std::string::npos)
+    return nullptr;
+  std::string recipe = store_ + "/" + name;
+  struct stat st;
+  uint64_t size = 0;
+  std::vector<Extent> extents;
+  if (stat(recipe.c_str(), &st) != 0) return nullptr;
+  if (!readRecipe(recipe, size, extents)) {
+    logError() << "Store: damaged recipe " << name;
+    return nullptr;
+  }
+
+  // Свой дескриптор файла кусков - своё упреждающее чтение у каждого файла
+  auto file = std::make_shared<CachedFile>();
+  file->fd = ::open((store_ + "/.pack").c_str(), O_RDONLY | O_CLOEXEC);
+  if (file->fd < 0) {
+    perror("Failed to open chunk pack");
+    return nullptr;
+  }
+  file->size = size;
+  file->mtime = st.st_mtim;
+  file->activity = fileActivity(st.st_dev, st.st_ino);  // Рецепт
+  // Куски, лежащие в файле кусков подряд, объединяются в один участок
+  uint64_t position = 0;
+  for (const auto& extent : extents) {
+    if (!file->extents.empty() &&
+        file->extents.back().offset + file->extents.back().length ==
+            extent.offset)
+      file->extents.back().length += extent.length;
+    else
+      file->extents.push_back({position, extent.offset, extent.length});
+    position += extent.length;
+  }
+  for (const auto& extent : extents) {
+    CasChunk chunk;
+    chunk.hash = extent.hash;
+    chunk.length = extent.length;
+    file->chunk_list.push_back(chunk);
+  }
+  file->chunk_list_ready = true;
+  logDebug() << "Store: " << name << " opened as " << extents.size()
+             << " chunks in " << file->extents.size() << " extents";
+  return file;
+}
+
+/**
+ * @brief Формирует кадры FRAME_CHUNKS.
+ *
+ * Последний кадр отмечается флагом FLAG_LAST; если кусков нет,
+ * отправляется один пустой кадр.
+ */
+
+static std::string encodeChunkList(const std::vector<CasChunk>& chunks) {
+  const size_t per_frame = MAX_DATA_PAYLOAD / CAS_ENTRY_SIZE;
+  std::string frames;
+  size_t first = 0;
+  do {
+    size_t count = std::min(per_frame, chunks.size() - first);
+    std::string payload(count * CAS_ENTRY_SIZE, '\0');
+    for (size_t i = 0; i < count; i++) {
+      const CasChunk& chunk = chunks[first + i];
+      uint64_t hash[2] = {htobe64(chunk.hash.low), htobe64(chunk.hash.high)};
+      uint32_t length = htobe32(chunk.length);
+      memcpy(&payload[i * CAS_ENTRY_SIZE], hash, sizeof(hash));
+      memcpy(&payload[i * CAS_ENTRY_SIZE + sizeof(hash)], &length,
+             sizeof(length));
+    }
+    bool last = first + count == chunks.size();
+    frames += encodeFrame(FRAME_CHUNKS, last ? FLAG_LAST : 0, first, payload);
+    first += count;
+  } while (first < chunks.size());
+  return frames;
+}
+
+/**
+ * @brief Возвращает список кусков файла, деля файл при первом обращении.
+ *
+ * Для файла из хранилища список берётся из рецепта, для обычного файла
+ * считается так же, как при импорте, поэтому клиент находит одинаковые
+ * куски независимо от способа хранения.
+ *
+ * @param file_name Имя файла.
+ * @return Кадры FRAME_CHUNKS одной строкой.
+ */
+
+std::string computeChunkList(const std::string& file_name) {
+  std::vector<CasChunk> chunks;
+  std::shared_ptr<CachedFile> file = fileCache().lookup(file_name);
+  if (file) {
+    std::lock_guard<std::mutex> lock(file->manifest_mutex);
+    if (!file->chunk_list_ready) {
+      std::vector<CasChunk> list;
+      if (casSplitFile(file->fd, file->size,
+                       [&list](const unsigned char* data, size_t length) {
+                         CasChunk chunk;
+                         chunk.hash = casHash(data, length);
+                         chunk.length = length;
+                         list.push_back(chunk);
+                         return true;
+                       })) {
+        file->chunk_list.swap(list);
+        file->chunk_list_ready = true;
+      } else {
+        logError() << "Failed to split file: " << file_name;
+      }
+    }
+    chunks = file->chunk_list;
+  }
+  logDebug() << "Chunk list for " << file_name << ": " << chunks.size()
+             << " chunks";
+  return encodeChunkList(chunks);
+}
+
+/**
+ * @brief Отправляет клиенту список кусков файла.
+ *
+ * @param new_socket Сокет клиента.
+ * @param file_name Имя файла.
+ * @return false при разрыве соединения.
+ */
+
+bool sendChunkList(int new_socket, const std::string& file_name) {
+  std::string frames = computeChunkList(file_name);
+  return writeFull(new_socket, frames.data(), frames.size());
+}
@@ -0,0 +1,160 @@
+/**
+ * @file server_tcp.cpp
+ * @brief Настройка TCP под соединение: размер кадров, буфер отправки и
+ * склейка сегментов.
+ *
+ * Во время передачи сервер каждые TCP_TUNE_BYTES байт читает TCP_INFO и
+ * оценивает скорость соединения как окно перегрузки, делённое на RTT.
+ * Размер кадра FRAME_DATA - столько данных, сколько соединение передаёт за
+ * TCP_CHUNK_TARGET_US: на быстром соединении кадры крупные, и заголовки с
+ * системными вызовами почти ничего не стоят, на медленном - мелкие, и
+ * прогресс сохраняется чаще. Буфер отправки растёт автонастройкой ядра до
+ * net.ipv4.tcp_wmem[2], а для длинных быстрых каналов этого бывает мало:
+ * если двух окон (произведения скорости на RTT) больше этого предела, буфер
+ * задаётся через SO_SNDBUF, но не больше tcp_sndbuf_max и
+ * net.core.wmem_max. Иначе SO_SNDBUF не трогается: он отключает
+ * автонастройку, и буфер, заданный меньше её предела, снизил бы скорость.
+ * Буфер приёма не меняется: сервер принимает только короткие управляющие
+ * кадры, а масштаб окна приёма фиксируется при установке соединения.
+ *
+ * На время передачи сокет держится в TCP_CORK, чтобы заголовки кадров и
+ * хвосты кусков уходили полными сегментами; последний неполный сегмент
+ * отправляется при снятии TCP_CORK. TCP_NOTSENT_LOWAT (tcp_notsent_lowat)
+ * ограничивает объём данных, ещё не отправленных в сеть: отправка ждёт, а
+ * EPOLLOUT не приходит, пока их больше порога, поэтому соединение не держит
+ * в памяти ядра больше, чем нужно для непрерывной передачи.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+
+#include "protocol.h"
+#include "server.h"
+
+/// Минимальный размер кадра данных; размер кадра кратен ему.
+const uint64_t TCP_CHUNK_MIN = 64 << 10;
+/// Сколько времени передачи на текущей скорости занимает один кадр.
+const uint64_t TCP_CHUNK_TARGET_US = 10000;
+/// Как часто пересчитываются размер кадра и буфер отправки.
+const uint64_t TCP_TUNE_BYTES = 4 << 20;
+
+/**
+ * @brief Возвращает net.core.wmem_max: больше этого SO_SNDBUF без
+ * привилегий не задать.
+ */
+
+static uint64_t systemSndbufMax() {
+  static uint64_t value = [] {
+    uint64_t max = 0;
+    std::ifstream file("/proc/sys/net/core/wmem_max");
+    if (!(file >> max)) max = 0;
+    return max;
+  }();
+  return value;
+}
+
+/**
+ * @brief Возвращает net.ipv4.tcp_wmem[2]: до этого размера буфер отправки
+ * растёт сам.
+ */
+
+static uint64_t autotuneSndbufMax() {
+  static uint64_t value = [] {
+    uint64_t min = 0, initial = 0, max = 0;
+    std::ifstream file("/proc/sys/net/ipv4/tcp_wmem");
+    if (!(file >> min >> initial >> max)) max = 0;
+    return max;
+  }();
+  return value;
+}
+
+/**
+ * @brief Начинает передачу файла по сокету.
+ *
+ * @param config Конфигурация сервера.
+ * @param sock Сокет клиента.
+ */
+
+void TcpTuner::start(const ServerConfig& config, int sock) {
+  sock_ = sock;
+  active_ = config.tcp_tuning;
+  measured_ = false;
+  tuned_at_ = 0;
+  chunk_ = MAX_DATA_PAYLOAD;
+  sndbuf_max_ = std::min(config.tcp_sndbuf_max, systemSndbufMax());
+  if (config.tcp_notsent_lowat > 0) {
+    int lowat = (int)std::min<uint64_t>(config.tcp_notsent_lowat, INT32_MAX);
+    setsockopt(sock_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+  }
+  if (!active_) return;
+  int on = 1;
+  setsockopt(sock_, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**
+ * @brief Возвращает размер очередного кадра данных.
+ *
+ * @param position Позиция отправки в файле.
+ * @param fallback Размер кадра, если настройка отключена.
+ * @return Длина полезной нагрузки кадра.
+ */
+
+size_t TcpTuner::chunkSize(uint64_t position, size_t fallback) {
+  if (!active_) return fallback;
+  if (!measured_ || position - tuned_at_ >= TCP_TUNE_BYTES) {
+    measured_ = true;
+    tuned_at_ = position;
+    tune();
+  }
+  return chunk_;
+}
+
+/**
+ * @brief Пересчитывает размер кадра и буфер отправки по TCP_INFO.
+ */
+
+void TcpTuner::tune() {
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  if (getsockopt(sock_, IPPROTO_TCP, TCP_INFO, &info, &length) != 0 ||
+      info.tcpi_rtt == 0)
+    return;
+  uint64_t window = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+  uint64_t rate = window * 1000000 / info.tcpi_rtt;  // Байт в секунду
+  uint64_t chunk = rate * TCP_CHUNK_TARGET_US / 1000000;
+  chunk = std::max(TCP_CHUNK_MIN, std::min<uint64_t>(chunk, MAX_DATA_PAYLOAD));
+  chunk_ = chunk / TCP_CHUNK_MIN * TCP_CHUNK_MIN;
+
+  // Ядро удваивает значение SO_SNDBUF и возвращает удвоенное
+  int current = 0;
+  length = sizeof(current);
+  if (getsockopt(sock_, SOL_SOCKET, SO_SNDBUF, &current, &length) != 0)
+    return;
+  uint64_t want = std::min(2 * window, sndbuf_max_);
+  // Пока автонастройка может дать столько же, SO_SNDBUF её только отключит
+  bool grow = 2 * want > (uint64_t)current && 2 * want > autotuneSndbufMax();
+  if (grow) {
+    int value = (int)std::min<uint64_t>(want, INT32_MAX);
+    setsockopt(sock_, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+  }
+  logDebug() << "TCP rtt " << info.tcpi_rtt << " us, window " << window
+             << " bytes, chunk " << chunk_ << ", sndbuf "
+             << (grow ? 2 * want : (uint64_t)current);
+}
+
+/**
+ * @brief Завершает передачу: снимает TCP_CORK, и ядро сразу отправляет
+ * неполный последний сегмент.
+ */
+
+void TcpTuner::finish() {
+  if (!active_) return;
+  active_ = false;
+  int off = 0;
+  setsockopt(sock_, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+}
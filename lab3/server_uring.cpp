@@ -0,0 +1,930 @@
+/**
+ * @file server_uring.cpp
+ * @brief Модель сервера на io_uring.
+ *
+ * Как и в модели "epoll", каждый поток обслуживает свои подключения, а
+ * протокол ведётся тем же конечным автоматом (см. server_protocol.cpp).
+ * Вместо ожидания готовности
+ * сокетов поток ставит операции (accept, приём кадров, чтение файла, отправка)
+ * в очередь io_uring и за один вызов io_uring_enter отправляет все
+ * накопившиеся операции и забирает завершённые.
+ *
+ * Данные файла читаются в зарегистрированные в ядре буферы по 1 МБ сразу за
+ * местом под заголовок FRAME_DATA, так что кадр уходит в сокет одной
+ * операцией записи. На каждое подключение приходится до
+ * URING_CONNECTION_BUFFERS буферов: следующий кусок файла читается, пока
+ * отправляется текущий. Сокеты и файлы подключений регистрируются в таблице
+ * фиксированных файлов кольца, что избавляет ядро от поиска дескриптора на
+ * каждой операции.
+ *
+ * Работа с кольцом идёт через системные вызовы io_uring_setup,
+ * io_uring_enter и io_uring_register напрямую, без liburing. Если ядро не
+ * поддерживает io_uring или нужные операции, runUringServer возвращает false,
+ * и сервер работает в модели "epoll". Без регистрации буферов или файлов
+ * (например, из-за RLIMIT_MEMLOCK на старых ядрах) используются обычные
+ * операции чтения и записи.
+ */
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol.h"
+#include "server.h"
+
+/// Размер очереди отправки кольца.
+const unsigned URING_ENTRIES = 256;
+/// Количество зарегистрированных буферов данных на поток.
+const int URING_BUFFERS = 16;
+/// Сколько буферов данных может занять одно подключение.
+const size_t URING_CONNECTION_BUFFERS = 2;
+/// Размер таблицы фиксированных файлов: сокет и файл на подключение.
+const int URING_FIXED_FILES = 2048;
+/// Не принимать новые кадры, пока столько байт не разобрано.
+const size_t URING_MAX_INPUT = 64 << 10;
+
+/**
+ * @enum UringOp
+ * @brief Вид операции, закодированный в user_data.
+ */
+enum UringOp : uint8_t {
+  URING_ACCEPT = 1,  ///< Приём подключения.
+  URING_EVENT,       ///< Чтение eventfd готовых манифестов.
+  URING_RECV,        ///< Приём кадров клиента.
+  URING_SEND,        ///< Отправка управляющих кадров.
+  URING_READ,        ///< Чтение куска файла в буфер.
+  URING_WRITE,       ///< Отправка кадра FRAME_DATA из буфера.
+  URING_TIMEOUT      ///< Ожидание корзин маркеров.
+};
+
+/// user_data: серийный номер подключения, номер буфера и вид операции.
+static uint64_t packUserData(uint64_t serial, int buffer, UringOp op) {
+  return serial << 24 | (uint64_t)(buffer & 0xffff) << 8 | op;
+}
+
+/**
+ * @class Ring
+ * @brief Кольцо io_uring: очереди отправки и завершения в общей с ядром
+ * памяти.
+ */
+class Ring {
+ public:
+  Ring() = default;
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+  ~Ring();
+
+  bool open(unsigned entries);
+  bool supports(const std::vector<uint8_t>& ops);
+  int registerBuffers(const std::vector<struct iovec>& buffers);
+  int registerFiles(int count);
+  int updateFile(int slot, int fd);
+  struct io_uring_sqe* sqe();
+  int submit(bool wait);
+  bool next(struct io_uring_cqe& cqe);
+
+ private:
+  int fd_ = -1;
+  void* sq_map_ = nullptr;
+  size_t sq_map_size_ = 0;
+  void* cq_map_ = nullptr;
+  size_t cq_map_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_local_tail_ = 0;  ///< Хвост с ещё не опубликованными SQE.
+  unsigned sq_submitted_ = 0;   ///< Сколько SQE уже забрало ядро.
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+  std::deque<struct io_uring_sqe> backlog_;  ///< SQE, не вошедшие в очередь.
+};
+
+Ring::~Ring() {
+  if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+  if (cq_map_ != nullptr && cq_map_ != sq_map_) munmap(cq_map_, cq_map_size_);
+  if (sq_map_ != nullptr) munmap(sq_map_, sq_map_size_);
+  if (fd_ >= 0) close(fd_);
+}
+
+/**
+ * @brief Создаёт кольцо и отображает его очереди.
+ *
+ * @param entries Размер очереди отправки.
+ * @return false, если io_uring недоступен.
+ */
+
+bool Ring::open(unsigned entries) {
+  struct io_uring_params params = {};
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) return false;
+
+  sq_map_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_map_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+  sq_map_ = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_map_ == MAP_FAILED) {
+    sq_map_ = nullptr;
+    return false;
+  }
+  cq_map_ = single ? sq_map_
+                   : mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  if (cq_map_ == MAP_FAILED) {
+    cq_map_ = nullptr;
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(sq_map_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  // SQE с индексом i всегда лежит в слоте i массива очереди
+  unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; i++) array[i] = i;
+  sq_local_tail_ = sq_submitted_ = *sq_tail_;
+
+  char* cq = static_cast<char*>(cq_map_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+/**
+ * @brief Проверяет, что ядро поддерживает все указанные операции.
+ */
+
+bool Ring::supports(const std::vector<uint8_t>& ops) {
+  const int count = 256;
+  std::vector<char> raw(sizeof(struct io_uring_probe) +
+                        count * sizeof(struct io_uring_probe_op));
+  struct io_uring_probe* probe =
+      reinterpret_cast<struct io_uring_probe*>(raw.data());
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+              count) < 0)
+    return false;
+  for (uint8_t op : ops) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Регистрирует буферы для операций READ_FIXED и WRITE_FIXED.
+ *
+ * @return 0 или -1 с кодом ошибки в errno.
+ */
+
+int Ring::registerBuffers(const std::vector<struct iovec>& buffers) {
+  return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                 buffers.data(), buffers.size());
+}
+
+/**
+ * @brief Регистрирует пустую таблицу фиксированных файлов.
+ *
+ * @param count Размер таблицы.
+ * @return 0 или -1 с кодом ошибки в errno.
+ */
+
+int Ring::registerFiles(int count) {
+  std::vector<int> fds(count, -1);
+  return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES,
+                 fds.data(), count);
+}
+
+/**
+ * @brief Помещает дескриптор в таблицу фиксированных файлов (-1 очищает
+ * слот).
+ */
+
+int Ring::updateFile(int slot, int fd) {
+  struct io_uring_files_update update = {};
+  update.offset = slot;
+  update.fds = reinterpret_cast<uint64_t>(&fd);
+  int ret = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES_UPDATE,
+                    &update, 1);
+  return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief Возвращает обнулённый SQE в конце очереди отправки.
+ *
+ * Если очередь заполнена, SQE откладывается и попадает в очередь при
+ * следующем submit: ждать здесь, пока ядро освободит место, нельзя - ядро
+ * отвечает EBUSY, пока не забраны завершения, а забирает их только цикл
+ * потока.
+ */
+
+struct io_uring_sqe* Ring::sqe() {
+  struct io_uring_sqe* sqe;
+  if (backlog_.empty() &&
+      sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) <
+          sq_entries_) {
+    sqe = &sqes_[sq_local_tail_ & sq_mask_];
+    sq_local_tail_++;
+  } else {
+    backlog_.emplace_back();
+    sqe = &backlog_.back();
+  }
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * @brief Отправляет ядру накопленные операции.
+ *
+ * Отложенные SQE переносятся в очередь по мере того, как ядро её
+ * освобождает; завершения ждутся только после отправки всех операций.
+ *
+ * @param wait Дождаться хотя бы одного завершения.
+ * @return Количество принятых ядром SQE или -1 с кодом ошибки в errno.
+ */
+
+int Ring::submit(bool wait) {
+  int total = 0;
+  while (1) {
+    while (!backlog_.empty() &&
+           sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) <
+               sq_entries_) {
+      sqes_[sq_local_tail_ & sq_mask_] = backlog_.front();
+      backlog_.pop_front();
+      sq_local_tail_++;
+    }
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    bool last = backlog_.empty();
+    unsigned pending = sq_local_tail_ - sq_submitted_;
+    int ret = syscall(__NR_io_uring_enter, fd_, pending, wait && last ? 1 : 0,
+                      wait && last ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret < 0) return total > 0 ? total : ret;
+    sq_submitted_ += ret;
+    total += ret;
+    // Ядро не взяло ни одной операции - повтор после разбора завершений
+    if (last || ret == 0) return total;
+  }
+}
+
+/**
+ * @brief Забирает следующее завершение из очереди.
+ *
+ * @param cqe Копия завершения.
+ * @return false, если очередь пуста.
+ */
+
+bool Ring::next(struct io_uring_cqe& cqe) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+  cqe = cqes_[head & cq_mask_];
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @struct UringChunk
+ * @brief Кусок файла в зарегистрированном буфере.
+ */
+struct UringChunk {
+  int buffer = -1;
+  uint64_t offset = 0;
+  size_t length = 0;
+  size_t read = 0;     ///< Сколько байт куска уже прочитано.
+  size_t written = 0;  ///< Сколько байт кадра (с заголовком) отправлено.
+  std::string frame;   ///< Сжатый кадр, если кусок удалось сжать.
+  bool shaped = false;  ///< Отправка куска зарезервирована в корзинах.
+
+  size_t frameSize() const {
+    return frame.empty() ? FRAME_HEADER_SIZE + length : frame.size();
+  }
+};
+
+/**
+ * @struct UringConnection
+ * @brief Подключение модели io_uring: состояние протокола и операции в
+ * кольце.
+ *
+ * В out здесь только управляющие кадры: данные файла идут из буферов
+ * кусков.
+ */
+struct UringConnection : ProtocolConnection {
+  int slot = -1;  ///< Слот сокета в таблице фиксированных файлов, файл - +1.
+  std::vector<char> recv_buffer;
+  std::string sending;  ///< Управляющие кадры, отправляемые сейчас.
+  size_t sending_pos = 0;
+  bool receiving = false;  ///< В кольце есть приём.
+  bool writing = false;    ///< В кольце есть отправка.
+  int inflight = 0;        ///< Операции в кольце.
+  bool closing = false;
+  bool waiting = false;  ///< Подключение в очереди ждущих буфер.
+  uint64_t read_pos = 0;  ///< Позиция, с которой читать следующий кусок.
+  std::deque<UringChunk> chunks;  ///< Куски в порядке отправки.
+  bool throttled = false;  ///< В кольце ожидание корзин маркеров.
+  struct __kernel_timespec timeout = {};
+};
+
+/**
+ * @class UringWorker
+ * @brief Поток с собственным кольцом io_uring.
+ */
+class UringWorker : public ProtocolWorker {
+ public:
+  UringWorker(ServerConfig& config, int server_fd)
+      : ProtocolWorker(config), server_fd_(server_fd) {}
+  ~UringWorker();
+
+  bool open();
+  void run();
+
+ protected:
+  void beginSending(ProtocolConnection& conn) override;
+  void endSending(ProtocolConnection& conn) override;
+  ProtocolConnection* findConnection(int fd, uint64_t serial) override;
+  void resume(ProtocolConnection& conn) override;
+
+ private:
+  void submitAccept();
+  void submitEvent();
+  void handleCompletion(const struct io_uring_cqe& cqe);
+  void accepted(int fd);
+  void pump(UringConnection& conn);
+  void submitRead(UringConnection& conn, UringChunk& chunk);
+  void submitWrite(UringConnection& conn);
+  bool throttle(UringConnection& conn, UringChunk& chunk);
+  void submitSend(UringConnection& conn);
+  void submitRecv(UringConnection& conn);
+  void setFile(struct io_uring_sqe* sqe, UringConnection& conn, bool socket);
+  void releaseBuffer(int buffer);
+  void closeConnection(UringConnection& conn);
+
+  int server_fd_;
+  Ring ring_;
+  uint64_t event_value_ = 0;
+  bool fixed_buffers_ = false;
+  bool fixed_files_ = false;
+  std::vector<char*> buffers_;
+  std::vector<int> free_buffers_;
+  std::vector<int> free_slots_;
+  std::deque<uint64_t> waiting_;  ///< Подключения, ждущие буфер данных.
+  std::map<uint64_t, std::unique_ptr<UringConnection>> connections_;
+  uint64_t next_serial_ = 0;
+};
+
+/**
+ * @brief Запускает модель сервера на io_uring.
+ *
+ * @param config Конфигурация сервера.
+ * @param server_fd Прослушивающий сокет.
+ * @return false, если io_uring недоступен или ни один поток не создал
+ * кольцо и нужно использовать другую модель.
+ */
+
+bool runUringServer(ServerConfig& config, int server_fd) {
+  {
+    Ring probe;
+    std::vector<uint8_t> ops = {IORING_OP_ACCEPT,      IORING_OP_RECV,
+                                IORING_OP_SEND,        IORING_OP_READ,
+                                IORING_OP_WRITE,       IORING_OP_READ_FIXED,
+                                IORING_OP_WRITE_FIXED, IORING_OP_TIMEOUT};
+    if (!probe.open(URING_ENTRIES) || !probe.supports(ops)) {
+      logWarn() << "io_uring is not available, falling back to epoll";
+      return false;
+    }
+  }
+  checkDirectory(config);
+  // Запись в сокет через io_uring не принимает MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+
+  int workers = config.workers;
+  if (workers <= 0) workers = std::thread::hardware_concurrency();
+  if (workers <= 0) workers = 1;
+  logInfo() << "Workers: " << workers;
+
+  std::atomic<int> opened{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++) {
+    threads.emplace_back([&config, server_fd, &opened]() {
+      UringWorker worker(config, server_fd);
+      if (!worker.open()) return;
+      opened++;
+      worker.run();
+    });
+  }
+  // Поток без кольца завершается сразу: если не открылось ни одно,
+  // join не ждёт и сервер переходит на epoll
+  for (auto& thread : threads) thread.join();
+  if (opened == 0) {
+    logWarn() << "No io_uring worker started, falling back to epoll";
+    return false;
+  }
+  return true;
+}
+
+UringWorker::~UringWorker() {
+  for (char* buffer : buffers_) free(buffer);
+  if (event_fd_ >= 0) close(event_fd_);
+}
+
+/**
+ * @brief Создаёт кольцо потока и регистрирует буферы и таблицу файлов.
+ */
+
+bool UringWorker::open() {
+  if (!ring_.open(URING_ENTRIES)) {
+    perror("io_uring_setup failed");
+    return false;
+  }
+  event_fd_ = eventfd(0, EFD_CLOEXEC);
+
+  std::vector<struct iovec> iovecs;
+  size_t size = FRAME_HEADER_SIZE + MAX_DATA_PAYLOAD;
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, 4096, size) != 0) return false;
+    buffers_.push_back(static_cast<char*>(buffer));
+    free_buffers_.push_back(i);
+    iovecs.push_back({buffer, size});
+  }
+  fixed_buffers_ = ring_.registerBuffers(iovecs) == 0;
+  if (!fixed_buffers_) perror("io_uring buffer registration failed");
+  fixed_files_ = ring_.registerFiles(URING_FIXED_FILES) == 0;
+  if (!fixed_files_) perror("io_uring file registration failed");
+  for (int slot = URING_FIXED_FILES - 2; slot >= 0; slot -= 2)
+    free_slots_.push_back(slot);
+  return true;
+}
+
+/**
+ * @brief Цикл обработки завершений потока.
+ *
+ * Каждый проход одним io_uring_enter отправляет все накопленные операции и
+ * ждёт хотя бы одного завершения.
+ */
+
+void UringWorker::run() {
+  submitAccept();
+  submitEvent();
+  while (1) {
+    if (ring_.submit(true) < 0 && errno != EINTR && errno != EAGAIN &&
+        errno != EBUSY) {
+      perror("io_uring_enter failed");
+      break;
+    }
+    struct io_uring_cqe cqe;
+    while (ring_.next(cqe)) handleCompletion(cqe);
+  }
+}
+
+void UringWorker::submitAccept() {
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_fd_;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = packUserData(0, 0, URING_ACCEPT);
+}
+
+void UringWorker::submitEvent() {
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = event_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&event_value_);
+  sqe->len = sizeof(event_value_);
+  sqe->user_data = packUserData(0, 0, URING_EVENT);
+}
+
+/**
+ * @brief Указывает в SQE сокет или файл подключения.
+ *
+ * @param sqe Операция.
+ * @param conn Подключение.
+ * @param socket true - сокет, false - передаваемый файл.
+ */
+
+void UringWorker::setFile(struct io_uring_sqe* sqe, UringConnection& conn,
+                          bool socket) {
+  if (conn.slot >= 0) {
+    sqe->fd = socket ? conn.slot : conn.slot + 1;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = socket ? conn.fd : conn.file->fd;
+  }
+}
+
+/**
+ * @brief Обрабатывает завершение операции.
+ *
+ * @param cqe Завершение.
+ */
+
+void UringWorker::handleCompletion(const struct io_uring_cqe& cqe) {
+  UringOp op = static_cast<UringOp>(cqe.user_data & 0xff);
+  int buffer = (cqe.user_data >> 8) & 0xffff;
+  uint64_t serial = cqe.user_data >> 24;
+  if (op == URING_ACCEPT) {
+    submitAccept();
+    if (cqe.res >= 0)
+      accepted(cqe.res);
+    else if (cqe.res != -EINTR && cqe.res != -EAGAIN)
+      logError() << "accept failed: " << strerror(-cqe.res);
+    return;
+  }
+  if (op == URING_EVENT) {
+    submitEvent();
+    completeManifests();
+    return;
+  }
+
+  auto it = connections_.find(serial);
+  if (it == connections_.end()) return;
+  UringConnection& conn = *it->second;
+  conn.inflight--;
+  bool retry = cqe.res == -EINTR || cqe.res == -EAGAIN;
+  switch (op) {
+    case URING_RECV:
+      conn.receiving = false;
+      if (cqe.res > 0)
+        conn.in.append(conn.recv_buffer.data(), cqe.res);
+      else if (!retry)
+        closeConnection(conn);
+      break;
+    case URING_SEND:
+      conn.writing = false;
+      if (cqe.res >= 0) {
+        conn.sending_pos += cqe.res;
+        if (conn.sending_pos == conn.sending.size()) {
+          conn.sending.clear();
+          conn.sending_pos = 0;
+        }
+      } else if (!retry) {
+        closeConnection(conn);
+      }
+      break;
+    case URING_READ: {
+      auto chunk = std::find_if(
+          conn.chunks.begin(), conn.chunks.end(),
+          [buffer](const UringChunk& c) { return c.buffer == buffer; });
+      if (chunk == conn.chunks.end()) break;
+      // 0 - файл укоротился во время передачи
+      if (cqe.res > 0)
+        chunk->read += cqe.res;
+      else if (!retry)
+        closeConnection(conn);
+      if (!conn.closing && chunk->read < chunk->length)
+        submitRead(conn, *chunk);
+      // Прочитанный кусок сжимается прямо из зарегистрированного буфера
+      if (!conn.closing && chunk->read == chunk->length)
+        conn.compressor.encode(chunk->offset, chunk->length,
+                               buffers_[chunk->buffer] + FRAME_HEADER_SIZE,
+                               chunk->frame);
+      break;
+    }
+    case URING_WRITE: {
+      conn.writing = false;
+      if (cqe.res <= 0) {
+        if (!retry) closeConnection(conn);
+        break;
+      }
+      conn.metrics.sent(cqe.res);
+      UringChunk& chunk = conn.chunks.front();
+      chunk.written += cqe.res;
+      if (chunk.written < chunk.frameSize()) break;
+      conn.file_pos += chunk.length;
+      conn.checkpoint.update(conn.file_pos);
+      int released = chunk.buffer;
+      conn.chunks.pop_front();
+      releaseBuffer(released);
+      break;
+    }
+    case URING_TIMEOUT:
+      conn.throttled = false;
+      break;
+    default:
+      break;
+  }
+  pump(conn);
+}
+
+/**
+ * @brief Регистрирует принятое подключение.
+ *
+ * @param fd Сокет клиента.
+ */
+
+void UringWorker::accepted(int fd) {
+  auto conn = std::make_unique<UringConnection>();
+  conn->fd = fd;
+  conn->serial = ++next_serial_;
+  conn->accepted_us = monotonicUs();
+  metricAdd(METRIC_CONNECTIONS);
+  metricAdd(METRIC_ACTIVE_CONNECTIONS);
+  conn->recv_buffer.resize(config_.buffer_size > 0 ? config_.buffer_size
+                                                   : 4096);
+  if (fixed_files_ && !free_slots_.empty()) {
+    conn->slot = free_slots_.back();
+    if (ring_.updateFile(conn->slot, fd) == 0)
+      free_slots_.pop_back();
+    else
+      conn->slot = -1;
+  }
+  UringConnection& ref = *conn;
+  connections_[conn->serial] = std::move(conn);
+  pump(ref);
+}
+
+/**
+ * @brief Продвигает подключение: разбирает кадры, ставит в кольцо чтение
+ * файла, отправку и приём.
+ *
+ * После вызова подключение может быть уничтожено.
+ *
+ * @param conn Подключение.
+ */
+
+void UringWorker::pump(UringConnection& conn) {
+  if (conn.closing) {
+    if (conn.inflight > 0) return;
+    for (const auto& chunk : conn.chunks) releaseBuffer(chunk.buffer);
+    if (conn.slot >= 0) {
+      ring_.updateFile(conn.slot, -1);
+      ring_.updateFile(conn.slot + 1, -1);
+      free_slots_.push_back(conn.slot);
+    }
+    close(conn.fd);
+    metricAdd(METRIC_ACTIVE_CONNECTIONS, -1);
+    connections_.erase(conn.serial);
+    return;
+  }
+
+  // Кадры, пришедшие во время передачи файла, разбираются после её окончания
+  while (1) {
+    if (!processInput(conn)) {
+      closeConnection(conn);
+      pump(conn);
+      return;
+    }
+    if (conn.state != ConnState::Sending) break;
+    while (conn.chunks.size() < URING_CONNECTION_BUFFERS &&
+           conn.read_pos < conn.file_end && !free_buffers_.empty()) {
+      UringChunk chunk;
+      chunk.buffer = free_buffers_.back();
+      free_buffers_.pop_back();
+      chunk.offset = conn.read_pos;
+      chunk.length = std::min<uint64_t>(
+          conn.tcp.chunkSize(conn.read_pos, MAX_DATA_PAYLOAD),
+          conn.file_end - conn.read_pos);
+      if (conn.compressor.active())
+        chunk.length = conn.compressor.chunkLength(conn.read_pos,
+                                                   conn.file_end);
+      conn.io.advance(chunk.offset, chunk.length);
+      conn.read_pos += chunk.length;
+      conn.chunks.push_back(chunk);
+      submitRead(conn, conn.chunks.back());
+    }
+    if (conn.chunks.empty() && conn.read_pos < conn.file_end) {
+      // Все буферы заняты
+      if (!conn.waiting) waiting_.push_back(conn.serial);
+      conn.waiting = true;
+      break;
+    }
+    if (!conn.chunks.empty()) break;
+    finishSending(conn);
+  }
+
+  // Управляющие кадры всегда предшествуют данным файла
+  if (!conn.writing) {
+    if (!conn.sending.empty() || !conn.out.empty())
+      submitSend(conn);
+    else if (!conn.chunks.empty() &&
+             conn.chunks.front().read == conn.chunks.front().length &&
+             !throttle(conn, conn.chunks.front()))
+      submitWrite(conn);
+  }
+  if (!conn.receiving && conn.in.size() < URING_MAX_INPUT) submitRecv(conn);
+}
+
+/**
+ * @brief Готовит передачу файла: регистрирует его в таблице фиксированных
+ * файлов.
+ *
+ * @param base Подключение.
+ */
+
+void UringWorker::beginSending(ProtocolConnection& base) {
+  UringConnection& conn = static_cast<UringConnection&>(base);
+  // Без слота для файла подключение работает с обычными дескрипторами
+  if (conn.slot >= 0 && ring_.updateFile(conn.slot + 1, conn.file->fd) != 0) {
+    ring_.updateFile(conn.slot, -1);
+    free_slots_.push_back(conn.slot);
+    conn.slot = -1;
+  }
+  conn.read_pos = conn.file_pos;
+}
+
+/**
+ * @brief Убирает файл завершённой передачи из таблицы фиксированных файлов.
+ *
+ * @param base Подключение.
+ */
+
+void UringWorker::endSending(ProtocolConnection& base) {
+  UringConnection& conn = static_cast<UringConnection&>(base);
+  if (conn.slot >= 0) ring_.updateFile(conn.slot + 1, -1);
+}
+
+/**
+ * @brief Ставит в кольцо чтение непрочитанной части куска файла.
+ */
+
+void UringWorker::submitRead(UringConnection& conn, UringChunk& chunk) {
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = fixed_buffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  setFile(sqe, conn, false);
+  sqe->addr = reinterpret_cast<uint64_t>(buffers_[chunk.buffer] +
+                                         FRAME_HEADER_SIZE + chunk.read);
+  // Файл из хранилища кусков читается по участкам, лежащим в fd подряд
+  uint64_t length = chunk.length - chunk.read;
+  sqe->off = conn.file->locate(chunk.offset + chunk.read, length);
+  sqe->len = length;
+  if (fixed_buffers_) sqe->buf_index = chunk.buffer;
+  sqe->user_data = packUserData(conn.serial, chunk.buffer, URING_READ);
+  conn.inflight++;
+}
+
+/**
+ * @brief Ставит в кольцо отправку неотправленной части кадра FRAME_DATA
+ * первого куска.
+ *
+ * Несжатый кадр собирается в зарегистрированном буфере куска, сжатый
+ * отправляется из собственной строки.
+ */
+
+void UringWorker::submitWrite(UringConnection& conn) {
+  UringChunk& chunk = conn.chunks.front();
+  if (!chunk.frame.empty()) {
+    struct io_uring_sqe* sqe = ring_.sqe();
+    sqe->opcode = IORING_OP_SEND;
+    setFile(sqe, conn, true);
+    sqe->addr = reinterpret_cast<uint64_t>(chunk.frame.data() + chunk.written);
+    sqe->len = chunk.frame.size() - chunk.written;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = packUserData(conn.serial, chunk.buffer, URING_WRITE);
+    conn.writing = true;
+    conn.inflight++;
+    return;
+  }
+  char* buffer = buffers_[chunk.buffer];
+  if (chunk.written == 0) {
+    FrameHeader header;
+    header.type = FRAME_DATA;
+    header.length = chunk.length;
+    header.offset = chunk.offset;
+    encodeFrameHeader(header, reinterpret_cast<unsigned char*>(buffer));
+  }
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = fixed_buffers_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  setFile(sqe, conn, true);
+  sqe->addr = reinterpret_cast<uint64_t>(buffer + chunk.written);
+  sqe->len = FRAME_HEADER_SIZE + chunk.length - chunk.written;
+  sqe->off = (uint64_t)-1;  // Текущая позиция: у сокета её нет
+  if (fixed_buffers_) sqe->buf_index = chunk.buffer;
+  sqe->user_data = packUserData(conn.serial, chunk.buffer, URING_WRITE);
+  conn.writing = true;
+  conn.inflight++;
+}
+
+/**
+ * @brief Резервирует отправку куска в корзинах маркеров.
+ *
+ * @param conn Подключение.
+ * @param chunk Прочитанный кусок, следующий к отправке.
+ * @return true, если отправку нужно отложить: в кольцо поставлено ожидание,
+ * по завершении которого кусок будет отправлен.
+ */
+
+bool UringWorker::throttle(UringConnection& conn, UringChunk& chunk) {
+  if (conn.throttled) return true;
+  if (chunk.shaped) return false;
+  chunk.shaped = true;
+  int64_t wait = conn.shaper.reserve(chunk.frameSize());
+  if (wait <= 0) return false;
+  conn.timeout.tv_sec = wait / 1000000;
+  conn.timeout.tv_nsec = wait % 1000000 * 1000;
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = reinterpret_cast<uint64_t>(&conn.timeout);
+  sqe->len = 1;
+  sqe->user_data = packUserData(conn.serial, 0, URING_TIMEOUT);
+  conn.throttled = true;
+  conn.inflight++;
+  return true;
+}
+
+/**
+ * @brief Ставит в кольцо отправку управляющих кадров.
+ */
+
+void UringWorker::submitSend(UringConnection& conn) {
+  if (conn.sending.empty()) conn.sending.swap(conn.out);
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = IORING_OP_SEND;
+  setFile(sqe, conn, true);
+  sqe->addr =
+      reinterpret_cast<uint64_t>(conn.sending.data() + conn.sending_pos);
+  sqe->len = conn.sending.size() - conn.sending_pos;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = packUserData(conn.serial, 0, URING_SEND);
+  conn.writing = true;
+  conn.inflight++;
+}
+
+/**
+ * @brief Ставит в кольцо приём кадров клиента.
+ */
+
+void UringWorker::submitRecv(UringConnection& conn) {
+  struct io_uring_sqe* sqe = ring_.sqe();
+  sqe->opcode = IORING_OP_RECV;
+  setFile(sqe, conn, true);
+  sqe->addr = reinterpret_cast<uint64_t>(conn.recv_buffer.data());
+  sqe->len = conn.recv_buffer.size();
+  sqe->user_data = packUserData(conn.serial, 0, URING_RECV);
+  conn.receiving = true;
+  conn.inflight++;
+}
+
+/**
+ * @brief Возвращает буфер данных в пул и будит подключения, ждущие буфер.
+ */
+
+void UringWorker::releaseBuffer(int buffer) {
+  free_buffers_.push_back(buffer);
+  while (!free_buffers_.empty() && !waiting_.empty()) {
+    auto it = connections_.find(waiting_.front());
+    waiting_.pop_front();
+    if (it == connections_.end()) continue;
+    it->second->waiting = false;
+    if (!it->second->closing) pump(*it->second);
+  }
+}
+
+/**
+ * @brief Закрывает подключение.
+ *
+ * Сокет закрывается, когда в кольце не останется операций подключения:
+ * до этого ядро может писать в его буферы.
+ *
+ * @param conn Подключение.
+ */
+
+void UringWorker::closeConnection(UringConnection& conn) {
+  if (conn.closing) return;
+  conn.closing = true;
+  // Передача прервана: сохраняем, сколько успели отправить
+  abortSending(conn);
+  // Прерывает ожидающие приём и отправку
+  shutdown(conn.fd, SHUT_RDWR);
+}
+
+ProtocolConnection* UringWorker::findConnection(int, uint64_t serial) {
+  auto it = connections_.find(serial);
+  if (it == connections_.end() || it->second->closing) return nullptr;
+  return it->second.get();
+}
+
+void UringWorker::resume(ProtocolConnection& conn) {
+  pump(static_cast<UringConnection&>(conn));
+}